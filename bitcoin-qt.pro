@@ -159,6 +159,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/base58.h \
     src/bignum.h \
     src/checkpoints.h \
+    src/blockmap.h \
     src/compat.h \
     src/sync.h \
     src/util.h \
@@ -175,6 +176,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/bloom.h \
     src/mruset.h \
     src/checkqueue.h \
+    src/boundedqueue.h \
+    src/powcheckqueue.h \
+    src/minertemplate.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -225,6 +229,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/limitedmap.h \
     src/qt/splashscreen.h \
     src/prime.h \
+    src/montgomery.h \
     src/checkpointsync.h
 
 SOURCES += src/qt/bitcoin.cpp \
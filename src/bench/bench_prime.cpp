@@ -0,0 +1,299 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under conditional MIT/X11 software license,
+// see the accompanying file COPYING
+//
+// Deterministic prime mining benchmark
+//
+// Mines a fixed set of synthetic block headers for a fixed number of sieve
+// rounds each, so every run does the same work and only the timings differ.
+// The sieve and the chain tests are first measured apart on one thread, then
+// MineProbablePrimeChain is run on each of the given numbers of threads.
+#include "main.h"
+#include "prime.h"
+#include "wallet.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+using namespace boost;
+using namespace json_spirit;
+
+extern std::vector<unsigned int> vPrimes;
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+// Synthetic block header nHeader of thread nThread, with its first probable
+// prime header hash
+static CBlock BenchHeader(unsigned int nThread, unsigned int nHeader, unsigned int nBits)
+{
+    CBlock block;
+    block.nVersion = 2;
+    unsigned int pnSeed[2] = {nThread, nHeader};
+    block.hashPrevBlock = Hash(BEGIN(pnSeed), END(pnSeed));
+    block.hashMerkleRoot = Hash(BEGIN(block.hashPrevBlock), END(block.hashPrevBlock));
+    block.nTime = 1373064429;
+    block.nBits = nBits;
+    block.nNonce = 0;
+    SearchProbablePrimeHeader(block, 0xffff0000);
+    return block;
+}
+
+struct CBenchSettings
+{
+    CPrimeMinerProfile profile;
+    unsigned int nBits; // target of the synthetic headers
+    unsigned int nHeaders; // headers per thread
+    unsigned int nRounds; // sieve rounds per header
+};
+
+struct CBenchThreadResult
+{
+    uint64 nTests;
+    uint64 nPrimesHit;
+    double dChainExpected;
+};
+
+// Sieve and chain tests measured apart
+static Object BenchSieveAndTests(const CBenchSettings& settings)
+{
+    pminer.reset(new CPrimeMiner());
+    pminer->SetProfile(settings.profile);
+    CBigNum bnPrimorial;
+    Primorial(settings.profile.nPrimorialMultiplier, bnPrimorial);
+
+    int64 nSieveTime = 0, nTestTime = 0;
+    uint64 nCandidates = 0, nTests = 0, nPrimesHit = 0;
+    unsigned int nSieveRounds = 0;
+    unsigned int pnMultipliers[nPrimeTestLanes];
+    unsigned int pnCandidateTypes[nPrimeTestLanes];
+    unsigned int pnChainLengths[nPrimeTestLanes];
+    for (unsigned int nHeader = 0; nHeader < settings.nHeaders; nHeader++)
+    {
+        CBlock block = BenchHeader(0, nHeader, settings.nBits);
+        for (unsigned int nRound = 0; nRound < settings.nRounds; nRound++)
+        {
+            int64 nStart = GetTimeMicros();
+            CSieveOfEratosthenes sieve(pminer->nSieveSize, block.nBits, block.GetHeaderHash(), bnPrimorial, pminer->nSieveExtensions);
+            for (unsigned int nWeaved = 0; nWeaved < pminer->nSieveWeaveOptimal; )
+            {
+                unsigned int nWeave = sieve.Weave(std::min(pminer->nSieveWeaveOptimal - nWeaved, nSieveWeaveBatch));
+                if (nWeave == 0)
+                    break;
+                nWeaved += nWeave;
+            }
+            int64 nWeaveEnd = GetTimeMicros();
+            nSieveTime += nWeaveEnd - nStart;
+            nCandidates += sieve.GetCandidateCount();
+            nSieveRounds++;
+
+            loop
+            {
+                unsigned int nBatch = sieve.GetNextCandidates(pnMultipliers, pnCandidateTypes, nPrimeTestLanes);
+                ProbablePrimeChainTestBatch(sieve.GetFixedFactor(), block.nBits, nBatch, pnMultipliers, pnCandidateTypes, pnChainLengths);
+                nTests += nBatch;
+                for (unsigned int i = 0; i < nBatch; i++)
+                    if (TargetGetLength(pnChainLengths[i]) >= 1)
+                        nPrimesHit++;
+                if (nBatch < nPrimeTestLanes)
+                    break;
+            }
+            nTestTime += GetTimeMicros() - nWeaveEnd;
+
+            block.nNonce++;
+            SearchProbablePrimeHeader(block, 0xffff0000);
+        }
+    }
+    pminer.reset();
+
+    Object result;
+    result.push_back(Pair("sieve_rounds", (int) nSieveRounds));
+    result.push_back(Pair("sieve_us_per_round", (double) nSieveTime / max(1u, nSieveRounds)));
+    result.push_back(Pair("candidates_per_sieve", (double) nCandidates / max(1u, nSieveRounds)));
+    result.push_back(Pair("tests", (boost::int64_t) nTests));
+    result.push_back(Pair("tests_per_sec", 1000000.0 * nTests / max((int64) 1, nTestTime)));
+    result.push_back(Pair("primes_per_hour", 3600000000.0 * nPrimesHit / max((int64) 1, nSieveTime + nTestTime)));
+    result.push_back(Pair("test_engine", GetPrimeTestBatchEngine()));
+    result.push_back(Pair("header_engine", GetHeaderSearchEngine()));
+    return result;
+}
+
+// Mine the headers of a thread with MineProbablePrimeChain
+static void BenchMiningThread(const CBenchSettings& settings, unsigned int nThread, CBenchThreadResult* presult)
+{
+    pminer.reset(new CPrimeMiner());
+    pminer->SetProfile(settings.profile);
+    CBigNum bnPrimorial;
+    Primorial(settings.profile.nPrimorialMultiplier, bnPrimorial);
+    presult->nTests = 0;
+    presult->nPrimesHit = 0;
+    presult->dChainExpected = 0;
+    for (unsigned int nHeader = 0; nHeader < settings.nHeaders; nHeader++)
+    {
+        CBlock block = BenchHeader(nThread, nHeader, settings.nBits);
+        bool fNewBlock = true;
+        unsigned int nTriedMultiplier = 0;
+        unsigned int nRoundTests = 0;
+        for (unsigned int nRound = 0; nRound < settings.nRounds; )
+        {
+            unsigned int nProbableChainLength, nTests, nPrimesHit;
+            MineProbablePrimeChain(block, bnPrimorial, fNewBlock, nTriedMultiplier, nProbableChainLength, nTests, nPrimesHit);
+            nRoundTests += nTests;
+            presult->nTests += nTests;
+            presult->nPrimesHit += nPrimesHit;
+            if (fNewBlock)
+            {
+                // Expected chains of the round, as the miner estimates them
+                double dRoundChainExpected = (double) nRoundTests;
+                double dPrimeProbability = EstimateCandidatePrimeProbability();
+                for (unsigned int n = 0; n < TargetGetLength(block.nBits); n++)
+                    dRoundChainExpected *= dPrimeProbability;
+                presult->dChainExpected += dRoundChainExpected;
+                nRoundTests = 0;
+                nRound++;
+                block.nNonce++;
+                SearchProbablePrimeHeader(block, 0xffff0000);
+            }
+        }
+    }
+}
+
+static Object BenchMining(const CBenchSettings& settings, unsigned int nThreads)
+{
+    std::vector<CBenchThreadResult> vResults(nThreads);
+    thread_group threadGroup;
+    int64 nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&BenchMiningThread, boost::cref(settings), i, &vResults[i]));
+    threadGroup.join_all();
+    int64 nTime = max((int64) 1, GetTimeMicros() - nStart);
+
+    uint64 nTests = 0, nPrimesHit = 0;
+    double dChainExpected = 0;
+    BOOST_FOREACH(const CBenchThreadResult& result, vResults)
+    {
+        nTests += result.nTests;
+        nPrimesHit += result.nPrimesHit;
+        dChainExpected += result.dChainExpected;
+    }
+    Object result;
+    result.push_back(Pair("threads", (int) nThreads));
+    result.push_back(Pair("seconds", nTime / 1000000.0));
+    result.push_back(Pair("tests_per_sec", 1000000.0 * nTests / nTime));
+    result.push_back(Pair("primes_per_hour", 3600000000.0 * nPrimesHit / nTime));
+    result.push_back(Pair("chains_per_day", 86400000000.0 * dChainExpected / nTime));
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        fprintf(stdout, "Usage: bench_prime [options]\n"
+            "  -benchheaders=<n>     Synthetic block headers per thread (default: 4)\n"
+            "  -benchrounds=<n>      Sieve rounds per header (default: 4)\n"
+            "  -benchtarget=<n>      Prime chain length target (default: 10)\n"
+            "  -benchthreads=<list>  Comma separated thread counts (default: 1 and all cores)\n"
+            "  -json                 Print the results as JSON\n"
+            "  -sievesize=<n>, -sieveprimes=<n>, -gensieveextensions=<n>\n"
+            "                        Mining profile, as for mining\n"
+            "  -primorial=<n>        Primorial multiplier (default: 47)\n");
+        return 0;
+    }
+    fPrintToDebugger = true; // no debug.log
+    // The sieve weaves its full depth however long it takes
+    SoftSetArg("-gensieveroundlimitms", "3600000");
+    GeneratePrimeTable();
+
+    CBenchSettings settings;
+    settings.profile.nSieveSize = (unsigned int) std::max((int64) nMinSieveSize, std::min(GetArg("-sievesize", nDefaultSieveSize), (int64) nMaxSieveSize));
+    settings.profile.nSieveWeave = (unsigned int) std::max((int64) nSieveWeaveMin, std::min(GetArg("-sieveprimes", nSieveWeaveInitial), (int64) vPrimes.size()));
+    // The tuner starts from the smallest primorial, which leaves too few
+    // candidates per sieve for a representative measurement
+    settings.profile.nPrimorialMultiplier = (unsigned int) std::max((int64) nPrimorialMultiplierMin, std::min(GetArg("-primorial", 47), (int64) vPrimes.back())) + 1;
+    PrimeTableGetPreviousPrime(settings.profile.nPrimorialMultiplier);
+    settings.nBits = TargetFromInt((unsigned int) std::max((int64) nTargetMinLength, std::min(GetArg("-benchtarget", 10), (int64) 99)));
+    settings.nHeaders = (unsigned int) std::max((int64) 1, GetArg("-benchheaders", 4));
+    settings.nRounds = (unsigned int) std::max((int64) 1, GetArg("-benchrounds", 4));
+
+    std::vector<unsigned int> vThreads;
+    if (mapArgs.count("-benchthreads"))
+    {
+        std::vector<std::string> vstrThreads;
+        boost::split(vstrThreads, mapArgs["-benchthreads"], boost::is_any_of(","));
+        BOOST_FOREACH(const std::string& strThreads, vstrThreads)
+            if (atoi(strThreads) > 0)
+                vThreads.push_back(atoi(strThreads));
+    }
+    if (vThreads.empty())
+    {
+        vThreads.push_back(1);
+        if (boost::thread::hardware_concurrency() > 1)
+            vThreads.push_back(boost::thread::hardware_concurrency());
+    }
+
+    bool fJSON = GetBoolArg("-json");
+    if (!fJSON)
+        fprintf(stdout, "bench_prime: %s extensions=%u target=%s headers=%u rounds=%u\n",
+            settings.profile.ToString().c_str(), (unsigned int) GetArg("-gensieveextensions", 0),
+            TargetToString(settings.nBits).c_str(), settings.nHeaders, settings.nRounds);
+
+    Object sieve = BenchSieveAndTests(settings);
+    if (!fJSON)
+    {
+        fprintf(stdout, "sieve:  %.0f us/round, %.0f candidates/sieve over %d rounds\n",
+            find_value(sieve, "sieve_us_per_round").get_real(), find_value(sieve, "candidates_per_sieve").get_real(),
+            find_value(sieve, "sieve_rounds").get_int());
+        fprintf(stdout, "tests:  %.0f tests/s (%s), %.0f primes/h (header search %s)\n",
+            find_value(sieve, "tests_per_sec").get_real(), find_value(sieve, "test_engine").get_str().c_str(),
+            find_value(sieve, "primes_per_hour").get_real(), find_value(sieve, "header_engine").get_str().c_str());
+        fprintf(stdout, "%8s %12s %14s %12s\n", "threads", "tests/s", "primes/h", "chains/day");
+    }
+
+    Array mining;
+    BOOST_FOREACH(unsigned int nThreads, vThreads)
+    {
+        Object result = BenchMining(settings, nThreads);
+        if (!fJSON)
+            fprintf(stdout, "%8d %12.0f %14.0f %12.6f\n", find_value(result, "threads").get_int(),
+                find_value(result, "tests_per_sec").get_real(), find_value(result, "primes_per_hour").get_real(),
+                find_value(result, "chains_per_day").get_real());
+        mining.push_back(result);
+    }
+
+    if (fJSON)
+    {
+        Object profile;
+        profile.push_back(Pair("sievesize", (int) settings.profile.nSieveSize));
+        profile.push_back(Pair("sieveprimes", (int) settings.profile.nSieveWeave));
+        profile.push_back(Pair("primorial", (int) settings.profile.nPrimorialMultiplier));
+        profile.push_back(Pair("extensions", (int) GetArg("-gensieveextensions", 0)));
+        Object report;
+        report.push_back(Pair("profile", profile));
+        report.push_back(Pair("target", TargetToString(settings.nBits)));
+        report.push_back(Pair("headers", (int) settings.nHeaders));
+        report.push_back(Pair("rounds", (int) settings.nRounds));
+        report.push_back(Pair("sieve", sieve));
+        report.push_back(Pair("mining", mining));
+        fprintf(stdout, "%s\n", write_string(Value(report), true).c_str());
+    }
+    return 0;
+}
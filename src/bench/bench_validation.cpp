@@ -0,0 +1,581 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under conditional MIT/X11 software license,
+// see the accompanying file COPYING
+//
+// Block validation benchmark
+//
+// Replays a fixture of recorded blocks through the stages of block
+// validation, timing each stage apart: deserialization, block and merkle
+// hashing, the prime proof-of-work check, the input and script checks, the
+// coins cache updates and the undo write. Every fixture block comes with the
+// outputs spent by its inputs, so the replay needs neither a chain state nor
+// the network. -benchrecord cuts a fixture from the block files of a node,
+// -benchgenerate makes a synthetic one.
+#include "main.h"
+#include "prime.h"
+#include "txdb.h"
+#include "wallet.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+#include "json/json_spirit_utils.h"
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace boost;
+using namespace json_spirit;
+
+extern std::vector<unsigned int> vPrimes;
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static const std::string strFixtureMagic = "primecoin validation fixture";
+static const int nFixtureFormat = 1;
+
+// A fixture block: the block as received from the network, and the outputs
+// spent by its inputs in order, as the undo data of the block records them
+class CBenchBlock
+{
+public:
+    int nHeight;
+    std::vector<unsigned char> vchBlock;
+    std::vector<CTxInUndo> vSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nHeight);
+        READWRITE(vchBlock);
+        READWRITE(vSpent);
+    )
+};
+
+enum
+{
+    STAGE_DESERIALIZE,
+    STAGE_HASH,
+    STAGE_POW,
+    STAGE_INPUTS,
+    STAGE_COINS,
+    STAGE_UNDO,
+    STAGE_COUNT
+};
+
+static const char* pszStageNames[STAGE_COUNT] = { "deserialize", "hash", "pow", "inputs", "coins", "undo" };
+
+struct CBenchTimes
+{
+    int64 pnTime[STAGE_COUNT]; // microseconds
+
+    CBenchTimes()
+    {
+        for (int i = 0; i < STAGE_COUNT; i++)
+            pnTime[i] = 0;
+    }
+};
+
+static bool ReadFixture(const std::string& strPath, std::vector<CBenchBlock>& vBlocks)
+{
+    CAutoFile filein = CAutoFile(fopen(strPath.c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadFixture() : cannot open %s", strPath.c_str());
+    try {
+        std::string strMagic;
+        int nFormat = 0;
+        filein >> strMagic >> nFormat;
+        if (strMagic != strFixtureMagic || nFormat != nFixtureFormat)
+            return error("ReadFixture() : %s is not a fixture of format %d", strPath.c_str(), nFixtureFormat);
+        filein >> vBlocks;
+    }
+    catch (std::exception &e) {
+        return error("ReadFixture() : %s", e.what());
+    }
+    return true;
+}
+
+// Record the main chain blocks from nStart on of the node in -datadir
+static bool RecordFixture(const std::string& strPath, int nStart, int nBlocks)
+{
+    pblocktree = new CBlockTreeDB(1 << 21);
+    CCoinsViewDB* pcoinsdbview = new CCoinsViewDB(1 << 23);
+    pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+    if (!LoadBlockIndex())
+        return error("RecordFixture() : cannot load the block index");
+    if (nStart < 1 || nStart > nBestHeight)
+        return error("RecordFixture() : no block at height %d", nStart);
+
+    std::vector<CBenchBlock> vBlocks;
+    for (CBlockIndex* pindex = FindBlockByHeight(nStart); pindex && (int)vBlocks.size() < nBlocks; pindex = pindex->pnext)
+    {
+        CBlock block;
+        CBlockUndo blockundo;
+        if (!block.ReadFromDisk(pindex))
+            return error("RecordFixture() : cannot read block %d", pindex->nHeight);
+        if (!(pindex->nStatus & BLOCK_HAVE_UNDO) || !blockundo.ReadFromDisk(pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+            return error("RecordFixture() : cannot read the undo data of block %d", pindex->nHeight);
+
+        CBenchBlock bench;
+        bench.nHeight = pindex->nHeight;
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+        bench.vchBlock.assign(ss.begin(), ss.end());
+        for (unsigned int i = 0; i < blockundo.vtxundo.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i + 1];
+            for (unsigned int j = 0; j < tx.vin.size(); j++)
+            {
+                CTxInUndo undo = blockundo.vtxundo[i].vprevout[j];
+                // The undo data only carries the height of the last output
+                // spent of a transaction; the others come from the coins
+                // still unspent, or are taken as recent non-coinbase ones,
+                // which only the coinbase maturity check could tell
+                if (undo.nHeight == 0)
+                {
+                    CCoins coins;
+                    if (pcoinsTip->GetCoins(tx.vin[j].prevout.hash, coins))
+                    {
+                        undo.fCoinBase = coins.fCoinBase;
+                        undo.nHeight = coins.nHeight;
+                        undo.nVersion = coins.nVersion;
+                    }
+                    else
+                    {
+                        undo.nHeight = pindex->nHeight - 1;
+                        undo.nVersion = 1;
+                    }
+                }
+                bench.vSpent.push_back(undo);
+            }
+        }
+        vBlocks.push_back(bench);
+    }
+
+    CAutoFile fileout = CAutoFile(fopen(strPath.c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("RecordFixture() : cannot create %s", strPath.c_str());
+    fileout << strFixtureMagic << nFixtureFormat << vBlocks;
+    fprintf(stdout, "recorded %"PRIszu" blocks from height %d to %s\n", vBlocks.size(), nStart, strPath.c_str());
+
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    return true;
+}
+
+// An output of a generated fixture block, spendable by the later blocks
+struct CFixtureOutput
+{
+    COutPoint prevout;
+    CTxOut txout;
+    int nHeight;
+};
+
+// Add an input to a generated transaction, spending an output of an
+// earlier fixture block or one made up with it, recorded as spent by the
+// fixture block; its value is added to nValueIn
+static void AddFixtureInput(CTransaction& tx, std::vector<CScript>& vFrom, int64& nValueIn, std::vector<CFixtureOutput>& vUnspent, const std::vector<CScript>& vScripts, CBenchBlock& bench)
+{
+    CTxIn txin;
+    CTxInUndo undo;
+    if (!vUnspent.empty() && GetRand(2) == 0)
+    {
+        unsigned int i = GetRand(vUnspent.size());
+        txin.prevout = vUnspent[i].prevout;
+        undo = CTxInUndo(vUnspent[i].txout, false, vUnspent[i].nHeight, 1);
+        vUnspent.erase(vUnspent.begin() + i);
+    }
+    else
+    {
+        txin.prevout = COutPoint(GetRandHash(), GetRand(4));
+        bool fCoinBase = GetRand(100) < 15;
+        CTxOut txout((1 + GetRand(2000)) * CENT * (fCoinBase ? 10 : 1), vScripts[GetRand(vScripts.size())]);
+        int nHeight = fCoinBase ? bench.nHeight - COINBASE_MATURITY - GetRand(197000) : bench.nHeight - 1 - GetRand(100000);
+        undo = CTxInUndo(txout, fCoinBase, std::max(nHeight, 1), 1);
+    }
+    tx.vin.push_back(txin);
+    vFrom.push_back(undo.txout.scriptPubKey);
+    nValueIn += undo.txout.nValue;
+    bench.vSpent.push_back(undo);
+}
+
+// Generate a synthetic fixture of blocks from height nStart on. Their
+// number of transactions, inputs and outputs follows the mix of mainnet
+// blocks; the transactions are signed and the blocks carry prime chains of
+// length nTargetLength, mined here. Mainnet targets take a single core far
+// too long, a fixture of mainnet blocks is recorded with -benchrecord.
+static bool GenerateFixture(const std::string& strPath, int nStart, int nBlocks, unsigned int nTargetLength)
+{
+    CBasicKeyStore keystore;
+    std::vector<CScript> vScripts;
+    for (int i = 0; i < 48; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        CScript script;
+        script.SetDestination(key.GetPubKey().GetID());
+        vScripts.push_back(script);
+    }
+
+    // The sieve weaves its full depth however long it takes
+    SoftSetArg("-gensieveroundlimitms", "3600000");
+    CPrimeMinerProfile profile;
+    profile.nSieveWeave = (unsigned int) std::max((int64) nSieveWeaveMin, std::min(GetArg("-sieveprimes", 100000), (int64) vPrimes.size()));
+    profile.nPrimorialMultiplier = 47;
+    pminer.reset(new CPrimeMiner());
+    pminer->SetProfile(profile);
+    CBigNum bnPrimorial;
+    Primorial(profile.nPrimorialMultiplier, bnPrimorial);
+
+    std::vector<CBenchBlock> vBlocks;
+    std::vector<CFixtureOutput> vUnspent;
+    uint256 hashPrev = GetRandHash();
+    unsigned int nTime = GetAdjustedTime() - 60 * nBlocks;
+    for (int nHeight = nStart; nHeight < nStart + nBlocks; nHeight++)
+    {
+        int64 nGenerateStart = GetTimeMillis();
+        CBenchBlock bench;
+        bench.nHeight = nHeight;
+        CBlock block;
+        block.vtx.resize(1);
+
+        // Mostly blocks of a few transactions, some larger ones
+        unsigned int nDice = GetRand(100);
+        int nTx = nDice < 65 ? GetRand(4) : nDice < 90 ? 4 + GetRand(17) : 30 + GetRand(41);
+        int64 nFees = 0;
+        for (int n = 0; n < nTx; n++)
+        {
+            static const unsigned int pnInputs[6] = { 1, 1, 1, 2, 2, 3 };
+            static const unsigned int pnOutputs[5] = { 1, 2, 2, 2, 2 };
+            unsigned int nIn = GetRand(100) < 93 ? pnInputs[GetRand(6)] : 6 + GetRand(9);
+            unsigned int nOut = GetRand(10) < 9 ? pnOutputs[GetRand(5)] : 8 + GetRand(17);
+            CTransaction tx;
+            std::vector<CScript> vFrom;
+            int64 nValueIn = 0;
+            int64 nFee = 0;
+            while (tx.vin.size() < nIn || nValueIn - nFee < CENT)
+            {
+                AddFixtureInput(tx, vFrom, nValueIn, vUnspent, vScripts, bench);
+                nFee = (1 + (10 + 150 * tx.vin.size() + 34 * nOut) / 1000) * CENT + GetRand(6) * 100000;
+            }
+            int64 nValueOut = nValueIn - nFee;
+            if (nValueOut < (int64) nOut * CENT)
+                nOut = 1;
+            for (unsigned int i = 0; i < nOut; i++)
+            {
+                int64 nValue = nValueOut;
+                if (i + 1 < nOut)
+                {
+                    nValue = std::min(CENT + (int64) GetRand(2 * nValueOut / nOut), nValueOut - (nOut - 1 - i) * CENT);
+                    nValue = std::max(CENT, nValue - nValue % 10000);
+                }
+                tx.vout.push_back(CTxOut(nValue, vScripts[GetRand(vScripts.size())]));
+                nValueOut -= nValue;
+            }
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+                if (!SignSignature(keystore, vFrom[i], tx, i))
+                    return error("GenerateFixture() : signing failed");
+            nFees += nFee;
+            for (unsigned int i = 0; i < tx.vout.size(); i++)
+            {
+                CFixtureOutput output;
+                output.prevout = COutPoint(tx.GetHash(), i);
+                output.txout = tx.vout[i];
+                output.nHeight = nHeight;
+                vUnspent.push_back(output);
+            }
+            block.vtx.push_back(tx);
+        }
+
+        CTransaction& txCoinbase = block.vtx[0];
+        txCoinbase.vin.resize(1);
+        txCoinbase.vin[0].prevout.SetNull();
+        txCoinbase.vin[0].scriptSig = CScript() << nHeight << CBigNum(GetRand(std::numeric_limits<uint64>::max()));
+        txCoinbase.vout.push_back(CTxOut((900 + GetRand(401)) * CENT + nFees, vScripts[GetRand(vScripts.size())]));
+
+        nTime += 40 + GetRand(41);
+        block.nVersion = 2;
+        block.hashPrevBlock = hashPrev;
+        block.hashMerkleRoot = block.BuildMerkleTree();
+        block.nTime = nTime;
+        block.nBits = TargetFromInt(nTargetLength);
+        block.nNonce = 0;
+        SearchProbablePrimeHeader(block, 0xffff0000);
+        bool fNewBlock = true;
+        unsigned int nTriedMultiplier = 0;
+        loop
+        {
+            unsigned int nProbableChainLength, nTests, nPrimesHit;
+            if (MineProbablePrimeChain(block, bnPrimorial, fNewBlock, nTriedMultiplier, nProbableChainLength, nTests, nPrimesHit))
+                break;
+            if (fNewBlock)
+            {
+                block.nNonce++;
+                SearchProbablePrimeHeader(block, 0xffff0000);
+            }
+        }
+        unsigned int nChainType = 0, nChainLength = 0;
+        if (!CheckPrimeProofOfWork(block.GetHeaderHash(), block.nBits, block.bnPrimeChainMultiplier, nChainType, nChainLength))
+            return error("GenerateFixture() : mined block %d fails the proof-of-work check", nHeight);
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+        bench.vchBlock.assign(ss.begin(), ss.end());
+        vBlocks.push_back(bench);
+        hashPrev = block.GetHash();
+        fprintf(stdout, "generated block %d txs=%"PRIszu" size=%"PRIszu" chain=%s (%"PRI64d"s)\n", nHeight, block.vtx.size(), bench.vchBlock.size(),
+            GetPrimeChainName(nChainType, nChainLength).c_str(), (GetTimeMillis() - nGenerateStart) / 1000);
+    }
+    pminer.reset();
+
+    CAutoFile fileout = CAutoFile(fopen(strPath.c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("GenerateFixture() : cannot create %s", strPath.c_str());
+    fileout << strFixtureMagic << nFixtureFormat << vBlocks;
+    fprintf(stdout, "generated %"PRIszu" blocks from height %d to %s\n", vBlocks.size(), nStart, strPath.c_str());
+    return true;
+}
+
+// Replay the fixture once on an empty coins view, adding the stage times of
+// each block to vTimes
+static bool ReplayFixture(const std::vector<CBenchBlock>& vBlocks, std::vector<CBenchTimes>& vTimes, unsigned int& nTx)
+{
+    CCoinsView viewDummy;
+    CCoinsViewCache view(viewDummy);
+    // Parents of the blocks, for the coinbase maturity checks
+    std::vector<CBlockIndex> vIndexPrev(vBlocks.size());
+    unsigned int nUndoPos = 0;
+    unsigned int flags = SCRIPT_VERIFY_NOCACHE | SCRIPT_VERIFY_P2SH;
+    nTx = 0;
+
+    for (unsigned int n = 0; n < vBlocks.size(); n++)
+    {
+        const CBenchBlock& bench = vBlocks[n];
+        CBenchTimes& times = vTimes[n];
+        CValidationState state;
+
+        int64 nStart = GetTimeMicros();
+        CBlock block;
+        CDataStream ss(bench.vchBlock, SER_NETWORK, PROTOCOL_VERSION);
+        ss >> block;
+        int64 nHashStart = GetTimeMicros();
+        times.pnTime[STAGE_DESERIALIZE] += nHashStart - nStart;
+
+        uint256 hash = block.GetHash();
+        if (block.BuildMerkleTree() != block.hashMerkleRoot)
+            return error("ReplayFixture() : merkle root mismatch in block %s", hash.ToString().c_str());
+        int64 nPowStart = GetTimeMicros();
+        times.pnTime[STAGE_HASH] += nPowStart - nHashStart;
+
+        unsigned int nChainType = 0, nChainLength = 0;
+        if (!CheckPrimeProofOfWork(block.GetHeaderHash(), block.nBits, block.bnPrimeChainMultiplier, nChainType, nChainLength))
+            return error("ReplayFixture() : proof of work failed in block %s", hash.ToString().c_str());
+        times.pnTime[STAGE_POW] += GetTimeMicros() - nPowStart;
+
+        // Add the spent outputs the fixture does not create itself
+        unsigned int nSpent = 0;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                if (nSpent >= bench.vSpent.size())
+                    return error("ReplayFixture() : spent outputs missing for block %s", hash.ToString().c_str());
+                const CTxInUndo& undo = bench.vSpent[nSpent++];
+                CCoins coins;
+                if (view.GetCoins(txin.prevout.hash, coins) && coins.IsAvailable(txin.prevout.n))
+                    continue;
+                if (coins.vout.size() <= txin.prevout.n)
+                    coins.vout.resize(txin.prevout.n + 1);
+                coins.vout[txin.prevout.n] = undo.txout;
+                coins.fCoinBase = undo.fCoinBase;
+                coins.nHeight = undo.nHeight;
+                coins.nVersion = undo.nVersion;
+                view.SetCoins(txin.prevout.hash, coins);
+            }
+        }
+        vIndexPrev[n].nHeight = bench.nHeight - 1;
+        view.SetBestBlock(&vIndexPrev[n]);
+
+        CBlockUndo blockundo;
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            int64 nInputsStart = GetTimeMicros();
+            if (!tx.IsCoinBase() && !tx.CheckInputs(state, view, true, flags))
+                return error("ReplayFixture() : input checks failed in block %s", hash.ToString().c_str());
+            int64 nCoinsStart = GetTimeMicros();
+            times.pnTime[STAGE_INPUTS] += nCoinsStart - nInputsStart;
+
+            CTxUndo txundo;
+            tx.UpdateCoins(state, view, txundo, bench.nHeight, block.GetTxHash(i));
+            if (!tx.IsCoinBase())
+                blockundo.vtxundo.push_back(txundo);
+            times.pnTime[STAGE_COINS] += GetTimeMicros() - nCoinsStart;
+        }
+        nTx += block.vtx.size();
+
+        int64 nUndoStart = GetTimeMicros();
+        CDiskBlockPos pos(0, nUndoPos);
+        if (!blockundo.WriteToDisk(pos, block.hashPrevBlock))
+            return error("ReplayFixture() : undo write failed");
+        times.pnTime[STAGE_UNDO] += GetTimeMicros() - nUndoStart;
+        nUndoPos = pos.nPos + ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + sizeof(uint256);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    if (mapArgs.count("-?") || mapArgs.count("--help"))
+    {
+        fprintf(stdout, "Usage: bench_validation [options]\n"
+            "  -benchfixture=<file>  Fixture of recorded blocks (default: test/data/bench_validation.dat)\n"
+            "  -benchpasses=<n>      Replays of the fixture (default: 3)\n"
+            "  -benchperblock        Print the stage times of every block\n"
+            "  -json                 Print the results as JSON\n"
+            "  -benchrecord=<file>   Record a fixture from the blocks of the node in -datadir\n"
+            "  -benchgenerate=<file> Generate a synthetic fixture, mining its blocks\n"
+            "  -benchtarget=<n>      Prime chain length target of the blocks generated (default: 6)\n"
+            "  -benchstart=<n>       Height of the first block to record or generate (default: 1)\n"
+            "  -benchblocks=<n>      Number of blocks to record or generate (default: 100)\n");
+        return 0;
+    }
+    fPrintToDebugger = true; // no debug.log
+    GeneratePrimeTable();
+
+    if (mapArgs.count("-benchrecord"))
+    {
+        fTestNet = GetBoolArg("-testnet");
+        if (!RecordFixture(mapArgs["-benchrecord"], GetArg("-benchstart", 1), GetArg("-benchblocks", 100)))
+        {
+            fprintf(stderr, "bench_validation: recording the fixture failed\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (mapArgs.count("-benchgenerate"))
+    {
+        unsigned int nTargetLength = (unsigned int) std::max((int64) nTargetMinLength, std::min(GetArg("-benchtarget", 6), (int64) 99));
+        if (!GenerateFixture(mapArgs["-benchgenerate"], GetArg("-benchstart", 1), GetArg("-benchblocks", 100), nTargetLength))
+        {
+            fprintf(stderr, "bench_validation: generating the fixture failed\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    std::string strFixture = GetArg("-benchfixture", "test/data/bench_validation.dat");
+    std::vector<CBenchBlock> vBlocks;
+    if (!ReadFixture(strFixture, vBlocks) || vBlocks.empty())
+    {
+        fprintf(stderr, "bench_validation: cannot read the fixture %s\n", strFixture.c_str());
+        return 1;
+    }
+
+    // The undo data goes to a scratch data directory
+    boost::filesystem::path pathTemp = GetTempPath() / strprintf("bench_validation_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+
+    int nPasses = std::max((int64) 1, GetArg("-benchpasses", 3));
+    std::vector<CBenchTimes> vTimes(vBlocks.size());
+    unsigned int nTx = 0;
+    bool fReplayed = true;
+    for (int nPass = 0; nPass < nPasses && fReplayed; nPass++)
+        fReplayed = ReplayFixture(vBlocks, vTimes, nTx);
+    boost::filesystem::remove_all(pathTemp);
+    if (!fReplayed)
+    {
+        fprintf(stderr, "bench_validation: replaying the fixture failed\n");
+        return 1;
+    }
+
+    CBenchTimes total;
+    BOOST_FOREACH(const CBenchTimes& times, vTimes)
+        for (int i = 0; i < STAGE_COUNT; i++)
+            total.pnTime[i] += times.pnTime[i];
+    int64 nTotalTime = 0;
+    for (int i = 0; i < STAGE_COUNT; i++)
+        nTotalTime += total.pnTime[i];
+
+    bool fJSON = GetBoolArg("-json");
+    if (!fJSON)
+    {
+        fprintf(stdout, "bench_validation: %s blocks=%"PRIszu" txs=%u passes=%d\n", strFixture.c_str(), vBlocks.size(), nTx, nPasses);
+        fprintf(stdout, "%12s %12s %12s %8s\n", "stage", "us/block", "us/tx", "share");
+    }
+    Array stages;
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        double dPerBlock = (double) total.pnTime[i] / nPasses / vBlocks.size();
+        double dPerTx = (double) total.pnTime[i] / nPasses / std::max(1u, nTx);
+        double dShare = 100.0 * total.pnTime[i] / std::max((int64) 1, nTotalTime);
+        if (!fJSON)
+            fprintf(stdout, "%12s %12.1f %12.1f %7.1f%%\n", pszStageNames[i], dPerBlock, dPerTx, dShare);
+        Object stage;
+        stage.push_back(Pair("stage", pszStageNames[i]));
+        stage.push_back(Pair("us_per_block", dPerBlock));
+        stage.push_back(Pair("us_per_tx", dPerTx));
+        stage.push_back(Pair("share", dShare));
+        stages.push_back(stage);
+    }
+    if (!fJSON)
+        fprintf(stdout, "%12s %12.1f %12.1f\n", "total", (double) nTotalTime / nPasses / vBlocks.size(), (double) nTotalTime / nPasses / std::max(1u, nTx));
+
+    bool fPerBlock = GetBoolArg("-benchperblock");
+    Array blocks;
+    if (fPerBlock && !fJSON)
+    {
+        fprintf(stdout, "%8s", "height");
+        for (int i = 0; i < STAGE_COUNT; i++)
+            fprintf(stdout, " %11s", pszStageNames[i]);
+        fprintf(stdout, "\n");
+    }
+    for (unsigned int n = 0; fPerBlock && n < vBlocks.size(); n++)
+    {
+        Object block;
+        block.push_back(Pair("height", vBlocks[n].nHeight));
+        if (!fJSON)
+            fprintf(stdout, "%8d", vBlocks[n].nHeight);
+        for (int i = 0; i < STAGE_COUNT; i++)
+        {
+            double dTime = (double) vTimes[n].pnTime[i] / nPasses;
+            if (!fJSON)
+                fprintf(stdout, " %11.1f", dTime);
+            block.push_back(Pair(pszStageNames[i], dTime));
+        }
+        if (!fJSON)
+            fprintf(stdout, "\n");
+        blocks.push_back(block);
+    }
+
+    if (fJSON)
+    {
+        Object report;
+        report.push_back(Pair("fixture", strFixture));
+        report.push_back(Pair("blocks", (int) vBlocks.size()));
+        report.push_back(Pair("txs", (int) nTx));
+        report.push_back(Pair("passes", nPasses));
+        report.push_back(Pair("stages", stages));
+        if (fPerBlock)
+            report.push_back(Pair("per_block", blocks));
+        fprintf(stdout, "%s\n", write_string(Value(report), true).c_str());
+    }
+    return 0;
+}
@@ -213,6 +213,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getprimespersec",        &getprimespersec,        true,      false },
     { "getinfo",                &getinfo,                true,      false },
     { "getmininginfo",          &getmininginfo,          true,      false },
+    { "getminingstats",         &getminingstats,         true,      false },
     { "getnewaddress",          &getnewaddress,          true,      false },
     { "getaccountaddress",      &getaccountaddress,      true,      false },
     { "setaccount",             &setaccount,             true,      false },
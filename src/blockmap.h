@@ -0,0 +1,32 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef PRIMECOIN_BLOCKMAP_H
+#define PRIMECOIN_BLOCKMAP_H
+
+#include "uint256.h"
+
+#include <boost/unordered_map.hpp>
+
+class CBlockIndex;
+
+/** Hasher of the block index maps. Block hashes are cheap to grind, so the
+ * bucket of a hash is keyed with a random salt. */
+struct CBlockHasher
+{
+    static const uint64 nSalt;
+
+    size_t operator()(const uint256& hash) const
+    {
+        uint64 n = hash.Get64() ^ nSalt;
+        n ^= n >> 33;
+        n *= 0xff51afd7ed558ccdULL;
+        n ^= n >> 33;
+        n *= 0xc4ceb9fe1a85ec53ULL;
+        n ^= n >> 33;
+        return n;
+    }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, CBlockHasher> BlockMap;
+
+#endif
@@ -0,0 +1,69 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <deque>
+
+/** Bounded FIFO queue handing work from producer threads to consumer
+  * threads.
+  *
+  * Producers block while the queue is full, which holds them to the pace of
+  * the consumers; consumers block while it is empty. Both waits are boost
+  * thread interruption points. Items are exchanged with their swap() member,
+  * so their contents are never copied. The mutex is taken once per item,
+  * so items should carry enough work to make that negligible.
+  */
+template<typename T> class CBoundedQueue {
+private:
+    // Mutex to protect the inner state
+    boost::mutex mutex;
+
+    // Producers block on this while the queue is full
+    boost::condition_variable condProducer;
+
+    // Consumers block on this while the queue is empty
+    boost::condition_variable condConsumer;
+
+    // The items, oldest first
+    std::deque<T> queue;
+
+    // The maximum number of items held
+    unsigned int nCapacity;
+
+public:
+    CBoundedQueue(unsigned int nCapacityIn) : nCapacity(nCapacityIn) {}
+
+    // Append an item, waiting for room; item is left empty
+    void Push(T& item) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= nCapacity)
+            condProducer.wait(lock);
+        queue.push_back(T());
+        queue.back().swap(item);
+        condConsumer.notify_one();
+    }
+
+    // Remove the oldest item into item, waiting for one to arrive
+    void Pop(T& item) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty())
+            condConsumer.wait(lock);
+        item.swap(queue.front());
+        queue.pop_front();
+        condProducer.notify_one();
+    }
+
+    // Number of items currently queued
+    unsigned int Size() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size();
+    }
+};
+
+#endif
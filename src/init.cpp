@@ -110,6 +110,9 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        if (pcoinsdbview && !pcoinsdbview->WaitForWrite())
+            printf("Shutdown : failed to write to coin database\n");
+        WriteBlockIndexSnapshot();
         delete pcoinsTip; pcoinsTip = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
@@ -301,8 +304,15 @@ std::string HelpMessage()
         "  -conf=<file>           " + _("Specify configuration file (default: primecoin.conf)") + "\n" +
         "  -pid=<file>            " + _("Specify pid file (default: primecoind.pid)") + "\n" +
         "  -gen                   " + _("Generate coins (default: 0)") + "\n" +
+        "  -sievesize=<n>         " + _("Sieve size for mining, tuned if not set (100000-4000000, default: 1000000)") + "\n" +
+        "  -sieveprimes=<n>       " + _("Number of primes woven into the mining sieve, tuned from 1000 if not set (200-283146)") + "\n" +
+        "  -primorial=<n>         " + _("Primorial multiplier for mining, tuned if not set (default: 7)") + "\n" +
+        "  -gensieveextensions=<n> " + _("Also mine chains of origin doubled up to <n> times from each sieve (0-10, default: 0)") + "\n" +
+        "  -genpipeline=<n>       " + _("Split mining threads into sieve threads feeding <n> primality test threads each (default: 0 = off, 3 when given without a value)") + "\n" +
+        "  -genaffinity=<cpus>    " + _("Pin mining threads to these CPUs in turn, e.g. 0-7,16-23 (default: spread over the cores of all NUMA nodes, 0 = off)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -indexsnapshot         " + _("Keep a snapshot of the block index across clean restarts to start faster (default: 1)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -367,7 +377,9 @@ std::string HelpMessage()
         "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n" +
         "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n" +
-        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script and proof-of-work verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -assumevalid=<hash>    " + _("Skip proof-of-work and script checks of that block and its ancestors (default: 0 = none)") + "\n" +
+        "  -headersfirst          " + _("Download block headers first, then the blocks from several peers in parallel (default: 1)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -560,6 +572,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    if (mapArgs.count("-assumevalid") && mapArgs["-assumevalid"] != "0")
+    {
+        if (!IsHex(mapArgs["-assumevalid"]) || mapArgs["-assumevalid"].size() != 64)
+            return InitError(strprintf(_("Invalid block hash for -assumevalid: '%s'"), mapArgs["-assumevalid"].c_str()));
+        hashAssumeValid.SetHex(mapArgs["-assumevalid"]);
+    }
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -647,6 +666,9 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        printf("Using %u threads for proof-of-work verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPowCheck);
     }
 
     int64 nStart;
@@ -836,7 +858,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest is for the coins cache, whose usage is counted in bytes
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -852,8 +874,21 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pcoinsTip;
                 delete pcoinsdbview;
                 delete pblocktree;
-
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                pblocktree = NULL;
+
+                if (fReindex) {
+                    // primecoin: keep the verified proof-of-work records, unless
+                    // the block database cannot be read at all
+                    try {
+                        pblocktree = new CBlockTreeDB(nBlockTreeDBCache);
+                        if (!pblocktree->EraseBlockIndex())
+                            throw std::runtime_error("EraseBlockIndex() failed");
+                    } catch(std::exception &e) {
+                        delete pblocktree;
+                        pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, true);
+                    }
+                } else
+                    pblocktree = new CBlockTreeDB(nBlockTreeDBCache);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
                 pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
 
@@ -919,7 +954,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
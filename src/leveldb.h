@@ -26,8 +26,19 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t nSizeEstimate;
 
 public:
+    CLevelDBBatch() : nSizeEstimate(0) { }
+
+    // Approximate number of bytes queued
+    size_t SizeEstimate() const { return nSizeEstimate; }
+
+    void Clear() {
+        batch.Clear();
+        nSizeEstimate = 0;
+    }
+
     template<typename K, typename V> void Write(const K& key, const V& value) {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
@@ -40,6 +51,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSizeEstimate += ssKey.size() + ssValue.size();
     }
 
     template<typename K> void Erase(const K& key) {
@@ -49,6 +61,13 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSizeEstimate += ssKey.size();
+    }
+
+    // Erase a key as found by an iterator, already serialized
+    void EraseRaw(const leveldb::Slice& slKey) {
+        batch.Delete(slKey);
+        nSizeEstimate += slKey.size();
     }
 };
 
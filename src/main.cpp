@@ -13,11 +13,15 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "checkqueue.h"
+#include "powcheckqueue.h"
+#include "minertemplate.h"
 #include "prime.h"
 #include "checkpointsync.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 using namespace std;
 using namespace boost;
@@ -34,7 +38,8 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+const uint64 CBlockHasher::nSalt = GetRand(std::numeric_limits<uint64>::max());
+BlockMap mapBlockIndex;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
@@ -49,7 +54,8 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+uint256 hashAssumeValid = 0;
+size_t nCoinCacheUsage = 5000 * 300;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 int64 CTransaction::nMinTxFee = MIN_TX_FEE;  // Override with -mintxfee
@@ -175,8 +181,11 @@ bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
 bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
+bool CCoinsView::GetBestBlockHash(uint256 &hashBlock) { return false; }
+bool CCoinsView::GetInterruptedWrite(uint256 &hashFrom, uint256 &hashTo) { return false; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+size_t CCoinsView::GetWriteUsage() { return 0; }
+bool CCoinsView::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -185,50 +194,203 @@ bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) { return bas
 bool CCoinsViewBacked::SetCoins(const uint256 &txid, const CCoins &coins) { return base->SetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(txid); }
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
+bool CCoinsViewBacked::GetBestBlockHash(uint256 &hashBlock) { return base->GetBestBlockHash(hashBlock); }
+bool CCoinsViewBacked::GetInterruptedWrite(uint256 &hashFrom, uint256 &hashTo) { return base->GetInterruptedWrite(hashFrom, hashTo); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
+size_t CCoinsViewBacked::GetWriteUsage() { return base->GetWriteUsage(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+// Heap memory taken by an allocation of nBytes, including the allocator's
+// bookkeeping and rounding (as done by glibc malloc)
+static inline size_t MallocUsage(size_t nBytes)
+{
+    if (nBytes == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nBytes + 31) >> 4) << 4;
+    return ((nBytes + 15) >> 3) << 3;
+}
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
+size_t GetCoinsMemoryUsage(const CCoins &coins)
+{
+    size_t nUsage = MallocUsage(coins.vout.capacity() * sizeof(CTxOut));
+    BOOST_FOREACH(const CTxOut &out, coins.vout)
+        nUsage += MallocUsage(out.scriptPubKey.capacity());
+    return nUsage;
+}
+
+CCoinsMap::CCoinsMap() : nMask(0), nEntries(0) { }
+
+CCoinsCacheEntry *CCoinsMap::find(const uint256 &txid) {
+    if (vSlots.empty())
+        return NULL;
+    for (size_t i = GetSlot(txid); ; i = (i + 1) & nMask) {
+        CCoinsCacheEntry &entry = vSlots[i];
+        if (!entry.IsUsed())
+            return NULL;
+        if (entry.txid == txid)
+            return &entry;
     }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
+}
+
+const CCoinsCacheEntry *CCoinsMap::find(const uint256 &txid) const {
+    return const_cast<CCoinsMap*>(this)->find(txid);
+}
+
+CCoinsCacheEntry *CCoinsMap::insert(const uint256 &txid, bool &fInserted) {
+    CCoinsCacheEntry *pentry = find(txid);
+    if (pentry) {
+        fInserted = false;
+        return pentry;
+    }
+    // keep the table at most 3/4 full, so probe runs stay short
+    if ((nEntries + 1) * 4 > vSlots.size() * 3)
+        Rehash(vSlots.empty() ? 16 : vSlots.size() * 2);
+    size_t i = GetSlot(txid);
+    while (vSlots[i].IsUsed())
+        i = (i + 1) & nMask;
+    CCoinsCacheEntry &entry = vSlots[i];
+    entry.txid = txid;
+    entry.nFlags = CCoinsCacheEntry::USED;
+    nEntries++;
+    fInserted = true;
+    return &entry;
+}
+
+void CCoinsMap::Rehash(size_t nNewSlots) {
+    std::vector<CCoinsCacheEntry> vOld(nNewSlots);
+    vOld.swap(vSlots);
+    nMask = nNewSlots - 1;
+    BOOST_FOREACH(CCoinsCacheEntry &old, vOld) {
+        if (!old.IsUsed())
+            continue;
+        size_t i = GetSlot(old.txid);
+        while (vSlots[i].IsUsed())
+            i = (i + 1) & nMask;
+        CCoinsCacheEntry &entry = vSlots[i];
+        entry.txid = old.txid;
+        entry.coins.swap(old.coins);
+        entry.nFlags = old.nFlags;
+    }
+}
+
+void CCoinsMap::erase(CCoinsCacheEntry *pentry) {
+    size_t i = pentry - &vSlots[0];
+    CCoins().swap(vSlots[i].coins);
+    vSlots[i].nFlags = 0;
+    nEntries--;
+    // Move back the following entries of the probe run that could no
+    // longer be reached past the freed slot.
+    for (size_t j = (i + 1) & nMask; vSlots[j].IsUsed(); j = (j + 1) & nMask) {
+        size_t k = GetSlot(vSlots[j].txid);
+        bool fReachable = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+        if (fReachable)
+            continue;
+        vSlots[i].txid = vSlots[j].txid;
+        vSlots[i].coins.swap(vSlots[j].coins);
+        vSlots[i].nFlags = vSlots[j].nFlags;
+        vSlots[j].nFlags = 0;
+        i = j;
     }
-    return false;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
-        return it;
+void CCoinsMap::clear() {
+    std::vector<CCoinsCacheEntry>().swap(vSlots);
+    nMask = 0;
+    nEntries = 0;
+    ClearDirtyList();
+}
+
+void CCoinsMap::swap(CCoinsMap &other) {
+    vSlots.swap(other.vSlots);
+    std::swap(nMask, other.nMask);
+    std::swap(nEntries, other.nEntries);
+    vDirty.swap(other.vDirty);
+}
+
+void CCoinsMap::MarkDirty(CCoinsCacheEntry *pentry) {
+    if (pentry->IsDirty())
+        return;
+    pentry->nFlags |= CCoinsCacheEntry::DIRTY;
+    vDirty.push_back(pentry->txid);
+}
+
+size_t CCoinsMap::DynamicMemoryUsage() const {
+    return MallocUsage(vSlots.capacity() * sizeof(CCoinsCacheEntry)) + MallocUsage(vDirty.capacity() * sizeof(uint256));
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0), nClockHand(0) { }
+
+bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
+    const CCoinsCacheEntry *pentry = FetchCoins(txid);
+    if (pentry == NULL)
+        return false;
+    coins = pentry->coins;
+    return true;
+}
+
+CCoinsCacheEntry *CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    CCoinsCacheEntry *pentry = cacheCoins.find(txid);
+    if (pentry) {
+        pentry->nFlags |= CCoinsCacheEntry::RECENT;
+        return pentry;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
-        return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
-    return ret;
+        return NULL;
+    bool fInserted;
+    pentry = cacheCoins.insert(txid, fInserted);
+    tmp.swap(pentry->coins);
+    cachedCoinsUsage += GetCoinsMemoryUsage(pentry->coins);
+    return pentry;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
-    assert(it != cacheCoins.end());
-    return it->second;
+    CCoinsCacheEntry *pentry = FetchCoins(txid);
+    assert(pentry != NULL);
+    cacheCoins.MarkDirty(pentry);
+    // the caller changes the coins after we return; count them again later
+    if (!(pentry->nFlags & CCoinsCacheEntry::PENDING)) {
+        pentry->nFlags |= CCoinsCacheEntry::PENDING;
+        cachedCoinsUsage -= GetCoinsMemoryUsage(pentry->coins);
+        vPending.push_back(txid);
+    }
+    return pentry->coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    const CCoinsCacheEntry *pentry = FetchCoins(txid);
+    assert(pentry != NULL);
+    return pentry->coins;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    bool fInserted;
+    CCoinsCacheEntry *pentry = cacheCoins.insert(txid, fInserted);
+    bool fCounted = !(pentry->nFlags & CCoinsCacheEntry::PENDING);
+    if (fCounted)
+        cachedCoinsUsage -= GetCoinsMemoryUsage(pentry->coins);
+    pentry->coins = coins;
+    if (fCounted)
+        cachedCoinsUsage += GetCoinsMemoryUsage(pentry->coins);
+    cacheCoins.MarkDirty(pentry);
+    return true;
+}
+
+bool CCoinsViewCache::SetNewCoins(const uint256 &txid, const CCoins &coins) {
+    // An entry already cached here holds spent coins (BIP30), which the base
+    // may still have to learn about; leave its flags alone.
+    bool fFresh = (cacheCoins.find(txid) == NULL);
+    SetCoins(txid, coins);
+    if (fFresh)
+        cacheCoins.find(txid)->nFlags |= CCoinsCacheEntry::FRESH;
     return true;
 }
 
 bool CCoinsViewCache::HaveCoins(const uint256 &txid) {
-    return FetchCoins(txid) != cacheCoins.end();
+    return FetchCoins(txid) != NULL;
 }
 
 CBlockIndex *CCoinsViewCache::GetBestBlock() {
@@ -237,29 +399,114 @@ CBlockIndex *CCoinsViewCache::GetBestBlock() {
     return pindexTip;
 }
 
+bool CCoinsViewCache::GetBestBlockHash(uint256 &hashBlock) {
+    if (pindexTip == NULL)
+        return base->GetBestBlockHash(hashBlock);
+    hashBlock = pindexTip->GetBlockHash();
+    return true;
+}
+
 bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     pindexTip = pindex;
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    BOOST_FOREACH(const uint256 &txid, mapCoins.dirty()) {
+        const CCoinsCacheEntry *pchild = mapCoins.find(txid);
+        if (pchild == NULL || !pchild->IsDirty())
+            continue;
+        CCoinsCacheEntry *pentry = cacheCoins.find(txid);
+        if (pentry == NULL) {
+            // created and spent again in the child: nothing for us to forget
+            if (pchild->IsFresh() && pchild->coins.IsPruned())
+                continue;
+            bool fInserted;
+            pentry = cacheCoins.insert(txid, fInserted);
+            pentry->coins = pchild->coins;
+            cachedCoinsUsage += GetCoinsMemoryUsage(pentry->coins);
+            cacheCoins.MarkDirty(pentry);
+            if (pchild->IsFresh())
+                pentry->nFlags |= CCoinsCacheEntry::FRESH;
+        } else {
+            // if ours is fresh it stays so: spent again, our flush skips it
+            bool fCounted = !(pentry->nFlags & CCoinsCacheEntry::PENDING);
+            if (fCounted)
+                cachedCoinsUsage -= GetCoinsMemoryUsage(pentry->coins);
+            pentry->coins = pchild->coins;
+            if (fCounted)
+                cachedCoinsUsage += GetCoinsMemoryUsage(pentry->coins);
+            cacheCoins.MarkDirty(pentry);
+        }
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    CountPending();
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
-        cacheCoins.clear();
+    if (fOk) {
+        BOOST_FOREACH(const uint256 &txid, cacheCoins.dirty()) {
+            CCoinsCacheEntry *pentry = cacheCoins.find(txid);
+            if (pentry == NULL || !pentry->IsDirty())
+                continue;
+            if (pentry->coins.IsPruned()) {
+                cachedCoinsUsage -= GetCoinsMemoryUsage(pentry->coins);
+                cacheCoins.erase(pentry);
+            } else {
+                pentry->nFlags &= ~(CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+            }
+        }
+        cacheCoins.ClearDirtyList();
+    }
     return fOk;
 }
 
+void CCoinsViewCache::Trim(size_t nMaxUsage) {
+    // CLOCK: the hand sweeps the slots, giving recently used entries a
+    // second chance; dirty entries cannot be dropped before a flush.
+    size_t nSlots = cacheCoins.bucket_count();
+    size_t nVisited = 0;
+    while (nVisited < 2 * nSlots && GetCacheUsage() > nMaxUsage) {
+        nClockHand &= nSlots - 1;
+        CCoinsCacheEntry &entry = cacheCoins.slot(nClockHand);
+        if (entry.IsUsed() && !entry.IsDirty() && !(entry.nFlags & CCoinsCacheEntry::RECENT)) {
+            cachedCoinsUsage -= GetCoinsMemoryUsage(entry.coins);
+            // another entry may move into this slot; look at it next
+            cacheCoins.erase(&entry);
+            continue;
+        }
+        entry.nFlags &= ~CCoinsCacheEntry::RECENT;
+        nClockHand++;
+        nVisited++;
+    }
+}
+
+void CCoinsViewCache::CountPending() {
+    BOOST_FOREACH(const uint256 &txid, vPending) {
+        CCoinsCacheEntry *pentry = cacheCoins.find(txid);
+        if (pentry == NULL || !(pentry->nFlags & CCoinsCacheEntry::PENDING))
+            continue;
+        pentry->nFlags &= ~CCoinsCacheEntry::PENDING;
+        cachedCoinsUsage += GetCoinsMemoryUsage(pentry->coins);
+    }
+    vPending.clear();
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+unsigned int CCoinsViewCache::GetDirtyCount() {
+    return cacheCoins.dirty().size();
+}
+
+size_t CCoinsViewCache::GetCacheUsage() {
+    CountPending();
+    return cachedCoinsUsage + cacheCoins.DynamicMemoryUsage() + MallocUsage(vPending.capacity() * sizeof(uint256));
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -536,7 +783,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -911,7 +1158,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1097,7 +1344,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     return nBase;
 }
 
-unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
     unsigned int nBits = TargetGetLimit();
 
@@ -1131,6 +1378,578 @@ bool CheckProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum
     return true;
 }
 
+// Primecoin: verified proof-of-work records
+//
+// The prime proof-of-work of a block depends on its header alone, so once
+// verified on this machine it is recorded by block hash in the block tree
+// database, with the most recent ones kept in memory too. A block seen
+// again, from another peer, a block file being reindexed or VerifyDB,
+// takes the recorded chain type and length instead of the prime tests.
+// Only passed checks are recorded.
+class CPowCheckCache
+{
+private:
+    // Records kept in memory, the oldest dropped beyond this number
+    static const unsigned int nMaxRecords = 4096;
+
+    CCriticalSection cs;
+    std::map<uint256, std::pair<unsigned int, unsigned int> > mapRecords;
+    std::deque<uint256> vRecords; // oldest first
+
+    void Remember(const uint256& hash, unsigned int nChainType, unsigned int nChainLength)
+    {
+        if (mapRecords.count(hash))
+            return;
+        while (vRecords.size() >= nMaxRecords)
+        {
+            mapRecords.erase(vRecords.front());
+            vRecords.pop_front();
+        }
+        mapRecords[hash] = std::make_pair(nChainType, nChainLength);
+        vRecords.push_back(hash);
+    }
+
+public:
+    bool Get(const uint256& hash, unsigned int& nChainType, unsigned int& nChainLength)
+    {
+        LOCK(cs);
+        std::map<uint256, std::pair<unsigned int, unsigned int> >::iterator mi = mapRecords.find(hash);
+        if (mi != mapRecords.end())
+        {
+            nChainType = mi->second.first;
+            nChainLength = mi->second.second;
+            return true;
+        }
+        try {
+            if (!pblocktree || !pblocktree->ReadPowCheck(hash, nChainType, nChainLength))
+                return false;
+        } catch (std::exception &e) {
+            return false; // check the block instead
+        }
+        Remember(hash, nChainType, nChainLength);
+        return true;
+    }
+
+    void Set(const uint256& hash, unsigned int nChainType, unsigned int nChainLength)
+    {
+        LOCK(cs);
+        Remember(hash, nChainType, nChainLength);
+        try {
+            if (pblocktree)
+                pblocktree->WritePowCheck(hash, nChainType, nChainLength);
+        } catch (std::exception &e) {
+            printf("CPowCheckCache::Set() : failed to record proof-of-work check: %s\n", e.what());
+        }
+    }
+};
+
+static CPowCheckCache powcheckcache;
+
+// Check the proof-of-work of a block, unless it was verified before
+bool static CheckProofOfWorkCached(const CBlockHeader& header, unsigned int& nChainType, unsigned int& nChainLength)
+{
+    uint256 hash = header.GetHash();
+    if (powcheckcache.Get(hash, nChainType, nChainLength))
+        return true;
+    if (!CheckProofOfWork(header.GetHeaderHash(), header.nBits, header.bnPrimeChainMultiplier, nChainType, nChainLength))
+        return false;
+    powcheckcache.Set(hash, nChainType, nChainLength);
+    return true;
+}
+
+// Prime chain of a block in the index. A block accepted with its
+// proof-of-work assumed valid has it from the records of the checks done
+// since, if any; otherwise it is unknown, type and length 0, unless fCheck
+// asks for the check to be done now.
+bool GetBlockPrimeChain(const CBlockIndex* pindex, unsigned int& nChainType, unsigned int& nChainLength, bool fCheck)
+{
+    nChainType = pindex->nPrimeChainType;
+    nChainLength = pindex->nPrimeChainLength;
+    if (nChainLength != 0)
+        return true;
+    if (powcheckcache.Get(pindex->GetBlockHash(), nChainType, nChainLength))
+        return true;
+    if (fCheck && CheckProofOfWorkCached(pindex->GetBlockHeader(), nChainType, nChainLength))
+        return true;
+    nChainType = 0;
+    nChainLength = 0;
+    return false;
+}
+
+static CPowCheckQueue powcheckqueue(CheckProofOfWorkCached);
+
+void ThreadPowCheck() {
+    RenameThread("primecoin-powchk");
+    powcheckqueue.Thread();
+}
+
+// Block index entries are never freed one by one, so they are carved out of
+// slabs instead of being allocated each on its own; cs_main must be held
+static std::vector<CBlockIndex*> vBlockIndexSlabs;
+static unsigned int nBlockIndexSlabUsed = 0;
+static const unsigned int BLOCK_INDEX_SLAB_SIZE = 4096;
+
+static CBlockIndex* NewBlockIndex()
+{
+    if (vBlockIndexSlabs.empty() || nBlockIndexSlabUsed == BLOCK_INDEX_SLAB_SIZE)
+    {
+        vBlockIndexSlabs.push_back(new CBlockIndex[BLOCK_INDEX_SLAB_SIZE]);
+        nBlockIndexSlabUsed = 0;
+    }
+    return &vBlockIndexSlabs.back()[nBlockIndexSlabUsed++];
+}
+
+// Primecoin: headers-first synchronization
+//
+// Block headers are accepted ahead of their blocks into a tree of index
+// entries without data, so that the blocks of the best header chain can be
+// asked from several peers at once. A header gets the contextual checks of
+// AcceptBlock and the full check of its prime proof-of-work, done ahead on
+// the checking threads, before it is stored, so a header chain costs as
+// much work to forge as its blocks; the block takes the recorded check when
+// it arrives. AddToBlockIndex takes over the entry of a header when its
+// block is stored, so the headers linking to it stay valid and
+// mapBlockIndex still only holds the blocks we have.
+//
+// With -assumevalid, the proof-of-work check of the headers is deferred
+// while the assumed-valid block is not indexed, up to MAX_HEADERS_DEFERRED
+// headers: once its header links to ours, its ancestors are trusted and
+// only the other headers deferred are checked. Their blocks are checked in
+// full by ProcessBlock as long as they are not known to be ancestors.
+static BlockMap mapHeaderIndex;
+static CBlockIndex* pindexBestHeader = NULL;
+static std::vector<CBlockIndex*> vHeaderChain; // best header chain by height
+// Headers without their block by the index entry of their previous block
+typedef std::multimap<CBlockIndex*, CBlockIndex*> HeaderChildMap;
+static HeaderChildMap mapHeaderChildren;
+// Headers accepted with their proof-of-work check deferred, parents first
+static std::vector<CBlockIndex*> vHeadersDeferred;
+
+static CBlockIndex* GetAssumeValidIndex();
+bool static IsAssumedValid(const CBlockIndex* pindex);
+
+// Blocks asked from peers by the download scheduler
+struct CBlockRequest
+{
+    CNode* pnode;
+    int64 nTime;
+};
+static std::map<uint256, CBlockRequest> mapBlockRequests;
+
+// Index entry of a block, or of its header alone; cs_main must be held
+static CBlockIndex* FindHeaderIndex(const uint256& hash)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return mi->second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return mi->second;
+    return NULL;
+}
+
+void static SetBestHeader(CBlockIndex* pindex)
+{
+    pindexBestHeader = pindex;
+    vHeaderChain.resize(pindex->nHeight + 1);
+    for (; pindex && vHeaderChain[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vHeaderChain[pindex->nHeight] = pindex;
+}
+
+// Tip of the best header chain, never behind the best chain
+static CBlockIndex* GetBestHeader()
+{
+    if (pindexBest && (pindexBestHeader == NULL || pindexBest->nChainWork > pindexBestHeader->nChainWork))
+        SetBestHeader(pindexBest);
+    return pindexBestHeader;
+}
+
+// Checks of a header but its prime proof-of-work, on top of pindexPrev,
+// the index entry of its previous block if we have it
+bool static CheckBlockHeaderContext(const CBlockHeader& header, const uint256& hash, CBlockIndex* pindexPrev, CValidationState& state)
+{
+    if (!CheckBlockHeaderIntegrity(header.GetHeaderHash(), header.nBits, header.bnPrimeChainMultiplier))
+        return state.DoS(100, error("AcceptBlockHeader() : header integrity check failed"));
+    if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("AcceptBlockHeader() : block timestamp too far in the future"));
+    if (header.nVersion < 2)
+        return state.Invalid(error("AcceptBlockHeader() : rejected nVersion=1 block"));
+
+    if (pindexPrev == NULL)
+        return state.DoS(10, error("AcceptBlockHeader() : prev block not found"));
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"));
+    int nHeight = pindexPrev->nHeight + 1;
+
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header))
+        return state.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("AcceptBlockHeader() : block's timestamp is too early"));
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
+    // The blocks below the last checkpoint are all known, anything new there is a fork
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight <= pcheckpoint->nHeight)
+        return state.DoS(100, error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+    return true;
+}
+
+// Whether to defer the proof-of-work check of the headers coming, as they
+// may lead to the assumed-valid block; cs_main must be held
+bool static DeferHeaderPow()
+{
+    return hashAssumeValid != 0 && GetAssumeValidIndex() == NULL && vHeadersDeferred.size() < MAX_HEADERS_DEFERRED;
+}
+
+void static InvalidHeaderChain(CBlockIndex* pindexInvalid, CNode* pfrom);
+
+// Check the proof-of-work of the headers deferred, now that the
+// assumed-valid block is indexed, but for its ancestors
+void static CheckDeferredHeaders()
+{
+    std::vector<CBlockIndex*> vDeferred;
+    vDeferred.swap(vHeadersDeferred);
+    unsigned int nChecked = 0;
+    BOOST_FOREACH(CBlockIndex* pindex, vDeferred)
+    {
+        if ((pindex->nStatus & BLOCK_FAILED_MASK) || IsAssumedValid(pindex))
+            continue;
+        unsigned int nChainType = 0;
+        unsigned int nChainLength = 0;
+        nChecked++;
+        if (!powcheckqueue.Check(pindex->GetBlockHeader(), nChainType, nChainLength))
+        {
+            printf("CheckDeferredHeaders() : proof of work failed, block=%s height=%d\n", pindex->GetBlockHash().ToString().c_str(), pindex->nHeight);
+            pindex->nStatus |= BLOCK_FAILED_VALID;
+            InvalidHeaderChain(pindex, NULL);
+        }
+    }
+    printf("CheckDeferredHeaders() : %"PRIszu" headers deferred, %u off the assumed-valid chain checked\n", vDeferred.size(), nChecked);
+}
+
+bool AcceptBlockHeader(CBlockHeader& header, CValidationState& state, CBlockIndex** ppindex)
+{
+    // Check for duplicate
+    uint256 hash = header.GetHash();
+    CBlockIndex* pindex = FindHeaderIndex(hash);
+    if (pindex)
+    {
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString().c_str()));
+        *ppindex = pindex;
+        return true;
+    }
+
+    CBlockIndex* pindexPrev = FindHeaderIndex(header.hashPrevBlock);
+    if (!CheckBlockHeaderContext(header, hash, pindexPrev, state))
+        return false;
+
+    // Prime chain last, the other checks are cheap
+    bool fDeferred = DeferHeaderPow();
+    unsigned int nChainType = 0;
+    unsigned int nChainLength = 0;
+    if (!fDeferred && !powcheckqueue.Check(header, nChainType, nChainLength))
+        return state.DoS(100, error("AcceptBlockHeader() : proof of work failed"));
+
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(header);
+    BlockMap::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = pindexPrev->nHeight + 1;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+    mapHeaderChildren.insert(make_pair(pindexPrev, pindexNew));
+    if (fDeferred)
+        vHeadersDeferred.push_back(pindexNew);
+    if (!vHeadersDeferred.empty() && GetAssumeValidIndex() != NULL)
+        CheckDeferredHeaders();
+    if (pindexNew->nChainWork > GetBestHeader()->nChainWork && !(pindexNew->nStatus & BLOCK_FAILED_MASK))
+        SetBestHeader(pindexNew);
+
+    *ppindex = pindexNew;
+    return true;
+}
+
+// Headers of a headers message worth checking the prime proof-of-work of:
+// those new to us up to the first failing the other checks of
+// AcceptBlockHeader, none while the check is deferred. The headers before
+// are their context, linked in temporary index entries.
+void CheckHeadersContext(const std::vector<CBlock>& vHeaders, std::vector<CBlockHeader>& vCheck)
+{
+    LOCK(cs_main);
+    if (DeferHeaderPow())
+        return;
+    std::vector<uint256> vHash(vHeaders.size());
+    std::vector<CBlockIndex> vIndex(vHeaders.size());
+    CBlockIndex* pindexPrev = NULL;
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        const CBlockHeader& header = vHeaders[i];
+        vHash[i] = header.GetHash();
+        if (pindexPrev == NULL || header.hashPrevBlock != pindexPrev->GetBlockHash())
+            pindexPrev = FindHeaderIndex(header.hashPrevBlock);
+        CBlockIndex* pindex = FindHeaderIndex(vHash[i]);
+        if (pindex)
+        {
+            if (pindex->nStatus & BLOCK_FAILED_MASK)
+                return;
+            pindexPrev = pindex;
+            continue;
+        }
+        CValidationState state;
+        if (!CheckBlockHeaderContext(header, vHash[i], pindexPrev, state))
+            return;
+        vIndex[i] = CBlockIndex(header);
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = pindexPrev;
+        vIndex[i].nHeight = pindexPrev->nHeight + 1;
+        pindexPrev = &vIndex[i];
+        vCheck.push_back(header);
+    }
+}
+
+// Flag the headers descending from an invalid block, so they are no longer
+// downloaded, and leave the best header chain if it ran through them: the
+// peers but pfrom, which sent the invalid block, are asked for headers again
+// from the new best header, those not answering getting a getblocks instead
+void static InvalidHeaderChain(CBlockIndex* pindexInvalid, CNode* pfrom)
+{
+    std::vector<CBlockIndex*> vWalk(1, pindexInvalid);
+    while (!vWalk.empty())
+    {
+        CBlockIndex* pindex = vWalk.back();
+        vWalk.pop_back();
+        std::pair<HeaderChildMap::iterator, HeaderChildMap::iterator> range = mapHeaderChildren.equal_range(pindex);
+        for (HeaderChildMap::iterator mi = range.first; mi != range.second; ++mi)
+        {
+            // headers flagged before have their descendants flagged too
+            if (mi->second->nStatus & BLOCK_FAILED_MASK)
+                continue;
+            mi->second->nStatus |= BLOCK_FAILED_CHILD;
+            vWalk.push_back(mi->second);
+        }
+    }
+
+    if (pindexBestHeader == NULL || !(pindexBestHeader->nStatus & BLOCK_FAILED_MASK))
+        return;
+    pindexBestHeader = NULL;
+    CBlockIndex* pindexHeader = GetBestHeader();
+    printf("InvalidHeaderChain() : best header back to height %d\n", pindexHeader ? pindexHeader->nHeight : -1);
+    if (pindexHeader == NULL)
+        return;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        if (pnode != pfrom && pnode->fSuccessfullyConnected && !pnode->fDisconnect && !pnode->fClient)
+            pnode->PushGetHeaders(pindexHeader, uint256(0));
+}
+
+// Flag the header of a block found invalid and its descendants
+void InvalidHeaderFound(const uint256& hash, CNode* pfrom)
+{
+    BlockMap::iterator mi = mapHeaderIndex.find(hash);
+    if (mi == mapHeaderIndex.end())
+        return;
+    CBlockIndex* pindex = mi->second;
+    pindex->nStatus |= BLOCK_FAILED_VALID;
+    printf("InvalidHeaderFound() : invalid block=%s height=%d\n", hash.ToString().c_str(), pindex->nHeight);
+    InvalidHeaderChain(pindex, pfrom);
+}
+
+void static MarkBlockReceived(const uint256& hash)
+{
+    std::map<uint256, CBlockRequest>::iterator mi = mapBlockRequests.find(hash);
+    if (mi == mapBlockRequests.end())
+        return;
+    mi->second.pnode->nBlocksInFlight--;
+    mi->second.pnode->Release();
+    mapBlockRequests.erase(mi);
+}
+
+// Ask the peer for blocks of the best header chain past the best block,
+// within the download window and its share of the requests in flight
+void ScheduleBlockDownload(CNode* pto)
+{
+    int64 nNow = GetTime();
+
+    // Requests to peers gone or stalling go back to the pool
+    for (std::map<uint256, CBlockRequest>::iterator mi = mapBlockRequests.begin(); mi != mapBlockRequests.end();)
+    {
+        CNode* pnode = mi->second.pnode;
+        if (pnode->fDisconnect || nNow - mi->second.nTime > BLOCK_STALLING_TIMEOUT)
+        {
+            if (!pnode->fDisconnect && pnode->nBlocksStalledTime != nNow)
+                printf("ScheduleBlockDownload() : peer=%s stalling on block=%s, reassigning\n", pnode->addrName.c_str(), mi->first.ToString().c_str());
+            pnode->nBlocksStalledTime = nNow;
+            pnode->nBlocksInFlight--;
+            pnode->Release();
+            mapBlockRequests.erase(mi++);
+        }
+        else
+            ++mi;
+    }
+
+    if (!pto->fSuccessfullyConnected || pto->fInbound || pto->fClient || pto->fDisconnect)
+        return;
+    // A stalling peer sits out a few rounds of requests
+    if (nNow - pto->nBlocksStalledTime < 5 * BLOCK_STALLING_TIMEOUT)
+        return;
+    if (pto->nBlocksInFlight >= MAX_BLOCKS_IN_FLIGHT)
+        return;
+    CBlockIndex* pindexHeader = GetBestHeader();
+    if (pindexHeader == NULL || pindexHeader == pindexBest)
+        return;
+
+    // Download from where the best chain leaves the best header chain
+    CBlockIndex* pindexFork = pindexBest;
+    while (pindexFork && (pindexFork->nHeight >= (int)vHeaderChain.size() || vHeaderChain[pindexFork->nHeight] != pindexFork))
+        pindexFork = pindexFork->pprev;
+    int nStart = pindexFork ? pindexFork->nHeight + 1 : 0;
+    int nEnd = std::min(pindexHeader->nHeight, std::min(nStart + BLOCK_DOWNLOAD_WINDOW - 1, pto->nStartingHeight));
+
+    vector<CInv> vGetData;
+    for (int nHeight = nStart; nHeight <= nEnd && pto->nBlocksInFlight < MAX_BLOCKS_IN_FLIGHT; nHeight++)
+    {
+        CBlockIndex* pindex = vHeaderChain[nHeight];
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+        {
+            // Best header chain found invalid since, by ConnectBlock
+            InvalidHeaderChain(pindex, NULL);
+            break;
+        }
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            continue;
+        const uint256& hash = pindex->GetBlockHash();
+        if (mapBlockRequests.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        CBlockRequest request;
+        request.pnode = pto->AddRef();
+        request.nTime = nNow;
+        mapBlockRequests.insert(make_pair(hash, request));
+        pto->nBlocksInFlight++;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+    }
+    if (!vGetData.empty())
+    {
+        if (fDebug)
+            printf("ScheduleBlockDownload() : peer=%s asked %"PRIszu" blocks from height %d\n", pto->addrName.c_str(), vGetData.size(), nStart);
+        pto->PushMessage("getdata", vGetData);
+    }
+}
+
+// Primecoin: assumed-valid blocks
+//
+// With -assumevalid=<hash>, the ancestors of that block are trusted to have
+// valid prime proof-of-work and scripts. Their headers are accepted without
+// the proof-of-work check, see AcceptBlockHeader; ProcessBlock only checks
+// their header integrity, and ConnectBlock skips their script checks; every
+// other check, the UTXO accounting in particular, is still done. Ancestry
+// follows the hashes linking the block index, so blocks are assumed valid
+// only once the assumed-valid block is indexed, and never blocks off its
+// chain. Their prime chain is recorded as unknown, type and length 0,
+// unless checked before; see GetBlockPrimeChain.
+static CBlockIndex* pindexAssumeValid = NULL;
+static std::vector<CBlockIndex*> vAssumeValidChain; // its ancestors by height
+
+// Index entry of the assumed-valid block, NULL until it is indexed; cs_main
+// must be held
+static CBlockIndex* GetAssumeValidIndex()
+{
+    if (hashAssumeValid == 0)
+        return NULL;
+    if (pindexAssumeValid == NULL)
+    {
+        pindexAssumeValid = FindHeaderIndex(hashAssumeValid);
+        if (pindexAssumeValid == NULL)
+            return NULL;
+        vAssumeValidChain.resize(pindexAssumeValid->nHeight + 1);
+        for (CBlockIndex* pindex = pindexAssumeValid; pindex; pindex = pindex->pprev)
+            vAssumeValidChain[pindex->nHeight] = pindex;
+        printf("GetAssumeValidIndex() : assuming valid the blocks up to height %d, block=%s\n", pindexAssumeValid->nHeight, hashAssumeValid.ToString().c_str());
+    }
+    return pindexAssumeValid;
+}
+
+// Whether the block of given height and hash is the assumed-valid block or
+// one of its ancestors; cs_main must be held
+bool static IsAssumedValid(int nHeight, const uint256& hash)
+{
+    if (GetAssumeValidIndex() == NULL)
+        return false;
+    return nHeight >= 0 && nHeight <= pindexAssumeValid->nHeight && vAssumeValidChain[nHeight]->GetBlockHash() == hash;
+}
+
+bool static IsAssumedValid(const CBlockIndex* pindex)
+{
+    return pindex->phashBlock != NULL && IsAssumedValid(pindex->nHeight, pindex->GetBlockHash());
+}
+
+// Primecoin: timing of block checks during the initial block download,
+// reported to the debug log to measure what -assumevalid saves
+static struct CSyncStats
+{
+    int64 nStart;
+    int nBlocks;
+    int64 nPowTime;
+    int nPowChecked;
+    int nPowAssumed;
+    int64 nConnectTime;
+    int nConnected;
+    int nScriptsAssumed;
+    bool fDone;
+
+    void Report(const char* pszPhase)
+    {
+        printf("Sync %s: height=%d blocks=%d in %.1fs, proof-of-work %.1fs (%d checked, %d assumed valid), connect %.1fs (%d blocks, %d without script checks)\n",
+            pszPhase, nBestHeight, nBlocks, 0.000001 * (GetTimeMicros() - nStart), 0.000001 * nPowTime, nPowChecked, nPowAssumed,
+            0.000001 * nConnectTime, nConnected, nScriptsAssumed);
+    }
+
+    // Called for each block accepted
+    void BlockAccepted()
+    {
+        if (fDone)
+            return;
+        if (nBlocks++ == 0)
+            nStart = GetTimeMicros();
+        if (!IsInitialBlockDownload())
+        {
+            Report("finished");
+            fDone = true;
+        }
+        else if (nBlocks % 1000 == 0)
+            Report("progress");
+    }
+} syncstats;
+
+// Read the header of a block message, without the transactions
+bool static GetBlockMessageHeader(const CNetMessage& msg, CBlockHeader& header)
+{
+    if (!msg.complete() || msg.hdr.GetCommand() != "block")
+        return false;
+    try {
+        unsigned int nSize = std::min(msg.vRecv.size(), (size_t) 1024);
+        CDataStream ss(msg.vRecv.begin(), msg.vRecv.begin() + nSize, SER_NETWORK, PROTOCOL_VERSION);
+        ss >> header;
+    } catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+// Read the headers of a headers message
+bool static GetHeadersMessageHeaders(const CNetMessage& msg, std::vector<CBlock>& vHeaders)
+{
+    if (!msg.complete() || msg.hdr.GetCommand() != "headers")
+        return false;
+    try {
+        CDataStream ss(msg.vRecv.begin(), msg.vRecv.end(), SER_NETWORK, PROTOCOL_VERSION);
+        ss >> vHeaders;
+    } catch (std::exception &e) {
+        return false;
+    }
+    return vHeaders.size() <= MAX_HEADERS_RESULTS;
+}
+
 // Return maximum amount of blocks that other nodes claim to have
 int GetNumBlocksOfPeers()
 {
@@ -1251,7 +2070,7 @@ void CBlockHeader::UpdateTime(const CBlockIndex* pindexPrev)
 
 const CTxOut &CTransaction::GetOutputFor(const CTxIn& input, CCoinsViewCache& view)
 {
-    const CCoins &coins = view.GetCoins(input.prevout.hash);
+    const CCoins &coins = view.AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1296,7 +2115,7 @@ void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs,
     }
 
     // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(*this, nHeight)));
+    assert(inputs.SetNewCoins(txhash, CCoins(*this, nHeight)));
 }
 
 bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
@@ -1312,7 +2131,7 @@ bool CTransaction::HaveInputs(CCoinsViewCache &inputs) const
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1352,7 +2171,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             const COutPoint &prevout = vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1391,7 +2210,7 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         if (fScriptChecks) {
             for (unsigned int i = 0; i < vin.size(); i++) {
                 const COutPoint &prevout = vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
                 CScriptCheck check(coins, *this, i, flags, 0);
@@ -1554,7 +2373,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
         return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1574,7 +2393,7 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fEnforceBIP30) {
         for (unsigned int i=0; i<vtx.size(); i++) {
             uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+            if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
         }
     }
@@ -1671,6 +2490,11 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
     if (fJustCheck)
         return true;
 
+    syncstats.nConnectTime += nTime2;
+    syncstats.nConnected++;
+    if (!fScriptChecks)
+        syncstats.nScriptsAssumed++;
+
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
     {
@@ -1788,7 +2612,7 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Flush changes to global coin state
     int64 nStart = GetTimeMicros();
-    int nModified = view.GetCacheSize();
+    int nModified = view.GetDirtyCount();
     assert(view.Flush());
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
@@ -1796,21 +2620,35 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 
     // Make sure it's successfully written to disk before changing memory structure
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    // The copy of the changes the coin database is still writing counts too
+    bool fCacheFull = pcoinsTip->GetCacheUsage() + pcoinsTip->GetWriteUsage() > nCoinCacheUsage;
+    if (!fIsInitialDownload || fCacheFull) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetDirtyCount()))
             return state.Error();
         FlushBlockFile();
         pblocktree->Sync();
+        // The coin database writes the changes in the background, and only
+        // moves its best block once they are durable. This fails if the
+        // previous write did.
         if (!pcoinsTip->Flush())
             return state.Abort(_("Failed to write to coin database"));
+        // Everything cached is clean now, and the database holds a copy
+        // of the changes until they are written. Keep the most recently
+        // used entries in what that leaves of the budget, with room for
+        // the next blocks' changes.
+        if (fCacheFull) {
+            size_t nTarget = nCoinCacheUsage / 4 * 3;
+            size_t nWriteUsage = pcoinsTip->GetWriteUsage();
+            pcoinsTip->Trim(nWriteUsage < nTarget ? nTarget - nWriteUsage : 0);
+        }
     }
 
-    // At this point, all changes have been done to the database.
+    // At this point, all changes have been handed to the database.
     // Proceed by updating the memory structures.
 
     // Disconnect shorter branch
@@ -1895,12 +2733,28 @@ bool CBlock::AddToBlockIndex(CValidationState &state, const CDiskBlockPos &pos)
     if (mapBlockIndex.count(hash))
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
-    // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(*this);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    // Construct new block index object, taking over the entry of its header
+    // as the headers after it link to it
+    CBlockIndex* pindexNew;
+    BlockMap::iterator miHeader = mapHeaderIndex.find(hash);
+    if (miHeader != mapHeaderIndex.end())
+    {
+        pindexNew = miHeader->second;
+        mapHeaderIndex.erase(miHeader);
+        std::pair<HeaderChildMap::iterator, HeaderChildMap::iterator> range = mapHeaderChildren.equal_range(pindexNew->pprev);
+        for (HeaderChildMap::iterator mi = range.first; mi != range.second; ++mi)
+            if (mi->second == pindexNew)
+            {
+                mapHeaderChildren.erase(mi);
+                break;
+            }
+    }
+    else
+        pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(*this);
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2122,7 +2976,7 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     CBlockIndex* pindexPrev = NULL;
     int nHeight = 0;
     if (hash != hashGenesisBlock) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"));
         pindexPrev = (*mi).second;
@@ -2241,9 +3095,30 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (!pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    // Check proof of work matches claimed amount
-    if (!CheckProofOfWork(pblock->GetHeaderHash(), pblock->nBits, pblock->bnPrimeChainMultiplier, pblock->nPrimeChainType, pblock->nPrimeChainLength))
-        return state.DoS(100, error("ProcessBlock() : proof of work failed"));
+    // Check proof of work matches claimed amount, only the header integrity
+    // of an assumed-valid block
+    int64 nPowStart = GetTimeMicros();
+    CBlockIndex* pindexPrev = FindHeaderIndex(pblock->hashPrevBlock);
+    if (pindexPrev && IsAssumedValid(pindexPrev->nHeight + 1, hash))
+    {
+        if (!CheckBlockHeaderIntegrity(pblock->GetHeaderHash(), pblock->nBits, pblock->bnPrimeChainMultiplier))
+            return state.DoS(100, error("ProcessBlock() : header integrity check failed"));
+        // Prime chain unknown unless checked before, recorded as type and
+        // length 0; see GetBlockPrimeChain
+        if (!powcheckcache.Get(hash, pblock->nPrimeChainType, pblock->nPrimeChainLength))
+        {
+            pblock->nPrimeChainType = 0;
+            pblock->nPrimeChainLength = 0;
+        }
+        syncstats.nPowAssumed++;
+    }
+    else
+    {
+        if (!powcheckqueue.Check(*pblock, pblock->nPrimeChainType, pblock->nPrimeChainLength))
+            return state.DoS(100, error("ProcessBlock() : proof of work failed"));
+        syncstats.nPowChecked++;
+    }
+    syncstats.nPowTime += GetTimeMicros() - nPowStart;
 
     // Check for v0.2 protocol compatibility
     if (GetBoolArg("-v2compatible", false) &&
@@ -2282,8 +3157,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // Ask this guy to fill in what we're missing, unless the
+            // download scheduler has the headers leading to it
+            if (!mapHeaderIndex.count(pblock2->hashPrevBlock))
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
         }
         return true;
     }
@@ -2313,6 +3190,12 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
+    // No use checking ahead the proof-of-work of the blocks to come while
+    // they are assumed valid
+    bool fAssumedValid = pindexBest && IsAssumedValid(pindexBest);
+    powcheckqueue.SetPaused(fAssumedValid && pindexBest != pindexAssumeValid);
+    syncstats.BlockAccepted();
+
     printf("ProcessBlock: ACCEPTED\n");
 
     return true;
@@ -2537,46 +3420,412 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     if (hash == 0)
         return NULL;
 
-    // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    // Return existing
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+
+    // Create new
+    CBlockIndex* pindexNew = NewBlockIndex();
+    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+
+    return pindexNew;
+}
+
+// Rough size in memory of the block index: the slabs of entries, plus the
+// buckets and the nodes (value and links) of the maps
+static uint64 GetBlockIndexMemoryUsage()
+{
+    uint64 nUsage = (uint64)vBlockIndexSlabs.size() * BLOCK_INDEX_SLAB_SIZE * sizeof(CBlockIndex);
+    nUsage += (mapBlockIndex.bucket_count() + mapHeaderIndex.bucket_count()) * sizeof(void*);
+    nUsage += (mapBlockIndex.size() + mapHeaderIndex.size()) * (sizeof(BlockMap::value_type) + 2 * sizeof(void*));
+    return nUsage;
+}
+
+// Entries of the block index in height order, each after its predecessor;
+// a counting sort by height gives it without comparing them
+static void GetBlockIndexByHeight(vector<CBlockIndex*>& vSortedByHeight)
+{
+    int nMaxHeight = 0;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = max(nMaxHeight, item.second->nHeight);
+    vector<unsigned int> vHeightPos(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightPos[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight; nHeight++)
+        vHeightPos[nHeight] += vHeightPos[nHeight - 1];
+    vSortedByHeight.resize(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(const uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightPos[item.second->nHeight]++] = item.second;
+}
+
+// Primecoin: block index snapshot
+//
+// On clean shutdown the block index is written to a flat file of fixed-size
+// records in height order, with the parent of an entry given by its position
+// and the memory-only sums (chain work, work transition, transaction count)
+// included. The next start maps the file and fills the index from it instead
+// of reading and checking every entry from LevelDB. The snapshot is only
+// taken if it was written at the best block of the coin database, and it is
+// removed once read, so a later crash never finds one that is out of date.
+static const unsigned int BLOCK_INDEX_SNAPSHOT_MAGIC = 0x70786469;
+static const unsigned int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+
+struct CBlockIndexSnapshotHeader
+{
+    unsigned int nMagic;        // also tells the byte order
+    unsigned int nVersion;
+    unsigned int nRecordSize;
+    unsigned int nRecords;
+    unsigned int nExtraSize;    // bytes of long multipliers after the records
+    uint256 hashBestChain;      // best block of the coin database when written
+    uint256 hashChecksum;       // SHA256 of the records and the extra bytes
+};
+
+struct CBlockIndexSnapshotRecord
+{
+    enum { nInlineSize = 24 };
+
+    uint256 hashBlock;
+    uint256 hashMerkleRoot;
+    uint256 nChainWork;
+    int64 nMoneySupply;
+    int nPrev;                  // position of the parent's record, -1 if none
+    int nHeight;
+    int nFile;
+    unsigned int nDataPos;
+    unsigned int nUndoPos;
+    unsigned int nWorkTransition;
+    unsigned int nPrimeChainType;
+    unsigned int nPrimeChainLength;
+    unsigned int nTx;
+    unsigned int nChainTx;
+    unsigned int nStatus;
+    int nVersion;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    unsigned int nMultiplierSize;
+    unsigned char pchMultiplier[nInlineSize]; // the bytes, or their offset in the extra bytes past nInlineSize
+};
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "indexsnapshot.dat";
+}
+
+static uint256 GetBlockIndexSnapshotChecksum(const unsigned char* pchRecords, size_t nRecordsSize, const unsigned char* pchExtra, size_t nExtraSize)
+{
+    uint256 hash;
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, pchRecords, nRecordsSize);
+    SHA256_Update(&ctx, pchExtra, nExtraSize);
+    SHA256_Final((unsigned char*)&hash, &ctx);
+    return hash;
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    if (!GetBoolArg("-indexsnapshot", true) || pindexBest == NULL || pcoinsTip == NULL)
+        return false;
+    int64 nStart = GetTimeMillis();
+
+    CBlockIndexSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.nMagic = BLOCK_INDEX_SNAPSHOT_MAGIC;
+    header.nVersion = BLOCK_INDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    if (!pcoinsTip->GetBestBlockHash(header.hashBestChain))
+        return false;
+
+    vector<CBlockIndex*> vSortedByHeight;
+    GetBlockIndexByHeight(vSortedByHeight);
+    header.nRecords = vSortedByHeight.size();
+    boost::unordered_map<const CBlockIndex*, int> mapPos;
+    mapPos.rehash(vSortedByHeight.size());
+    vector<CBlockIndexSnapshotRecord> vRecords(vSortedByHeight.size());
+    memset(&vRecords[0], 0, vRecords.size() * sizeof(CBlockIndexSnapshotRecord));
+    vector<unsigned char> vchExtra;
+    for (unsigned int i = 0; i < vSortedByHeight.size(); i++)
+    {
+        const CBlockIndex* pindex = vSortedByHeight[i];
+        CBlockIndexSnapshotRecord& rec = vRecords[i];
+        mapPos[pindex] = i;
+        rec.hashBlock         = pindex->GetBlockHash();
+        rec.hashMerkleRoot    = pindex->hashMerkleRoot;
+        rec.nChainWork        = pindex->nChainWork;
+        rec.nMoneySupply      = pindex->nMoneySupply;
+        rec.nPrev             = -1;
+        if (pindex->pprev)
+        {
+            boost::unordered_map<const CBlockIndex*, int>::iterator mi = mapPos.find(pindex->pprev);
+            if (mi == mapPos.end())
+                return error("WriteBlockIndexSnapshot() : block %s is not above its parent", pindex->GetBlockHash().ToString().c_str());
+            rec.nPrev = mi->second;
+        }
+        rec.nHeight           = pindex->nHeight;
+        rec.nFile             = pindex->nFile;
+        rec.nDataPos          = pindex->nDataPos;
+        rec.nUndoPos          = pindex->nUndoPos;
+        rec.nWorkTransition   = pindex->nWorkTransition;
+        rec.nPrimeChainType   = pindex->nPrimeChainType;
+        rec.nPrimeChainLength = pindex->nPrimeChainLength;
+        rec.nTx               = pindex->nTx;
+        rec.nChainTx          = pindex->nChainTx;
+        rec.nStatus           = pindex->nStatus;
+        rec.nVersion          = pindex->nVersion;
+        rec.nTime             = pindex->nTime;
+        rec.nBits             = pindex->nBits;
+        rec.nNonce            = pindex->nNonce;
+        const CCompactMultiplier& multiplier = pindex->primeChainMultiplier;
+        rec.nMultiplierSize = multiplier.size();
+        if (multiplier.size() <= CBlockIndexSnapshotRecord::nInlineSize)
+            memcpy(rec.pchMultiplier, multiplier.data(), multiplier.size());
+        else
+        {
+            unsigned int nOffset = vchExtra.size();
+            memcpy(rec.pchMultiplier, &nOffset, sizeof(nOffset));
+            vchExtra.insert(vchExtra.end(), multiplier.data(), multiplier.data() + multiplier.size());
+        }
+    }
+    header.nExtraSize = vchExtra.size();
+    header.hashChecksum = GetBlockIndexSnapshotChecksum((const unsigned char*)&vRecords[0], vRecords.size() * sizeof(CBlockIndexSnapshotRecord),
+                                                        vchExtra.empty() ? NULL : &vchExtra[0], vchExtra.size());
+
+    // Write to a temporary file and rename it over the snapshot
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = pathSnapshot.string() + ".new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : cannot open %s", pathTmp.string().c_str());
+    bool fOk = fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fOk && !vRecords.empty())
+        fOk = fwrite(&vRecords[0], sizeof(CBlockIndexSnapshotRecord), vRecords.size(), file) == vRecords.size();
+    if (fOk && !vchExtra.empty())
+        fOk = fwrite(&vchExtra[0], 1, vchExtra.size(), file) == vchExtra.size();
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, pathSnapshot))
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : cannot write %s", pathSnapshot.string().c_str());
+    }
+    printf("WriteBlockIndexSnapshot(): %u entries written in %"PRI64d"ms\n", header.nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Fill the block index from a mapped snapshot, if it is sound and matches
+// the coin database
+static bool ReadBlockIndexSnapshot(const unsigned char* pchBegin, size_t nSize)
+{
+    CBlockIndexSnapshotHeader header;
+    if (nSize < sizeof(header))
+        return error("ReadBlockIndexSnapshot() : file too short");
+    memcpy(&header, pchBegin, sizeof(header));
+    if (header.nMagic != BLOCK_INDEX_SNAPSHOT_MAGIC || header.nVersion != BLOCK_INDEX_SNAPSHOT_VERSION || header.nRecordSize != sizeof(CBlockIndexSnapshotRecord))
+        return error("ReadBlockIndexSnapshot() : unknown format");
+    uint64 nRecordsSize = (uint64)header.nRecords * sizeof(CBlockIndexSnapshotRecord);
+    if (nSize != sizeof(header) + nRecordsSize + header.nExtraSize)
+        return error("ReadBlockIndexSnapshot() : size mismatch");
+    uint256 hashBestChain;
+    if (!pcoinsTip->GetBestBlockHash(hashBestChain) || hashBestChain != header.hashBestChain)
+        return error("ReadBlockIndexSnapshot() : written at block %s, not at the best block of the coin database", header.hashBestChain.ToString().c_str());
+    const unsigned char* pchRecords = pchBegin + sizeof(header);
+    const unsigned char* pchExtra = pchRecords + nRecordsSize;
+    if (GetBlockIndexSnapshotChecksum(pchRecords, nRecordsSize, pchExtra, header.nExtraSize) != header.hashChecksum)
+        return error("ReadBlockIndexSnapshot() : checksum mismatch");
+
+    // Check the links before touching the index, so that it is filled
+    // either completely or not at all
+    CBlockIndexSnapshotRecord rec;
+    for (unsigned int i = 0; i < header.nRecords; i++)
+    {
+        memcpy(&rec, pchRecords + i * sizeof(rec), sizeof(rec));
+        if (rec.nPrev < -1 || rec.nPrev >= (int)i || rec.nMultiplierSize > 255)
+            return error("ReadBlockIndexSnapshot() : bad record %u", i);
+        if (rec.nMultiplierSize > CBlockIndexSnapshotRecord::nInlineSize)
+        {
+            unsigned int nOffset;
+            memcpy(&nOffset, rec.pchMultiplier, sizeof(nOffset));
+            if ((uint64)nOffset + rec.nMultiplierSize > header.nExtraSize)
+                return error("ReadBlockIndexSnapshot() : bad record %u", i);
+        }
+    }
+
+    mapBlockIndex.rehash(header.nRecords);
+    vector<CBlockIndex*> vIndex(header.nRecords);
+    for (unsigned int i = 0; i < header.nRecords; i++)
+    {
+        memcpy(&rec, pchRecords + i * sizeof(rec), sizeof(rec));
+        CBlockIndex* pindexNew = InsertBlockIndex(rec.hashBlock);
+        vIndex[i] = pindexNew;
+        pindexNew->pprev             = rec.nPrev >= 0 ? vIndex[rec.nPrev] : NULL;
+        pindexNew->hashMerkleRoot    = rec.hashMerkleRoot;
+        pindexNew->nChainWork        = rec.nChainWork;
+        pindexNew->nMoneySupply      = rec.nMoneySupply;
+        pindexNew->nHeight           = rec.nHeight;
+        pindexNew->nFile             = rec.nFile;
+        pindexNew->nDataPos          = rec.nDataPos;
+        pindexNew->nUndoPos          = rec.nUndoPos;
+        pindexNew->nWorkTransition   = rec.nWorkTransition;
+        pindexNew->nPrimeChainType   = rec.nPrimeChainType;
+        pindexNew->nPrimeChainLength = rec.nPrimeChainLength;
+        pindexNew->nTx               = rec.nTx;
+        pindexNew->nChainTx          = rec.nChainTx;
+        pindexNew->nStatus           = rec.nStatus;
+        pindexNew->nVersion          = rec.nVersion;
+        pindexNew->nTime             = rec.nTime;
+        pindexNew->nBits             = rec.nBits;
+        pindexNew->nNonce            = rec.nNonce;
+        if (rec.nMultiplierSize <= CBlockIndexSnapshotRecord::nInlineSize)
+            pindexNew->primeChainMultiplier.assign(rec.pchMultiplier, rec.nMultiplierSize);
+        else
+        {
+            unsigned int nOffset;
+            memcpy(&nOffset, rec.pchMultiplier, sizeof(nOffset));
+            pindexNew->primeChainMultiplier.assign(pchExtra + nOffset, rec.nMultiplierSize);
+        }
+
+        if (pindexGenesisBlock == NULL && rec.hashBlock == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+        if ((pindexNew->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindexNew->nStatus & BLOCK_FAILED_MASK))
+            setBlockIndexValid.insert(setBlockIndexValid.end(), pindexNew);
+    }
+    return true;
+}
+
+static bool LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path pathSnapshot = GetBlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(pathSnapshot))
+        return false;
+    bool fLoaded = false;
+    if (GetBoolArg("-indexsnapshot", true))
+    {
+        try {
+            boost::interprocess::file_mapping mapping(pathSnapshot.string().c_str(), boost::interprocess::read_only);
+            boost::interprocess::mapped_region region(mapping, boost::interprocess::read_only);
+            fLoaded = ReadBlockIndexSnapshot((const unsigned char*)region.get_address(), region.get_size());
+        } catch (std::exception &e) {
+            printf("LoadBlockIndexSnapshot() : %s\n", e.what());
+        }
+    }
+    boost::filesystem::remove(pathSnapshot);
+    printf("LoadBlockIndexSnapshot(): snapshot %s\n", fLoaded ? "loaded" : "discarded");
+    return fLoaded;
+}
+
+// A background write of the coin database that stopped half way left each
+// coin either at the state of block hashFrom or at that of hashTo. Bring
+// them all to hashTo: undo the blocks from hashFrom back to the fork, then
+// apply those up to hashTo again, tolerating coins already at the new state.
+bool ReplayInterruptedWrite()
+{
+    uint256 hashFrom, hashTo;
+    if (!pcoinsTip->GetInterruptedWrite(hashFrom, hashTo))
+        return true;
+    printf("ReplayInterruptedWrite() : finishing the coin database write from %s to %s\n",
+        hashFrom.ToString().c_str(), hashTo.ToString().c_str());
+
+    BlockMap::iterator it = mapBlockIndex.find(hashTo);
+    if (it == mapBlockIndex.end())
+        return error("ReplayInterruptedWrite() : unknown block %s", hashTo.ToString().c_str());
+    CBlockIndex *pindexTo = it->second;
+    CBlockIndex *pindexFrom = NULL;
+    if (hashFrom != 0) {
+        it = mapBlockIndex.find(hashFrom);
+        if (it == mapBlockIndex.end())
+            return error("ReplayInterruptedWrite() : unknown block %s", hashFrom.ToString().c_str());
+        pindexFrom = it->second;
+    }
+
+    CCoinsViewCache view(*pcoinsTip, true);
+    view.SetBestBlock(pindexFrom);
+
+    // Find the fork
+    CBlockIndex* pfork = pindexFrom;
+    CBlockIndex* plonger = pindexTo;
+    while (pfork && pfork != plonger)
+    {
+        while (plonger->nHeight > pfork->nHeight) {
+            plonger = plonger->pprev;
+            assert(plonger != NULL);
+        }
+        if (pfork == plonger)
+            break;
+        pfork = pfork->pprev;
+        assert(pfork != NULL);
+    }
+
+    CValidationState state;
+    for (CBlockIndex *pindex = pindexFrom; pindex != pfork; pindex = pindex->pprev) {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("ReplayInterruptedWrite() : ReadFromDisk for disconnect failed");
+        bool fClean = true;
+        if (!block.DisconnectBlock(state, pindex, view, &fClean))
+            return error("ReplayInterruptedWrite() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
+    }
 
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    vector<CBlockIndex*> vConnect;
+    for (CBlockIndex *pindex = pindexTo; pindex != pfork; pindex = pindex->pprev)
+        vConnect.push_back(pindex);
+    reverse(vConnect.begin(), vConnect.end());
+    BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("ReplayInterruptedWrite() : ReadFromDisk for connect failed");
+        // the genesis coinbase is unspendable and never added
+        if (pindex->GetBlockHash() != hashGenesisBlock) {
+            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+                if (!tx.IsCoinBase()) {
+                    BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                        const COutPoint &prevout = txin.prevout;
+                        if (view.HaveCoins(prevout.hash) && view.AccessCoins(prevout.hash).IsAvailable(prevout.n))
+                            view.GetCoins(prevout.hash).Spend(prevout.n);
+                    }
+                }
+                view.SetCoins(tx.GetHash(), CCoins(tx, pindex->nHeight));
+            }
+        }
+        view.SetBestBlock(pindex);
+    }
 
-    return pindexNew;
+    if (!view.Flush() || !pcoinsTip->Flush())
+        return error("ReplayInterruptedWrite() : failed to write coin database");
+    return true;
 }
 
 bool static LoadBlockIndexDB()
 {
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+    int64 nStart = GetTimeMillis();
+    if (!LoadBlockIndexSnapshot())
+    {
+        if (!pblocktree->LoadBlockIndexGuts())
+            return false;
 
-    boost::this_thread::interruption_point();
+        boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
-        pindex->nWorkTransition = EstimateWorkTransition((pindex->pprev ? pindex->pprev->nWorkTransition : TargetGetInitial()), pindex->nBits, pindex->nPrimeChainLength);
-        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
-            setBlockIndexValid.insert(pindex);
+        // Calculate nChainWork. LoadBlockIndexGuts left the work of each
+        // block alone in it; it is summed up with the entries in height order.
+        vector<CBlockIndex*> vSortedByHeight;
+        GetBlockIndexByHeight(vSortedByHeight);
+        BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
+        {
+            if (pindex->pprev)
+                pindex->nChainWork += pindex->pprev->nChainWork;
+            pindex->nWorkTransition = EstimateWorkTransition((pindex->pprev ? pindex->pprev->nWorkTransition : TargetGetInitial()), pindex->nBits, pindex->nPrimeChainLength);
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            // Mostly in increasing work, so the hint spares the search
+            if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+                setBlockIndexValid.insert(setBlockIndexValid.end(), pindex);
+        }
     }
+    printf("LoadBlockIndexDB(): %"PRIszu" entries, %"PRI64u" kB in memory, loaded in %"PRI64d"ms\n",
+           mapBlockIndex.size(), GetBlockIndexMemoryUsage() / 1024, GetTimeMillis() - nStart);
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -2604,6 +3853,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Finish a write of the coin database that was cut short
+    if (!ReplayInterruptedWrite())
+        return false;
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -2656,6 +3909,15 @@ bool VerifyDB() {
         // check level 1: verify block validity
         if (nCheckLevel >= 1 && !block.CheckBlock(state))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        // primecoin: and its proof-of-work against the block index, which has
+        // no chain type for a block connected as assumed valid
+        if (nCheckLevel >= 1 && !IsAssumedValid(pindex)) {
+            unsigned int nChainType = 0;
+            unsigned int nChainLength = 0;
+            if (!CheckProofOfWorkCached(block, nChainType, nChainLength) ||
+                (pindex->nPrimeChainType != 0 && (nChainType != pindex->nPrimeChainType || nChainLength != pindex->nPrimeChainLength)))
+                return error("VerifyDB() : *** found bad proof-of-work at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        }
         // check level 2: verify undo validity
         if (nCheckLevel >= 2 && pindex) {
             CBlockUndo undo;
@@ -2666,7 +3928,7 @@ bool VerifyDB() {
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheUsage() + pcoinsTip->GetCacheUsage()) <= 2*nCoinCacheUsage + 32000*300) {
             bool fClean = true;
             if (!block.DisconnectBlock(state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2710,6 +3972,13 @@ void UnloadBlockIndex()
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+    pindexAssumeValid = NULL;
+    vAssumeValidChain.clear();
+    vHeadersDeferred.clear();
+    mapHeaderIndex.clear();
+    mapHeaderChildren.clear();
+    pindexBestHeader = NULL;
+    vHeaderChain.clear();
 }
 
 bool LoadBlockIndex()
@@ -2731,6 +4000,8 @@ bool LoadBlockIndex()
     //
     // Load block index from databases
     //
+    if (fReindex)
+        boost::filesystem::remove(GetBlockIndexSnapshotPath());
     if (!fReindex && !LoadBlockIndexDB())
         return false;
 
@@ -2828,7 +4099,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2894,6 +4165,23 @@ void PrintBlockTree()
     }
 }
 
+// Process the oldest block read ahead from a block file
+// Return value: false on a system error
+bool static ProcessExternalBlock(std::deque<std::pair<uint64, CBlock> >& vPending, CDiskBlockPos *dbp, int& nLoaded)
+{
+    CBlock block;
+    uint64 nBlockPos = vPending.front().first;
+    std::swap(block, vPending.front().second);
+    vPending.pop_front();
+    LOCK(cs_main);
+    if (dbp)
+        dbp->nPos = nBlockPos;
+    CValidationState state;
+    if (ProcessBlock(state, NULL, &block, dbp))
+        nLoaded++;
+    return !state.IsError();
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
@@ -2911,6 +4199,10 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             }
         }
         uint64 nRewind = blkdat.GetPos();
+        // Primecoin: blocks read ahead while their proof-of-work is checked
+        unsigned int nLookahead = powcheckqueue.GetLookahead();
+        std::deque<std::pair<uint64, CBlock> > vPending;
+        bool fError = false;
         while (blkdat.good() && !blkdat.eof()) {
             boost::this_thread::interruption_point();
 
@@ -2944,19 +4236,25 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 
                 // process block
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
+                    powcheckqueue.Add(block);
+                    vPending.push_back(make_pair(nBlockPos, block));
+                    if (vPending.size() > nLookahead && !ProcessExternalBlock(vPending, dbp, nLoaded)) {
+                        fError = true;
                         break;
+                    }
                 }
             } catch (std::exception &e) {
                 printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
         }
+        while (!fError && !vPending.empty()) {
+            try {
+                if (!ProcessExternalBlock(vPending, dbp, nLoaded))
+                    break;
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+        }
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3108,7 +4406,7 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     CBlock block;
@@ -3200,7 +4498,7 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
     if (fDebug)
@@ -3511,7 +4809,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3526,7 +4824,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3536,6 +4834,66 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         }
         pfrom->PushMessage("headers", vHeaders);
     }
+
+
+    else if (strCommand == "headers" && !fImporting && !fReindex)
+    {
+        // Headers come as CBlocks, with an empty transaction list
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+        pfrom->nHeadersRequestTime = 0;
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            // Headers not connecting to ours, ask from our best header
+            if (!FindHeaderIndex(header.hashPrevBlock) && !FindHeaderIndex(header.GetHash()))
+            {
+                pfrom->PushGetHeaders(GetBestHeader(), uint256(0));
+                return true;
+            }
+            CValidationState state;
+            if (!AcceptBlockHeader(header, state, &pindexLast))
+            {
+                int nDoS = 0;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                return true;
+            }
+        }
+        if (fDebug && pindexLast)
+            printf("received %"PRIszu" headers up to height %d, best header height %d\n", vHeaders.size(), pindexLast->nHeight, GetBestHeader()->nHeight);
+
+        // A full message means the peer has more
+        if (pindexLast && vHeaders.size() == MAX_HEADERS_RESULTS)
+            pfrom->PushGetHeaders(pindexLast, uint256(0));
+    }
+
+
+    else if (strCommand == "notfound")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        if (vInv.size() > MAX_INV_SZ)
+        {
+            pfrom->Misbehaving(20);
+            return error("message notfound size() = %"PRIszu"", vInv.size());
+        }
+        // Let another peer have the blocks this one does not
+        BOOST_FOREACH(const CInv& inv, vInv)
+        {
+            if (inv.type != MSG_BLOCK)
+                continue;
+            std::map<uint256, CBlockRequest>::iterator mi = mapBlockRequests.find(inv.hash);
+            if (mi != mapBlockRequests.end() && mi->second.pnode == pfrom)
+                MarkBlockReceived(inv.hash);
+        }
+    }
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3628,13 +4986,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        MarkBlockReceived(inv.hash);
         CValidationState state;
         if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
             mapAlreadyAskedFor.erase(inv);
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
             if (nDoS > 0)
+            {
                 pfrom->Misbehaving(nDoS);
+                if (!state.CorruptionPossible())
+                    InvalidHeaderFound(inv.hash, pfrom);
+            }
     }
 
 
@@ -3856,6 +5219,48 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        // Primecoin: check the proof-of-work of this and the next blocks from
+        // the peer on the checking threads, and wait for this one out of cs_main
+        if (strCommand == "block" && !fImporting && !fReindex)
+        {
+            unsigned int nLookahead = powcheckqueue.GetLookahead();
+            std::deque<CNetMessage>::iterator itAhead = it;
+            CBlockHeader header;
+            if (nLookahead > 0 && GetBlockMessageHeader(msg, header))
+            {
+                powcheckqueue.Add(header);
+                for (; itAhead != pfrom->vRecvMsg.end() && nLookahead > 1; ++itAhead, nLookahead--)
+                {
+                    CBlockHeader headerAhead;
+                    if (GetBlockMessageHeader(*itAhead, headerAhead))
+                        powcheckqueue.Add(headerAhead);
+                }
+                powcheckqueue.Wait(header.GetHash());
+            }
+        }
+
+        // Primecoin: same for the headers from the peer, a few ahead of the
+        // one waited for, stopping at the first that fails; headers failing
+        // the cheaper checks are not worth checking at all
+        if (strCommand == "headers" && !fImporting && !fReindex)
+        {
+            unsigned int nLookahead = powcheckqueue.GetLookahead(true);
+            vector<CBlock> vHeaders;
+            if (nLookahead > 0 && GetHeadersMessageHeaders(msg, vHeaders))
+            {
+                vector<CBlockHeader> vCheck;
+                CheckHeadersContext(vHeaders, vCheck);
+                unsigned int nAdded = 0;
+                for (unsigned int i = 0; i < vCheck.size(); i++)
+                {
+                    for (; nAdded < vCheck.size() && nAdded < i + nLookahead; nAdded++)
+                        powcheckqueue.Add(vCheck[nAdded]);
+                    if (!powcheckqueue.Wait(vCheck[i].GetHash()))
+                        break;
+                }
+            }
+        }
+
         // Process message
         bool fRet = false;
         try
@@ -3925,11 +5330,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
 
         // Start block sync
+        bool fHeadersFirst = GetBoolArg("-headersfirst", true);
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
+            if (fHeadersFirst)
+                pto->PushGetHeaders(GetBestHeader(), uint256(0));
+            else
+                pto->PushGetBlocks(pindexBest, uint256(0));
+        }
+
+        // Fall back to getblocks with a peer not answering getheaders
+        if (pto->nHeadersRequestTime && GetTime() - pto->nHeadersRequestTime > 2 * BLOCK_STALLING_TIMEOUT) {
+            printf("peer=%s not answering getheaders, requesting blocks\n", pto->addrName.c_str());
+            pto->nHeadersRequestTime = 0;
             pto->PushGetBlocks(pindexBest, uint256(0));
         }
 
+        // Download the blocks of the best header chain in parallel
+        if (fHeadersFirst && !fImporting && !fReindex)
+            ScheduleBlockDownload(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -4288,7 +5708,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
                     nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
+                const CCoins &coins = view.AccessCoins(txin.prevout.hash);
 
                 int64 nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
@@ -4438,6 +5858,15 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
 }
 
 
+// Coinbase input script with the height and extranonce of a block
+CScript static GetCoinbaseScriptSig(unsigned int nHeight, const CBigNum& bnExtraNonce)
+{
+    const char* pszDedication = mapArgs.count("-dedication")? mapArgs["-dedication"].c_str() : "";
+    CScript scriptSig = (CScript() << nHeight << bnExtraNonce << vector<unsigned char>((const unsigned char*)pszDedication, (const unsigned char*)pszDedication + strlen(pszDedication))) + COINBASE_FLAGS;
+    assert(scriptSig.size() <= 100);
+    return scriptSig;
+}
+
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -4449,9 +5878,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    const char* pszDedication = mapArgs.count("-dedication")? mapArgs["-dedication"].c_str() : "";
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce) << vector<unsigned char>((const unsigned char*)pszDedication, (const unsigned char*)pszDedication + strlen(pszDedication))) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].vin[0].scriptSig = GetCoinbaseScriptSig(nHeight, CBigNum(nExtraNonce));
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -4540,45 +5967,198 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+// Primecoin: primemeter counters shared by all mining threads
+static CCriticalSection cs_primemeter;
+static int64 nPrimeCounter;
+static int64 nSieveCounter;
+static int64 nTestCounter;
+static double dChainExpected;
+
+// Primecoin: account expected chains in the primemeter
+void static PrimeMeterAddChainExpected(double dRoundChainExpected)
+{
+    LOCK(cs_primemeter);
+    dChainExpected += dRoundChainExpected;
+}
+
+// Primecoin: count primes, tests and sieves and refresh the primemeter once a minute
+void static PrimeMeterUpdate(unsigned int nPrimesHit, unsigned int nTests, bool fNewSieve)
+{
+    LOCK(cs_primemeter);
+    if (nHPSTimerStart == 0)
+    {
+        nHPSTimerStart = GetTimeMillis();
+        nPrimeCounter = 0;
+        nSieveCounter = 0;
+        nTestCounter = 0;
+        dChainExpected = 0;
+    }
+    else
+    {
+        nPrimeCounter += nPrimesHit;
+        nTestCounter += nTests;
+        if (fNewSieve)
+            nSieveCounter++;
+    }
+    if (GetTimeMillis() - nHPSTimerStart > 60000)
+    {
+        double dPrimesPerMinute = 60000.0 * nPrimeCounter / (GetTimeMillis() - nHPSTimerStart);
+        dPrimesPerSec = dPrimesPerMinute / 60.0;
+        double dTestsPerMinute = 60000.0 * nTestCounter / (GetTimeMillis() - nHPSTimerStart);
+        double dSievesPerHour = 3600000.0 * nSieveCounter / (GetTimeMillis() - nHPSTimerStart);
+        dChainsPerDay = 86400000.0 * dChainExpected / (GetTimeMillis() - nHPSTimerStart);
+        nHPSTimerStart = GetTimeMillis();
+        nPrimeCounter = 0;
+        nSieveCounter = 0;
+        nTestCounter = 0;
+        dChainExpected = 0;
+        static int64 nLogTime = 0;
+        if (GetTime() - nLogTime > 60)
+        {
+            nLogTime = GetTime();
+            printf("%s primemeter %9.0f prime/h %9.0f test/h %6.0f sieve/h %3.6f chain/d\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nLogTime).c_str(), dPrimesPerMinute * 60.0, dTestsPerMinute * 60.0, dSievesPerHour, dChainsPerDay);
+        }
+    }
+}
+
+// Primecoin: put the extranonce of a mining thread into a block copied from
+// a shared template. The thread number keeps the coinbases of the threads
+// apart, and the merkle root is updated along the coinbase branch only.
+void SetTemplateExtraNonce(CBlock& block, const CMinerBlockTemplate& blocktemplate, unsigned int nThread, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = blocktemplate.pindexPrev->nHeight + 1; // Height first in coinbase required for block.version=2
+    block.vtx[0].vin[0].scriptSig = GetCoinbaseScriptSig(nHeight, CBigNum(((uint64) nThread << 32) | nExtraNonce));
+    block.hashMerkleRoot = CBlock::CheckMerkleBranch(block.vtx[0].GetHash(), blocktemplate.vCoinbaseBranch, 0);
+}
+
+// Primecoin: placement of the mining threads
+//
+// Each mining thread is pinned to a CPU, spreading the threads over the NUMA
+// nodes and over the cores of a node before their second hardware threads.
+// A pinned thread allocates its sieve and scratch memory itself, so the
+// kernel's first touch policy keeps them on its node, and it sieves with the
+// replica of the prime table on its node. -genaffinity=<cpus> gives the CPUs
+// to use in turn instead, and -genaffinity=0 leaves the threads unpinned.
+
+struct CMinerPlacement
+{
+    int nCpu; // CPU the thread is pinned to, -1 if not pinned
+    int nNode; // NUMA node with the prime table of the thread, -1 for the shared one
+
+    CMinerPlacement() : nCpu(-1), nNode(-1) {}
+};
+
+void static GetMinerPlacement(int nThreads, std::vector<CMinerPlacement>& vPlacement)
+{
+    vPlacement.assign(nThreads, CMinerPlacement());
+    string strAffinity = GetArg("-genaffinity", "");
+    if (strAffinity == "0")
+        return;
+
+    std::vector<std::vector<int> > vNodeCpus;
+    GetCpuTopology(vNodeCpus);
+    std::vector<CMinerPlacement> vOrder;
+    if (strAffinity == "" || strAffinity == "1")
+    {
+        // One CPU of each node in turn
+        for (unsigned int nRound = 0; ; nRound++)
+        {
+            unsigned int nPlaced = vOrder.size();
+            for (unsigned int nNode = 0; nNode < vNodeCpus.size(); nNode++)
+            {
+                if (nRound >= vNodeCpus[nNode].size())
+                    continue;
+                CMinerPlacement placement;
+                placement.nCpu = vNodeCpus[nNode][nRound];
+                placement.nNode = nNode;
+                vOrder.push_back(placement);
+            }
+            if (vOrder.size() == nPlaced)
+                break;
+        }
+    }
+    else
+    {
+        std::vector<int> vCpus;
+        if (!ParseCpuList(strAffinity, vCpus))
+        {
+            printf("PrimecoinMiner : invalid -genaffinity=%s, threads left unpinned\n", strAffinity.c_str());
+            return;
+        }
+        BOOST_FOREACH(int nCpu, vCpus)
+        {
+            CMinerPlacement placement;
+            placement.nCpu = nCpu;
+            for (unsigned int nNode = 0; nNode < vNodeCpus.size(); nNode++)
+                if (std::find(vNodeCpus[nNode].begin(), vNodeCpus[nNode].end(), nCpu) != vNodeCpus[nNode].end())
+                    placement.nNode = nNode;
+            vOrder.push_back(placement);
+        }
+    }
+    if (vOrder.empty())
+        return;
+
+    // Replicate the prime table only across more than one node
+    bool fReplicate = (vNodeCpus.size() > 1);
+    string strPlacement;
+    for (int i = 0; i < nThreads; i++)
+    {
+        vPlacement[i] = vOrder[i % vOrder.size()];
+        if (!fReplicate)
+            vPlacement[i].nNode = -1;
+        strPlacement += (vPlacement[i].nNode >= 0)? strprintf(" %d/%d", vPlacement[i].nCpu, vPlacement[i].nNode) : strprintf(" %d", vPlacement[i].nCpu);
+    }
+    printf("PrimecoinMiner placement (cpu%s):%s\n", fReplicate? "/node" : "", strPlacement.c_str());
+}
+
+// Pin a mining thread to its CPU and use the prime table of its node
+void static SetMinerPlacement(const CMinerPlacement& placement)
+{
+    if (placement.nCpu >= 0 && !SetThreadAffinity(placement.nCpu))
+        printf("PrimecoinMiner : failed to pin thread to cpu %d\n", placement.nCpu);
+    SetPrimeTableNode(placement.nNode);
+}
+
+void static BitcoinMiner(CWallet *pwallet, boost::shared_ptr<CMinerTemplateProducer> pproducer, unsigned int nThread, CMinerPlacement placement)
 {
     printf("PrimecoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("primecoin-miner");
+    SetMinerPlacement(placement);
 
     // Primecoin miner
     if (pminer.get() == NULL)
         pminer.reset(new CPrimeMiner()); // init miner control object
+    miningstats.Register(pminer->pstats);
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
+    // Each thread has its own extranonce in the shared templates
     unsigned int nExtraNonce = 0;
+    uint64 nGeneration = 0;
 
     double dTimeExpected = 0;   // time expected to prime chain (micro-second)
-    double dTimeExpectedPrev = 0; // time expected to prime chain last time
-    bool fIncrementPrimorial = true; // increase or decrease primorial factor
 
     try { loop {
         while (vNodes.empty())
             MilliSleep(1000);
 
-        //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrev = pindexBest;
-
 	// pindexBest may be NULL (e.g. when doing a -reindex)
-	if (!pindexPrev) {
+	if (!pindexBest) {
 		MilliSleep(1000);
 		continue;
 	}
 
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(reservekey));
-        if (!pblocktemplate.get())
+        //
+        // Derive new block from the shared template
+        //
+        boost::shared_ptr<const CMinerBlockTemplate> ptemplate = pproducer->GetTemplate();
+        if (!ptemplate)
             return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+        nExtraNonce = (ptemplate->nGeneration == nGeneration)? nExtraNonce + 1 : 1;
+        nGeneration = ptemplate->nGeneration;
+        CBlock block(ptemplate->blocktemplate.block);
+        CBlock *pblock = &block;
+        SetTemplateExtraNonce(*pblock, *ptemplate, nThread, nExtraNonce);
 
         if (fDebug && GetBoolArg("-printmining"))
             printf("Running PrimecoinMiner with %"PRIszu" transactions in block (%u bytes)\n", pblock->vtx.size(),
@@ -4587,26 +6167,19 @@ void static BitcoinMiner(CWallet *pwallet)
         //
         // Search
         //
-        int64 nStart = GetTime();
         bool fNewBlock = true;
         unsigned int nTriedMultiplier = 0;
 
         // Primecoin: try to find hash that is probable prime
-        do
-        {
-            uint256 hashBlockHeader = pblock->GetHeaderHash();
-            if (hashBlockHeader < hashBlockHeaderLimit)
-                continue; // must meet minimum requirement
-            if (ProbablePrimalityTestWithTrialDivision(CBigNum(hashBlockHeader), 1000))
-                break;
-        } while (++(pblock->nNonce) < 0xffff0000);
-        if (pblock->nNonce >= 0xffff0000)
+        if (!SearchProbablePrimeHeader(*pblock, 0xffff0000))
             continue;
         // Primecoin: primorial fixed multiplier
         CBigNum bnPrimorial;
         unsigned int nRoundTests = 0;
         unsigned int nRoundPrimesHit = 0;
         int64 nPrimeTimerStart = GetTimeMicros();
+        CPrimeMinerProfile profile = minertuner.GetProfile();
+        pminer->SetProfile(profile);
         Primorial(pminer->nPrimorialMultiplier, bnPrimorial);
 
         loop
@@ -4619,7 +6192,7 @@ void static BitcoinMiner(CWallet *pwallet)
             if (MineProbablePrimeChain(*pblock, bnPrimorial, fNewBlock, nTriedMultiplier, nProbableChainLength, nTests, nPrimesHit))
             {
                 SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                CheckWork(pblock, *pwalletMain, reservekey);
+                pproducer->CheckWork(pblock, *pwallet);
                 SetThreadPriority(THREAD_PRIORITY_LOWEST);
                 break;
             }
@@ -4627,51 +6200,7 @@ void static BitcoinMiner(CWallet *pwallet)
             nRoundPrimesHit += nPrimesHit;
 
             // Meter primes/sec
-            static int64 nPrimeCounter;
-            static int64 nSieveCounter;
-            static int64 nTestCounter;
-            static double dChainExpected;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nPrimeCounter = 0;
-                nSieveCounter = 0;
-                nTestCounter = 0;
-                dChainExpected = 0;
-            }
-            else
-            {
-                nPrimeCounter += nPrimesHit;
-                nTestCounter += nTests;
-                if (fNewBlock)
-                    nSieveCounter++;
-            }
-            if (GetTimeMillis() - nHPSTimerStart > 60000)
-            {
-                static CCriticalSection cs;
-                {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 60000)
-                    {
-                        double dPrimesPerMinute = 60000.0 * nPrimeCounter / (GetTimeMillis() - nHPSTimerStart);
-                        dPrimesPerSec = dPrimesPerMinute / 60.0;
-                        double dTestsPerMinute = 60000.0 * nTestCounter / (GetTimeMillis() - nHPSTimerStart);
-                        double dSievesPerHour = 3600000.0 * nSieveCounter / (GetTimeMillis() - nHPSTimerStart);
-                        dChainsPerDay = 86400000.0 * dChainExpected / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nPrimeCounter = 0;
-                        nSieveCounter = 0;
-                        nTestCounter = 0;
-                        dChainExpected = 0;
-                        static int64 nLogTime = 0;
-                        if (GetTime() - nLogTime > 60)
-                        {
-                            nLogTime = GetTime();
-                            printf("%s primemeter %9.0f prime/h %9.0f test/h %6.0f sieve/h %3.6f chain/d\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nLogTime).c_str(), dPrimesPerMinute * 60.0, dTestsPerMinute * 60.0, dSievesPerHour, dChainsPerDay);
-                        }
-                    }
-                }
-            }
+            PrimeMeterUpdate(nPrimesHit, nTests, fNewBlock);
 
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
@@ -4679,10 +6208,16 @@ void static BitcoinMiner(CWallet *pwallet)
                 break;
             if (pblock->nNonce >= 0xffff0000)
                 break;
-            if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 10)
+            if (CMinerTemplateProducer::HasNewTransactions(*ptemplate))
                 break;
             if (pindexPrev != pindexBest)
+            {
+                // Primecoin: the rest of the round is lost to the new block
+                CPrimeMinerCounters counters;
+                counters.nStaleTime = GetTimeMicros() - nPrimeTimerStart;
+                pminer->pstats->Add(counters);
                 break;
+            }
             if (fNewBlock)
             {
                 // Primecoin: a sieve+primality round completes
@@ -4696,42 +6231,25 @@ void static BitcoinMiner(CWallet *pwallet)
                     dTimeExpected = dTimeExpected / max(0.01, dPrimeProbability);
                     dRoundChainExpected *= dPrimeProbability;
                 }
-                dChainExpected += dRoundChainExpected;
+                PrimeMeterAddChainExpected(dRoundChainExpected);
+                minertuner.AddRound(profile, nRoundTime, dRoundChainExpected);
                 if (fDebug && GetBoolArg("-printmining"))
                     printf("PrimecoinMiner() : Round primorial=%u tests=%u primes=%u time=%uus pprob=%1.6f tochain=%6.3fd expect=%3.9f\n", pminer->nPrimorialMultiplier, nRoundTests, nRoundPrimesHit, (unsigned int) nRoundTime, dPrimeProbability, ((dTimeExpected/1000000.0))/86400.0, dRoundChainExpected);
 
                 // Primecoin: update time and nonce
                 pblock->nTime = max(pblock->nTime, (unsigned int) GetAdjustedTime());
-                while (++(pblock->nNonce) < 0xffff0000)
-                {
-                    uint256 hashBlockHeader = pblock->GetHeaderHash();
-                    if (hashBlockHeader < hashBlockHeaderLimit)
-                        continue; // must meet minimum requirement
-                    if (ProbablePrimalityTestWithTrialDivision(CBigNum(hashBlockHeader), 1000))
-                        break;
-                }
-                if (pblock->nNonce >= 0xffff0000)
+                pblock->nNonce++;
+                if (!SearchProbablePrimeHeader(*pblock, 0xffff0000))
                     break;
 
                 // Primecoin: reset sieve+primality round timer
                 nRoundTests = 0;
                 nRoundPrimesHit = 0;
                 nPrimeTimerStart = GetTimeMicros();
-                if (dTimeExpected > dTimeExpectedPrev)
-                    fIncrementPrimorial = !fIncrementPrimorial;
-                dTimeExpectedPrev = dTimeExpected;
 
-                // Primecoin: dynamic adjustment of primorial multiplier
-                if (fIncrementPrimorial)
-                {
-                    if (!PrimeTableGetNextPrime(pminer->nPrimorialMultiplier))
-                        error("PrimecoinMiner() : primorial increment overflow");
-                }
-                else if (pminer->nPrimorialMultiplier > nPrimorialMultiplierMin)
-                {
-                    if (!PrimeTableGetPreviousPrime(pminer->nPrimorialMultiplier))
-                        error("PrimecoinMiner() : primorial decrement overflow");
-                }
+                // Primecoin: mine the next round with the tuner's profile
+                profile = minertuner.GetProfile();
+                pminer->SetProfile(profile);
                 Primorial(pminer->nPrimorialMultiplier, bnPrimorial);
             }
         }
@@ -4744,6 +6262,167 @@ void static BitcoinMiner(CWallet *pwallet)
     }
 }
 
+// Primecoin: pipelined mining
+//
+// With -genpipeline the mining threads are split into sieve threads and
+// primality test threads. Each sieve thread builds block templates, finds
+// probable prime header hashes and weaves one sieve at a time, handing its
+// candidates in batches to the testers through a bounded queue. A full queue
+// holds the sieve threads back until the testers catch up. Work for a stale
+// pindexBest is dropped by the testers as soon as they see it.
+
+void static PrimeSieveWorker(boost::shared_ptr<CMinerTemplateProducer> pproducer, boost::shared_ptr<CPrimeMiningPipeline> ppipeline, unsigned int nThread, CMinerPlacement placement)
+{
+    printf("PrimecoinMiner sieve started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("primecoin-sieve");
+    SetMinerPlacement(placement);
+
+    // Primecoin miner
+    if (pminer.get() == NULL)
+        pminer.reset(new CPrimeMiner()); // init miner control object
+    pminer->pstats->strName = "sieve";
+    miningstats.Register(pminer->pstats);
+
+    unsigned int nExtraNonce = 0;
+    uint64 nGeneration = 0;
+
+    try { loop {
+        while (vNodes.empty())
+            MilliSleep(1000);
+        if (!pindexBest) {
+            MilliSleep(1000);
+            continue;
+        }
+
+        //
+        // Derive new block from the shared template
+        //
+        boost::shared_ptr<const CMinerBlockTemplate> ptemplate = pproducer->GetTemplate();
+        if (!ptemplate)
+            return;
+        CBlockIndex* pindexPrev = ptemplate->pindexPrev;
+        nExtraNonce = (ptemplate->nGeneration == nGeneration)? nExtraNonce + 1 : 1;
+        nGeneration = ptemplate->nGeneration;
+        CBlock block(ptemplate->blocktemplate.block);
+        CBlock *pblock = &block;
+        SetTemplateExtraNonce(*pblock, *ptemplate, nThread, nExtraNonce);
+
+        while (SearchProbablePrimeHeader(*pblock, 0xffff0000))
+        {
+            // Primecoin: weave the sieve with the tuner's profile and the
+            // testers' measured test cost
+            CPrimeMinerProfile profile = minertuner.GetProfile();
+            pminer->SetProfile(profile);
+            boost::shared_ptr<CPrimeSieveRound> pround(new CPrimeSieveRound());
+            pround->block = *pblock;
+            pround->pindexPrev = pindexPrev;
+            Primorial(pminer->nPrimorialMultiplier, pround->bnFixedMultiplier);
+            int64 nPrimalityTestCost = ppipeline->GetPrimalityTestCost();
+            pminer->SetPrimalityTestCost(nPrimalityTestCost);
+
+            // Hand the candidates to the testers, waiting while the queue is full
+            int64 nRoundStart = GetTimeMicros();
+            unsigned int nCandidateCount = 0;
+            int64 nWeaveTime = 0;
+            bool fSieveDone = QueueMiningSieve(*ppipeline, pround, nCandidateCount, nWeaveTime);
+            PrimeMeterUpdate(0, 0, true);
+
+            // Primecoin: estimate time to block from the weave time and the
+            // test time of the candidates
+            double dTimeExpected = (double) (nWeaveTime + nCandidateCount * nPrimalityTestCost) / max(1u, nCandidateCount);
+            double dRoundChainExpected = (double) nCandidateCount;
+            for (unsigned int n = 0; n < TargetGetLength(pblock->nBits); n++)
+            {
+                dTimeExpected = dTimeExpected / max(0.01, pround->dPrimeProbability);
+                dRoundChainExpected *= pround->dPrimeProbability;
+            }
+            if (fDebug && GetBoolArg("-printmining"))
+                printf("PrimeSieveWorker() : Round primorial=%u candidates=%u weave=%uus test cost=%uus queued=%u tochain=%6.3fd\n", pminer->nPrimorialMultiplier, nCandidateCount, (unsigned int) nWeaveTime, (unsigned int) nPrimalityTestCost, ppipeline->queue.Size(), ((dTimeExpected/1000000.0))/86400.0);
+
+            // Primecoin: the time of a whole round includes waiting for the
+            // testers, so the tuner sees the throughput of the pipeline
+            if (fSieveDone)
+                minertuner.AddRound(profile, GetTimeMicros() - nRoundStart, dRoundChainExpected);
+            else
+            {
+                // Primecoin: the candidates left in the sieve are lost to the new block
+                CPrimeMinerCounters counters;
+                counters.nStaleTime = GetTimeMicros() - nRoundStart;
+                pminer->pstats->Add(counters);
+            }
+
+            // Check for stop or if block needs to be rebuilt
+            boost::this_thread::interruption_point();
+            if (vNodes.empty())
+                break;
+            if (CMinerTemplateProducer::HasNewTransactions(*ptemplate))
+                break;
+            if (pindexPrev != pindexBest)
+                break;
+
+            // Primecoin: update time and nonce
+            pblock->nTime = max(pblock->nTime, (unsigned int) GetAdjustedTime());
+            pblock->nNonce++;
+        }
+    } }
+    catch (boost::thread_interrupted)
+    {
+        printf("PrimecoinMiner sieve terminated\n");
+        throw;
+    }
+}
+
+void static PrimeTestWorker(CWallet *pwallet, boost::shared_ptr<CMinerTemplateProducer> pproducer, boost::shared_ptr<CPrimeMiningPipeline> ppipeline, CMinerPlacement placement)
+{
+    printf("PrimecoinMiner tester started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("primecoin-tester");
+    SetMinerPlacement(placement);
+
+    CPrimeCandidateBatch batch;
+    boost::shared_ptr<CPrimeMinerStats> pstats(new CPrimeMinerStats("tester"));
+    miningstats.Register(pstats);
+
+    try { loop {
+        ppipeline->queue.Pop(batch);
+        if (batch.pround->pindexPrev != pindexBest)
+            continue; // stale, drop it
+
+        // Primecoin: test the candidates side by side, giving up as soon as
+        // the best chain moves on
+        CPrimeMinerCounters counters;
+        unsigned int nTests = 0;
+        unsigned int nPrimesHit = 0;
+        double dBatchChainExpected = 0;
+        CBlock block;
+        int64 nStart = GetTimeMicros();
+        bool fFound = TestMiningCandidates(batch, counters, nTests, nPrimesHit, dBatchChainExpected, block);
+        if (fFound)
+        {
+            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+            pproducer->CheckWork(&block, *pwallet);
+            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+        }
+        int64 nBatchTime = GetTimeMicros() - nStart;
+        if (nTests > 0 && !fFound)
+            ppipeline->UpdatePrimalityTestCost(nBatchTime / nTests);
+        counters.nTestTime = nBatchTime;
+        if (nTests < batch.vMultipliers.size() && !fFound)
+            counters.nStaleTime = nBatchTime; // the rest of the batch went stale
+        pstats->Add(counters);
+
+        // Meter primes/sec
+        PrimeMeterUpdate(nPrimesHit, nTests, false);
+        PrimeMeterAddChainExpected(dBatchChainExpected);
+    } }
+    catch (boost::thread_interrupted)
+    {
+        printf("PrimecoinMiner tester terminated\n");
+        throw;
+    }
+}
+
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
 {
     static boost::thread_group* minerThreads = NULL;
@@ -4763,8 +6442,30 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet)
         return;
 
     minerThreads = new boost::thread_group();
+    minertuner.Init(nThreads);
+    miningstats.Reset();
+    boost::shared_ptr<CMinerTemplateProducer> pproducer(new CMinerTemplateProducer(pwallet));
+    std::vector<CMinerPlacement> vPlacement;
+    GetMinerPlacement(nThreads, vPlacement);
+    if (GetBoolArg("-genpipeline") && nThreads >= 2)
+    {
+        // Primecoin: split the threads into sieve threads and testers,
+        // -genpipeline testers per sieve thread
+        int nTestPerSieve = GetArg("-genpipeline", 0);
+        if (nTestPerSieve <= 0)
+            nTestPerSieve = 3;
+        int nSieveThreads = max(1, nThreads / (nTestPerSieve + 1));
+        int nTestThreads = max(1, nThreads - nSieveThreads);
+        printf("PrimecoinMiner pipeline with %d sieve threads and %d test threads\n", nSieveThreads, nTestThreads);
+        boost::shared_ptr<CPrimeMiningPipeline> ppipeline(new CPrimeMiningPipeline(nSieveThreads, nTestThreads));
+        for (int i = 0; i < nSieveThreads; i++)
+            minerThreads->create_thread(boost::bind(&PrimeSieveWorker, pproducer, ppipeline, i, vPlacement[i]));
+        for (int i = 0; i < nTestThreads; i++)
+            minerThreads->create_thread(boost::bind(&PrimeTestWorker, pwallet, pproducer, ppipeline, vPlacement[(nSieveThreads + i) % nThreads]));
+        return;
+    }
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&BitcoinMiner, pwallet, pproducer, i, vPlacement[i]));
 }
 
 // Amount compression:
@@ -4828,10 +6529,12 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        mapHeaderIndex.clear();
+        mapHeaderChildren.clear();
+        BOOST_FOREACH(CBlockIndex* pslab, vBlockIndexSlabs)
+            delete[] pslab;
+        vBlockIndexSlabs.clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
@@ -11,6 +11,7 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "blockmap.h"
 
 #include <list>
 
@@ -62,6 +63,16 @@ static const int COINBASE_MATURITY = 3000;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of headers returned in a "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of blocks past the best block that may be downloaded in parallel */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum number of blocks requested from one peer at a time */
+static const int MAX_BLOCKS_IN_FLIGHT = 16;
+/** Seconds a peer has to deliver a requested block before it is asked from another */
+static const int64 BLOCK_STALLING_TIMEOUT = 60;
+/** Maximum number of headers accepted with their proof-of-work check deferred until the assumed-valid block is indexed */
+static const unsigned int MAX_HEADERS_DEFERRED = 1000000;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -79,7 +90,7 @@ extern CScript COINBASE_FLAGS;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
 extern CBlockIndex* pindexGenesisBlock;
@@ -105,7 +116,8 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern uint256 hashAssumeValid;
+extern size_t nCoinCacheUsage;
 
 // Settings
 extern int64 nTransactionFee;
@@ -149,6 +161,8 @@ bool InitBlockIndex();
 bool LoadBlockIndex();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Write the snapshot of the block index that the next start loads from */
+bool WriteBlockIndexSnapshot();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB();
 /** Print the loaded block tree */
@@ -161,6 +175,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the proof-of-work checking thread */
+void ThreadPowCheck();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
@@ -173,6 +189,8 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength);
+/** Get the prime chain of a block in the index, false if unknown as its proof-of-work was assumed valid; with fCheck it is checked then */
+bool GetBlockPrimeChain(const CBlockIndex* pindex, unsigned int& nChainType, unsigned int& nChainLength, bool fCheck = false);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
 /** Get the number of active peers */
@@ -1628,6 +1646,121 @@ enum BlockStatus {
     BLOCK_FAILED_MASK        =   96
 };
 
+/** Primecoin: prime chain multiplier of a block index entry. It is kept in
+ * its serialized form (see CBigNum::getvch) in a buffer of its own and only
+ * made a CBigNum on demand; the rare ones too long for the buffer go to the
+ * heap. A valid multiplier is at most 220 bytes long.
+ */
+class CCompactMultiplier
+{
+private:
+    enum { nInlineSize = 23, nMaxSize = 255 };
+
+    unsigned char nSize;
+    unsigned char pch[nInlineSize]; // the bytes, or a pointer to them past nInlineSize
+
+public:
+    const unsigned char* data() const
+    {
+        if (nSize <= nInlineSize)
+            return pch;
+        unsigned char* p;
+        memcpy(&p, pch, sizeof(p));
+        return p;
+    }
+
+    void assign(const unsigned char* pbegin, unsigned int nNewSize)
+    {
+        if (nNewSize > nMaxSize)
+            throw std::ios_base::failure("CCompactMultiplier::assign() : multiplier too long");
+        clear();
+        if (nNewSize <= nInlineSize)
+            memcpy(pch, pbegin, nNewSize);
+        else
+        {
+            unsigned char* p = new unsigned char[nNewSize];
+            memcpy(p, pbegin, nNewSize);
+            memcpy(pch, &p, sizeof(p));
+        }
+        nSize = nNewSize;
+    }
+
+    unsigned int size() const
+    {
+        return nSize;
+    }
+
+    CCompactMultiplier()
+    {
+        nSize = 0;
+    }
+
+    CCompactMultiplier(const CCompactMultiplier& b)
+    {
+        nSize = 0;
+        assign(b.data(), b.nSize);
+    }
+
+    CCompactMultiplier& operator=(const CCompactMultiplier& b)
+    {
+        if (this != &b)
+            assign(b.data(), b.nSize);
+        return *this;
+    }
+
+    CCompactMultiplier& operator=(const CBigNum& bn)
+    {
+        std::vector<unsigned char> vch = bn.getvch();
+        assign(vch.empty() ? NULL : &vch[0], vch.size());
+        return *this;
+    }
+
+    ~CCompactMultiplier()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        if (nSize > nInlineSize)
+            delete[] data();
+        nSize = 0;
+    }
+
+    CBigNum GetBigNum() const
+    {
+        CBigNum bn;
+        bn.setvch(std::vector<unsigned char>(data(), data() + nSize));
+        return bn;
+    }
+
+    // Same encoding as CBigNum
+    unsigned int GetSerializeSize(int nType=0, int nVersion=PROTOCOL_VERSION) const
+    {
+        return GetSizeOfCompactSize(nSize) + nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType=0, int nVersion=PROTOCOL_VERSION) const
+    {
+        WriteCompactSize(s, nSize);
+        if (nSize)
+            s.write((const char*)data(), nSize);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType=0, int nVersion=PROTOCOL_VERSION)
+    {
+        uint64 nNewSize = ReadCompactSize(s);
+        if (nNewSize > nMaxSize)
+            throw std::ios_base::failure("CCompactMultiplier::Unserialize() : multiplier too long");
+        unsigned char buf[nMaxSize];
+        if (nNewSize)
+            s.read((char*)buf, nNewSize);
+        assign(buf, nNewSize);
+    }
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block.  pprev and pnext link a path through the
@@ -1683,7 +1816,7 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     unsigned int nNonce;
-	CBigNum bnPrimeChainMultiplier;
+    CCompactMultiplier primeChainMultiplier; // primecoin: see GetPrimeChainMultiplier()
 
     CBlockIndex()
     {
@@ -1708,10 +1841,9 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
-		bnPrimeChainMultiplier = 0;
     }
 
-    CBlockIndex(CBlockHeader& block)
+    CBlockIndex(const CBlockHeader& block)
     {
         phashBlock = NULL;
         pprev = NULL;
@@ -1734,7 +1866,7 @@ public:
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
-		bnPrimeChainMultiplier = block.bnPrimeChainMultiplier;
+        primeChainMultiplier = block.bnPrimeChainMultiplier;
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -1765,10 +1897,15 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
-		block.bnPrimeChainMultiplier = bnPrimeChainMultiplier;
+        block.bnPrimeChainMultiplier = GetPrimeChainMultiplier();
         return block;
     }
 
+    CBigNum GetPrimeChainMultiplier() const
+    {
+        return primeChainMultiplier.GetBigNum();
+    }
+
     uint256 GetBlockHash() const
     {
         return *phashBlock;
@@ -1900,7 +2037,7 @@ public:
         READWRITE(nBits);
         READWRITE(nNonce);
         READWRITE(hashBlock);
-		READWRITE(bnPrimeChainMultiplier);
+        READWRITE(primeChainMultiplier);
     )
 
     uint256 GetBlockHash() const
@@ -2004,7 +2141,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -2057,7 +2194,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2076,7 +2213,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2092,7 +2229,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2166,6 +2303,79 @@ struct CCoinsStats
     CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
 };
 
+/** A CCoins held by a CCoinsViewCache, with its state relative to the parent view. */
+struct CCoinsCacheEntry
+{
+    uint256 txid;
+    CCoins coins;
+    unsigned char nFlags;
+
+    enum
+    {
+        USED = (1 << 0),    // slot holds an entry
+        DIRTY = (1 << 1),   // coins differ from the parent view
+        FRESH = (1 << 2),   // the parent view has no unspent coins for txid
+        RECENT = (1 << 3),  // accessed since the eviction hand last passed
+        PENDING = (1 << 4), // handed out for modification, memory usage not yet counted
+    };
+
+    CCoinsCacheEntry() : nFlags(0) { }
+
+    bool IsUsed() const { return (nFlags & USED) != 0; }
+    bool IsDirty() const { return (nFlags & DIRTY) != 0; }
+    bool IsFresh() const { return (nFlags & FRESH) != 0; }
+};
+
+/** Open-addressing hash table of CCoinsCacheEntry keyed by txid.
+ *  Uses linear probing over a power-of-two slot array, salted like the
+ *  block index, and backward-shift deletion so no tombstones accumulate.
+ *  Inserting and erasing move entries: pointers into the table are only
+ *  valid until the next insert or erase.
+ *  Entries marked dirty are also listed in dirty(), so a flush does not
+ *  have to scan the table. Dirty entries are only erased once a flush has
+ *  written them, which also clears the list. */
+class CCoinsMap
+{
+private:
+    std::vector<CCoinsCacheEntry> vSlots;
+    size_t nMask;
+    size_t nEntries;
+    std::vector<uint256> vDirty;
+
+    size_t GetSlot(const uint256 &txid) const { return CBlockHasher()(txid) & nMask; }
+    void Rehash(size_t nNewSlots);
+
+public:
+    CCoinsMap();
+
+    CCoinsCacheEntry *find(const uint256 &txid);
+    const CCoinsCacheEntry *find(const uint256 &txid) const;
+
+    // Return the entry for txid, adding an empty clean one if there is none
+    CCoinsCacheEntry *insert(const uint256 &txid, bool &fInserted);
+
+    // Remove an entry. An entry from further along the probe sequence may
+    // be moved into the freed slot, so a scan should look at it again.
+    void erase(CCoinsCacheEntry *pentry);
+
+    void clear();
+    void swap(CCoinsMap &other);
+
+    void MarkDirty(CCoinsCacheEntry *pentry);
+    const std::vector<uint256> &dirty() const { return vDirty; }
+    void ClearDirtyList() { std::vector<uint256>().swap(vDirty); }
+
+    size_t size() const { return nEntries; }
+    size_t bucket_count() const { return vSlots.size(); }
+    CCoinsCacheEntry &slot(size_t n) { return vSlots[n]; }
+
+    // Heap memory of the table itself, not counting what the entries own
+    size_t DynamicMemoryUsage() const;
+};
+
+/** Heap memory owned by a CCoins: its vout array and the scripts in it */
+size_t GetCoinsMemoryUsage(const CCoins &coins);
+
 /** Abstract view on the open txout dataset. */
 class CCoinsView
 {
@@ -2183,11 +2393,22 @@ public:
     // Retrieve the block index whose state this CCoinsView currently represents
     virtual CBlockIndex *GetBestBlock();
 
+    // Retrieve the hash of that block; also works before the block index is loaded
+    virtual bool GetBestBlockHash(uint256 &hashBlock);
+
+    // Retrieve the blocks between which a write to disk stopped half way, leaving
+    // the coins partly at the state of each
+    virtual bool GetInterruptedWrite(uint256 &hashFrom, uint256 &hashTo);
+
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Memory held, in bytes, by changes passed to BatchWrite and not yet written
+    virtual size_t GetWriteUsage();
+
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock) with the
+    // dirty entries of a cache
+    virtual bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -2208,9 +2429,12 @@ public:
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
+    bool GetBestBlockHash(uint256 &hashBlock);
+    bool GetInterruptedWrite(uint256 &hashFrom, uint256 &hashTo);
     bool SetBestBlock(CBlockIndex *pindex);
+    size_t GetWriteUsage();
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -2219,7 +2443,14 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Memory owned by the coins in cacheCoins, excluding PENDING entries
+    size_t cachedCoinsUsage;
+    // Entries handed out by GetCoins(txid) whose usage is recounted later
+    std::vector<uint256> vPending;
+    // Eviction hand of Trim()
+    size_t nClockHand;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2229,23 +2460,45 @@ public:
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
+    bool GetBestBlockHash(uint256 &hashBlock);
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The entry is marked dirty; use AccessCoins to only read it.
+    // The reference is valid until the next call that adds or removes entries.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a read-only reference to a CCoins. Check HaveCoins first.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // Add the outputs of a transaction being connected. BIP30 guarantees there
+    // are no unspent outputs for txid in this view, so if they are all spent
+    // before the next flush the base never has to see them.
+    bool SetNewCoins(const uint256 &txid, const CCoins &coins);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
+    // The written entries stay cached, now clean.
     bool Flush();
 
+    // Evict clean entries until the cache uses at most nMaxUsage bytes, or
+    // only dirty entries are left
+    void Trim(size_t nMaxUsage);
+
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Number of transactions modified since the last flush
+    unsigned int GetDirtyCount();
+
+    // Calculate the memory used by the cache, in bytes
+    size_t GetCacheUsage();
+
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsCacheEntry *FetchCoins(const uint256 &txid);
+    void CountPending();
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -0,0 +1,86 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef MINERTEMPLATE_H
+#define MINERTEMPLATE_H
+
+#include "main.h"
+#include "wallet.h"
+
+#include <boost/shared_ptr.hpp>
+
+#include <memory>
+
+// Primecoin: block template shared by the mining threads
+//
+// The template producer builds one block template per change of the best
+// chain or of the memory pool and publishes it as an immutable snapshot with
+// a generation number. A mining thread copies the snapshot and puts only its
+// own extranonce into the coinbase, so a new tip costs one CreateNewBlock
+// under cs_main instead of one per thread. All templates pay the key the
+// producer reserves, which is kept once one of its blocks is accepted.
+
+// Immutable block template snapshot
+struct CMinerBlockTemplate
+{
+    CBlockTemplate blocktemplate; // block with the coinbase of the producer
+    std::vector<uint256> vCoinbaseBranch; // merkle branch of the coinbase
+    CBlockIndex* pindexPrev; // best chain tip the block builds on
+    unsigned int nTransactionsUpdated; // memory pool updates seen by the block
+    int64 nTime; // time the template was built
+    uint64 nGeneration; // sequence number of the template
+};
+
+class CMinerTemplateProducer
+{
+private:
+    CCriticalSection cs;
+    CReserveKey reservekey; // key paid by the templates
+    boost::shared_ptr<const CMinerBlockTemplate> ptemplate;
+    uint64 nGeneration;
+
+public:
+    CMinerTemplateProducer(CWallet* pwallet) : reservekey(pwallet), nGeneration(0) {}
+
+    // Whether transactions arrived long enough ago to rebuild the template
+    static bool HasNewTransactions(const CMinerBlockTemplate& blocktemplate)
+    {
+        return nTransactionsUpdated != blocktemplate.nTransactionsUpdated && GetTime() - blocktemplate.nTime > 10;
+    }
+
+    // Current template, built anew if the best chain moved on or transactions arrived
+    // Return value: empty if no template could be built
+    boost::shared_ptr<const CMinerBlockTemplate> GetTemplate()
+    {
+        LOCK(cs);
+        if (ptemplate && ptemplate->pindexPrev == pindexBest && !HasNewTransactions(*ptemplate))
+            return ptemplate;
+
+        boost::shared_ptr<CMinerBlockTemplate> pnew(new CMinerBlockTemplate());
+        pnew->nTransactionsUpdated = nTransactionsUpdated;
+        pnew->pindexPrev = pindexBest;
+        pnew->nTime = GetTime();
+        std::auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(reservekey));
+        if (!pblocktemplate.get())
+            return boost::shared_ptr<const CMinerBlockTemplate>();
+        pnew->blocktemplate = *pblocktemplate;
+        pnew->vCoinbaseBranch = pnew->blocktemplate.block.GetMerkleBranch(0);
+        pnew->nGeneration = ++nGeneration;
+        if (fDebug && GetBoolArg("-printmining"))
+            printf("CMinerTemplateProducer() : template %"PRI64u" with %"PRIszu" transactions\n", pnew->nGeneration, pnew->blocktemplate.block.vtx.size());
+        ptemplate = pnew;
+        return ptemplate;
+    }
+
+    // Submit a block found from one of the templates
+    bool CheckWork(CBlock* pblock, CWallet& wallet)
+    {
+        LOCK(cs);
+        return ::CheckWork(pblock, wallet, reservekey);
+    }
+};
+
+/** Put the extranonce of a mining thread into a block copied from a template */
+void SetTemplateExtraNonce(CBlock& block, const CMinerBlockTemplate& blocktemplate, unsigned int nThread, unsigned int nExtraNonce);
+
+#endif
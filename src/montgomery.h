@@ -0,0 +1,315 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef PRIMECOIN_MONTGOMERY_H
+#define PRIMECOIN_MONTGOMERY_H
+
+#include "bignum.h"
+
+#include <cassert>
+
+/**********************************/
+/* FIXED-WIDTH MONTGOMERY NUMBERS */
+/**********************************/
+
+// Limbs are 64-bit where the compiler has a double-width 128-bit type,
+// 32-bit otherwise. Numbers are stored least significant limb first.
+#if defined(__SIZEOF_INT128__)
+typedef uint64 mont_limb_t;
+typedef unsigned __int128 mont_dlimb_t;
+static const unsigned int nMontLimbBits = 64;
+#else
+typedef unsigned int mont_limb_t;
+typedef uint64 mont_dlimb_t;
+static const unsigned int nMontLimbBits = 32;
+#endif
+
+// Largest number handled: prime chain origins are capped at 2000 bits and
+// a chain can add up to 99 more bits
+static const unsigned int nMontBitsMax = 2112;
+static const unsigned int nMontLimbsMax = nMontBitsMax / nMontLimbBits;
+
+// Number of significant bits in a limb array
+inline unsigned int MontBitLength(const mont_limb_t* pa, unsigned int nLimbs)
+{
+    while (nLimbs > 0 && pa[nLimbs - 1] == 0)
+        nLimbs--;
+    if (nLimbs == 0)
+        return 0;
+    unsigned int nBits = (nLimbs - 1) * nMontLimbBits;
+    for (mont_limb_t nTop = pa[nLimbs - 1]; nTop; nTop >>= 1)
+        nBits++;
+    return nBits;
+}
+
+// Compare two limb arrays
+inline int MontCompare(const mont_limb_t* pa, const mont_limb_t* pb, unsigned int nLimbs)
+{
+    for (unsigned int i = nLimbs; i > 0; i--)
+        if (pa[i - 1] != pb[i - 1])
+            return (pa[i - 1] < pb[i - 1])? -1 : 1;
+    return 0;
+}
+
+// r = a - b, return borrow
+inline mont_limb_t MontSubtract(mont_limb_t* pr, const mont_limb_t* pa, const mont_limb_t* pb, unsigned int nLimbs)
+{
+    mont_limb_t nBorrow = 0;
+    for (unsigned int i = 0; i < nLimbs; i++)
+    {
+        mont_limb_t nDiff = pa[i] - pb[i];
+        mont_limb_t nBorrowNext = (pa[i] < pb[i]) || (nDiff < nBorrow);
+        pr[i] = nDiff - nBorrow;
+        nBorrow = nBorrowNext;
+    }
+    return nBorrow;
+}
+
+// a = 2a +/- 1, return carry out of the top limb
+inline mont_limb_t MontDoublePlusMinusOne(mont_limb_t* pa, unsigned int nLimbs, bool fPlus)
+{
+    mont_limb_t nCarry = 0;
+    for (unsigned int i = 0; i < nLimbs; i++)
+    {
+        mont_limb_t nNext = pa[i] >> (nMontLimbBits - 1);
+        pa[i] = (pa[i] << 1) | nCarry;
+        nCarry = nNext;
+    }
+    if (fPlus)
+        pa[0] |= 1;
+    else
+    {
+        for (unsigned int i = 0; i < nLimbs; i++)
+            if (pa[i]-- != 0)
+                break;
+    }
+    return nCarry;
+}
+
+// Load a non-negative CBigNum into a limb array
+// Return value: false if the number does not fit in nLimbs limbs
+inline bool MontFromBigNum(const CBigNum& bn, mont_limb_t* pa, unsigned int nLimbs)
+{
+    assert(nLimbs <= nMontLimbsMax + 1);
+    if (BN_is_negative(&bn) || (unsigned int) BN_num_bits(&bn) > nLimbs * nMontLimbBits)
+        return false;
+    unsigned char pch[(nMontLimbsMax + 1) * sizeof(mont_limb_t)];
+    unsigned int nBytes = BN_bn2bin(&bn, pch);
+    for (unsigned int i = 0; i < nLimbs; i++)
+        pa[i] = 0;
+    for (unsigned int i = 0; i < nBytes; i++)
+        pa[i / sizeof(mont_limb_t)] |= ((mont_limb_t) pch[nBytes - 1 - i]) << (8 * (i % sizeof(mont_limb_t)));
+    return true;
+}
+
+// Store a limb array into a CBigNum; a chain number outgrowing the widest
+// modulus takes nMontLimbsMax + 1 limbs
+inline void MontToBigNum(const mont_limb_t* pa, unsigned int nLimbs, CBigNum& bn)
+{
+    assert(nLimbs <= nMontLimbsMax + 1);
+    unsigned char pch[(nMontLimbsMax + 1) * sizeof(mont_limb_t)];
+    unsigned int nBytes = nLimbs * sizeof(mont_limb_t);
+    for (unsigned int i = 0; i < nBytes; i++)
+        pch[nBytes - 1 - i] = (unsigned char) (pa[i / sizeof(mont_limb_t)] >> (8 * (i % sizeof(mont_limb_t))));
+    if (!BN_bin2bn(pch, nBytes, &bn))
+        throw bignum_error("MontToBigNum() : BN_bin2bn failed");
+}
+
+/** Arithmetic modulo an odd number of at most nLimbs limbs in Montgomery
+ * form, with R = 2**(nLimbs * nMontLimbBits). All storage is inline so a
+ * modulus can live on the stack and be reset for each number in a chain.
+ */
+template<unsigned int nLimbs>
+class CMontgomeryModulus
+{
+public:
+    mont_limb_t n[nLimbs]; // modulus
+    mont_limb_t nInverse; // -n**-1 modulo 2**nMontLimbBits
+    mont_limb_t one[nLimbs]; // R modulo n, i.e. 1 in Montgomery form
+    unsigned int nBits; // significant bits of the modulus
+
+    // Set an odd modulus, n > 1
+    void SetModulus(const mont_limb_t* pn)
+    {
+        for (unsigned int i = 0; i < nLimbs; i++)
+            n[i] = pn[i];
+        nBits = MontBitLength(n, nLimbs);
+
+        // Newton iteration doubles the correct low bits of the inverse,
+        // starting from 3 bits since n * n = 1 modulo 8
+        mont_limb_t nInv = n[0];
+        for (unsigned int nCorrect = 3; nCorrect < nMontLimbBits; nCorrect *= 2)
+            nInv *= 2 - n[0] * nInv;
+        nInverse = (mont_limb_t) 0 - nInv;
+
+        // R modulo n by doubling 2**(bits-1), which is below n
+        for (unsigned int i = 0; i < nLimbs; i++)
+            one[i] = 0;
+        one[(nBits - 1) / nMontLimbBits] = ((mont_limb_t) 1) << ((nBits - 1) % nMontLimbBits);
+        for (unsigned int i = nBits - 1; i < nLimbs * nMontLimbBits; i++)
+            Double(one);
+    }
+
+    // r = a * b / R modulo n; a, b < n; r may alias a or b
+    void Multiply(mont_limb_t* pr, const mont_limb_t* pa, const mont_limb_t* pb) const
+    {
+        mont_limb_t t[nLimbs + 2];
+        for (unsigned int i = 0; i < nLimbs + 2; i++)
+            t[i] = 0;
+        for (unsigned int i = 0; i < nLimbs; i++)
+        {
+            // t += a * b[i]
+            mont_dlimb_t nSum = 0;
+            for (unsigned int j = 0; j < nLimbs; j++)
+            {
+                nSum = (mont_dlimb_t) t[j] + (mont_dlimb_t) pa[j] * pb[i] + (nSum >> nMontLimbBits);
+                t[j] = (mont_limb_t) nSum;
+            }
+            nSum = (mont_dlimb_t) t[nLimbs] + (nSum >> nMontLimbBits);
+            t[nLimbs] = (mont_limb_t) nSum;
+            t[nLimbs + 1] = (mont_limb_t) (nSum >> nMontLimbBits);
+
+            // t = (t + m * n) / 2**nMontLimbBits
+            mont_limb_t m = t[0] * nInverse;
+            nSum = (mont_dlimb_t) t[0] + (mont_dlimb_t) m * n[0];
+            for (unsigned int j = 1; j < nLimbs; j++)
+            {
+                nSum = (mont_dlimb_t) t[j] + (mont_dlimb_t) m * n[j] + (nSum >> nMontLimbBits);
+                t[j - 1] = (mont_limb_t) nSum;
+            }
+            nSum = (mont_dlimb_t) t[nLimbs] + (nSum >> nMontLimbBits);
+            t[nLimbs - 1] = (mont_limb_t) nSum;
+            t[nLimbs] = t[nLimbs + 1] + (mont_limb_t) (nSum >> nMontLimbBits);
+        }
+        if (t[nLimbs] || MontCompare(t, n, nLimbs) >= 0)
+            MontSubtract(t, t, n, nLimbs);
+        for (unsigned int i = 0; i < nLimbs; i++)
+            pr[i] = t[i];
+    }
+
+    // r = a * a / R modulo n; a < n; r may alias a
+    // The cross products are computed once and doubled, which saves
+    // nearly half the limb multiplications of Multiply()
+    void Square(mont_limb_t* pr, const mont_limb_t* pa) const
+    {
+        mont_limb_t t[2 * nLimbs];
+        t[0] = 0;
+        t[2 * nLimbs - 1] = 0;
+        for (unsigned int i = 0; i < nLimbs; i++)
+        {
+            mont_limb_t nCarry = 0;
+            for (unsigned int j = i + 1; j < nLimbs; j++)
+            {
+                mont_dlimb_t nSum = (mont_dlimb_t) pa[i] * pa[j] + nCarry + ((i == 0)? 0 : t[i + j]);
+                t[i + j] = (mont_limb_t) nSum;
+                nCarry = (mont_limb_t) (nSum >> nMontLimbBits);
+            }
+            t[i + nLimbs] = nCarry;
+        }
+
+        // t = 2t + diagonal squares
+        mont_limb_t nCarry = 0;
+        for (unsigned int i = 0; i < nLimbs; i++)
+        {
+            mont_dlimb_t nSquare = (mont_dlimb_t) pa[i] * pa[i];
+            mont_dlimb_t nSum = ((mont_dlimb_t) t[2 * i] << 1) + (mont_limb_t) nSquare + nCarry;
+            t[2 * i] = (mont_limb_t) nSum;
+            nSum = ((mont_dlimb_t) t[2 * i + 1] << 1) + (mont_limb_t) (nSquare >> nMontLimbBits) + (nSum >> nMontLimbBits);
+            t[2 * i + 1] = (mont_limb_t) nSum;
+            nCarry = (mont_limb_t) (nSum >> nMontLimbBits);
+        }
+        ReduceWide(pr, t);
+    }
+
+    // r = t / R modulo n for a double-width t < n * R; t is overwritten
+    void ReduceWide(mont_limb_t* pr, mont_limb_t* pt) const
+    {
+        mont_limb_t nExtra = 0;
+        for (unsigned int i = 0; i < nLimbs; i++)
+        {
+            mont_limb_t m = pt[i] * nInverse;
+            mont_limb_t nCarry = 0;
+            for (unsigned int j = 0; j < nLimbs; j++)
+            {
+                mont_dlimb_t nSum = (mont_dlimb_t) m * n[j] + pt[i + j] + nCarry;
+                pt[i + j] = (mont_limb_t) nSum;
+                nCarry = (mont_limb_t) (nSum >> nMontLimbBits);
+            }
+            // Carry out of the top limb is deferred to the next row
+            mont_dlimb_t nSum = (mont_dlimb_t) pt[i + nLimbs] + nCarry + nExtra;
+            pt[i + nLimbs] = (mont_limb_t) nSum;
+            nExtra = (mont_limb_t) (nSum >> nMontLimbBits);
+        }
+        if (nExtra || MontCompare(pt + nLimbs, n, nLimbs) >= 0)
+            MontSubtract(pt + nLimbs, pt + nLimbs, n, nLimbs);
+        for (unsigned int i = 0; i < nLimbs; i++)
+            pr[i] = pt[nLimbs + i];
+    }
+
+    // a = 2a modulo n; a < n
+    void Double(mont_limb_t* pa) const
+    {
+        mont_limb_t nCarry = 0;
+        for (unsigned int i = 0; i < nLimbs; i++)
+        {
+            mont_limb_t nNext = pa[i] >> (nMontLimbBits - 1);
+            pa[i] = (pa[i] << 1) | nCarry;
+            nCarry = nNext;
+        }
+        if (nCarry || MontCompare(pa, n, nLimbs) >= 0)
+            MontSubtract(pa, pa, n, nLimbs);
+    }
+
+    // Convert out of Montgomery form
+    void Reduce(mont_limb_t* pr, const mont_limb_t* pa) const
+    {
+        mont_limb_t t[2 * nLimbs];
+        for (unsigned int i = 0; i < nLimbs; i++)
+        {
+            t[i] = pa[i];
+            t[nLimbs + i] = 0;
+        }
+        ReduceWide(pr, t);
+    }
+
+    // r = 2**e modulo n in Montgomery form, e given with nExpBits bits > 0
+    // Multiplications by the base are doublings, so only squarings multiply
+    void PowerOfTwo(mont_limb_t* pr, const mont_limb_t* pe, unsigned int nExpBits) const
+    {
+        for (unsigned int i = 0; i < nLimbs; i++)
+            pr[i] = one[i];
+        Double(pr); // top bit of the exponent
+        for (unsigned int nBit = nExpBits - 1; nBit > 0; nBit--)
+        {
+            Square(pr, pr);
+            if ((pe[(nBit - 1) / nMontLimbBits] >> ((nBit - 1) % nMontLimbBits)) & 1)
+                Double(pr);
+        }
+    }
+
+    // Fractional part of a failed test: ((n - r) << nFractionalBits) / n
+    unsigned int GetFractional(const mont_limb_t* pr, unsigned int nFractionalBits) const
+    {
+        mont_limb_t d[nLimbs];
+        MontSubtract(d, n, pr, nLimbs);
+        unsigned int nFractional = 0;
+        for (unsigned int nBit = 0; nBit < nFractionalBits; nBit++)
+        {
+            // Long division one quotient bit at a time; d < n throughout
+            mont_limb_t nCarry = d[nLimbs - 1] >> (nMontLimbBits - 1);
+            for (unsigned int i = nLimbs - 1; i > 0; i--)
+                d[i] = (d[i] << 1) | (d[i - 1] >> (nMontLimbBits - 1));
+            d[0] <<= 1;
+            nFractional <<= 1;
+            if (nCarry || MontCompare(d, n, nLimbs) >= 0)
+            {
+                MontSubtract(d, d, n, nLimbs);
+                nFractional |= 1;
+            }
+        }
+        return nFractional;
+    }
+};
+
+#endif
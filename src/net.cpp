@@ -102,6 +102,15 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd)
+{
+    nHeadersRequestTime = GetTime();
+    if (fDebug)
+        printf("getheaders from height=%d\n", pindexBegin->nHeight);
+
+    PushMessage("getheaders", CBlockLocator(pindexBegin), hashEnd);
+}
+
 // find 'best' local address for a particular peer
 bool GetLocal(CService& addr, const CNetAddr *paddrPeer)
 {
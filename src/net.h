@@ -214,6 +214,11 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // headers-first block download
+    int64 nHeadersRequestTime; // getheaders pending a reply, 0 if none
+    int nBlocksInFlight;
+    int64 nBlocksStalledTime;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -258,6 +263,9 @@ public:
         nLastGetBlocksHeight = -1;
         nStartingHeight = -1;
         fStartSync = false;
+        nHeadersRequestTime = 0;
+        nBlocksInFlight = 0;
+        nBlocksStalledTime = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
@@ -611,6 +619,7 @@ public:
     }
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin, uint256 hashEnd);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
@@ -0,0 +1,191 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef POWCHECKQUEUE_H
+#define POWCHECKQUEUE_H
+
+#include "main.h"
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <deque>
+#include <map>
+
+// Primecoin: proof-of-work checks ahead of block acceptance
+//
+// Blocks waiting in a peer's receive queue or read ahead from a block file
+// have their prime proof-of-work checked on the proof-of-work checking
+// threads, out of cs_main. ProcessBlock still checks every block in turn:
+// it takes the result of a check done ahead, waits for a check in progress
+// or checks the block itself, so a block is accepted or rejected exactly as
+// without the checking threads.
+class CPowCheckQueue
+{
+public:
+    // Proof-of-work check of a header, run by the queue
+    typedef bool (*CheckFunc)(const CBlockHeader& header, unsigned int& nChainType, unsigned int& nChainLength);
+
+private:
+    enum
+    {
+        POWCHECK_QUEUED,
+        POWCHECK_RUNNING,
+        POWCHECK_DONE,
+    };
+
+    struct CPowCheck
+    {
+        CBlockHeader header;
+        int nState;
+        bool fValid;
+        unsigned int nChainType;
+        unsigned int nChainLength;
+        uint64 nAdded; // sequence number of the Add() of the check
+    };
+
+    const CheckFunc pfnCheck;
+    // Checks done ahead and not asked for are forgotten beyond this number
+    const unsigned int nMaxChecks;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker; // workers wait for checks to be queued
+    boost::condition_variable condDone; // waiters for a check in progress
+    std::map<uint256, CPowCheck> mapChecks; // checks by block hash
+    std::deque<uint256> queue; // blocks to check, oldest first
+    // blocks with a check and the sequence number of their Add(), oldest
+    // first; entries of checks taken by Check() are left behind and skipped
+    std::deque<std::pair<uint256, uint64> > vAdded;
+    uint64 nAddedSeq;
+    int nWorkers;
+    bool fPaused; // no checks ahead, the blocks coming are assumed valid
+
+    // Run a queued check with the mutex released
+    void Run(boost::unique_lock<boost::mutex>& lock, CPowCheck& check)
+    {
+        check.nState = POWCHECK_RUNNING;
+        CBlockHeader header = check.header;
+        lock.unlock();
+        unsigned int nChainType = 0;
+        unsigned int nChainLength = 0;
+        bool fValid = pfnCheck(header, nChainType, nChainLength);
+        lock.lock();
+        // a running check is never erased, the reference is still valid
+        check.fValid = fValid;
+        check.nChainType = nChainType;
+        check.nChainLength = nChainLength;
+        check.nState = POWCHECK_DONE;
+        condDone.notify_all();
+    }
+
+public:
+    CPowCheckQueue(CheckFunc pfnCheckIn, unsigned int nMaxChecksIn = 1024) :
+        pfnCheck(pfnCheckIn), nMaxChecks(nMaxChecksIn), nAddedSeq(0), nWorkers(0), fPaused(false) {}
+
+    // Worker thread
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nWorkers++;
+        loop {
+            while (queue.empty())
+                condWorker.wait(lock);
+            uint256 hash = queue.front();
+            queue.pop_front();
+            std::map<uint256, CPowCheck>::iterator mi = mapChecks.find(hash);
+            if (mi != mapChecks.end() && mi->second.nState == POWCHECK_QUEUED)
+                Run(lock, mi->second);
+        }
+    }
+
+    // Number of blocks worth checking ahead, 0 without worker threads;
+    // headers are checked even while the blocks are assumed valid
+    unsigned int GetLookahead(bool fHeaders = false)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fPaused && !fHeaders ? 0 : 4 * nWorkers;
+    }
+
+    void SetPaused(bool fPausedIn)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fPaused = fPausedIn;
+    }
+
+    // Queue the check of a block for the worker threads
+    void Add(const CBlockHeader& header)
+    {
+        uint256 hash = header.GetHash();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (nWorkers == 0 || mapChecks.count(hash))
+            return;
+        while (vAdded.size() >= nMaxChecks)
+        {
+            std::pair<uint256, uint64> added = vAdded.front();
+            vAdded.pop_front();
+            std::map<uint256, CPowCheck>::iterator mi = mapChecks.find(added.first);
+            if (mi == mapChecks.end() || mi->second.nAdded != added.second)
+                continue; // taken by Check(), maybe added again since
+            if (mi->second.nState == POWCHECK_RUNNING)
+                vAdded.push_back(added);
+            else
+                mapChecks.erase(mi);
+        }
+        CPowCheck& check = mapChecks[hash];
+        check.header = header;
+        check.nState = POWCHECK_QUEUED;
+        check.nAdded = ++nAddedSeq;
+        queue.push_back(hash);
+        vAdded.push_back(std::make_pair(hash, check.nAdded));
+        condWorker.notify_one();
+    }
+
+    // Wait until the check of a block added earlier is done, running it
+    // here if no worker took it yet; false if the check failed
+    bool Wait(const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        loop {
+            std::map<uint256, CPowCheck>::iterator mi = mapChecks.find(hash);
+            if (mi == mapChecks.end())
+                return true;
+            if (mi->second.nState == POWCHECK_DONE)
+                return mi->second.fValid;
+            if (mi->second.nState == POWCHECK_QUEUED)
+                Run(lock, mi->second);
+            else
+                condDone.wait(lock);
+        }
+    }
+
+    // Check the proof-of-work of a block, with the result of a check added
+    // earlier if there is one
+    bool Check(const CBlockHeader& header, unsigned int& nChainType, unsigned int& nChainLength)
+    {
+        uint256 hash = header.GetHash();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            loop {
+                std::map<uint256, CPowCheck>::iterator mi = mapChecks.find(hash);
+                if (mi == mapChecks.end())
+                    break;
+                if (mi->second.nState == POWCHECK_QUEUED)
+                    Run(lock, mi->second);
+                else if (mi->second.nState == POWCHECK_RUNNING)
+                    condDone.wait(lock);
+                else
+                {
+                    bool fValid = mi->second.fValid;
+                    nChainType = mi->second.nChainType;
+                    nChainLength = mi->second.nChainLength;
+                    mapChecks.erase(mi);
+                    return fValid;
+                }
+            }
+        }
+        return pfnCheck(header, nChainType, nChainLength);
+    }
+};
+
+#endif
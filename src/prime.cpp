@@ -3,6 +3,16 @@
 // see the accompanying file COPYING
 
 #include "prime.h"
+#include "montgomery.h"
+
+#include <boost/thread/once.hpp>
+
+// Lane-parallel primality tests are also built for AVX2 and AVX-512 and
+// selected at run time
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || __GNUC__ >= 6)
+#define PRIME_LANES_DISPATCH
+#include <immintrin.h>
+#endif
 
 /**********************/
 /* PRIMECOIN PROTOCOL */
@@ -10,10 +20,45 @@
 
 // Prime Table
 std::vector<unsigned int> vPrimes;
+// Per-prime constants for native modular arithmetic in the sieve
+std::vector<unsigned int> vPrimesTwoInverse; // inverse of 2 modulo the prime
+std::vector<unsigned int> vPrimesWordModulo; // 2**32 modulo the prime
+std::vector<unsigned int> vPrimesDoubleWordModulo; // 2**64 modulo the prime
 static const unsigned int nPrimeTableLimit = nMaxSieveSize;
 
+// Trial division of header hashes in vector lanes: a hash is split into
+// 16-bit halfwords h[j], so sum(h[j] * (2**(16 j) mod p)) fits in 32 bits
+// and is congruent to the hash. x is divisible by odd p exactly when
+// x * (p**-1 mod 2**32) mod 2**32 <= (2**32 - 1) / p
+static const unsigned int nHeaderTrialDivisionLimit = 1000;
+struct CHeaderTrialPrime
+{
+    unsigned int pHalfwordModulo[16];
+    unsigned int nInverse;
+    unsigned int nLimit;
+};
+static std::vector<CHeaderTrialPrime> vHeaderTrialPrimes;
+
+// Replica of the per-prime constants on a NUMA node, copied by the first
+// mining thread placed on the node so that its pages are local to the node
+class CPrimeTableReplica
+{
+public:
+    std::vector<unsigned int> vPrimes;
+    std::vector<unsigned int> vPrimesTwoInverse;
+    std::vector<unsigned int> vPrimesWordModulo;
+    std::vector<unsigned int> vPrimesDoubleWordModulo;
+};
+static CCriticalSection cs_primetablereplicas;
+static std::map<int, boost::shared_ptr<const CPrimeTableReplica> > mapPrimeTableReplicas;
+static boost::thread_specific_ptr<boost::shared_ptr<const CPrimeTableReplica> > pprimetablereplica;
+
 void GeneratePrimeTable()
 {
+    {
+        LOCK(cs_primetablereplicas);
+        mapPrimeTableReplicas.clear();
+    }
     vPrimes.clear();
     // Generate prime table using sieve of Eratosthenes
     std::vector<bool> vfComposite (nPrimeTableLimit, false);
@@ -27,9 +72,82 @@ void GeneratePrimeTable()
     for (unsigned int n = 2; n < nPrimeTableLimit; n++)
         if (!vfComposite[n])
             vPrimes.push_back(n);
+    vPrimesTwoInverse.clear();
+    vPrimesWordModulo.clear();
+    vPrimesDoubleWordModulo.clear();
+    BOOST_FOREACH(unsigned int nPrime, vPrimes)
+    {
+        uint64 nWordModulo = (1llu << 32) % nPrime;
+        vPrimesTwoInverse.push_back((nPrime == 2)? 0 : (nPrime + 1) / 2); // 2 has no inverse modulo 2
+        vPrimesWordModulo.push_back(nWordModulo);
+        vPrimesDoubleWordModulo.push_back(nWordModulo * nWordModulo % nPrime);
+    }
+    vHeaderTrialPrimes.clear();
+    for (unsigned int i = 1; i < vPrimes.size() && vPrimes[i] < nHeaderTrialDivisionLimit; i++)
+    {
+        unsigned int nPrime = vPrimes[i];
+        CHeaderTrialPrime trial;
+        unsigned int nModulo = 1;
+        for (unsigned int j = 0; j < 16; j++)
+        {
+            trial.pHalfwordModulo[j] = nModulo;
+            nModulo = (nModulo << 16) % nPrime;
+        }
+        // Newton iteration doubles the correct low bits of the inverse
+        unsigned int nInverse = nPrime;
+        for (unsigned int j = 0; j < 4; j++)
+            nInverse *= 2 - nPrime * nInverse;
+        trial.nInverse = nInverse;
+        trial.nLimit = 0xffffffffu / nPrime;
+        vHeaderTrialPrimes.push_back(trial);
+    }
     printf("GeneratePrimeTable() : prime table [1, %u] generated with %u primes\n", nPrimeTableLimit, (unsigned int) vPrimes.size());
 }
 
+void SetPrimeTableNode(int nNode)
+{
+    if (nNode < 0)
+    {
+        pprimetablereplica.reset();
+        return;
+    }
+    LOCK(cs_primetablereplicas);
+    boost::shared_ptr<const CPrimeTableReplica>& preplica = mapPrimeTableReplicas[nNode];
+    if (!preplica)
+    {
+        CPrimeTableReplica* pnew = new CPrimeTableReplica();
+        pnew->vPrimes = vPrimes;
+        pnew->vPrimesTwoInverse = vPrimesTwoInverse;
+        pnew->vPrimesWordModulo = vPrimesWordModulo;
+        pnew->vPrimesDoubleWordModulo = vPrimesDoubleWordModulo;
+        preplica.reset(pnew);
+    }
+    pprimetablereplica.reset(new boost::shared_ptr<const CPrimeTableReplica>(preplica));
+}
+
+CPrimeTable GetPrimeTable()
+{
+    CPrimeTable table;
+    if (pprimetablereplica.get() != NULL && !(*pprimetablereplica)->vPrimes.empty())
+    {
+        const CPrimeTableReplica& replica = **pprimetablereplica;
+        table.pPrimes = &replica.vPrimes[0];
+        table.pPrimesTwoInverse = &replica.vPrimesTwoInverse[0];
+        table.pPrimesWordModulo = &replica.vPrimesWordModulo[0];
+        table.pPrimesDoubleWordModulo = &replica.vPrimesDoubleWordModulo[0];
+        table.nPrimes = replica.vPrimes.size();
+    }
+    else
+    {
+        table.nPrimes = vPrimes.size();
+        table.pPrimes = table.nPrimes? &vPrimes[0] : NULL;
+        table.pPrimesTwoInverse = table.nPrimes? &vPrimesTwoInverse[0] : NULL;
+        table.pPrimesWordModulo = table.nPrimes? &vPrimesWordModulo[0] : NULL;
+        table.pPrimesDoubleWordModulo = table.nPrimes? &vPrimesDoubleWordModulo[0] : NULL;
+    }
+    return table;
+}
+
 // Get next prime number of p
 bool PrimeTableGetNextPrime(unsigned int& p)
 {
@@ -85,11 +203,42 @@ void PrimorialAt(CBigNum& bn, CBigNum& bnPrimorial)
     }
 }
 
+// Check Fermat probable primality test (2-PRP): 2 ** (n-1) = 1 (mod n)
+// Fixed-width version, n odd and n > 1 set as modulus
+// true: n is probable prime
+// false: n is composite; set fractional length in the nLength output
+template<unsigned int nLimbs>
+static bool FermatProbablePrimalityTestFixed(const CMontgomeryModulus<nLimbs>& mod, unsigned int& nLength)
+{
+    mont_limb_t e[nLimbs];
+    mont_limb_t r[nLimbs];
+    for (unsigned int i = 0; i < nLimbs; i++)
+        e[i] = mod.n[i];
+    e[0]--; // n is odd
+    mod.PowerOfTwo(r, e, mod.nBits);
+    if (MontCompare(r, mod.one, nLimbs) == 0)
+        return true;
+    // Failed Fermat test, calculate fractional length
+    mod.Reduce(r, r);
+    nLength = (nLength & TARGET_LENGTH_MASK) | mod.GetFractional(r, nFractionalBits);
+    return false;
+}
+
 // Check Fermat probable primality test (2-PRP): 2 ** (n-1) = 1 (mod n)
 // true: n is probable prime
 // false: n is composite; set fractional length in the nLength output
 static bool FermatProbablePrimalityTest(const CBigNum& n, unsigned int& nLength)
 {
+    // Block header hashes take the fixed-width path
+    static const unsigned int nHashLimbs = 256 / nMontLimbBits;
+    mont_limb_t pn[nHashLimbs];
+    if (BN_is_odd(&n) && BN_num_bits(&n) > 1 && MontFromBigNum(n, pn, nHashLimbs))
+    {
+        CMontgomeryModulus<nHashLimbs> mod;
+        mod.SetModulus(pn);
+        return FermatProbablePrimalityTestFixed(mod, nLength);
+    }
+
     CAutoBN_CTX pctx;
     CBigNum a = 2; // base; Fermat witness
     CBigNum e = n - 1;
@@ -105,6 +254,45 @@ static bool FermatProbablePrimalityTest(const CBigNum& n, unsigned int& nLength)
     return false;
 }
 
+// Test probable primality of n = 2p +/- 1 based on Euler, Lagrange and Lifchitz
+// Fixed-width version, n odd and n > 1 set as modulus
+// Return values
+//   true: n is probable prime
+//   false: n is composite; set fractional length in the nLength output
+template<unsigned int nLimbs>
+static bool EulerLagrangeLifchitzPrimalityTestFixed(const CMontgomeryModulus<nLimbs>& mod, bool fSophieGermain, unsigned int& nLength)
+{
+    mont_limb_t e[nLimbs];
+    mont_limb_t r[nLimbs];
+    for (unsigned int i = 0; i < nLimbs - 1; i++)
+        e[i] = (mod.n[i] >> 1) | (mod.n[i + 1] << (nMontLimbBits - 1));
+    e[nLimbs - 1] = mod.n[nLimbs - 1] >> 1;
+    mod.PowerOfTwo(r, e, mod.nBits - 1);
+    // Both 1 and n-1 compared in Montgomery form
+    mont_limb_t minusone[nLimbs];
+    MontSubtract(minusone, mod.n, mod.one, nLimbs);
+    unsigned int nMod8 = (unsigned int) (mod.n[0] & 7);
+    bool fPassedTest = false;
+    if (fSophieGermain && (nMod8 == 7)) // Euler & Lagrange
+        fPassedTest = (MontCompare(r, mod.one, nLimbs) == 0);
+    else if (fSophieGermain && (nMod8 == 3)) // Lifchitz
+        fPassedTest = (MontCompare(r, minusone, nLimbs) == 0);
+    else if ((!fSophieGermain) && (nMod8 == 5)) // Lifchitz
+        fPassedTest = (MontCompare(r, minusone, nLimbs) == 0);
+    else if ((!fSophieGermain) && (nMod8 == 1)) // LifChitz
+        fPassedTest = (MontCompare(r, mod.one, nLimbs) == 0);
+    else
+        return error("EulerLagrangeLifchitzPrimalityTest() : invalid n %% 8 = %d, %s", nMod8, (fSophieGermain? "first kind" : "second kind"));
+
+    if (fPassedTest)
+        return true;
+    // Failed test, calculate fractional length
+    mod.Multiply(r, r, r); // derive Fermat test remainder
+    mod.Reduce(r, r);
+    nLength = (nLength & TARGET_LENGTH_MASK) | mod.GetFractional(r, nFractionalBits);
+    return false;
+}
+
 // Test probable primality of n = 2p +/- 1 based on Euler, Lagrange and Lifchitz
 // fSophieGermain:
 //   true:  n = 2p+1, p prime, aka Cunningham Chain of first kind
@@ -295,42 +483,263 @@ std::string GetPrimeOriginPrimorialForm(CBigNum& bnPrimeChainOrigin)
     return strprintf("%s*%u#", bnNonPrimorialFactor.ToString().c_str(), (nPrimeSeq > 0)? vPrimes[nPrimeSeq-1] : 0);
 }
 
-// Test Probable Cunningham Chain for: n
-// fSophieGermain:
-//   true - Test for Cunningham Chain of first kind (n, 2n+1, 4n+3, ...)
-//   false - Test for Cunningham Chain of second kind (n, 2n-1, 4n-3, ...)
-// Return value:
-//   true - Probable Cunningham Chain found (length at least 2)
-//   false - Not Cunningham Chain
-static bool ProbableCunninghamChainTest(const CBigNum& n, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength)
+// Apply the verdicts of a dual primality test to both chain lengths
+// fPlusOne, fMinusOne: r = 1 or r = n-1; fFermat: r**2 = 1
+static bool DualPrimalityTestVerdict(unsigned int nMod8, bool fSophieGermain, bool fPlusOne, bool fMinusOne, bool fFermat, unsigned int nFractionalLength, unsigned int& nLength, unsigned int& nLengthFermat)
 {
-    nProbableChainLength = 0;
-    CBigNum N = n;
+    if (TargetGetLength(nLength) == TargetGetLength(nLengthFermat)) // Euler-Lagrange-Lifchitz chain not ended
+    {
+        bool fPassedTest = false;
+        bool fValid = true;
+        if (TargetGetLength(nLength) == 0) // Fermat test for the first number
+            fPassedTest = fFermat;
+        else if (fSophieGermain && (nMod8 == 7)) // Euler & Lagrange
+            fPassedTest = fPlusOne;
+        else if (fSophieGermain && (nMod8 == 3)) // Lifchitz
+            fPassedTest = fMinusOne;
+        else if ((!fSophieGermain) && (nMod8 == 5)) // Lifchitz
+            fPassedTest = fMinusOne;
+        else if ((!fSophieGermain) && (nMod8 == 1)) // LifChitz
+            fPassedTest = fPlusOne;
+        else
+            fValid = error("EulerLagrangeLifchitzPrimalityTest() : invalid n %% 8 = %d, %s", nMod8, (fSophieGermain? "first kind" : "second kind"));
+        if (fPassedTest)
+            TargetIncrementLength(nLength);
+        else if (fValid)
+            nLength = (nLength & TARGET_LENGTH_MASK) | nFractionalLength;
+    }
+    if (fFermat)
+        TargetIncrementLength(nLengthFermat);
+    else
+        nLengthFermat = (nLengthFermat & TARGET_LENGTH_MASK) | nFractionalLength;
+    return fFermat;
+}
 
-    // Fermat test for n first
-    if (!FermatProbablePrimalityTest(N, nProbableChainLength))
-        return false;
+// Dual primality test of a number in chain
+// Fixed-width version, n odd and n > 1 set as modulus
+// Return value: true if the Fermat test passed
+template<unsigned int nLimbs>
+static bool DualPrimalityTestFixed(const CMontgomeryModulus<nLimbs>& mod, bool fSophieGermain, unsigned int& nLength, unsigned int& nLengthFermat)
+{
+    mont_limb_t e[nLimbs];
+    mont_limb_t r[nLimbs];
+    for (unsigned int i = 0; i < nLimbs - 1; i++)
+        e[i] = (mod.n[i] >> 1) | (mod.n[i + 1] << (nMontLimbBits - 1));
+    e[nLimbs - 1] = mod.n[nLimbs - 1] >> 1;
+    mod.PowerOfTwo(r, e, mod.nBits - 1);
+    // Both 1 and n-1 compared in Montgomery form
+    mont_limb_t minusone[nLimbs];
+    MontSubtract(minusone, mod.n, mod.one, nLimbs);
+    bool fPlusOne = (MontCompare(r, mod.one, nLimbs) == 0);
+    bool fMinusOne = (MontCompare(r, minusone, nLimbs) == 0);
+    mod.Square(r, r); // derive Fermat test remainder
+    bool fFermat = (MontCompare(r, mod.one, nLimbs) == 0);
+    // Also when the Fermat test passed, for an Euler-Lagrange-Lifchitz test
+    // that failed all the same
+    mod.Reduce(r, r);
+    unsigned int nFractionalLength = mod.GetFractional(r, nFractionalBits);
+    return DualPrimalityTestVerdict((unsigned int) (mod.n[0] & 7), fSophieGermain, fPlusOne, fMinusOne, fFermat, nFractionalLength, nLength, nLengthFermat);
+}
 
-    // Euler-Lagrange-Lifchitz test for the following numbers in chain
-    while (true)
+// Dual primality test of a number in chain
+//
+// The Euler-Lagrange-Lifchitz test computes r = 2**((n-1)/2) mod n, and for
+// odd n the Fermat test remainder 2**(n-1) mod n is r**2. A single
+// exponentiation thus gives the verdicts of both the chain test with
+// Euler-Lagrange-Lifchitz tests (Fermat test for the first number) and the
+// chain test with Fermat tests only. The fractional length of a failed test
+// is that of the Fermat remainder for both, (n-1)/n for a Fermat pseudoprime
+// failing the Euler-Lagrange-Lifchitz test.
+// nLength: chain length with Euler-Lagrange-Lifchitz tests, which stops
+//   growing once a test fails
+// nLengthFermat: chain length with Fermat tests only
+// Return value: true if the Fermat test passed
+static bool DualPrimalityTest(const CBigNum& n, bool fSophieGermain, unsigned int& nLength, unsigned int& nLengthFermat)
+{
+    if (!BN_is_odd(&n) || BN_num_bits(&n) <= 1)
     {
-        TargetIncrementLength(nProbableChainLength);
-        N = N + N + (fSophieGermain? 1 : (-1));
-        if (fFermatTest)
+        // The Fermat remainder is not the square of the other one, test both ways
+        if (TargetGetLength(nLength) == TargetGetLength(nLengthFermat))
+        {
+            bool fPassedTest = (TargetGetLength(nLength) == 0)? FermatProbablePrimalityTest(n, nLength) : EulerLagrangeLifchitzPrimalityTest(n, fSophieGermain, nLength);
+            if (fPassedTest)
+                TargetIncrementLength(nLength);
+        }
+        if (!FermatProbablePrimalityTest(n, nLengthFermat))
+            return false;
+        TargetIncrementLength(nLengthFermat);
+        return true;
+    }
+
+    CAutoBN_CTX pctx;
+    CBigNum a = 2;
+    CBigNum e = (n - 1) >> 1;
+    CBigNum r;
+    BN_mod_exp(&r, &a, &e, &n, pctx);
+    bool fPlusOne = (r == 1);
+    bool fMinusOne = ((r+1) == n);
+    r = (r * r) % n; // derive Fermat test remainder
+    bool fFermat = (r == 1);
+    // Also when the Fermat test passed, for an Euler-Lagrange-Lifchitz test
+    // that failed all the same
+    unsigned int nFractionalLength = (((n-r) << nFractionalBits) / n).getuint();
+    if (nFractionalLength >= (1 << nFractionalBits))
+    {
+        // Leave the lengths as the separate tests would
+        if (TargetGetLength(nLength) == TargetGetLength(nLengthFermat))
+            error("EulerLagrangeLifchitzPrimalityTest() : fractional assert");
+        return error("FermatProbablePrimalityTest() : fractional assert");
+    }
+    unsigned int nMod8 = (n % 8).getuint();
+    return DualPrimalityTestVerdict(nMod8, fSophieGermain, fPlusOne, fMinusOne, fFermat, nFractionalLength, nLength, nLengthFermat);
+}
+
+// Test Probable Cunningham Chain from N on with CBigNum arithmetic
+// nProbableChainLength holds the chain length found so far
+// pnLengthFermat: if set, dual test the chain; it holds the chain length
+//   with Fermat tests only and fFermatTest is ignored
+static void ProbableCunninghamChainTestBigNum(CBigNum N, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength, unsigned int* pnLengthFermat = NULL)
+{
+    loop
+    {
+        if (pnLengthFermat)
         {
-            if (!FermatProbablePrimalityTest(N, nProbableChainLength))
+            if (!DualPrimalityTest(N, fSophieGermain, nProbableChainLength, *pnLengthFermat))
                 break;
         }
         else
         {
-            if (!EulerLagrangeLifchitzPrimalityTest(N, fSophieGermain, nProbableChainLength))
-                break;
+            // Fermat test for n first
+            // Euler-Lagrange-Lifchitz test for the following numbers in chain
+            if (TargetGetLength(nProbableChainLength) == 0 || fFermatTest)
+            {
+                if (!FermatProbablePrimalityTest(N, nProbableChainLength))
+                    break;
+            }
+            else
+            {
+                if (!EulerLagrangeLifchitzPrimalityTest(N, fSophieGermain, nProbableChainLength))
+                    break;
+            }
+            TargetIncrementLength(nProbableChainLength);
+        }
+        N = N + N + (fSophieGermain? 1 : (-1));
+    }
+}
+
+// Test Probable Cunningham Chain from N on with a modulus of nLimbs limbs;
+// N is advanced along the chain
+// nProbableChainLength holds the chain length found so far
+// pnLengthFermat: if set, dual test the chain as above
+// Return values:
+//   true  - chain ended
+//   false - N outgrew the modulus, continue with a wider one
+template<unsigned int nLimbs>
+static bool ProbableCunninghamChainTestLimbs(mont_limb_t* pN, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength, unsigned int* pnLengthFermat)
+{
+    CMontgomeryModulus<nLimbs> mod;
+    while (MontBitLength(pN, nMontLimbsMax + 1) <= nLimbs * nMontLimbBits)
+    {
+        mod.SetModulus(pN);
+        if (pnLengthFermat)
+        {
+            if (!DualPrimalityTestFixed(mod, fSophieGermain, nProbableChainLength, *pnLengthFermat))
+                return true;
+        }
+        else
+        {
+            if (TargetGetLength(nProbableChainLength) == 0 || fFermatTest)
+            {
+                if (!FermatProbablePrimalityTestFixed(mod, nProbableChainLength))
+                    return true;
+            }
+            else
+            {
+                if (!EulerLagrangeLifchitzPrimalityTestFixed(mod, fSophieGermain, nProbableChainLength))
+                    return true;
+            }
+            TargetIncrementLength(nProbableChainLength);
+        }
+        MontDoublePlusMinusOne(pN, nMontLimbsMax + 1, fSophieGermain);
+    }
+    return false;
+}
+
+// Test Probable Cunningham Chain from odd N on with the narrowest fixed-width
+// modulus N fits in; pN holds nMontLimbsMax + 1 limbs
+// pnLengthFermat: if set, dual test the chain as above
+static void ProbableCunninghamChainTestFixed(mont_limb_t* pN, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength, unsigned int* pnLengthFermat = NULL)
+{
+    loop
+    {
+        unsigned int nBits = MontBitLength(pN, nMontLimbsMax + 1);
+        bool fChainEnded;
+        if (nBits <= 256)
+            fChainEnded = ProbableCunninghamChainTestLimbs<256 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 320)
+            fChainEnded = ProbableCunninghamChainTestLimbs<320 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 384)
+            fChainEnded = ProbableCunninghamChainTestLimbs<384 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 448)
+            fChainEnded = ProbableCunninghamChainTestLimbs<448 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 512)
+            fChainEnded = ProbableCunninghamChainTestLimbs<512 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 640)
+            fChainEnded = ProbableCunninghamChainTestLimbs<640 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 768)
+            fChainEnded = ProbableCunninghamChainTestLimbs<768 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 1024)
+            fChainEnded = ProbableCunninghamChainTestLimbs<1024 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= 1536)
+            fChainEnded = ProbableCunninghamChainTestLimbs<1536 / nMontLimbBits>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else if (nBits <= nMontBitsMax)
+            fChainEnded = ProbableCunninghamChainTestLimbs<nMontLimbsMax>(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+        else
+        {
+            // Beyond the fixed-width range
+            CBigNum N;
+            MontToBigNum(pN, nMontLimbsMax + 1, N);
+            ProbableCunninghamChainTestBigNum(N, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+            fChainEnded = true;
         }
+        if (fChainEnded)
+            return;
     }
+}
+
+// Test Probable Cunningham Chain for: n
+// fSophieGermain:
+//   true - Test for Cunningham Chain of first kind (n, 2n+1, 4n+3, ...)
+//   false - Test for Cunningham Chain of second kind (n, 2n-1, 4n-3, ...)
+// pnLengthFermat: if set, also get the chain length with Fermat tests only
+//   from the same exponentiations; fFermatTest is ignored
+// Return value:
+//   true - Probable Cunningham Chain found (length at least 2)
+//   false - Not Cunningham Chain
+bool ProbableCunninghamChainTest(const CBigNum& n, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength, unsigned int* pnLengthFermat)
+{
+    nProbableChainLength = 0;
+    if (pnLengthFermat)
+        *pnLengthFermat = 0;
+    mont_limb_t pN[nMontLimbsMax + 1];
+    pN[nMontLimbsMax] = 0;
+    if (BN_is_odd(&n) && BN_num_bits(&n) > 1 && MontFromBigNum(n, pN, nMontLimbsMax))
+        ProbableCunninghamChainTestFixed(pN, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
+    else
+        ProbableCunninghamChainTestBigNum(n, fSophieGermain, fFermatTest, nProbableChainLength, pnLengthFermat);
 
     return (TargetGetLength(nProbableChainLength) >= 2);
 }
 
+// BiTwin Chain length from the chain lengths of both kinds
+// BiTwin Chain allows a single prime at the end for odd length chain
+static unsigned int BiTwinChainLength(unsigned int nChainLengthCunningham1, unsigned int nChainLengthCunningham2)
+{
+    return (TargetGetLength(nChainLengthCunningham1) > TargetGetLength(nChainLengthCunningham2))?
+        (nChainLengthCunningham2 + TargetFromInt(TargetGetLength(nChainLengthCunningham2)+1)) :
+        (nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)));
+}
+
 // Test probable prime chain for: nOrigin
 // Return value:
 //   true - Probable prime chain found (one of nChainLength meeting target)
@@ -346,11 +755,7 @@ bool ProbablePrimeChainTest(const CBigNum& bnPrimeChainOrigin, unsigned int nBit
     // Test for Cunningham Chain of second kind
     ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, fFermatTest, nChainLengthCunningham2);
     // Figure out BiTwin Chain length
-    // BiTwin Chain allows a single prime at the end for odd length chain
-    nChainLengthBiTwin =
-        (TargetGetLength(nChainLengthCunningham1) > TargetGetLength(nChainLengthCunningham2))?
-            (nChainLengthCunningham2 + TargetFromInt(TargetGetLength(nChainLengthCunningham2)+1)) :
-            (nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)));
+    nChainLengthBiTwin = BiTwinChainLength(nChainLengthCunningham1, nChainLengthCunningham2);
 
     return (nChainLengthCunningham1 >= nBits || nChainLengthCunningham2 >= nBits || nChainLengthBiTwin >= nBits);
 }
@@ -402,11 +807,19 @@ bool CheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CB
     if (bnPrimeChainOrigin > bnPrimeMax)
         return error("CheckPrimeProofOfWork() : prime too big");
 
-    // Check prime chain
+    // Check prime chain, and double check it with Fermat tests only; a single
+    // pass of exponentiations gives the chain lengths of both
     unsigned int nChainLengthCunningham1 = 0;
     unsigned int nChainLengthCunningham2 = 0;
     unsigned int nChainLengthBiTwin = 0;
-    if (!ProbablePrimeChainTest(bnPrimeChainOrigin, nBits, false, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin))
+    unsigned int nChainLengthCunningham1FermatTest = 0;
+    unsigned int nChainLengthCunningham2FermatTest = 0;
+    unsigned int nChainLengthBiTwinFermatTest = 0;
+    ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, nChainLengthCunningham1, &nChainLengthCunningham1FermatTest);
+    ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, nChainLengthCunningham2, &nChainLengthCunningham2FermatTest);
+    nChainLengthBiTwin = BiTwinChainLength(nChainLengthCunningham1, nChainLengthCunningham2);
+    nChainLengthBiTwinFermatTest = BiTwinChainLength(nChainLengthCunningham1FermatTest, nChainLengthCunningham2FermatTest);
+    if (nChainLengthCunningham1 < nBits && nChainLengthCunningham2 < nBits && nChainLengthBiTwin < nBits)
     {
         // Despite failing the check, still return info of longest primechain from the three chain types
         nChainLength = nChainLengthCunningham1;
@@ -424,15 +837,7 @@ bool CheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CB
         return error("CheckPrimeProofOfWork() : failed prime chain test target=%s length=(%s %s %s)", TargetToString(nBits).c_str(),
             TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str());
     }
-    if (nChainLengthCunningham1 < nBits && nChainLengthCunningham2 < nBits && nChainLengthBiTwin < nBits)
-        return error("CheckPrimeProofOfWork() : prime chain length assert target=%s length=(%s %s %s)", TargetToString(nBits).c_str(),
-            TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str());
-
-    // Double check prime chain with Fermat tests only
-    unsigned int nChainLengthCunningham1FermatTest = 0;
-    unsigned int nChainLengthCunningham2FermatTest = 0;
-    unsigned int nChainLengthBiTwinFermatTest = 0;
-    if (!ProbablePrimeChainTest(bnPrimeChainOrigin, nBits, true, nChainLengthCunningham1FermatTest, nChainLengthCunningham2FermatTest, nChainLengthBiTwinFermatTest))
+    if (nChainLengthCunningham1FermatTest < nBits && nChainLengthCunningham2FermatTest < nBits && nChainLengthBiTwinFermatTest < nBits)
         return error("CheckPrimeProofOfWork() : failed Fermat test target=%s length=(%s %s %s) lengthFermat=(%s %s %s)", TargetToString(nBits).c_str(),
             TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str(),
             TargetToString(nChainLengthCunningham1FermatTest).c_str(), TargetToString(nChainLengthCunningham2FermatTest).c_str(), TargetToString(nChainLengthBiTwinFermatTest).c_str());
@@ -489,8 +894,11 @@ double GetPrimeDifficulty(unsigned int nBits)
 }
 
 // Estimate work transition target to longer prime chain
+// nChainLength: 0 if the prime chain was not verified, the estimate stays
 unsigned int EstimateWorkTransition(unsigned int nPrevWorkTransition, unsigned int nBits, unsigned int nChainLength)
 {
+    if (nChainLength == 0)
+        return nPrevWorkTransition;
     int64 nInterval = 500;
     int64 nWorkTransition = nPrevWorkTransition;
     unsigned int nBitsCeiling = 0;
@@ -511,191 +919,1306 @@ unsigned int EstimateWorkTransition(unsigned int nPrevWorkTransition, unsigned i
 /* PRIMECOIN MINING */
 /********************/
 
-// Test probable prime chain for: nOrigin (miner version - for miner use only)
+// Derive the chain number fixed factor * nMultiplier - 1 (fSophieGermain) or
+// + 1 into pN of nMontLimbsMax + 1 limbs
+// Return value: false if it is beyond the fixed-width range or not above 1
+static bool GetChainNumberFixed(const CPrimeFixedFactor& fixed, unsigned int nMultiplier, bool fSophieGermain, mont_limb_t* pN)
+{
+    static const unsigned int nLimbWords = nMontLimbBits / 32;
+    if (fixed.nWords >= nMontLimbsMax * nLimbWords || BN_is_negative(&fixed.bnFixedFactor) || nMultiplier == 0)
+        return false;
+    for (unsigned int j = 0; j < nMontLimbsMax + 1; j++)
+        pN[j] = 0;
+    uint64 nCarry = 0;
+    for (unsigned int j = 0; j <= fixed.nWords; j++)
+    {
+        nCarry += (uint64) fixed.vWords[j] * nMultiplier;
+        pN[j / nLimbWords] |= ((mont_limb_t) (unsigned int) nCarry) << (32 * (j % nLimbWords));
+        nCarry >>= 32;
+    }
+    if (fSophieGermain)
+    {
+        for (unsigned int j = 0; j < nMontLimbsMax + 1; j++)
+            if (pN[j]-- != 0)
+                break;
+    }
+    else
+    {
+        for (unsigned int j = 0; j < nMontLimbsMax + 1; j++)
+            if (++pN[j] != 0)
+                break;
+    }
+    unsigned int nBits = MontBitLength(pN, nMontLimbsMax + 1);
+    return (nBits > 1 && nBits <= nMontBitsMax);
+}
+
+// Test probable Cunningham Chain from fixed factor * nMultiplier - 1 for the
+// first kind, + 1 for the second kind
+// Return value:
+//   true - Probable Cunningham Chain found (length at least 2)
+//   false - Not Cunningham Chain
+static bool ProbableCunninghamChainTestFromFactor(const CPrimeFixedFactor& fixed, unsigned int nMultiplier, bool fSophieGermain, unsigned int& nProbableChainLength)
+{
+    nProbableChainLength = 0;
+    mont_limb_t pN[nMontLimbsMax + 1];
+    if (GetChainNumberFixed(fixed, nMultiplier, fSophieGermain, pN) && (pN[0] & 1))
+        ProbableCunninghamChainTestFixed(pN, fSophieGermain, false, nProbableChainLength);
+    else
+        ProbableCunninghamChainTestBigNum(fixed.bnFixedFactor * nMultiplier + (fSophieGermain? -1 : 1), fSophieGermain, false, nProbableChainLength);
+
+    return (TargetGetLength(nProbableChainLength) >= 2);
+}
+
+// Test probable prime chain for: fixed factor * nMultiplier (miner version - for miner use only)
 // Return value:
 //   true - Probable prime chain found (nChainLength meeting target)
 //   false - prime chain too short (nChainLength not meeting target)
-static bool ProbablePrimeChainTestForMiner(const CBigNum& bnPrimeChainOrigin, unsigned int nBits, unsigned nCandidateType, unsigned int& nChainLength)
+static bool ProbablePrimeChainTestForMiner(const CPrimeFixedFactor& fixed, unsigned int nMultiplier, unsigned int nBits, unsigned nCandidateType, unsigned int& nChainLength)
 {
     nChainLength = 0;
 
     // Test for Cunningham Chain of first kind
     if (nCandidateType == PRIME_CHAIN_CUNNINGHAM1)
-        ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, nChainLength);
+        ProbableCunninghamChainTestFromFactor(fixed, nMultiplier, true, nChainLength);
     // Test for Cunningham Chain of second kind
     else if (nCandidateType == PRIME_CHAIN_CUNNINGHAM2)
-        ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, nChainLength);
+        ProbableCunninghamChainTestFromFactor(fixed, nMultiplier, false, nChainLength);
     else
     {
         unsigned int nChainLengthCunningham1 = 0;
         unsigned int nChainLengthCunningham2 = 0;
-        if (ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, nChainLengthCunningham1))
+        if (ProbableCunninghamChainTestFromFactor(fixed, nMultiplier, true, nChainLengthCunningham1))
         {
-            ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, nChainLengthCunningham2);
-            // Figure out BiTwin Chain length
-            // BiTwin Chain allows a single prime at the end for odd length chain
-            nChainLength =
-                (TargetGetLength(nChainLengthCunningham1) > TargetGetLength(nChainLengthCunningham2))?
-                    (nChainLengthCunningham2 + TargetFromInt(TargetGetLength(nChainLengthCunningham2)+1)) :
-                    (nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)));
+            ProbableCunninghamChainTestFromFactor(fixed, nMultiplier, false, nChainLengthCunningham2);
+            nChainLength = BiTwinChainLength(nChainLengthCunningham1, nChainLengthCunningham2);
         }
     }
 
     return (nChainLength >= nBits);
 }
 
-// Perform Fermat test with trial division
-// Return values:
-//   true  - passes trial division test and Fermat test; probable prime
-//   false - failed either trial division or Fermat test; composite
-bool ProbablePrimalityTestWithTrialDivision(const CBigNum& bnCandidate, unsigned int nTrialDivisionLimit)
+// Lane-parallel Fermat tests
+//
+// nPrimeTestLanes numbers are tested at once. Limb j of lane k is stored at
+// [j * nPrimeTestLanes + k], so each step of the Montgomery multiplication
+// is the same operation on all lanes. Limbs hold 28 bits in 64-bit lane
+// words: a product of two limbs then has 8 spare bits, so up to 256 products
+// accumulate without carry propagation and the inner loop is just two
+// 32x32 bit vector multiplications and two additions. R = 2**(28 * limbs)
+// is chosen above 8n, which keeps all intermediate values below 2n without
+// conditional subtractions.
+static const unsigned int nLaneLimbBits = 28;
+static const uint64 nLaneLimbMask = (1u << nLaneLimbBits) - 1;
+static const unsigned int nLaneWordsMax = nMontBitsMax / 32;
+static const unsigned int nLaneLimbsMax = (nMontBitsMax + 3 + nLaneLimbBits - 1) / nLaneLimbBits;
+
+// r = a * b / R modulo n in every lane; a, b < 2n; r < 2n may alias a or b
+typedef void (*LanesMultiplyFunc)(uint64* pr, const uint64* pa, const uint64* pb, const uint64* pn, const uint64* pnInverse, unsigned int nLimbs);
+
+#ifdef PRIME_LANES_DISPATCH
+__attribute__((target("avx2")))
+static void LanesMultiplyAVX2(uint64* pr, const uint64* pa, const uint64* pb, const uint64* pn, const uint64* pnInverse, unsigned int nLimbs)
 {
-    // Trial division
-    BOOST_FOREACH(unsigned int nPrime, vPrimes)
+    // Two vectors of four lanes each
+    __m256i t[(2 * nLaneLimbsMax + 1) * 2];
+    for (unsigned int j = 0; j < (2 * nLimbs + 1) * 2; j++)
+        t[j] = _mm256_setzero_si256();
+    const __m256i vMask = _mm256_set1_epi64x(nLaneLimbMask);
+    const __m256i vInverse0 = _mm256_loadu_si256((const __m256i*) pnInverse);
+    const __m256i vInverse1 = _mm256_loadu_si256((const __m256i*) (pnInverse + 4));
+    for (unsigned int i = 0; i < nLimbs; i++)
     {
-        if (nPrime >= nTrialDivisionLimit)
-            break;
-        if (bnCandidate % nPrime == 0)
-            return false; // failed trial division test
+        __m256i* pt = t + i * 2;
+        const __m256i b0 = _mm256_loadu_si256((const __m256i*) (pb + i * nPrimeTestLanes));
+        const __m256i b1 = _mm256_loadu_si256((const __m256i*) (pb + i * nPrimeTestLanes + 4));
+        __m256i nLow0 = _mm256_add_epi64(pt[0], _mm256_mul_epu32(_mm256_loadu_si256((const __m256i*) pa), b0));
+        __m256i nLow1 = _mm256_add_epi64(pt[1], _mm256_mul_epu32(_mm256_loadu_si256((const __m256i*) (pa + 4)), b1));
+        const __m256i m0 = _mm256_and_si256(_mm256_mul_epu32(nLow0, vInverse0), vMask);
+        const __m256i m1 = _mm256_and_si256(_mm256_mul_epu32(nLow1, vInverse1), vMask);
+        nLow0 = _mm256_add_epi64(nLow0, _mm256_mul_epu32(m0, _mm256_loadu_si256((const __m256i*) pn)));
+        nLow1 = _mm256_add_epi64(nLow1, _mm256_mul_epu32(m1, _mm256_loadu_si256((const __m256i*) (pn + 4))));
+        pt[2] = _mm256_add_epi64(pt[2], _mm256_srli_epi64(nLow0, nLaneLimbBits));
+        pt[3] = _mm256_add_epi64(pt[3], _mm256_srli_epi64(nLow1, nLaneLimbBits));
+        for (unsigned int j = 1; j < nLimbs; j++)
+        {
+            const uint64* paj = pa + j * nPrimeTestLanes;
+            const uint64* pnj = pn + j * nPrimeTestLanes;
+            pt[j * 2] = _mm256_add_epi64(pt[j * 2], _mm256_add_epi64(
+                _mm256_mul_epu32(_mm256_loadu_si256((const __m256i*) paj), b0),
+                _mm256_mul_epu32(_mm256_loadu_si256((const __m256i*) pnj), m0)));
+            pt[j * 2 + 1] = _mm256_add_epi64(pt[j * 2 + 1], _mm256_add_epi64(
+                _mm256_mul_epu32(_mm256_loadu_si256((const __m256i*) (paj + 4)), b1),
+                _mm256_mul_epu32(_mm256_loadu_si256((const __m256i*) (pnj + 4)), m1)));
+        }
+    }
+    __m256i vCarry0 = _mm256_setzero_si256(), vCarry1 = _mm256_setzero_si256();
+    for (unsigned int j = 0; j < nLimbs; j++)
+    {
+        __m256i nLimb0 = _mm256_add_epi64(t[(nLimbs + j) * 2], vCarry0);
+        __m256i nLimb1 = _mm256_add_epi64(t[(nLimbs + j) * 2 + 1], vCarry1);
+        _mm256_storeu_si256((__m256i*) (pr + j * nPrimeTestLanes), _mm256_and_si256(nLimb0, vMask));
+        _mm256_storeu_si256((__m256i*) (pr + j * nPrimeTestLanes + 4), _mm256_and_si256(nLimb1, vMask));
+        vCarry0 = _mm256_srli_epi64(nLimb0, nLaneLimbBits);
+        vCarry1 = _mm256_srli_epi64(nLimb1, nLaneLimbBits);
     }
-    unsigned int nLength = 0;
-    return (FermatProbablePrimalityTest(bnCandidate, nLength));
 }
 
-// Sieve for mining
-boost::thread_specific_ptr<CSieveOfEratosthenes> psieve;
-boost::thread_specific_ptr<CPrimeMiner> pminer;
-
-// Mine probable prime chain of form: n = h * p# +/- 1
-bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNewBlock, unsigned int& nTriedMultiplier, unsigned int& nProbableChainLength, unsigned int& nTests, unsigned int& nPrimesHit)
+__attribute__((target("avx512f")))
+static void LanesMultiplyAVX512(uint64* pr, const uint64* pa, const uint64* pb, const uint64* pn, const uint64* pnInverse, unsigned int nLimbs)
 {
-    nProbableChainLength = 0;
-    nTests = 0;
-    nPrimesHit = 0;
-
-    if (fNewBlock && psieve.get() != NULL)
+    __m512i t[2 * nLaneLimbsMax + 1];
+    for (unsigned int j = 0; j < 2 * nLimbs + 1; j++)
+        t[j] = _mm512_setzero_si512();
+    const __m512i vMask = _mm512_set1_epi64(nLaneLimbMask);
+    const __m512i vInverse = _mm512_loadu_si512(pnInverse);
+    for (unsigned int i = 0; i < nLimbs; i++)
     {
-        // Must rebuild the sieve
-        psieve.reset();
+        __m512i* pt = t + i;
+        const __m512i b = _mm512_loadu_si512(pb + i * nPrimeTestLanes);
+        __m512i nLow = _mm512_add_epi64(pt[0], _mm512_mul_epu32(_mm512_loadu_si512(pa), b));
+        const __m512i m = _mm512_and_si512(_mm512_mul_epu32(nLow, vInverse), vMask);
+        nLow = _mm512_add_epi64(nLow, _mm512_mul_epu32(m, _mm512_loadu_si512(pn)));
+        pt[1] = _mm512_add_epi64(pt[1], _mm512_srli_epi64(nLow, nLaneLimbBits));
+        for (unsigned int j = 1; j < nLimbs; j++)
+            pt[j] = _mm512_add_epi64(pt[j], _mm512_add_epi64(
+                _mm512_mul_epu32(_mm512_loadu_si512(pa + j * nPrimeTestLanes), b),
+                _mm512_mul_epu32(_mm512_loadu_si512(pn + j * nPrimeTestLanes), m)));
     }
-    fNewBlock = false;
+    __m512i vCarry = _mm512_setzero_si512();
+    for (unsigned int j = 0; j < nLimbs; j++)
+    {
+        __m512i nLimb = _mm512_add_epi64(t[nLimbs + j], vCarry);
+        _mm512_storeu_si512(pr + j * nPrimeTestLanes, _mm512_and_si512(nLimb, vMask));
+        vCarry = _mm512_srli_epi64(nLimb, nLaneLimbBits);
+    }
+}
+#endif
 
-    int64 nStart, nCurrent; // microsecond timer
-    CBlockIndex* pindexPrev = pindexBest;
-    if (psieve.get() == NULL)
+// Lane engine selected once, on the first call from any miner thread
+static boost::once_flag lanesMultiplyInitFlag = BOOST_ONCE_INIT;
+static LanesMultiplyFunc pfnLanesEngine = NULL;
+static const char* pszLanesEngine = NULL;
+
+static void LanesMultiplyInit()
+{
+    // Without vector units the candidates are tested one by one, as the
+    // 64-bit scalar path beats eight lanes of 32-bit products
+    const char* pszName = "scalar";
+    LanesMultiplyFunc pfn = NULL;
+#ifdef PRIME_LANES_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
     {
-        // Build sieve
-        psieve.reset(new CSieveOfEratosthenes(nMaxSieveSize, block.nBits, block.GetHeaderHash(), bnFixedMultiplier));
-        int64 nSieveRoundLimit = (int)GetArg("-gensieveroundlimitms", 1000);
-        nStart = GetTimeMicros();
-        unsigned int nWeaveTimes = 0;
-        while (psieve->Weave() && pindexPrev == pindexBest && (GetTimeMicros() - nStart < 1000 * nSieveRoundLimit) && (++nWeaveTimes < pminer->nSieveWeaveOptimal));
-        nCurrent = GetTimeMicros();
-        int64 nSieveWeaveCost = (nCurrent - nStart) / std::max(nWeaveTimes, 1u); // average weave cost in us
-        unsigned int nCandidateCount = psieve->GetCandidateCount();
-        psieve->Weave(); // weave once more to find out about weave efficiency
-        unsigned int nSieveWeaveComposites = nCandidateCount;
-        nCandidateCount = psieve->GetCandidateCount();
-        nSieveWeaveComposites = nCandidateCount - nSieveWeaveComposites; // number of composite chains found in last weave
-        if (fDebug && GetBoolArg("-printmining"))
-            printf("MineProbablePrimeChain() : new sieve (%u/%u@%u/%u) ready in %uus test cost=%uus\n",
-                nCandidateCount, nMaxSieveSize,
-                (nWeaveTimes < vPrimes.size())? vPrimes[nWeaveTimes] : nPrimeTableLimit, pminer->GetSieveWeaveOptimalPrime(),
-                (unsigned int) (nCurrent - nStart), (unsigned int)pminer->GetPrimalityTestCost());
-        pminer->TimerSetSieveReady(nCandidateCount, nCurrent);
-        pminer->SetSieveWeaveCount(nWeaveTimes);
-        pminer->SetSieveWeaveCost(nSieveWeaveCost, nSieveWeaveComposites);
-        pminer->AdjustSieveWeaveOptimal();
-    }
-
-    CBigNum bnChainOrigin;
+        pszName = "avx512";
+        pfn = LanesMultiplyAVX512;
+    }
+    else if (__builtin_cpu_supports("avx2"))
+    {
+        pszName = "avx2";
+        pfn = LanesMultiplyAVX2;
+    }
+#endif
+    pszLanesEngine = pszName;
+    pfnLanesEngine = pfn;
+}
 
-    nStart = GetTimeMicros();
-    nCurrent = nStart;
+static LanesMultiplyFunc GetLanesMultiply(const char** ppszName)
+{
+    boost::call_once(&LanesMultiplyInit, lanesMultiplyInitFlag);
+    if (ppszName)
+        *ppszName = pszLanesEngine;
+    return pfnLanesEngine;
+}
 
-    while (nCurrent - nStart < 10000 && nCurrent >= nStart && pindexPrev == pindexBest)
+const char* GetPrimeTestBatchEngine()
+{
+    const char* pszName;
+    GetLanesMultiply(&pszName);
+    return pszName;
+}
+
+// r = 2**(n-1) modulo n in every lane; pn and pr hold nWords 32-bit words
+// per lane, n odd of nMinBits to nMaxBits bits
+static void LanesFermat(LanesMultiplyFunc pfnMultiply, unsigned int* pr, const unsigned int* pn, unsigned int nWords, unsigned int nMinBits, unsigned int nMaxBits)
+{
+    unsigned int nLimbs = (nMaxBits + 3 + nLaneLimbBits - 1) / nLaneLimbBits; // R > 8n
+    uint64 n[nLaneLimbsMax * nPrimeTestLanes];
+    uint64 x[nLaneLimbsMax * nPrimeTestLanes];
+    uint64 y[nLaneLimbsMax * nPrimeTestLanes];
+    uint64 pnInverse[nPrimeTestLanes];
+    for (unsigned int k = 0; k < nPrimeTestLanes; k++)
     {
-        nTests++;
-        unsigned int nCandidateType;
-        if (!psieve->GetNextCandidateMultiplier(nTriedMultiplier, nCandidateType))
+        // Repack 32-bit words into 28-bit limbs
+        for (unsigned int j = 0; j < nLimbs; j++)
         {
-            // power tests completed for the sieve
-            pminer->TimerSetPrimalityDone(nCurrent);
-            psieve.reset();
-            fNewBlock = true; // notify caller to change nonce
-            return false;
+            unsigned int nBit = j * nLaneLimbBits;
+            uint64 nLimb = 0;
+            if (nBit / 32 < nWords)
+                nLimb = pn[(nBit / 32) * nPrimeTestLanes + k] >> (nBit % 32);
+            if (nBit / 32 + 1 < nWords)
+                nLimb |= ((uint64) pn[(nBit / 32 + 1) * nPrimeTestLanes + k]) << (32 - nBit % 32);
+            n[j * nPrimeTestLanes + k] = nLimb & nLaneLimbMask;
         }
-        bnChainOrigin = CBigNum(block.GetHeaderHash()) * bnFixedMultiplier * nTriedMultiplier;
-        unsigned int nChainLength = 0;
-        if (ProbablePrimeChainTestForMiner(bnChainOrigin, block.nBits, nCandidateType, nChainLength))
+
+        // -n**-1 modulo 2**28 by Newton iteration
+        unsigned int nInv = pn[k];
+        for (unsigned int nCorrect = 3; nCorrect < nLaneLimbBits; nCorrect *= 2)
+            nInv *= 2 - pn[k] * nInv;
+        pnInverse[k] = (0u - nInv) & nLaneLimbMask;
+    }
+
+    // R modulo n, i.e. 1 in Montgomery form, by doubling 2**(nMinBits-1)
+    // which is below every lane's n
+    for (unsigned int j = 0; j < nLimbs * nPrimeTestLanes; j++)
+        x[j] = 0;
+    for (unsigned int k = 0; k < nPrimeTestLanes; k++)
+        x[((nMinBits - 1) / nLaneLimbBits) * nPrimeTestLanes + k] = ((uint64) 1) << ((nMinBits - 1) % nLaneLimbBits);
+    for (unsigned int i = nMinBits - 1; i < nLimbs * nLaneLimbBits; i++)
+    {
+        for (unsigned int k = 0; k < nPrimeTestLanes; k++)
         {
-            block.bnPrimeChainMultiplier = bnFixedMultiplier * nTriedMultiplier;
-            printf("Probable prime chain found for block=%s!!\n  Target: %s\n  Chain: %s\n", block.GetHash().GetHex().c_str(),
-                TargetToString(block.nBits).c_str(), GetPrimeChainName(nCandidateType, nChainLength).c_str());
-            nProbableChainLength = nChainLength;
-            return true;
+            // x = 2x, then subtract n unless that borrows
+            uint64 nCarry = 0, nBorrow = 0;
+            for (unsigned int j = 0; j < nLimbs; j++)
+            {
+                uint64 nLimb = (x[j * nPrimeTestLanes + k] << 1) + nCarry;
+                nCarry = nLimb >> nLaneLimbBits;
+                x[j * nPrimeTestLanes + k] = nLimb & nLaneLimbMask;
+                y[j * nPrimeTestLanes + k] = (nLimb - n[j * nPrimeTestLanes + k] - nBorrow) & nLaneLimbMask;
+                nBorrow = ((nLimb & nLaneLimbMask) < n[j * nPrimeTestLanes + k] + nBorrow);
+            }
+            if (!nBorrow)
+                for (unsigned int j = 0; j < nLimbs; j++)
+                    x[j * nPrimeTestLanes + k] = y[j * nPrimeTestLanes + k];
         }
-        nProbableChainLength = nChainLength;
-        if(TargetGetLength(nProbableChainLength) >= 1)
-            nPrimesHit++;
-
-        nCurrent = GetTimeMicros();
     }
-    return false; // stop as timed out
-}
 
-// Weave sieve for the next prime in table
-// Return values:
-//   True  - weaved another prime
-//   False - sieve already completed
-bool CSieveOfEratosthenes::Weave()
-{
-    if (nPrimeSeq >= vPrimes.size() || vPrimes[nPrimeSeq] >= nSieveSize)
-        return false;  // sieve has been completed
-    CBigNum p = vPrimes[nPrimeSeq];
-    if (bnFixedFactor % p == 0)
+    // Exponent n-1 differs from n only in bit 0, which is clear. Squaring
+    // and doubling fold into one multiplication, x = x * 2x. Leading zero
+    // bits of shorter lanes keep x at 1
+    for (unsigned int nBit = nMaxBits; nBit > 0; nBit--)
     {
-        // Nothing in the sieve is divisible by this prime
-        nPrimeSeq++;
-        return true;
+        uint64 pnDouble[nPrimeTestLanes];
+        for (unsigned int k = 0; k < nPrimeTestLanes; k++)
+            pnDouble[k] = (nBit > 1)? ((pn[((nBit - 1) / 32) * nPrimeTestLanes + k] >> ((nBit - 1) % 32)) & 1) : 0;
+        uint64 pnCarry[nPrimeTestLanes] = {0};
+        for (unsigned int j = 0; j < nLimbs; j++)
+            for (unsigned int k = 0; k < nPrimeTestLanes; k++)
+            {
+                uint64 nLimb = (x[j * nPrimeTestLanes + k] << pnDouble[k]) + pnCarry[k];
+                y[j * nPrimeTestLanes + k] = nLimb & nLaneLimbMask;
+                pnCarry[k] = nLimb >> nLaneLimbBits;
+            }
+        pfnMultiply(x, x, y, n, pnInverse, nLimbs);
     }
-    // Find the modulo inverse of fixed factor
-    CAutoBN_CTX pctx;
-    CBigNum bnFixedInverse;
-    if (!BN_mod_inverse(&bnFixedInverse, &bnFixedFactor, &p, pctx))
-        return error("CSieveOfEratosthenes::Weave(): BN_mod_inverse of fixed factor failed for prime #%u=%u", nPrimeSeq, vPrimes[nPrimeSeq]);
-    CBigNum bnTwo = 2;
-    CBigNum bnTwoInverse;
-    if (!BN_mod_inverse(&bnTwoInverse, &bnTwo, &p, pctx))
-        return error("CSieveOfEratosthenes::Weave(): BN_mod_inverse of 2 failed for prime #%u=%u", nPrimeSeq, vPrimes[nPrimeSeq]);
-
-    // Weave the sieve for the prime
-    unsigned int nChainLength = TargetGetLength(nBits);
-    for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < 2 * nChainLength; nBiTwinSeq++)
+
+    // Out of Montgomery form; the result is fully reduced
+    for (unsigned int j = 0; j < nLimbs * nPrimeTestLanes; j++)
+        y[j] = (j < nPrimeTestLanes)? 1 : 0;
+    pfnMultiply(x, x, y, n, pnInverse, nLimbs);
+    for (unsigned int k = 0; k < nPrimeTestLanes; k++)
     {
-        // Find the first number that's divisible by this prime
-        int nDelta = ((nBiTwinSeq % 2 == 0)? (-1) : 1);
-        unsigned int nSolvedMultiplier = ((bnFixedInverse * (p - nDelta)) % p).getuint();
-        if (nBiTwinSeq % 2 == 1)
-            bnFixedInverse *= bnTwoInverse; // for next number in chain
-
-        unsigned int nPrime = vPrimes[nPrimeSeq];
-        if (nBiTwinSeq < nChainLength)
-            for (unsigned int nVariableMultiplier = nSolvedMultiplier; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
-                vfCompositeBiTwin[nVariableMultiplier] = true;
-        if (((nBiTwinSeq & 1u) == 0))
-            for (unsigned int nVariableMultiplier = nSolvedMultiplier; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
-                vfCompositeCunningham1[nVariableMultiplier] = true;
-        if (((nBiTwinSeq & 1u) == 1u))
-            for (unsigned int nVariableMultiplier = nSolvedMultiplier; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
-                vfCompositeCunningham2[nVariableMultiplier] = true;
+        for (unsigned int j = 0; j < nWords; j++)
+            pr[j * nPrimeTestLanes + k] = 0;
+        for (unsigned int j = 0; j < nLimbs; j++)
+        {
+            unsigned int nBit = j * nLaneLimbBits;
+            uint64 nLimb = x[j * nPrimeTestLanes + k];
+            if (nBit / 32 < nWords)
+                pr[(nBit / 32) * nPrimeTestLanes + k] |= (unsigned int) (nLimb << (nBit % 32));
+            if (nBit / 32 + 1 < nWords)
+                pr[(nBit / 32 + 1) * nPrimeTestLanes + k] |= (unsigned int) (nLimb >> (32 - nBit % 32));
+        }
     }
-    nPrimeSeq++;
-    return true;
 }
 
-// Estimate the probability of primality for a number in a candidate chain
-double EstimateCandidatePrimeProbability()
+// Fractional length of a failed Fermat test of lane k: ((n - r) << 24) / n
+static unsigned int LanesGetFractional(const unsigned int* pn, const unsigned int* pr, unsigned int k, unsigned int nWords)
+{
+    unsigned int n[nLaneWordsMax], d[nLaneWordsMax];
+    uint64 nBorrow = 0;
+    for (unsigned int j = 0; j < nWords; j++)
+    {
+        n[j] = pn[j * nPrimeTestLanes + k];
+        uint64 nDiff = (uint64) n[j] - pr[j * nPrimeTestLanes + k] - nBorrow;
+        d[j] = (unsigned int) nDiff;
+        nBorrow = nDiff >> 63;
+    }
+    unsigned int nFractional = 0;
+    for (unsigned int nBit = 0; nBit < nFractionalBits; nBit++)
+    {
+        // Long division one quotient bit at a time; d < n throughout
+        unsigned int nCarry = d[nWords - 1] >> 31;
+        for (unsigned int j = nWords - 1; j > 0; j--)
+            d[j] = (d[j] << 1) | (d[j - 1] >> 31);
+        d[0] <<= 1;
+        nFractional <<= 1;
+        unsigned int j = nWords;
+        while (j > 0 && d[j - 1] == n[j - 1])
+            j--;
+        bool fSubtract = (nCarry != 0 || j == 0 || d[j - 1] > n[j - 1]);
+        if (fSubtract)
+        {
+            nBorrow = 0;
+            for (unsigned int j = 0; j < nWords; j++)
+            {
+                uint64 nDiff = (uint64) d[j] - n[j] - nBorrow;
+                d[j] = (unsigned int) nDiff;
+                nBorrow = nDiff >> 63;
+            }
+            nFractional |= 1;
+        }
+    }
+    return nFractional;
+}
+
+unsigned int ProbablePrimeChainTestBatch(const CPrimeFixedFactor& fixed, unsigned int nBits, unsigned int nCandidates, const unsigned int* pnMultipliers, const unsigned int* pnCandidateTypes, unsigned int* pnChainLengths)
+{
+    LanesMultiplyFunc pfnLanesMultiply = GetLanesMultiply(NULL);
+    unsigned int nFixedWords = fixed.nWords;
+    const std::vector<unsigned int>& vFixedFactorWords = fixed.vWords;
+    bool fLanes = pfnLanesMultiply != NULL && !BN_is_negative(&fixed.bnFixedFactor) && !BN_is_odd(&fixed.bnFixedFactor) && nFixedWords + 1 <= nLaneWordsMax;
+
+    unsigned int nFound = 0;
+    for (unsigned int nFirst = 0; nFirst < nCandidates; nFirst += nPrimeTestLanes)
+    {
+        unsigned int nLanes = std::min(nCandidates - nFirst, nPrimeTestLanes);
+        unsigned int pn[nLaneWordsMax * nPrimeTestLanes];
+        unsigned int pr[nLaneWordsMax * nPrimeTestLanes];
+        unsigned int nWords = nFixedWords + 1;
+        unsigned int nMinBits = nWords * 32, nMaxBits = 0;
+        bool pfLane[nPrimeTestLanes];
+        for (unsigned int k = 0; k < nPrimeTestLanes; k++)
+        {
+            // First number of the chain: origin - 1 for chains of the first
+            // kind and BiTwin, origin + 1 for chains of the second kind
+            unsigned int nLane = std::min(k, nLanes - 1); // spare lanes repeat the last candidate
+            unsigned int nMultiplier = pnMultipliers[nFirst + nLane];
+            bool fSophieGermain = (pnCandidateTypes[nFirst + nLane] != PRIME_CHAIN_CUNNINGHAM2);
+            uint64 nCarry = 0;
+            for (unsigned int j = 0; j < nWords; j++)
+            {
+                nCarry += (uint64) vFixedFactorWords[j] * nMultiplier;
+                pn[j * nPrimeTestLanes + k] = (unsigned int) nCarry;
+                nCarry >>= 32;
+            }
+            if (fSophieGermain)
+            {
+                for (unsigned int j = 0; j < nWords; j++)
+                    if (pn[j * nPrimeTestLanes + k]-- != 0)
+                        break;
+            }
+            else
+                pn[k] |= 1;
+            unsigned int nLaneBits = nWords * 32;
+            for (unsigned int j = nWords; j > 0 && pn[(j - 1) * nPrimeTestLanes + k] == 0; j--)
+                nLaneBits -= 32;
+            if (nLaneBits > 0)
+                for (unsigned int nTop = pn[(nLaneBits / 32 - 1) * nPrimeTestLanes + k]; !(nTop >> 31); nTop <<= 1)
+                    nLaneBits--;
+            pfLane[k] = fLanes && nMultiplier > 0 && nLaneBits > 1 && nLaneBits <= nMontBitsMax;
+            if (pfLane[k])
+            {
+                nMinBits = std::min(nMinBits, nLaneBits);
+                nMaxBits = std::max(nMaxBits, nLaneBits);
+            }
+        }
+        if (nMaxBits > 0)
+        {
+            // Lanes that cannot be tested take the modulus of a testable one
+            unsigned int kValid = 0;
+            while (!pfLane[kValid])
+                kValid++;
+            for (unsigned int k = 0; k < nPrimeTestLanes; k++)
+                if (!pfLane[k])
+                    for (unsigned int j = 0; j < nWords; j++)
+                        pn[j * nPrimeTestLanes + k] = pn[j * nPrimeTestLanes + kValid];
+            nWords = (nMaxBits + 31) / 32;
+            LanesFermat(pfnLanesMultiply, pr, pn, nWords, nMinBits, nMaxBits);
+        }
+
+        for (unsigned int k = 0; k < nLanes; k++)
+        {
+            unsigned int nCandidate = nFirst + k;
+            unsigned int nCandidateType = pnCandidateTypes[nCandidate];
+            unsigned int& nChainLength = pnChainLengths[nCandidate];
+            nChainLength = 0;
+            if (!pfLane[k])
+            {
+                ProbablePrimeChainTestForMiner(fixed, pnMultipliers[nCandidate], nBits, nCandidateType, nChainLength);
+                if (nChainLength >= nBits)
+                    nFound++;
+                continue;
+            }
+
+            bool fProbablePrime = (pr[k] == 1);
+            for (unsigned int j = 1; j < nWords && fProbablePrime; j++)
+                fProbablePrime = (pr[j * nPrimeTestLanes + k] == 0);
+            unsigned int nChainLengthFirst = 0;
+            if (!fProbablePrime)
+                nChainLengthFirst = LanesGetFractional(pn, pr, k, nWords);
+            else
+            {
+                // Continue the chain from its second number one by one
+                bool fSophieGermain = (nCandidateType != PRIME_CHAIN_CUNNINGHAM2);
+                mont_limb_t pN[nMontLimbsMax + 1];
+                for (unsigned int j = 0; j < nMontLimbsMax + 1; j++)
+                    pN[j] = 0;
+                for (unsigned int j = 0; j < nWords; j++)
+                    pN[j / (nMontLimbBits / 32)] |= ((mont_limb_t) pn[j * nPrimeTestLanes + k]) << (32 * (j % (nMontLimbBits / 32)));
+                MontDoublePlusMinusOne(pN, nMontLimbsMax + 1, fSophieGermain);
+                nChainLengthFirst = TargetFromInt(1);
+                ProbableCunninghamChainTestFixed(pN, fSophieGermain, false, nChainLengthFirst);
+            }
+
+            if (nCandidateType != PRIME_CHAIN_BI_TWIN)
+                nChainLength = nChainLengthFirst;
+            else if (TargetGetLength(nChainLengthFirst) >= 2)
+            {
+                unsigned int nChainLengthCunningham2 = 0;
+                ProbableCunninghamChainTestFromFactor(fixed, pnMultipliers[nCandidate], false, nChainLengthCunningham2);
+                nChainLength = BiTwinChainLength(nChainLengthFirst, nChainLengthCunningham2);
+            }
+            if (nChainLength >= nBits)
+                nFound++;
+        }
+    }
+    return nFound;
+}
+
+// Perform Fermat test with trial division
+// Return values:
+//   true  - passes trial division test and Fermat test; probable prime
+//   false - failed either trial division or Fermat test; composite
+bool ProbablePrimalityTestWithTrialDivision(const CBigNum& bnCandidate, unsigned int nTrialDivisionLimit)
+{
+    // Trial division
+    BOOST_FOREACH(unsigned int nPrime, vPrimes)
+    {
+        if (nPrime >= nTrialDivisionLimit)
+            break;
+        if (bnCandidate % nPrime == 0)
+            return false; // failed trial division test
+    }
+    unsigned int nLength = 0;
+    return (FermatProbablePrimalityTest(bnCandidate, nLength));
+}
+
+// Multi-buffer header search
+//
+// The header hash is SHA-256d of the 80-byte header. Its first 64 bytes do
+// not change with the nonce, so their compression (the midstate) is done
+// once per search; the second block and the second hash are computed for
+// consecutive nonces at once, one nonce per 32-bit vector lane. Hashes
+// below 2**255 or with a factor below the trial division limit are then
+// eliminated in the lanes too, and only the survivors get a bignum and the
+// Fermat test.
+#ifdef __GNUC__
+#define PRIME_HEADER_LANES
+#endif
+
+#ifdef PRIME_HEADER_LANES
+static const unsigned int nHeaderLanesMax = 16;
+
+typedef unsigned int header_lanes4_t __attribute__((vector_size(16)));
+typedef unsigned int header_lanes8_t __attribute__((vector_size(32)));
+typedef unsigned int header_lanes16_t __attribute__((vector_size(64)));
+
+static const unsigned int pSha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const unsigned int pSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define HEADER_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define HEADER_ROUND(a, b, c, d, e, f, g, h, i) \
+    { \
+        V t1 = h + (HEADER_ROTR(e, 6) ^ HEADER_ROTR(e, 11) ^ HEADER_ROTR(e, 25)) + (g ^ (e & (f ^ g))) + pSha256K[i] + pw[(i) & 15]; \
+        V t2 = (HEADER_ROTR(a, 2) ^ HEADER_ROTR(a, 13) ^ HEADER_ROTR(a, 22)) + ((a & b) | (c & (a | b))); \
+        d += t1; \
+        h = t1 + t2; \
+    }
+
+// SHA-256 compression of the message words pw into the state ps, in every
+// lane of V; pw is overwritten by the message schedule
+template<typename V>
+static inline __attribute__((always_inline)) void HeaderLanesCompress(V* ps, V* pw)
+{
+    V a = ps[0], b = ps[1], c = ps[2], d = ps[3], e = ps[4], f = ps[5], g = ps[6], h = ps[7];
+    for (unsigned int i = 0; i < 64; i += 8)
+    {
+        if (i >= 16)
+        {
+            for (unsigned int j = i; j < i + 8; j++)
+            {
+                V w2 = pw[(j + 14) & 15], w15 = pw[(j + 1) & 15];
+                pw[j & 15] += (HEADER_ROTR(w2, 17) ^ HEADER_ROTR(w2, 19) ^ (w2 >> 10)) + pw[(j + 9) & 15] + (HEADER_ROTR(w15, 7) ^ HEADER_ROTR(w15, 18) ^ (w15 >> 3));
+            }
+        }
+        HEADER_ROUND(a, b, c, d, e, f, g, h, i);
+        HEADER_ROUND(h, a, b, c, d, e, f, g, i + 1);
+        HEADER_ROUND(g, h, a, b, c, d, e, f, i + 2);
+        HEADER_ROUND(f, g, h, a, b, c, d, e, i + 3);
+        HEADER_ROUND(e, f, g, h, a, b, c, d, i + 4);
+        HEADER_ROUND(d, e, f, g, h, a, b, c, i + 5);
+        HEADER_ROUND(c, d, e, f, g, h, a, b, i + 6);
+        HEADER_ROUND(b, c, d, e, f, g, h, a, i + 7);
+    }
+    ps[0] += a; ps[1] += b; ps[2] += c; ps[3] += d;
+    ps[4] += e; ps[5] += f; ps[6] += g; ps[7] += h;
+}
+
+#undef HEADER_ROUND
+#undef HEADER_ROTR
+
+// Hash the nLanes nonces from nNonce on, given the midstate and the three
+// message words of the header before the nonce. pnHashes receives the
+// hash of lane k as the 32-bit words of a uint256 at [k * 8]
+// Return value: mask of the lanes whose hash is at least 2**255 and has no
+// factor below the trial division limit
+template<typename V, unsigned int nLanes>
+static inline __attribute__((always_inline)) unsigned int HeaderLanesSearch(const unsigned int* pMidstate, const unsigned int* pTail, unsigned int nNonce, unsigned int* pnHashes)
+{
+    V s[8], w[16];
+    for (unsigned int k = 0; k < nLanes; k++)
+    {
+        for (unsigned int i = 0; i < 8; i++)
+            s[i][k] = pMidstate[i];
+        for (unsigned int i = 0; i < 3; i++)
+            w[i][k] = pTail[i];
+        w[3][k] = __builtin_bswap32(nNonce + k);
+        w[4][k] = 0x80000000;
+        for (unsigned int i = 5; i < 15; i++)
+            w[i][k] = 0;
+        w[15][k] = 640; // message length in bits
+    }
+    HeaderLanesCompress(s, w);
+
+    // Second hash over the 32-byte digest
+    for (unsigned int i = 0; i < 8; i++)
+        w[i] = s[i];
+    for (unsigned int k = 0; k < nLanes; k++)
+    {
+        for (unsigned int i = 0; i < 8; i++)
+            s[i][k] = pSha256Init[i];
+        w[8][k] = 0x80000000;
+        for (unsigned int i = 9; i < 15; i++)
+            w[i][k] = 0;
+        w[15][k] = 256;
+    }
+    HeaderLanesCompress(s, w);
+
+    // The digest bytes read as a little-endian number
+    V pn[8];
+    for (unsigned int i = 0; i < 8; i++)
+        pn[i] = (s[i] >> 24) | ((s[i] >> 8) & 0xff00) | ((s[i] << 8) & 0xff0000) | (s[i] << 24);
+    for (unsigned int k = 0; k < nLanes; k++)
+        for (unsigned int i = 0; i < 8; i++)
+            pnHashes[k * 8 + i] = pn[i][k];
+
+    // Size and parity, then the odd primes
+    V vZero = pn[0] ^ pn[0];
+    V vAlive = (V) ((pn[7] >> 31) != vZero) & (V) ((pn[0] & 1) != vZero);
+    V h[16];
+    for (unsigned int i = 0; i < 8; i++)
+    {
+        h[2 * i] = pn[i] & 0xffff;
+        h[2 * i + 1] = pn[i] >> 16;
+    }
+    for (unsigned int nPrimeSeq = 0; nPrimeSeq < vHeaderTrialPrimes.size(); nPrimeSeq++)
+    {
+        if (nPrimeSeq % 8 == 0)
+        {
+            unsigned int nAlive = 0;
+            for (unsigned int k = 0; k < nLanes; k++)
+                nAlive |= vAlive[k];
+            if (nAlive == 0)
+                return 0;
+        }
+        const CHeaderTrialPrime& trial = vHeaderTrialPrimes[nPrimeSeq];
+        V r = h[0];
+        for (unsigned int j = 1; j < 16; j++)
+            r += h[j] * trial.pHalfwordModulo[j];
+        vAlive &= (V) (r * trial.nInverse > trial.nLimit);
+    }
+    unsigned int nMask = 0;
+    for (unsigned int k = 0; k < nLanes; k++)
+        if (vAlive[k])
+            nMask |= 1u << k;
+    return nMask;
+}
+
+typedef unsigned int (*HeaderLanesFunc)(const unsigned int* pMidstate, const unsigned int* pTail, unsigned int nNonce, unsigned int* pnHashes);
+
+static unsigned int HeaderLanesSearch4(const unsigned int* pMidstate, const unsigned int* pTail, unsigned int nNonce, unsigned int* pnHashes)
+{
+    return HeaderLanesSearch<header_lanes4_t, 4>(pMidstate, pTail, nNonce, pnHashes);
+}
+
+#ifdef PRIME_LANES_DISPATCH
+__attribute__((target("avx2")))
+static unsigned int HeaderLanesSearchAVX2(const unsigned int* pMidstate, const unsigned int* pTail, unsigned int nNonce, unsigned int* pnHashes)
+{
+    return HeaderLanesSearch<header_lanes8_t, 8>(pMidstate, pTail, nNonce, pnHashes);
+}
+
+__attribute__((target("avx512f")))
+static unsigned int HeaderLanesSearchAVX512(const unsigned int* pMidstate, const unsigned int* pTail, unsigned int nNonce, unsigned int* pnHashes)
+{
+    return HeaderLanesSearch<header_lanes16_t, 16>(pMidstate, pTail, nNonce, pnHashes);
+}
+#endif
+
+static HeaderLanesFunc GetHeaderLanes(unsigned int& nLanes, const char** ppszName)
+{
+    static bool fSelected = false;
+    static HeaderLanesFunc pfnHeaderLanes = NULL;
+    static unsigned int nHeaderLanes = 0;
+    static const char* pszHeaderLanes = NULL;
+    if (!fSelected)
+    {
+        // Selection is idempotent, so concurrent first calls are harmless.
+        // The four-lane version is built for the baseline instruction set
+        const char* pszName = "generic4";
+        HeaderLanesFunc pfn = HeaderLanesSearch4;
+        unsigned int nLanesSelected = 4;
+#ifdef PRIME_LANES_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            pszName = "avx512";
+            pfn = HeaderLanesSearchAVX512;
+            nLanesSelected = 16;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            pszName = "avx2";
+            pfn = HeaderLanesSearchAVX2;
+            nLanesSelected = 8;
+        }
+        else
+            pszName = "sse2";
+#endif
+        pszHeaderLanes = pszName;
+        nHeaderLanes = nLanesSelected;
+        pfnHeaderLanes = pfn;
+        fSelected = true;
+    }
+    nLanes = nHeaderLanes;
+    if (ppszName)
+        *ppszName = pszHeaderLanes;
+    return pfnHeaderLanes;
+}
+#endif
+
+const char* GetHeaderSearchEngine()
+{
+#ifdef PRIME_HEADER_LANES
+    const char* pszName;
+    unsigned int nLanes;
+    GetHeaderLanes(nLanes, &pszName);
+    return pszName;
+#else
+    return "scalar";
+#endif
+}
+
+// Search the nonces from block.nNonce up to nNonceLimit for a header hash
+// that is at least hashBlockHeaderLimit and a probable prime
+bool SearchProbablePrimeHeader(CBlockHeader& block, unsigned int nNonceLimit)
+{
+#ifdef PRIME_HEADER_LANES
+    if (block.nNonce >= nNonceLimit)
+        return false;
+    unsigned int nLanes;
+    HeaderLanesFunc pfnHeaderLanes = GetHeaderLanes(nLanes, NULL);
+
+    // Header as big-endian message words; the nonce is the last one
+    const unsigned char* pHeader = (const unsigned char*) BEGIN(block.nVersion);
+    unsigned int pWords[20];
+    for (unsigned int i = 0; i < 19; i++)
+        pWords[i] = (pHeader[4 * i] << 24) | (pHeader[4 * i + 1] << 16) | (pHeader[4 * i + 2] << 8) | pHeader[4 * i + 3];
+    unsigned int pMidstate[8];
+    for (unsigned int i = 0; i < 8; i++)
+        pMidstate[i] = pSha256Init[i];
+    HeaderLanesCompress(pMidstate, pWords);
+    for (unsigned int i = 0; i < 3; i++)
+        pWords[i] = (pHeader[64 + 4 * i] << 24) | (pHeader[64 + 4 * i + 1] << 16) | (pHeader[64 + 4 * i + 2] << 8) | pHeader[64 + 4 * i + 3];
+
+    unsigned int pnHashes[nHeaderLanesMax * 8];
+    unsigned int nNonce = block.nNonce;
+    loop
+    {
+        unsigned int nMask = pfnHeaderLanes(pMidstate, pWords, nNonce, pnHashes);
+        unsigned int nRemaining = nNonceLimit - nNonce;
+        if (nRemaining < nLanes)
+            nMask &= (1u << nRemaining) - 1;
+        for (unsigned int k = 0; nMask != 0; k++, nMask >>= 1)
+        {
+            if (!(nMask & 1))
+                continue;
+            uint256 hashBlockHeader;
+            memcpy(hashBlockHeader.begin(), pnHashes + k * 8, 32);
+            unsigned int nLength = 0;
+            if (FermatProbablePrimalityTest(CBigNum(hashBlockHeader), nLength))
+            {
+                block.nNonce = nNonce + k;
+                return true;
+            }
+        }
+        if (nRemaining <= nLanes)
+            break;
+        nNonce += nLanes;
+    }
+    block.nNonce = nNonceLimit;
+    return false;
+#else
+    for (; block.nNonce < nNonceLimit; block.nNonce++)
+    {
+        uint256 hashBlockHeader = block.GetHeaderHash();
+        if (hashBlockHeader < hashBlockHeaderLimit)
+            continue; // must meet minimum requirement
+        if (ProbablePrimalityTestWithTrialDivision(CBigNum(hashBlockHeader), nHeaderTrialDivisionLimit))
+            return true;
+    }
+    return false;
+#endif
+}
+
+// Sieve for mining
+boost::thread_specific_ptr<CSieveOfEratosthenes> psieve;
+boost::thread_specific_ptr<CPrimeMiner> pminer;
+
+// Weave a new mining sieve as deep as the miner's weave count, the round
+// time limit and the best chain allow
+unsigned int WeaveMiningSieve(CSieveOfEratosthenes& sieve, CBlockIndex* pindexPrev)
+{
+    int64 nStart, nCurrent; // microsecond timer
+    int64 nSieveRoundLimit = (int)GetArg("-gensieveroundlimitms", 1000);
+    nStart = GetTimeMicros();
+    unsigned int nWeaveTimes = 0;
+    while (pindexPrev == pindexBest && (GetTimeMicros() - nStart < 1000 * nSieveRoundLimit) && nWeaveTimes < pminer->nSieveWeaveOptimal)
+    {
+        unsigned int nWeaved = sieve.Weave(std::min(pminer->nSieveWeaveOptimal - nWeaveTimes, nSieveWeaveBatch));
+        if (nWeaved == 0)
+            break;
+        nWeaveTimes += nWeaved;
+    }
+    nCurrent = GetTimeMicros();
+    unsigned int nCandidateCount = sieve.GetCandidateCount();
+    if (fDebug && GetBoolArg("-printmining"))
+        printf("WeaveMiningSieve() : new sieve (%u/%u@%u/%u) ready in %uus test cost=%uus\n",
+            nCandidateCount, pminer->nSieveSize,
+            (nWeaveTimes < vPrimes.size())? vPrimes[nWeaveTimes] : nPrimeTableLimit, pminer->GetSieveWeaveOptimalPrime(),
+            (unsigned int) (nCurrent - nStart), (unsigned int)pminer->GetPrimalityTestCost());
+    if (fDebug && GetBoolArg("-printmining") && sieve.GetExtensionCount() > 0)
+    {
+        std::string strExtensions;
+        for (unsigned int nExtension = 0; nExtension <= sieve.GetExtensionCount(); nExtension++)
+            strExtensions += strprintf(" %u", sieve.GetCandidateCount(nExtension));
+        printf("WeaveMiningSieve() : candidates per extension:%s\n", strExtensions.c_str());
+    }
+    pminer->TimerSetSieveReady(nCandidateCount, nCurrent);
+    pminer->SetSieveWeaveCount(nWeaveTimes);
+    CPrimeMinerCounters counters;
+    counters.AddSieve(pminer->nSieveSize, nCandidateCount, nCurrent - nStart);
+    pminer->pstats->Add(counters);
+    return nCandidateCount;
+}
+
+// Weave the sieve of a pipeline round and queue its candidates in batches
+bool QueueMiningSieve(CPrimeMiningPipeline& pipeline, boost::shared_ptr<CPrimeSieveRound> pround, unsigned int& nCandidateCount, int64& nWeaveTime)
+{
+    CPrimeSieveRound& round = *pround;
+    int64 nStart = GetTimeMicros();
+    CSieveOfEratosthenes sieve(pminer->nSieveSize, round.block.nBits, round.block.GetHeaderHash(), round.bnFixedMultiplier, pminer->nSieveExtensions);
+    nCandidateCount = WeaveMiningSieve(sieve, round.pindexPrev);
+    nWeaveTime = GetTimeMicros() - nStart;
+    round.fixed = sieve.GetFixedFactor();
+    // The testers run without a pminer, so the estimate travels with the round
+    round.dPrimeProbability = EstimateCandidatePrimeProbability();
+
+    CPrimeCandidateBatch batch;
+    bool fSieveDone = false;
+    while (!fSieveDone && round.pindexPrev == pindexBest)
+    {
+        batch.vMultipliers.resize(nPrimeCandidateBatchSize);
+        batch.vCandidateTypes.resize(nPrimeCandidateBatchSize);
+        unsigned int nCandidates = sieve.GetNextCandidates(&batch.vMultipliers[0], &batch.vCandidateTypes[0], nPrimeCandidateBatchSize);
+        fSieveDone = (nCandidates < nPrimeCandidateBatchSize);
+        if (nCandidates == 0)
+            break;
+        batch.vMultipliers.resize(nCandidates);
+        batch.vCandidateTypes.resize(nCandidates);
+        batch.pround = pround;
+        pipeline.queue.Push(batch);
+    }
+    return fSieveDone;
+}
+
+// Test the candidates of a pipeline batch
+bool TestMiningCandidates(const CPrimeCandidateBatch& batch, CPrimeMinerCounters& counters, unsigned int& nTests, unsigned int& nPrimesHit, double& dChainExpected, CBlock& blockFound)
+{
+    const CPrimeSieveRound& round = *batch.pround;
+    unsigned int pnChainLengths[nPrimeTestLanes];
+    nTests = 0;
+    nPrimesHit = 0;
+    bool fFound = false;
+    for (unsigned int i = 0; i < batch.vMultipliers.size() && !fFound && round.pindexPrev == pindexBest; i += nPrimeTestLanes)
+    {
+        unsigned int nCandidates = std::min(nPrimeTestLanes, (unsigned int) batch.vMultipliers.size() - i);
+        nTests += nCandidates;
+        ProbablePrimeChainTestBatch(round.fixed, round.block.nBits, nCandidates, &batch.vMultipliers[i], &batch.vCandidateTypes[i], pnChainLengths);
+        counters.AddTests(nCandidates, &batch.vCandidateTypes[i], pnChainLengths);
+        for (unsigned int j = 0; j < nCandidates && !fFound; j++)
+        {
+            if (pnChainLengths[j] >= round.block.nBits)
+            {
+                blockFound = round.block;
+                blockFound.bnPrimeChainMultiplier = round.bnFixedMultiplier * batch.vMultipliers[i + j];
+                printf("Probable prime chain found for block=%s!!\n  Target: %s\n  Chain: %s\n", blockFound.GetHash().GetHex().c_str(),
+                    TargetToString(blockFound.nBits).c_str(), GetPrimeChainName(batch.vCandidateTypes[i + j], pnChainLengths[j]).c_str());
+                fFound = true;
+            }
+            else if (TargetGetLength(pnChainLengths[j]) >= 1)
+                nPrimesHit++;
+        }
+    }
+    dChainExpected = (double) nTests;
+    for (unsigned int n = 0; n < TargetGetLength(round.block.nBits); n++)
+        dChainExpected *= round.dPrimeProbability;
+    return fFound;
+}
+
+// Mine probable prime chain of form: n = h * p# +/- 1
+bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNewBlock, unsigned int& nTriedMultiplier, unsigned int& nProbableChainLength, unsigned int& nTests, unsigned int& nPrimesHit)
+{
+    nProbableChainLength = 0;
+    nTests = 0;
+    nPrimesHit = 0;
+
+    if (fNewBlock && psieve.get() != NULL)
+    {
+        // Must rebuild the sieve
+        psieve.reset();
+    }
+    fNewBlock = false;
+
+    int64 nStart, nCurrent; // microsecond timer
+    CBlockIndex* pindexPrev = pindexBest;
+    if (psieve.get() == NULL)
+    {
+        // Build sieve
+        psieve.reset(new CSieveOfEratosthenes(pminer->nSieveSize, block.nBits, block.GetHeaderHash(), bnFixedMultiplier, pminer->nSieveExtensions));
+        WeaveMiningSieve(*psieve, pindexPrev);
+    }
+
+    const CPrimeFixedFactor& fixed = psieve->GetFixedFactor();
+    unsigned int pnMultipliers[nPrimeTestLanes];
+    unsigned int pnCandidateTypes[nPrimeTestLanes];
+    unsigned int pnChainLengths[nPrimeTestLanes];
+
+    nStart = GetTimeMicros();
+    nCurrent = nStart;
+    CPrimeMinerCounters counters;
+
+    while (nCurrent - nStart < 10000 && nCurrent >= nStart && pindexPrev == pindexBest)
+    {
+        // Test the next candidates of the sieve side by side
+        unsigned int nCandidates = psieve->GetNextCandidates(pnMultipliers, pnCandidateTypes, nPrimeTestLanes);
+        bool fSieveDone = (nCandidates < nPrimeTestLanes);
+        nTests += nCandidates;
+        ProbablePrimeChainTestBatch(fixed, block.nBits, nCandidates, pnMultipliers, pnCandidateTypes, pnChainLengths);
+        counters.AddTests(nCandidates, pnCandidateTypes, pnChainLengths);
+        for (unsigned int i = 0; i < nCandidates; i++)
+        {
+            nTriedMultiplier = pnMultipliers[i];
+            nProbableChainLength = pnChainLengths[i];
+            if (nProbableChainLength >= block.nBits)
+            {
+                block.bnPrimeChainMultiplier = bnFixedMultiplier * nTriedMultiplier;
+                printf("Probable prime chain found for block=%s!!\n  Target: %s\n  Chain: %s\n", block.GetHash().GetHex().c_str(),
+                    TargetToString(block.nBits).c_str(), GetPrimeChainName(pnCandidateTypes[i], nProbableChainLength).c_str());
+                counters.nTestTime = GetTimeMicros() - nStart;
+                pminer->pstats->Add(counters);
+                return true;
+            }
+            if(TargetGetLength(nProbableChainLength) >= 1)
+                nPrimesHit++;
+        }
+        nCurrent = GetTimeMicros();
+        if (fSieveDone)
+        {
+            // power tests completed for the sieve
+            pminer->TimerSetPrimalityDone(nCurrent);
+            psieve.reset();
+            fNewBlock = true; // notify caller to change nonce
+            break;
+        }
+    }
+    counters.nTestTime = nCurrent - nStart;
+    pminer->pstats->Add(counters);
+    return false; // stop as timed out or sieve done
+}
+
+// Count the bits set in a sieve word
+static inline unsigned int SieveWordBitCount(sieve_word_t nWord)
+{
+#if defined(__GNUC__) && defined(__POPCNT__)
+    return __builtin_popcountll(nWord);
+#else
+    nWord = nWord - ((nWord >> 1) & 0x5555555555555555llu);
+    nWord = (nWord & 0x3333333333333333llu) + ((nWord >> 2) & 0x3333333333333333llu);
+    nWord = (nWord + (nWord >> 4)) & 0x0f0f0f0f0f0f0f0fllu;
+    return (unsigned int) ((nWord * 0x0101010101010101llu) >> 56);
+#endif
+}
+
+// Position of the lowest bit set in a nonzero sieve word
+static inline unsigned int SieveWordLowestBit(sieve_word_t nWord)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(nWord);
+#else
+    unsigned int nBit = 0;
+    while (!(nWord & 1))
+    {
+        nWord >>= 1;
+        nBit++;
+    }
+    return nBit;
+#endif
+}
+
+// Cross off every nPrime-th multiplier from nMultiplier up to nEnd in a layer,
+// and in the BiTwin layer too if given
+// Return value: the next multiplier to cross off beyond nEnd
+static inline unsigned int SieveCrossOff(sieve_word_t* pLayer, sieve_word_t* pLayerBiTwin, unsigned int nMultiplier, unsigned int nPrime, unsigned int nEnd)
+{
+    if (pLayerBiTwin)
+    {
+        for (; nMultiplier < nEnd; nMultiplier += nPrime)
+        {
+            sieve_word_t nBitMask = (sieve_word_t)1 << (nMultiplier % nSieveWordBits);
+            pLayer[nMultiplier / nSieveWordBits] |= nBitMask;
+            pLayerBiTwin[nMultiplier / nSieveWordBits] |= nBitMask;
+        }
+    }
+    else
+    {
+        for (; nMultiplier < nEnd; nMultiplier += nPrime)
+            pLayer[nMultiplier / nSieveWordBits] |= (sieve_word_t)1 << (nMultiplier % nSieveWordBits);
+    }
+    return nMultiplier;
+}
+
+// Get a word of the composite bitmaps of an extension
+void CSieveOfEratosthenes::GetCompositeWords(unsigned int nExtension, unsigned int nWord, sieve_word_t& nComposite1, sieve_word_t& nComposite2, sieve_word_t& nCompositeBiTwin)
+{
+    if (nSieveExtensions == 0)
+    {
+        nComposite1 = vfCompositeCunningham1[nWord];
+        nComposite2 = vfCompositeCunningham2[nWord];
+        nCompositeBiTwin = vfCompositeBiTwin[nWord];
+        return;
+    }
+
+    // Combine the layers of the numbers in the chain of the extension
+    unsigned int nChainLength = TargetGetLength(nBits);
+    const sieve_word_t* pLayer1 = &vfCompositeCunningham1[nExtension * nSieveWords + nWord];
+    const sieve_word_t* pLayer2 = &vfCompositeCunningham2[nExtension * nSieveWords + nWord];
+    nComposite1 = nComposite2 = nCompositeBiTwin = 0;
+    for (unsigned int n = 0; n < nChainLength; n++)
+    {
+        sieve_word_t nWord1 = pLayer1[n * nSieveWords];
+        sieve_word_t nWord2 = pLayer2[n * nSieveWords];
+        nComposite1 |= nWord1;
+        nComposite2 |= nWord2;
+        // BiTwin chain takes the first half of each kind
+        if (2 * n < nChainLength)
+            nCompositeBiTwin |= nWord1;
+        if (2 * n + 1 < nChainLength)
+            nCompositeBiTwin |= nWord2;
+    }
+}
+
+// Get the mask of the multipliers of a word used by an extension
+sieve_word_t CSieveOfEratosthenes::GetExtensionMask(unsigned int nExtension, unsigned int nWord)
+{
+    // Extensions only use the upper half of the sieve
+    unsigned int nStart = (nExtension == 0)? 0 : (nSieveSize + 1) / 2;
+    sieve_word_t nMask = ~(sieve_word_t)0;
+    if (nWord == nStart / nSieveWordBits)
+        nMask &= ~(((sieve_word_t)1 << (nStart % nSieveWordBits)) - 1);
+    else if (nWord < nStart / nSieveWordBits)
+        return 0;
+    if (nWord == nSieveWords - 1 && nSieveSize % nSieveWordBits)
+        nMask &= ((sieve_word_t)1 << (nSieveSize % nSieveWordBits)) - 1;
+    return nMask;
+}
+
+// Get total number of candidates for power test
+unsigned int CSieveOfEratosthenes::GetCandidateCount()
+{
+    unsigned int nCandidates = 0;
+    for (unsigned int nExtension = 0; nExtension <= nSieveExtensions; nExtension++)
+        nCandidates += GetCandidateCount(nExtension);
+    return nCandidates;
+}
+
+// Get number of candidates of an extension (0 is the sieve itself)
+unsigned int CSieveOfEratosthenes::GetCandidateCount(unsigned int nExtension)
+{
+    unsigned int nCandidates = 0;
+    sieve_word_t nComposite1, nComposite2, nCompositeBiTwin;
+    for (unsigned int nWord = 0; nWord < nSieveWords; nWord++)
+    {
+        // A multiplier is a candidate unless it is composite in all three layers
+        GetCompositeWords(nExtension, nWord, nComposite1, nComposite2, nCompositeBiTwin);
+        sieve_word_t nCandidateMask = ~(nComposite1 & nComposite2 & nCompositeBiTwin) & GetExtensionMask(nExtension, nWord);
+        nCandidates += SieveWordBitCount(nCandidateMask);
+    }
+    return nCandidates;
+}
+
+// Scan for the next candidate multiplier (variable part), extensions after
+// the sieve itself
+// Return values:
+//   True - found next candidate; nVariableMultiplier has the candidate
+//   False - scan complete, no more candidate and reset scan
+bool CSieveOfEratosthenes::GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType)
+{
+    return (GetNextCandidates(&nVariableMultiplier, &nCandidateType, 1) == 1);
+}
+
+// Scan for up to nMaxCandidates next candidates a word at a time
+// Return value: number of candidates found; fewer than nMaxCandidates if the
+// scan completed, in which case the scan is reset
+unsigned int CSieveOfEratosthenes::GetNextCandidates(unsigned int* pnMultipliers, unsigned int* pnCandidateTypes, unsigned int nMaxCandidates)
+{
+    unsigned int nCandidates = 0;
+    sieve_word_t nComposite1, nComposite2, nCompositeBiTwin;
+    while (nCandidates < nMaxCandidates)
+    {
+        unsigned int nMultiplier = nCandidateMultiplier + 1;
+        if (nMultiplier >= nSieveSize)
+        {
+            if (nCandidateExtension >= nSieveExtensions)
+            {
+                nCandidateMultiplier = 0;
+                nCandidateExtension = 0;
+                return nCandidates;
+            }
+            nCandidateExtension++;
+            nMultiplier = (nSieveSize + 1) / 2;
+        }
+
+        // Take the candidates of the word from the current multiplier on,
+        // lowest first
+        unsigned int nWord = nMultiplier / nSieveWordBits;
+        GetCompositeWords(nCandidateExtension, nWord, nComposite1, nComposite2, nCompositeBiTwin);
+        sieve_word_t nCandidateMask = ~(nComposite1 & nComposite2 & nCompositeBiTwin) & GetExtensionMask(nCandidateExtension, nWord);
+        nCandidateMask &= ~(((sieve_word_t)1 << (nMultiplier % nSieveWordBits)) - 1);
+        nCandidateMultiplier = nWord * nSieveWordBits + (nSieveWordBits - 1);
+        while (nCandidateMask)
+        {
+            unsigned int nBit = SieveWordLowestBit(nCandidateMask);
+            sieve_word_t nBitMask = (sieve_word_t)1 << nBit;
+            nCandidateMask &= nCandidateMask - 1;
+            pnMultipliers[nCandidates] = (nWord * nSieveWordBits + nBit) << nCandidateExtension;
+            if (!(nCompositeBiTwin & nBitMask))
+                pnCandidateTypes[nCandidates] = PRIME_CHAIN_BI_TWIN;
+            else if (!(nComposite1 & nBitMask))
+                pnCandidateTypes[nCandidates] = PRIME_CHAIN_CUNNINGHAM1;
+            else
+                pnCandidateTypes[nCandidates] = PRIME_CHAIN_CUNNINGHAM2;
+            if (++nCandidates == nMaxCandidates)
+            {
+                // Resume after this candidate
+                nCandidateMultiplier = nWord * nSieveWordBits + nBit;
+                break;
+            }
+        }
+    }
+    return nCandidates;
+}
+
+// Compute modular inverse of a modulo prime p, 0 < a < p
+static unsigned int PrimeModularInverse(unsigned int a, unsigned int p)
+{
+    // Extended Euclidean algorithm
+    int t = 0, tNext = 1;
+    unsigned int r = p, rNext = a;
+    while (rNext)
+    {
+        unsigned int q = r / rNext;
+        int tSaved = t;
+        t = tNext;
+        tNext = tSaved - (int) q * tNext;
+        unsigned int rSaved = r;
+        r = rNext;
+        rNext = rSaved - q * rNext;
+    }
+    return (t < 0)? (unsigned int) (t + (int) p) : (unsigned int) t;
+}
+
+// Compute the fixed factor modulo a prime in the table
+// Two words are folded in per step: since the prime is below the table
+// limit nMaxSieveSize < 2**22, r * (2**64 mod p) + hi * (2**32 mod p) + lo
+// stays below 2**44 + 2**54 + 2**32 < 2**55
+unsigned int CSieveOfEratosthenes::GetFixedFactorModulo(unsigned int nPrimeSeq)
+{
+    uint64 nPrime = table.pPrimes[nPrimeSeq];
+    uint64 nWordModulo = table.pPrimesWordModulo[nPrimeSeq];
+    uint64 nDoubleWordModulo = table.pPrimesDoubleWordModulo[nPrimeSeq];
+    uint64 nRemainder = 0;
+    for (unsigned int i = fixed.vWords.size(); i > 0; i -= 2)
+        nRemainder = (nRemainder * nDoubleWordModulo + fixed.vWords[i - 1] * nWordModulo + fixed.vWords[i - 2]) % nPrime;
+    return (unsigned int) nRemainder;
+}
+
+// Solve the first multiplier divisible by the prime for each number in chain
+// Return values:
+//   True  - solved
+//   False - prime divides the fixed factor, nothing to weave
+bool CSieveOfEratosthenes::SolveMultipliers(unsigned int nPrimeSeq, unsigned int* pnSolvedMultiplier)
+{
+    unsigned int nPrime = table.pPrimes[nPrimeSeq];
+    unsigned int nFixedFactorModulo = GetFixedFactorModulo(nPrimeSeq);
+    if (nFixedFactorModulo == 0)
+        return false; // Nothing in the sieve is divisible by this prime
+
+    unsigned int nChainSeqs = 2 * (TargetGetLength(nBits) + nSieveExtensions);
+    if (nPrime == 2)
+    {
+        // Fixed factor is odd: only the first numbers in chain can be even
+        std::fill(pnSolvedMultiplier, pnSolvedMultiplier + nChainSeqs, nSieveSize);
+        pnSolvedMultiplier[0] = pnSolvedMultiplier[1] = 1;
+        return true;
+    }
+
+    // Find the modulo inverse of fixed factor
+    uint64 nFixedInverse = PrimeModularInverse(nFixedFactorModulo, nPrime);
+    for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < nChainSeqs; nBiTwinSeq++)
+    {
+        // Find the first number that's divisible by this prime
+        // fixed factor * multiplier * 2**k = +1 (first kind) or -1 (second kind)
+        pnSolvedMultiplier[nBiTwinSeq] = (nBiTwinSeq % 2 == 0)? (unsigned int) nFixedInverse : nPrime - (unsigned int) nFixedInverse;
+        if (nBiTwinSeq % 2 == 1)
+            nFixedInverse = nFixedInverse * table.pPrimesTwoInverse[nPrimeSeq] % nPrime; // for next number in chain
+    }
+    return true;
+}
+
+// Get the bitmaps to cross off for a number in the chain
+inline void CSieveOfEratosthenes::GetWeaveLayers(unsigned int nBiTwinSeq, sieve_word_t*& pLayer, sieve_word_t*& pLayerBiTwin)
+{
+    std::vector<sieve_word_t>& vfLayer = (nBiTwinSeq % 2 == 0)? vfCompositeCunningham1 : vfCompositeCunningham2;
+    if (nSieveExtensions == 0)
+    {
+        pLayer = &vfLayer[0];
+        pLayerBiTwin = (nBiTwinSeq < TargetGetLength(nBits))? &vfCompositeBiTwin[0] : NULL;
+    }
+    else
+    {
+        pLayer = &vfLayer[nBiTwinSeq / 2 * nSieveWords];
+        pLayerBiTwin = NULL;
+    }
+}
+
+// Weave a single prime across the whole sieve
+void CSieveOfEratosthenes::WeavePrime()
+{
+    unsigned int nPrime = table.pPrimes[nPrimeSeq];
+    unsigned int nChainSeqs = 2 * (TargetGetLength(nBits) + nSieveExtensions);
+    vnMultiplierNext.resize(nChainSeqs);
+    if (SolveMultipliers(nPrimeSeq, &vnMultiplierNext[0]))
+    {
+        for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < nChainSeqs; nBiTwinSeq++)
+        {
+            sieve_word_t *pLayer, *pLayerBiTwin;
+            GetWeaveLayers(nBiTwinSeq, pLayer, pLayerBiTwin);
+            SieveCrossOff(pLayer, pLayerBiTwin, vnMultiplierNext[nBiTwinSeq], nPrime, nSieveSize);
+        }
+    }
+    nPrimeSeq++;
+}
+
+// Weave a batch of primes smaller than the segment size, one segment at a time
+void CSieveOfEratosthenes::WeaveSegmented(unsigned int nPrimes)
+{
+    unsigned int nChainSeqs = 2 * (TargetGetLength(nBits) + nSieveExtensions);
+    vnMultiplierNext.resize(nPrimes * nChainSeqs);
+    for (unsigned int i = 0; i < nPrimes; i++)
+    {
+        unsigned int* pnMultiplierNext = &vnMultiplierNext[i * nChainSeqs];
+        if (!SolveMultipliers(nPrimeSeq + i, pnMultiplierNext))
+            std::fill(pnMultiplierNext, pnMultiplierNext + nChainSeqs, nSieveSize);
+    }
+
+    for (unsigned int nSegmentStart = 0; nSegmentStart < nSieveSize; nSegmentStart += nSegmentSize)
+    {
+        unsigned int nSegmentEnd = std::min(nSegmentStart + nSegmentSize, nSieveSize);
+        unsigned int* pnMultiplierNext = &vnMultiplierNext[0];
+        for (unsigned int i = 0; i < nPrimes; i++)
+        {
+            unsigned int nPrime = table.pPrimes[nPrimeSeq + i];
+            for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < nChainSeqs; nBiTwinSeq++, pnMultiplierNext++)
+            {
+                sieve_word_t *pLayer, *pLayerBiTwin;
+                GetWeaveLayers(nBiTwinSeq, pLayer, pLayerBiTwin);
+                *pnMultiplierNext = SieveCrossOff(pLayer, pLayerBiTwin, *pnMultiplierNext, nPrime, nSegmentEnd);
+            }
+        }
+    }
+    nPrimeSeq += nPrimes;
+}
+
+// Weave sieve for the next prime in table
+// Return values:
+//   True  - weaved another prime
+//   False - sieve already completed
+bool CSieveOfEratosthenes::Weave()
+{
+    return (Weave(1) > 0);
+}
+
+// Weave sieve for up to nPrimes next primes in table
+// Return value: number of primes weaved; 0 if sieve already completed
+unsigned int CSieveOfEratosthenes::Weave(unsigned int nPrimes)
+{
+    unsigned int nWeaved = 0;
+    while (nWeaved < nPrimes && nPrimeSeq < table.nPrimes && table.pPrimes[nPrimeSeq] < nSieveSize)
+    {
+        // Batch up the following primes small enough to be segmented
+        unsigned int nBatch = 0;
+        unsigned int nBatchLimit = std::min(nPrimes - nWeaved, nSieveWeaveBatch);
+        while (nBatch < nBatchLimit && nPrimeSeq + nBatch < table.nPrimes &&
+               table.pPrimes[nPrimeSeq + nBatch] < std::min(nSegmentSize, nSieveSize))
+            nBatch++;
+        if (nBatch > 1)
+        {
+            WeaveSegmented(nBatch);
+            nWeaved += nBatch;
+        }
+        else
+        {
+            WeavePrime();
+            nWeaved++;
+        }
+    }
+    return nWeaved;
+}
+
+// Estimate the probability of primality for a number in a candidate chain
+double EstimateCandidatePrimeProbability()
 {
     // h * q# / r# * s is prime with probability 1/log(h * q# / r# * s),
     //   (prime number theorem)
@@ -713,7 +2236,7 @@ double EstimateCandidatePrimeProbability()
     // true, but nontheless it's a reasonable model of the chances of finding
     // prime chains.
     unsigned int nSieveWeaveOptimalPrime = pminer->GetSieveWeaveOptimalPrime();
-    unsigned int nAverageCandidateMultiplier = nMaxSieveSize / 2;
+    unsigned int nAverageCandidateMultiplier = pminer->nSieveSize / 2;
     unsigned int nPrimorialMultiplier = pminer->nPrimorialMultiplier;
     double dFixedMultiplier = 1.0;
     for (unsigned int i = 0; vPrimes[i] <= nPrimorialMultiplier; i++)
@@ -729,14 +2252,246 @@ unsigned int CPrimeMiner::GetSieveWeaveOptimalPrime()
 void CPrimeMiner::SetSieveWeaveCount(unsigned int nSieveWeaveCount)
 {
     if (nSieveWeaveCount < nSieveWeaveOptimal)
-        nSieveWeaveOptimal = std::max(nSieveWeaveCount, nSieveWeaveInitial);
+        nSieveWeaveOptimal = std::max(nSieveWeaveCount, nSieveWeaveMin);
 }
 
-void CPrimeMiner::AdjustSieveWeaveOptimal()
+CPrimeMinerTuner minertuner;
+CPrimeMiningStats miningstats;
+
+void CPrimeMinerTuner::Init(unsigned int nThreads)
+{
+    CPrimeMinerProfile profile;
+    unsigned int nThreadsSaved = 0;
+    bool fSaved = Read(profile, nThreadsSaved) && nThreadsSaved == nThreads;
+    if (!fSaved)
+        profile = CPrimeMinerProfile();
+    bool fSieveSizeFixed = mapArgs.count("-sievesize");
+    bool fSieveWeaveFixed = mapArgs.count("-sieveprimes");
+    bool fPrimorialFixed = mapArgs.count("-primorial");
+    if (fSieveSizeFixed)
+        profile.nSieveSize = (unsigned int) std::max((int64) nMinSieveSize, std::min(GetArg("-sievesize", nDefaultSieveSize), (int64) nMaxSieveSize));
+    if (fSieveWeaveFixed)
+        profile.nSieveWeave = (unsigned int) std::max((int64) nSieveWeaveMin, std::min(GetArg("-sieveprimes", nSieveWeaveInitial), (int64) vPrimes.size()));
+    if (fPrimorialFixed)
+    {
+        // Round down to a prime
+        profile.nPrimorialMultiplier = (unsigned int) std::max((int64) nPrimorialMultiplierMin, std::min(GetArg("-primorial", nPrimorialMultiplierMin), (int64) vPrimes.back())) + 1;
+        PrimeTableGetPreviousPrime(profile.nPrimorialMultiplier);
+    }
+    Start(profile, fSieveSizeFixed, fSieveWeaveFixed, fPrimorialFixed);
+    {
+        LOCK(cs);
+        this->nThreads = nThreads;
+        fPersist = true;
+    }
+    printf("CPrimeMinerTuner::Init() : %s profile %s\n", fSaved? "saved" : "initial", profile.ToString().c_str());
+}
+
+void CPrimeMinerTuner::Start(const CPrimeMinerProfile& profile, bool fSieveSizeFixed, bool fSieveWeaveFixed, bool fPrimorialFixed)
+{
+    LOCK(cs);
+    fPersist = false;
+    fFixed[0] = fSieveSizeFixed;
+    fFixed[1] = fSieveWeaveFixed;
+    fFixed[2] = fPrimorialFixed;
+    for (unsigned int i = 0; i < 3; i++)
+        nDirection[i] = 1;
+    nParam = 0;
+    nParamFailures = 0;
+    profileBest = profile;
+    dRateBest = -1.0;
+    profileTrial = profile;
+    nTrialRounds = 0;
+    nTrialTime = 0;
+    dTrialChainExpected = 0.0;
+}
+
+CPrimeMinerProfile CPrimeMinerTuner::GetProfile()
 {
-    if (fSieveRoundShrink)
-        nSieveWeaveOptimal = std::max(nSieveWeaveOptimal * 95 / 100 + 1, nSieveWeaveInitial);
+    LOCK(cs);
+    return profileTrial;
+}
+
+CPrimeMinerProfile CPrimeMinerTuner::GetBestProfile()
+{
+    LOCK(cs);
+    return profileBest;
+}
+
+void CPrimeMinerTuner::AddRound(const CPrimeMinerProfile& profile, int64 nRoundTime, double dRoundChainExpected)
+{
+    CPrimeMinerProfile profileSave;
+    unsigned int nThreadsSave = 0;
+    unsigned int nSave = 0;
+    {
+        LOCK(cs);
+        if (profile != profileTrial || nRoundTime <= 0)
+            return; // mined with an earlier profile
+        nTrialRounds++;
+        nTrialTime += nRoundTime;
+        dTrialChainExpected += dRoundChainExpected;
+        if (nTrialRounds < nTunerTrialRounds || nTrialTime < nTunerTrialTime)
+            return;
+        bool fImproved = NextTrial(dTrialChainExpected / nTrialTime);
+        nTrialRounds = 0;
+        nTrialTime = 0;
+        dTrialChainExpected = 0.0;
+        if (!fImproved || !fPersist)
+            return;
+        profileSave = profileBest;
+        nThreadsSave = nThreads;
+        nSave = ++nBestSaves;
+    }
+
+    // Save outside of cs, skipping a profile already bettered and saved by
+    // another thread
+    LOCK(csFile);
+    if (nSave > nBestSaved)
+    {
+        Write(profileSave, nThreadsSave);
+        nBestSaved = nSave;
+    }
+}
+
+// Move a parameter of a profile one step in a direction
+// Return value: false if the parameter is fixed or at its limit
+bool CPrimeMinerTuner::Step(CPrimeMinerProfile& profile, unsigned int nParam, int nDirection)
+{
+    if (fFixed[nParam])
+        return false;
+    if (nParam == 0)
+    {
+        // Sieve size in steps of 25%, in whole words
+        unsigned int nSieveSize = (nDirection > 0)? profile.nSieveSize / 4 * 5 : profile.nSieveSize / 5 * 4;
+        nSieveSize = std::max(nMinSieveSize, std::min(nSieveSize / nSieveWordBits * nSieveWordBits, nMaxSieveSize));
+        if (nSieveSize == profile.nSieveSize)
+            return false;
+        profile.nSieveSize = nSieveSize;
+    }
+    else if (nParam == 1)
+    {
+        // Weave depth in steps of 25%, up to the primes below the sieve size
+        unsigned int nSieveWeaveLimit = std::lower_bound(vPrimes.begin(), vPrimes.end(), profile.nSieveSize) - vPrimes.begin();
+        unsigned int nSieveWeave = (nDirection > 0)? profile.nSieveWeave / 4 * 5 : profile.nSieveWeave / 5 * 4;
+        nSieveWeave = std::max(nSieveWeaveMin, std::min(nSieveWeave, nSieveWeaveLimit));
+        if (nSieveWeave == profile.nSieveWeave)
+            return false;
+        profile.nSieveWeave = nSieveWeave;
+    }
+    else
+    {
+        // Primorial multiplier to the next or previous prime
+        if (nDirection > 0)
+            return PrimeTableGetNextPrime(profile.nPrimorialMultiplier);
+        if (profile.nPrimorialMultiplier <= nPrimorialMultiplierMin)
+            return false;
+        return PrimeTableGetPreviousPrime(profile.nPrimorialMultiplier);
+    }
+    return true;
+}
+
+// Pick the next profile to measure after a trial
+bool CPrimeMinerTuner::NextTrial(double dRate)
+{
+    bool fImproved = false;
+    if (profileTrial == profileBest)
+        dRateBest = dRate; // (re)measured the best profile
+    else if (dRate > dRateBest)
+    {
+        // Improved: keep going the same way
+        printf("CPrimeMinerTuner : %s improves on %s by %.1f%%\n", profileTrial.ToString().c_str(), profileBest.ToString().c_str(), 100.0 * (dRate / dRateBest - 1.0));
+        profileBest = profileTrial;
+        dRateBest = dRate;
+        nParamFailures = 0;
+        fImproved = true;
+    }
     else
-        nSieveWeaveOptimal = std::min(nSieveWeaveOptimal * 100 / 95, (unsigned int) vPrimes.size());
+    {
+        // Try the other way, then the next parameter
+        nDirection[nParam] = -nDirection[nParam];
+        if (++nParamFailures >= 2)
+        {
+            nParamFailures = 0;
+            nParam = (nParam + 1) % 3;
+            if (nParam == 0)
+            {
+                // Measure the best profile again once every round of the
+                // parameters, as the chain target and the host load change
+                profileTrial = profileBest;
+                return fImproved;
+            }
+        }
+    }
+
+    // Step from the best profile, skipping fixed parameters and limits
+    for (unsigned int nTries = 0; nTries < 6; nTries++)
+    {
+        profileTrial = profileBest;
+        if (Step(profileTrial, nParam, nDirection[nParam]))
+            return fImproved;
+        nDirection[nParam] = -nDirection[nParam];
+        if (++nParamFailures >= 2)
+        {
+            nParamFailures = 0;
+            nParam = (nParam + 1) % 3;
+        }
+    }
+    profileTrial = profileBest; // nothing to search
+    return fImproved;
+}
+
+bool CPrimeMinerTuner::Read(CPrimeMinerProfile& profile, unsigned int& nThreadsSaved)
+{
+    boost::filesystem::path pathProfile = GetDataDir() / "primeminer.dat";
+    FILE *file = fopen(pathProfile.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    // Network magic number, profile and checksum
+    unsigned char pchMsgTmp[4];
+    uint256 hashIn;
+    try {
+        filein >> FLATDATA(pchMsgTmp) >> nThreadsSaved >> profile >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CPrimeMinerTuner::Read() : I/O error or stream data corrupted");
+    }
+    CDataStream ssProfile(SER_DISK, CLIENT_VERSION);
+    ssProfile << FLATDATA(pchMsgTmp) << nThreadsSaved << profile;
+    if (hashIn != Hash(ssProfile.begin(), ssProfile.end()))
+        return error("CPrimeMinerTuner::Read() : checksum mismatch; data corrupted");
+    if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+        return error("CPrimeMinerTuner::Read() : invalid network magic number");
+
+    // Must stay within the limits of this version
+    return (profile.nSieveSize >= nMinSieveSize && profile.nSieveSize <= nMaxSieveSize &&
+            profile.nSieveWeave >= nSieveWeaveMin && profile.nSieveWeave <= vPrimes.size() &&
+            profile.nPrimorialMultiplier >= nPrimorialMultiplierMin && profile.nPrimorialMultiplier <= vPrimes.back());
+}
+
+bool CPrimeMinerTuner::Write(const CPrimeMinerProfile& profile, unsigned int nThreads)
+{
+    CDataStream ssProfile(SER_DISK, CLIENT_VERSION);
+    ssProfile << FLATDATA(pchMessageStart) << nThreads << profile;
+    uint256 hash = Hash(ssProfile.begin(), ssProfile.end());
+
+    // Write to a temporary file and rename it into place
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("primeminer.dat.%04x", (unsigned int) GetRand(0x10000));
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CPrimeMinerTuner::Write() : open failed");
+    try {
+        fileout << ssProfile << hash;
+    }
+    catch (std::exception &e) {
+        return error("CPrimeMinerTuner::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetDataDir() / "primeminer.dat"))
+        return error("CPrimeMinerTuner::Write() : rename-into-place failed");
+    return true;
 }
 
@@ -6,12 +6,15 @@
 #define PRIMECOIN_PRIME_H
 
 #include "main.h"
+#include "boundedqueue.h"
 
 /**********************/
 /* PRIMECOIN PROTOCOL */
 /**********************/
 
-static const unsigned int nMaxSieveSize = 1000000u;
+static const unsigned int nMaxSieveSize = 4000000u;
+static const unsigned int nMinSieveSize = 100000u;
+static const unsigned int nDefaultSieveSize = 1000000u;
 static const uint256 hashBlockHeaderLimit = (uint256(1) << 255);
 static const CBigNum bnOne = 1;
 static const CBigNum bnPrimeMax = (bnOne << 2000) - 1;
@@ -41,6 +44,14 @@ void PrimorialAt(CBigNum& bn, CBigNum& bnPrimorial);
 //   false - prime chain too short (none of nChainLength meeting target)
 bool ProbablePrimeChainTest(const CBigNum& bnPrimeChainOrigin, unsigned int nBits, bool fFermatTest, unsigned int& nChainLengthCunningham1, unsigned int& nChainLengthCunningham2, unsigned int& nChainLengthBiTwin);
 
+// Test probable Cunningham Chain for: n
+// fSophieGermain
+//   true - Cunningham Chain of first kind (n, 2n+1, 4n+3, ...)
+//   false - Cunningham Chain of second kind (n, 2n-1, 4n-3, ...)
+// pnLengthFermat: if set, also get the chain length with Fermat tests only
+//   from the same exponentiations; fFermatTest is ignored
+bool ProbableCunninghamChainTest(const CBigNum& n, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength, unsigned int* pnLengthFermat = NULL);
+
 static const unsigned int nFractionalBits = 24;
 static const unsigned int TARGET_FRACTIONAL_MASK = (1u<<nFractionalBits) - 1;
 static const unsigned int TARGET_LENGTH_MASK = ~TARGET_FRACTIONAL_MASK;
@@ -88,107 +99,416 @@ std::string GetPrimeOriginPrimorialForm(CBigNum& bnPrimeChainOrigin);
 // Mine probable prime chain of form: n = h * p# +/- 1
 bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNewBlock, unsigned int& nTriedMultiplier, unsigned int& nProbableChainLength, unsigned int& nTests, unsigned int& nPrimesHit);
 
+// Number of candidates whose first Fermat tests run side by side
+static const unsigned int nPrimeTestLanes = 8;
+
+// Fixed factor of the chain origins of a sieve round: header hash times
+// primorial. It is kept in 32-bit words too, so the origin of a candidate
+// is derived with a single word multiplication instead of a CBigNum one
+class CPrimeFixedFactor
+{
+public:
+    CBigNum bnFixedFactor;
+    // least significant first, zero padded to an even count of at least
+    // nWords + 1
+    std::vector<unsigned int> vWords;
+    unsigned int nWords; // significant words
+
+    CPrimeFixedFactor()
+    {
+        nWords = 0;
+    }
+
+    CPrimeFixedFactor(const CBigNum& bnFixedFactorIn)
+    {
+        Set(bnFixedFactorIn);
+    }
+
+    void Set(const CBigNum& bnFixedFactorIn)
+    {
+        bnFixedFactor = bnFixedFactorIn;
+        std::vector<unsigned char> vchFixedFactor = bnFixedFactor.getvch();
+        nWords = (vchFixedFactor.size() + 3) / 4;
+        vWords.assign((nWords + 2) / 2 * 2, 0);
+        for (unsigned int i = 0; i < vchFixedFactor.size(); i++)
+            vWords[i / 4] |= ((unsigned int) vchFixedFactor[i]) << (8 * (i % 4));
+    }
+};
+
+// Test probable prime chains of a batch of miner candidates with origins
+// fixed factor * pnMultipliers[i]. The first Fermat test of every chain
+// runs lane-parallel, with AVX2 or AVX-512 where the processor supports it;
+// pnChainLengths[i] receives the same chain length as the one-by-one test.
+// Chain numbers are derived from the words of the fixed factor, without
+// allocations unless they outgrow the fixed-width arithmetic
+// Return value: number of candidates meeting target nBits
+unsigned int ProbablePrimeChainTestBatch(const CPrimeFixedFactor& fixed, unsigned int nBits, unsigned int nCandidates, const unsigned int* pnMultipliers, const unsigned int* pnCandidateTypes, unsigned int* pnChainLengths);
+
+// Name of the lane-parallel code path selected for this processor
+const char* GetPrimeTestBatchEngine();
+
 // Perform Fermat test with trial division
 // Return values:
 //   true  - passes trial division test and Fermat test; probable prime
 //   false - failed either trial division or Fermat test; composite
 bool ProbablePrimalityTestWithTrialDivision(const CBigNum& bnCandidate, unsigned int nTrialDivisionLimit);
 
+// Search the nonces from block.nNonce up to nNonceLimit for a header hash
+// that is at least hashBlockHeaderLimit and passes trial division below 1000
+// and the Fermat test, hashing several nonces at once from the midstate of
+// the constant header prefix
+// Return values:
+//   true  - found; block.nNonce is the first such nonce
+//   false - none below nNonceLimit; block.nNonce is at least nNonceLimit
+bool SearchProbablePrimeHeader(CBlockHeader& block, unsigned int nNonceLimit);
+
+// Name of the multi-buffer header hash code path selected for this processor
+const char* GetHeaderSearchEngine();
+
 // Estimate the probability of primality for a number in a candidate chain
 double EstimateCandidatePrimeProbability();
 
+// Sieve word type: the sieve layers are packed into 64-bit words
+typedef uint64 sieve_word_t;
+static const unsigned int nSieveWordBits = 64;
+// Sieve segment size in bits: one segment of each of the three layers
+// (3 x 8KB) fits in a typical 32KB L1 data cache
+static const unsigned int nSieveSegmentSize = 8 * 8192;
+// Maximum number of primes woven in one segmented pass
+static const unsigned int nSieveWeaveBatch = 1024;
+// Maximum number of sieve extensions: the variable multiplier of the deepest
+// extension must still fit in 32 bits
+static const unsigned int nSieveExtensionsMax = 10;
+
+// Per-prime constants read by the sieve, from the prime table or from the
+// replica of it on the NUMA node of a mining thread
+struct CPrimeTable
+{
+    const unsigned int* pPrimes;
+    const unsigned int* pPrimesTwoInverse; // inverse of 2 modulo the prime
+    const unsigned int* pPrimesWordModulo; // 2**32 modulo the prime
+    const unsigned int* pPrimesDoubleWordModulo; // 2**64 modulo the prime
+    unsigned int nPrimes;
+};
+
+// Use the replica of the prime table on a NUMA node in this thread, -1 for
+// the prime table itself
+void SetPrimeTableNode(int nNode);
+// Get the prime table for the sieves of this thread
+CPrimeTable GetPrimeTable();
+
 // Sieve of Eratosthenes for proof-of-work mining
+//
+// Primes below the segment size are woven one L1-sized segment at a time,
+// crossing off every prime of the batch before moving on to the next
+// segment. Larger primes hit each segment at most a few times and are
+// woven directly across the whole sieve.
+//
+// An extended sieve keeps one layer of each kind per number in the chain
+// instead of the combined layers, and weaves nSieveExtensions numbers deeper.
+// Extension k then lists the chains of origin fixed factor * multiplier * 2^k
+// from the same weave. Only multipliers in the upper half of the sieve are
+// used by the extensions, the others are already covered by a shallower one.
 class CSieveOfEratosthenes
 {
     unsigned int nSieveSize; // size of the sieve
+    unsigned int nSieveWords; // size of each bitmap in words
+    unsigned int nSieveExtensions; // number of extensions, 0 if not extended
+    unsigned int nSegmentSize; // size of a segment of the segmented weave
     unsigned int nBits; // target of the prime chain to search for
     uint256 hashBlockHeader; // block header hash
-    CBigNum bnFixedFactor; // fixed factor to derive the chain
+    CPrimeFixedFactor fixed; // fixed factor to derive the chain
+    CPrimeTable table; // prime table local to the thread
 
     // bitmaps of the sieve, index represents the variable part of multiplier
-    std::vector<bool> vfCompositeCunningham1;
-    std::vector<bool> vfCompositeCunningham2;
-    std::vector<bool> vfCompositeBiTwin;
+    // an extended sieve has no BiTwin bitmap, and a bitmap of each kind per
+    // number in the chain one after another
+    std::vector<sieve_word_t> vfCompositeCunningham1;
+    std::vector<sieve_word_t> vfCompositeCunningham2;
+    std::vector<sieve_word_t> vfCompositeBiTwin;
+
+    // next multiplier to cross off for each prime of a segmented weave batch
+    // and each number in the chain
+    std::vector<unsigned int> vnMultiplierNext;
 
     unsigned int nPrimeSeq; // prime sequence number currently being processed
     unsigned int nCandidateMultiplier; // current candidate for power test
+    unsigned int nCandidateExtension; // extension of the current candidate
+
+    // Compute the fixed factor modulo a prime in the table
+    unsigned int GetFixedFactorModulo(unsigned int nPrimeSeq);
+    // Solve the first multiplier divisible by the prime for each of the
+    // 2 * (chain length + extensions) numbers in the chain
+    // Return values:
+    //   True  - solved
+    //   False - prime divides the fixed factor, nothing to weave
+    bool SolveMultipliers(unsigned int nPrimeSeq, unsigned int* pnSolvedMultiplier);
+    // Weave a batch of small primes segment by segment
+    void WeaveSegmented(unsigned int nPrimes);
+    // Weave a single prime across the whole sieve
+    void WeavePrime();
+    // Get the bitmaps to cross off for a number in the chain
+    void GetWeaveLayers(unsigned int nBiTwinSeq, sieve_word_t*& pLayer, sieve_word_t*& pLayerBiTwin);
+    // Get a word of the composite bitmaps of an extension
+    void GetCompositeWords(unsigned int nExtension, unsigned int nWord, sieve_word_t& nComposite1, sieve_word_t& nComposite2, sieve_word_t& nCompositeBiTwin);
+    // Get the mask of the multipliers of a word used by an extension
+    sieve_word_t GetExtensionMask(unsigned int nExtension, unsigned int nWord);
 
 public:
-    CSieveOfEratosthenes(unsigned int nSieveSize, unsigned int nBits, uint256 hashBlockHeader, CBigNum& bnFixedMultiplier)
+    CSieveOfEratosthenes(unsigned int nSieveSize, unsigned int nBits, uint256 hashBlockHeader, CBigNum& bnFixedMultiplier, unsigned int nSieveExtensions = 0)
     {
         this->nSieveSize = nSieveSize;
+        this->nSieveWords = (nSieveSize + nSieveWordBits - 1) / nSieveWordBits;
+        this->nSieveExtensions = std::min(nSieveExtensions, nSieveExtensionsMax);
         this->nBits = nBits;
         this->hashBlockHeader = hashBlockHeader;
-        this->bnFixedFactor = bnFixedMultiplier * CBigNum(hashBlockHeader);
+        this->fixed.Set(bnFixedMultiplier * CBigNum(hashBlockHeader));
+        this->table = GetPrimeTable();
         nPrimeSeq = 0;
-        vfCompositeCunningham1 = std::vector<bool> (nMaxSieveSize, false);
-        vfCompositeCunningham2 = std::vector<bool> (nMaxSieveSize, false);
-        vfCompositeBiTwin = std::vector<bool> (nMaxSieveSize, false);
+        if (this->nSieveExtensions == 0)
+        {
+            vfCompositeCunningham1 = std::vector<sieve_word_t> (nSieveWords, 0);
+            vfCompositeCunningham2 = std::vector<sieve_word_t> (nSieveWords, 0);
+            vfCompositeBiTwin = std::vector<sieve_word_t> (nSieveWords, 0);
+            nSegmentSize = nSieveSegmentSize;
+        }
+        else
+        {
+            unsigned int nLayers = TargetGetLength(nBits) + this->nSieveExtensions;
+            vfCompositeCunningham1 = std::vector<sieve_word_t> (nLayers * nSieveWords, 0);
+            vfCompositeCunningham2 = std::vector<sieve_word_t> (nLayers * nSieveWords, 0);
+            // keep the segments of all the layers within the cache budget
+            // of the three combined layers
+            nSegmentSize = std::max(3 * nSieveSegmentSize / (2 * nLayers) / nSieveWordBits * nSieveWordBits, nSieveWordBits);
+        }
         nCandidateMultiplier = 0;
+        nCandidateExtension = 0;
     }
 
+    // Get number of sieve extensions
+    unsigned int GetExtensionCount() { return nSieveExtensions; }
+
+    // Get the fixed factor of the candidate chains
+    const CPrimeFixedFactor& GetFixedFactor() { return fixed; }
+
     // Get total number of candidates for power test
-    unsigned int GetCandidateCount()
-    {
-        unsigned int nCandidates = 0;
-        for (unsigned int nMultiplier = 0; nMultiplier < nSieveSize; nMultiplier++)
-        {
-            if (!vfCompositeCunningham1[nMultiplier] ||
-                !vfCompositeCunningham2[nMultiplier] ||
-                !vfCompositeBiTwin[nMultiplier])
-                nCandidates++;
-        }
-        return nCandidates;
-    }
+    unsigned int GetCandidateCount();
 
-    // Scan for the next candidate multiplier (variable part)
+    // Get number of candidates of an extension (0 is the sieve itself)
+    unsigned int GetCandidateCount(unsigned int nExtension);
+
+    // Scan for the next candidate multiplier (variable part), extensions
+    // after the sieve itself
     // Return values:
     //   True - found next candidate; nVariableMultiplier has the candidate
     //   False - scan complete, no more candidate and reset scan
-    bool GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType)
-    {
-        loop
-        {
-            nCandidateMultiplier++;
-            if (nCandidateMultiplier >= nSieveSize)
-            {
-                nCandidateMultiplier = 0;
-                return false;
-            }
-            if (!vfCompositeBiTwin[nCandidateMultiplier])
-            {
-                nVariableMultiplier = nCandidateMultiplier;
-                nCandidateType = PRIME_CHAIN_BI_TWIN;
-                return true;
-            }
-            if (!vfCompositeCunningham1[nCandidateMultiplier])
-            {
-                nVariableMultiplier = nCandidateMultiplier;
-                nCandidateType = PRIME_CHAIN_CUNNINGHAM1;
-                return true;
-            }
-            if (!vfCompositeCunningham2[nCandidateMultiplier])
-            {
-                nVariableMultiplier = nCandidateMultiplier;
-                nCandidateType = PRIME_CHAIN_CUNNINGHAM2;
-                return true;
-            }
-        }
-    }
+    bool GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType);
+
+    // Scan for up to nMaxCandidates next candidates, in the same order as
+    // GetNextCandidateMultiplier, into pnMultipliers and pnCandidateTypes
+    // Return value: number of candidates found; fewer than nMaxCandidates
+    // if the scan completed, in which case the scan is reset
+    unsigned int GetNextCandidates(unsigned int* pnMultipliers, unsigned int* pnCandidateTypes, unsigned int nMaxCandidates);
 
     // Weave the sieve for the next prime in table
     // Return values:
     //   True  - weaved another prime
     //   False - sieve already completed
     bool Weave();
+
+    // Weave the sieve for up to nPrimes next primes in table
+    // Return value: number of primes weaved; 0 if sieve already completed
+    unsigned int Weave(unsigned int nPrimes);
 };
 
 static const unsigned int nPrimorialMultiplierMin = 7;
 static const unsigned int nSieveWeaveInitial = 1000;
+static const unsigned int nSieveWeaveMin = 200;
+
+// Mining parameters searched by the tuner
+class CPrimeMinerProfile
+{
+public:
+    unsigned int nSieveSize; // size of the sieve
+    unsigned int nSieveWeave; // number of primes to weave
+    unsigned int nPrimorialMultiplier; // primorial multiplier
+
+    CPrimeMinerProfile()
+    {
+        nSieveSize = nDefaultSieveSize;
+        nSieveWeave = nSieveWeaveInitial;
+        nPrimorialMultiplier = nPrimorialMultiplierMin;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nSieveSize);
+        READWRITE(nSieveWeave);
+        READWRITE(nPrimorialMultiplier);
+    )
+
+    friend bool operator==(const CPrimeMinerProfile& a, const CPrimeMinerProfile& b)
+    {
+        return (a.nSieveSize == b.nSieveSize && a.nSieveWeave == b.nSieveWeave && a.nPrimorialMultiplier == b.nPrimorialMultiplier);
+    }
+
+    friend bool operator!=(const CPrimeMinerProfile& a, const CPrimeMinerProfile& b)
+    {
+        return !(a == b);
+    }
+
+    std::string ToString() const
+    {
+        return strprintf("sieve=%u weave=%u primorial=%u", nSieveSize, nSieveWeave, nPrimorialMultiplier);
+    }
+};
+
+// Chain lengths from this one on share the last bucket of the histograms
+static const unsigned int nMinerStatsChainLengthMax = 16;
+
+// Mining telemetry counters
+class CPrimeMinerCounters
+{
+public:
+    uint64 nSieves; // sieves woven
+    uint64 nSieveTime; // microseconds spent weaving
+    uint64 nSieveSize; // total size of the sieves woven
+    uint64 nCandidates; // candidates the sieves left
+    uint64 nTests; // candidates tested
+    uint64 nTestTime; // microseconds spent testing
+    uint64 nStaleTime; // microseconds of work dropped for a stale block
+    // candidates reaching each whole chain length from 1 on, by chain type
+    uint64 pnChains[3][nMinerStatsChainLengthMax];
+
+    CPrimeMinerCounters()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nSieves = 0;
+        nSieveTime = 0;
+        nSieveSize = 0;
+        nCandidates = 0;
+        nTests = 0;
+        nTestTime = 0;
+        nStaleTime = 0;
+        memset(pnChains, 0, sizeof(pnChains));
+    }
+
+    void AddSieve(unsigned int nSieveSizeIn, unsigned int nCandidatesIn, int64 nTime)
+    {
+        nSieves++;
+        nSieveSize += nSieveSizeIn;
+        nCandidates += nCandidatesIn;
+        nSieveTime += std::max((int64) 0, nTime);
+    }
+
+    // Account a batch of tested candidates with their chain lengths
+    void AddTests(unsigned int nTestsIn, const unsigned int* pnCandidateTypes, const unsigned int* pnChainLengths)
+    {
+        nTests += nTestsIn;
+        for (unsigned int i = 0; i < nTestsIn; i++)
+        {
+            unsigned int nLength = TargetGetLength(pnChainLengths[i]);
+            if (nLength >= 1 && pnCandidateTypes[i] >= 1 && pnCandidateTypes[i] <= 3)
+                pnChains[pnCandidateTypes[i] - 1][std::min(nLength, nMinerStatsChainLengthMax) - 1]++;
+        }
+    }
+
+    CPrimeMinerCounters& operator+=(const CPrimeMinerCounters& counters)
+    {
+        nSieves += counters.nSieves;
+        nSieveTime += counters.nSieveTime;
+        nSieveSize += counters.nSieveSize;
+        nCandidates += counters.nCandidates;
+        nTests += counters.nTests;
+        nTestTime += counters.nTestTime;
+        nStaleTime += counters.nStaleTime;
+        for (unsigned int nType = 0; nType < 3; nType++)
+            for (unsigned int nLength = 0; nLength < nMinerStatsChainLengthMax; nLength++)
+                pnChains[nType][nLength] += counters.pnChains[nType][nLength];
+        return *this;
+    }
+};
+
+// Mining telemetry of one thread. Only the thread itself adds to it, once
+// per sieve or batch of tests, so its lock is uncontended except for the
+// moment getminingstats copies the counters
+class CPrimeMinerStats
+{
+    mutable CCriticalSection cs;
+    CPrimeMinerCounters counters;
+
+public:
+    std::string strName; // role of the thread
+
+    CPrimeMinerStats(const std::string& strNameIn = "miner") : strName(strNameIn) {}
+
+    void Add(const CPrimeMinerCounters& countersIn)
+    {
+        LOCK(cs);
+        counters += countersIn;
+    }
+
+    CPrimeMinerCounters GetCounters() const
+    {
+        LOCK(cs);
+        return counters;
+    }
+};
+
+// Telemetry of the mining threads since mining last started
+class CPrimeMiningStats
+{
+    mutable CCriticalSection cs;
+    std::vector<boost::shared_ptr<CPrimeMinerStats> > vThreadStats;
+    int64 nStartTime;
+
+public:
+    CPrimeMiningStats()
+    {
+        nStartTime = 0;
+    }
+
+    // Forget the threads of a previous start
+    void Reset()
+    {
+        LOCK(cs);
+        vThreadStats.clear();
+        nStartTime = GetTimeMicros();
+    }
+
+    // Add the telemetry of a mining thread
+    void Register(boost::shared_ptr<CPrimeMinerStats> pstats)
+    {
+        LOCK(cs);
+        vThreadStats.push_back(pstats);
+    }
+
+    // Copy the counters of every thread, without stopping them
+    // Return value: microseconds since mining started
+    int64 GetThreadCounters(std::vector<std::pair<std::string, CPrimeMinerCounters> >& vCounters) const
+    {
+        std::vector<boost::shared_ptr<CPrimeMinerStats> > vThreadStatsCopy;
+        int64 nTime;
+        {
+            LOCK(cs);
+            vThreadStatsCopy = vThreadStats;
+            nTime = (nStartTime == 0)? 0 : GetTimeMicros() - nStartTime;
+        }
+        vCounters.clear();
+        BOOST_FOREACH(const boost::shared_ptr<CPrimeMinerStats>& pstats, vThreadStatsCopy)
+            vCounters.push_back(std::make_pair(pstats->strName, pstats->GetCounters()));
+        return nTime;
+    }
+};
+
+extern CPrimeMiningStats miningstats;
 
 class CPrimeMiner
 {
-    bool fSieveRoundShrink;
     unsigned int nSieveCandidateCount;
     int64 nTimeSieveReady; // sieve ready timestamp in microsecond
     int64 nPrimalityTestCost; // power test time cost in microsecond
@@ -198,35 +518,52 @@ class CPrimeMiner
     // Primorial multiplier
     unsigned int nPrimorialMultiplier;
 
+    // Size of the sieve
+    unsigned int nSieveSize;
+
     // Optimal sieve weave times (index to prime table)
     unsigned int nSieveWeaveOptimal;
 
-    CPrimeMiner()
+    // Number of sieve extensions
+    unsigned int nSieveExtensions;
+
+    // Telemetry of the thread, registered with miningstats by the miners
+    boost::shared_ptr<CPrimeMinerStats> pstats;
+
+    CPrimeMiner() : pstats(new CPrimeMinerStats())
     {
-        fSieveRoundShrink = true;
         nSieveCandidateCount = 0;
         nTimeSieveReady = 0;
         nPrimalityTestCost = 0;
         nPrimorialMultiplier = nPrimorialMultiplierMin;
+        nSieveSize = nDefaultSieveSize;
         nSieveWeaveOptimal = nSieveWeaveInitial;
+        nSieveExtensions = (unsigned int) std::max(0, std::min((int) GetArg("-gensieveextensions", 0), (int) nSieveExtensionsMax));
     }
 
     unsigned int GetSieveWeaveOptimalPrime();
 
-    void SetSieveWeaveCost(int64 nSieveWeaveCost, unsigned int nSieveWeaveComposites)
-    {
-        fSieveRoundShrink = (nSieveWeaveCost > nSieveWeaveComposites * nPrimalityTestCost);
-    }
-
     void SetSieveWeaveCount(unsigned int nSieveWeaveCount);
 
-    void AdjustSieveWeaveOptimal();
+    // Mine with the parameters of a profile from the next sieve on
+    void SetProfile(const CPrimeMinerProfile& profile)
+    {
+        nSieveSize = profile.nSieveSize;
+        nSieveWeaveOptimal = profile.nSieveWeave;
+        nPrimorialMultiplier = profile.nPrimorialMultiplier;
+    }
 
     int64 GetPrimalityTestCost()
     {
         return nPrimalityTestCost;
     }
 
+    // Primality test cost measured elsewhere, by the testers in pipeline mode
+    void SetPrimalityTestCost(int64 nCost)
+    {
+        nPrimalityTestCost = nCost;
+    }
+
     void TimerSetSieveReady(unsigned int nCandidateCount, int64 nTimestampMicro)
     {
         nSieveCandidateCount = nCandidateCount;
@@ -242,4 +579,158 @@ class CPrimeMiner
 
 extern boost::thread_specific_ptr<CPrimeMiner> pminer;
 
+// Number of rounds and mining thread time (in microseconds) a profile is
+// measured for before it is compared with the best one
+static const unsigned int nTunerTrialRounds = 20;
+static const int64 nTunerTrialTime = 30000000;
+
+// Search for the mining profile giving the most expected chains per unit of
+// mining thread time, shared by all the mining threads
+//
+// One parameter is moved a step at a time, in the same direction for as long
+// as it improves, then the other way, then the next parameter. The best
+// profile found is saved in the data directory and tuning resumes from it
+// at the next start. Parameters set on the command line stay fixed.
+class CPrimeMinerTuner
+{
+    CCriticalSection cs;
+    bool fPersist; // save the best profile in the data directory
+    unsigned int nThreads; // number of mining threads the profile is for
+    bool fFixed[3]; // parameters set by the user, not searched
+    int nDirection[3]; // direction of the next step of each parameter
+    unsigned int nParam; // parameter being searched
+    unsigned int nParamFailures; // failed steps of the parameter in a row
+    CPrimeMinerProfile profileBest; // best profile found
+    double dRateBest; // expected chains per microsecond of the best profile, negative if not measured
+    CPrimeMinerProfile profileTrial; // profile being measured
+    unsigned int nTrialRounds;
+    int64 nTrialTime;
+    double dTrialChainExpected;
+    unsigned int nBestSaves; // improvements of the best profile to be saved
+    CCriticalSection csFile; // orders the saves of the best profile
+    unsigned int nBestSaved; // improvements saved so far, protected by csFile
+
+    // Move a parameter of a profile one step in a direction
+    // Return value: false if the parameter is fixed or at its limit
+    bool Step(CPrimeMinerProfile& profile, unsigned int nParam, int nDirection);
+    // Pick the next profile to measure after a trial
+    // Return value: whether the best profile improved
+    bool NextTrial(double dRate);
+    // Load and save the best profile in the data directory, without holding
+    // cs: the mining threads must not wait on the disk
+    bool Read(CPrimeMinerProfile& profile, unsigned int& nThreadsSaved);
+    bool Write(const CPrimeMinerProfile& profile, unsigned int nThreads);
+
+public:
+    CPrimeMinerTuner()
+    {
+        fPersist = false;
+        nThreads = 0;
+        nBestSaves = 0;
+        nBestSaved = 0;
+        Start(CPrimeMinerProfile(), false, false, false);
+    }
+
+    // Start tuning for nThreads mining threads from the options and the
+    // saved profile
+    void Init(unsigned int nThreads);
+
+    // Start tuning from a profile, without saving
+    void Start(const CPrimeMinerProfile& profile, bool fSieveSizeFixed, bool fSieveWeaveFixed, bool fPrimorialFixed);
+
+    // Profile the mining threads should use for their next sieve
+    CPrimeMinerProfile GetProfile();
+
+    // Best profile found so far
+    CPrimeMinerProfile GetBestProfile();
+
+    // Account a completed sieve round mined with a profile
+    void AddRound(const CPrimeMinerProfile& profile, int64 nRoundTime, double dRoundChainExpected);
+};
+
+extern CPrimeMinerTuner minertuner;
+
+// Weave a new mining sieve as deep as the miner's weave count, the round
+// time limit and the best chain allow
+// Return value: number of candidates left in the sieve
+unsigned int WeaveMiningSieve(CSieveOfEratosthenes& sieve, CBlockIndex* pindexPrev);
+
+// Primecoin: pipelined mining
+//
+// With -genpipeline the mining threads are split into sieve threads and
+// primality test threads, see PrimeSieveWorker and PrimeTestWorker. A sieve
+// thread weaves one sieve at a time and hands its candidates in batches to
+// the testers through a bounded queue. The testers have no pminer: whatever
+// a batch needs to be tested and metered comes with its sieve round.
+
+// Sieve round shared by all the candidate batches of one sieve
+struct CPrimeSieveRound
+{
+    CBlock block; // block with the nonce of the sieve
+    CBlockIndex* pindexPrev; // best chain tip the block builds on
+    CBigNum bnFixedMultiplier; // primorial of the sieve
+    CPrimeFixedFactor fixed; // header hash times primorial
+    double dPrimeProbability; // estimated by the sieve thread, the testers have no pminer
+};
+
+// Batch of sieve candidates handed from a sieve thread to the testers
+struct CPrimeCandidateBatch
+{
+    boost::shared_ptr<const CPrimeSieveRound> pround;
+    std::vector<unsigned int> vMultipliers;
+    std::vector<unsigned int> vCandidateTypes;
+
+    void swap(CPrimeCandidateBatch& batch)
+    {
+        pround.swap(batch.pround);
+        vMultipliers.swap(batch.vMultipliers);
+        vCandidateTypes.swap(batch.vCandidateTypes);
+    }
+};
+
+// Number of candidates in a batch, enough to make the queue lock negligible
+static const unsigned int nPrimeCandidateBatchSize = 512;
+
+// State shared by the sieve and test threads of a pipeline
+class CPrimeMiningPipeline
+{
+private:
+    CCriticalSection cs;
+    int64 nPrimalityTestCost; // average test time of a candidate in microseconds
+
+public:
+    CBoundedQueue<CPrimeCandidateBatch> queue;
+    const unsigned int nSieveThreads;
+    const unsigned int nTestThreads;
+
+    CPrimeMiningPipeline(unsigned int nSieveThreadsIn, unsigned int nTestThreadsIn) :
+        nPrimalityTestCost(0), queue(2 * nTestThreadsIn), nSieveThreads(nSieveThreadsIn), nTestThreads(nTestThreadsIn) {}
+
+    void UpdatePrimalityTestCost(int64 nCost)
+    {
+        LOCK(cs);
+        nPrimalityTestCost = (nPrimalityTestCost == 0)? nCost : (7 * nPrimalityTestCost + nCost) / 8;
+    }
+
+    // Test time of a candidate as seen by one sieve thread: the testers share
+    // the candidates of all sieve threads
+    int64 GetPrimalityTestCost()
+    {
+        LOCK(cs);
+        return nPrimalityTestCost * nSieveThreads / nTestThreads;
+    }
+};
+
+// Weave the sieve of a round in the sieve thread, with its pminer, and hand
+// the candidates to the testers, waiting while the queue is full, until the
+// best chain moves on. The round needs its block, pindexPrev and fixed
+// multiplier; the fixed factor and the prime probability are filled in.
+// Return value: whether all the candidates were queued
+bool QueueMiningSieve(CPrimeMiningPipeline& pipeline, boost::shared_ptr<CPrimeSieveRound> pround, unsigned int& nCandidateCount, int64& nWeaveTime);
+
+// Test the candidates of a batch side by side in a tester thread, giving up
+// as soon as the best chain moves on or a candidate meets the target
+// Return value: whether a candidate meets the target, its block in blockFound
+bool TestMiningCandidates(const CPrimeCandidateBatch& batch, CPrimeMinerCounters& counters, unsigned int& nTests, unsigned int& nPrimesHit, double& dChainExpected, CBlock& blockFound);
+
 #endif
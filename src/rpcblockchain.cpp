@@ -54,7 +54,9 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
     result.push_back(Pair("difficulty", GetPrimeDifficulty(block.nBits)));
     result.push_back(Pair("transition", GetPrimeDifficulty(blockindex->nWorkTransition)));
     CBigNum bnPrimeChainOrigin = CBigNum(block.GetHeaderHash()) * block.bnPrimeChainMultiplier;
-    result.push_back(Pair("primechain", GetPrimeChainName(blockindex->nPrimeChainType, blockindex->nPrimeChainLength).c_str()));
+    unsigned int nPrimeChainType, nPrimeChainLength;
+    GetBlockPrimeChain(blockindex, nPrimeChainType, nPrimeChainLength, true);
+    result.push_back(Pair("primechain", GetPrimeChainName(nPrimeChainType, nPrimeChainLength).c_str()));
     result.push_back(Pair("primeorigin", bnPrimeChainOrigin.ToString().c_str()));
 
     if (blockindex->pprev)
@@ -225,6 +227,7 @@ Value listprimerecords(const Array& params, bool fHelp)
         throw runtime_error(
             "listprimerecords <primechain length> [primechain type]\n"
             "Returns the list of record prime chains in primecoin network.\n"
+            "Blocks with their proof-of-work assumed valid are left out.\n"
             "<primechain length> is integer like 10, 11, 12 etc.\n"
             "[primechain type] is optional type, among 1CC, 2CC and TWN");
 
@@ -249,9 +252,12 @@ Value listprimerecords(const Array& params, bool fHelp)
 
     for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
     {
-        if (nPrimeChainLength != (int) TargetGetLength(pindex->nPrimeChainLength))
+        unsigned int nBlockChainType, nBlockChainLength;
+        if (!GetBlockPrimeChain(pindex, nBlockChainType, nBlockChainLength))
+            continue; // prime chain not verified, next block
+        if (nPrimeChainLength != (int) TargetGetLength(nBlockChainLength))
             continue; // length not matching, next block
-        if (nPrimeChainType && nPrimeChainType != pindex->nPrimeChainType)
+        if (nPrimeChainType && nPrimeChainType != nBlockChainType)
             continue; // type not matching, next block
 
         CBlock block;
@@ -269,7 +275,7 @@ Value listprimerecords(const Array& params, bool fHelp)
             CTxDestination address;
             entry.push_back(Pair("mineraddress", (block.vtx[0].vout.size() > 1)? "multiple" : ExtractDestination(block.vtx[0].vout[0].scriptPubKey, address)? CBitcoinAddress(address).ToString().c_str() : "invalid"));
             entry.push_back(Pair("primedigit", (int) bnPrimeChainOrigin.ToString().length()));
-            entry.push_back(Pair("primechain", GetPrimeChainName(pindex->nPrimeChainType, pindex->nPrimeChainLength).c_str()));
+            entry.push_back(Pair("primechain", GetPrimeChainName(nBlockChainType, nBlockChainLength).c_str()));
             entry.push_back(Pair("primeorigin", bnPrimeChainOrigin.ToString().c_str()));
             entry.push_back(Pair("primorialform", GetPrimeOriginPrimorialForm(bnPrimeChainOrigin).c_str()));
             ret.push_back(entry);
@@ -286,6 +292,7 @@ Value listtopprimes(const Array& params, bool fHelp)
         throw runtime_error(
             "listtopprimes <primechain length> [primechain type]\n"
             "Returns the list of top prime chains in primecoin network.\n"
+            "Blocks with their proof-of-work assumed valid are left out.\n"
             "<primechain length> is integer like 10, 11, 12 etc.\n"
             "[primechain type] is optional type, among 1CC, 2CC and TWN");
 
@@ -311,9 +318,12 @@ Value listtopprimes(const Array& params, bool fHelp)
     vector<pair<CBigNum, uint256> > vSortedByOrigin;
     for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
     {
-        if (nPrimeChainLength != (int) TargetGetLength(pindex->nPrimeChainLength))
+        unsigned int nBlockChainType, nBlockChainLength;
+        if (!GetBlockPrimeChain(pindex, nBlockChainType, nBlockChainLength))
+            continue; // prime chain not verified, next block
+        if (nPrimeChainLength != (int) TargetGetLength(nBlockChainLength))
             continue; // length not matching, next block
-        if (nPrimeChainType && nPrimeChainType != pindex->nPrimeChainType)
+        if (nPrimeChainType && nPrimeChainType != nBlockChainType)
             continue; // type not matching, next block
 
         CBlock block;
@@ -359,7 +369,9 @@ Value listtopprimes(const Array& params, bool fHelp)
         CTxDestination address;
         entry.push_back(Pair("mineraddress", (block.vtx[0].vout.size() > 1)? "multiple" : ExtractDestination(block.vtx[0].vout[0].scriptPubKey, address)? CBitcoinAddress(address).ToString().c_str() : "invalid"));
         entry.push_back(Pair("primedigit", (int) bnPrimeChainOrigin.ToString().length()));
-        entry.push_back(Pair("primechain", GetPrimeChainName(pindex->nPrimeChainType, pindex->nPrimeChainLength).c_str()));
+        unsigned int nBlockChainType, nBlockChainLength;
+        GetBlockPrimeChain(pindex, nBlockChainType, nBlockChainLength);
+        entry.push_back(Pair("primechain", GetPrimeChainName(nBlockChainType, nBlockChainLength).c_str()));
         entry.push_back(Pair("primeorigin", bnPrimeChainOrigin.ToString().c_str()));
         entry.push_back(Pair("primorialform", GetPrimeOriginPrimorialForm(bnPrimeChainOrigin).c_str()));
         ret.push_back(entry);
@@ -68,7 +68,8 @@ Value getmininginfo(const Array& params, bool fHelp)
     if (fHelp || params.size() != 0)
         throw runtime_error(
             "getmininginfo\n"
-            "Returns an object containing mining-related information.");
+            "Returns an object containing mining-related information.\n"
+            "See getminingstats for the chain length histogram and per-stage telemetry.");
 
     Object obj;
     obj.push_back(Pair("blocks",        (int)nBestHeight));
@@ -85,6 +86,75 @@ Value getmininginfo(const Array& params, bool fHelp)
 }
 
 
+Value getminingstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getminingstats\n"
+            "Returns an object containing the mining telemetry since mining started:\n"
+            "  \"sievetime\" : microseconds to weave a sieve\n"
+            "  \"candidatedensity\" : candidates per sieve entry\n"
+            "  \"testcost\" : microseconds to test a candidate\n"
+            "  \"stalefraction\" : fraction of the mining time lost to stale blocks\n"
+            "  \"chains\" : candidates reaching each chain length from 1 on, by chain type\n"
+            "  \"chainsperhour\" : chains per hour at least as long as each length from 1 on");
+
+    vector<pair<string, CPrimeMinerCounters> > vCounters;
+    int64 nUptime = miningstats.GetThreadCounters(vCounters);
+    CPrimeMinerCounters total;
+    Array perthread;
+    for (unsigned int i = 0; i < vCounters.size(); i++)
+    {
+        const CPrimeMinerCounters& counters = vCounters[i].second;
+        total += counters;
+        Object thread;
+        thread.push_back(Pair("name",       vCounters[i].first));
+        thread.push_back(Pair("sieves",     (boost::uint64_t)counters.nSieves));
+        thread.push_back(Pair("candidates", (boost::uint64_t)counters.nCandidates));
+        thread.push_back(Pair("tests",      (boost::uint64_t)counters.nTests));
+        thread.push_back(Pair("testcost",   (double)counters.nTestTime / max((uint64)1, counters.nTests)));
+        thread.push_back(Pair("staletime",  (boost::uint64_t)counters.nStaleTime));
+        perthread.push_back(thread);
+    }
+
+    Object chains;
+    Array chainsperhour;
+    for (unsigned int nType = PRIME_CHAIN_CUNNINGHAM1; nType <= PRIME_CHAIN_BI_TWIN; nType++)
+    {
+        Array lengths;
+        for (unsigned int nLength = 0; nLength < nMinerStatsChainLengthMax; nLength++)
+            lengths.push_back((boost::uint64_t)total.pnChains[nType - 1][nLength]);
+        chains.push_back(Pair(GetPrimeChainName(nType, 0).substr(0, 3), lengths));
+    }
+    uint64 nChainsAtLeast = 0;
+    vector<uint64> vChainsAtLeast(nMinerStatsChainLengthMax);
+    for (int nLength = nMinerStatsChainLengthMax - 1; nLength >= 0; nLength--)
+    {
+        for (unsigned int nType = 0; nType < 3; nType++)
+            nChainsAtLeast += total.pnChains[nType][nLength];
+        vChainsAtLeast[nLength] = nChainsAtLeast;
+    }
+    for (unsigned int nLength = 0; nLength < nMinerStatsChainLengthMax; nLength++)
+        chainsperhour.push_back(nUptime > 0 ? 3600000000.0 * vChainsAtLeast[nLength] / nUptime : 0.0);
+
+    Object obj;
+    obj.push_back(Pair("uptime",             (boost::int64_t)(nUptime / 1000000)));
+    obj.push_back(Pair("threads",            (int)vCounters.size()));
+    obj.push_back(Pair("sieves",             (boost::uint64_t)total.nSieves));
+    obj.push_back(Pair("sievetime",          (double)total.nSieveTime / max((uint64)1, total.nSieves)));
+    obj.push_back(Pair("candidatespersieve", (double)total.nCandidates / max((uint64)1, total.nSieves)));
+    obj.push_back(Pair("candidatedensity",   (double)total.nCandidates / max((uint64)1, total.nSieveSize)));
+    obj.push_back(Pair("tests",              (boost::uint64_t)total.nTests));
+    obj.push_back(Pair("testspersec",        nUptime > 0 ? 1000000.0 * total.nTests / nUptime : 0.0));
+    obj.push_back(Pair("testcost",           (double)total.nTestTime / max((uint64)1, total.nTests)));
+    obj.push_back(Pair("staletime",          (boost::uint64_t)total.nStaleTime));
+    obj.push_back(Pair("stalefraction",      (nUptime > 0 && vCounters.size() > 0) ? (double)total.nStaleTime / ((double)nUptime * vCounters.size()) : 0.0));
+    obj.push_back(Pair("chains",             chains));
+    obj.push_back(Pair("chainsperhour",      chainsperhour));
+    obj.push_back(Pair("perthread",          perthread));
+    return obj;
+}
+
 Value getwork(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
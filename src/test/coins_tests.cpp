@@ -0,0 +1,255 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#include <map>
+
+using namespace std;
+
+// In-memory stand-in for the coin database, which like CCoinsViewDB only
+// keeps unspent coins and counts what it is asked to write
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapCoins;
+    unsigned int nWrites;
+
+    CCoinsViewTest() : nWrites(0) { }
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::const_iterator it = mapCoins.find(txid);
+        if (it == mapCoins.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256 &txid)
+    {
+        return mapCoins.count(txid) > 0;
+    }
+
+    bool BatchWrite(const CCoinsMap &mapDirty, CBlockIndex *pindex)
+    {
+        BOOST_FOREACH(const uint256 &txid, mapDirty.dirty()) {
+            const CCoinsCacheEntry *pentry = mapDirty.find(txid);
+            if (pentry == NULL || !pentry->IsDirty())
+                continue;
+            if (pentry->IsFresh() && pentry->coins.IsPruned())
+                continue;
+            // a fresh entry must not overwrite anything unspent
+            BOOST_CHECK(!pentry->IsFresh() || mapCoins.count(txid) == 0);
+            if (pentry->coins.IsPruned())
+                mapCoins.erase(txid);
+            else
+                mapCoins[txid] = pentry->coins;
+            nWrites++;
+        }
+        return true;
+    }
+};
+
+static CCoins RandomCoins(int nHeight)
+{
+    CCoins coins;
+    coins.nHeight = nHeight;
+    coins.vout.resize(1 + GetRandInt(4));
+    BOOST_FOREACH(CTxOut &out, coins.vout) {
+        out.nValue = 1 + GetRandInt(100000);
+        out.scriptPubKey = CScript() << vector<unsigned char>(GetRandInt(40), 0x51);
+    }
+    return coins;
+}
+
+// Check that what a view returns for txid matches the expected coins;
+// spent coins may be reported as missing or as pruned.
+static void CheckCoins(CCoinsView &view, const uint256 &txid, const std::map<uint256, CCoins> &mapExpected)
+{
+    CCoins coins;
+    bool fFound = view.GetCoins(txid, coins) && !coins.IsPruned();
+    std::map<uint256, CCoins>::const_iterator it = mapExpected.find(txid);
+    bool fExpected = it != mapExpected.end() && !it->second.IsPruned();
+    BOOST_CHECK_EQUAL(fFound, fExpected);
+    if (fFound && fExpected)
+        BOOST_CHECK(coins == it->second);
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coins_map)
+{
+    CCoinsMap map;
+    std::map<uint256, int> mapExpected;
+    for (int i = 0; i < 20000; i++) {
+        uint256 txid = GetRandInt(600);
+        if (GetRandInt(3) == 0) {
+            CCoinsCacheEntry *pentry = map.find(txid);
+            BOOST_CHECK_EQUAL(pentry != NULL, mapExpected.count(txid) > 0);
+            if (pentry) {
+                BOOST_CHECK_EQUAL(pentry->coins.nHeight, mapExpected[txid]);
+                map.erase(pentry);
+                mapExpected.erase(txid);
+            }
+        } else {
+            bool fInserted = false;
+            CCoinsCacheEntry *pentry = map.insert(txid, fInserted);
+            BOOST_CHECK_EQUAL(fInserted, mapExpected.count(txid) == 0);
+            BOOST_CHECK(pentry->txid == txid && pentry->IsUsed());
+            pentry->coins.nHeight = i;
+            mapExpected[txid] = i;
+        }
+    }
+    BOOST_CHECK_EQUAL(map.size(), mapExpected.size());
+    for (std::map<uint256, int>::iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+        const CCoinsCacheEntry *pentry = map.find(it->first);
+        BOOST_CHECK(pentry != NULL && pentry->coins.nHeight == it->second);
+    }
+    size_t nUsed = 0;
+    for (size_t n = 0; n < map.bucket_count(); n++)
+        nUsed += map.slot(n).IsUsed();
+    BOOST_CHECK_EQUAL(nUsed, map.size());
+}
+
+// Random modifications through a two-level cache, as SetBestChain stacks a
+// per-block view on pcoinsTip, compared against a plain map
+BOOST_AUTO_TEST_CASE(coins_cache_simulation)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache *ptip = new CCoinsViewCache(base);
+    CCoinsViewCache *pview = new CCoinsViewCache(*ptip, true);
+    std::map<uint256, CCoins> mapExpected;
+
+    for (int i = 0; i < 40000; i++) {
+        uint256 txid = GetRandInt(300);
+        std::map<uint256, CCoins>::iterator it = mapExpected.find(txid);
+        bool fUnspent = it != mapExpected.end() && !it->second.IsPruned();
+        if (!fUnspent) {
+            CCoins coins = RandomCoins(i);
+            if (GetRandInt(2))
+                pview->SetNewCoins(txid, coins);
+            else
+                pview->SetCoins(txid, coins);
+            mapExpected[txid] = coins;
+        } else if (GetRandInt(4) == 0) {
+            BOOST_CHECK(pview->AccessCoins(txid) == it->second);
+        } else {
+            BOOST_CHECK(pview->HaveCoins(txid));
+            CCoins &coins = pview->GetCoins(txid);
+            int n = GetRandInt(coins.vout.size());
+            coins.Spend(n);
+            it->second.Spend(n);
+            BOOST_CHECK(coins == it->second);
+        }
+
+        if (GetRandInt(50) == 0) {
+            BOOST_CHECK(pview->Flush());
+            delete pview;
+            if (GetRandInt(4) == 0)
+                BOOST_CHECK(ptip->Flush());
+            if (GetRandInt(8) == 0)
+                ptip->Trim(GetRandInt(2) ? 0 : 20000);
+            pview = new CCoinsViewCache(*ptip, true);
+        }
+        if (GetRandInt(500) == 0) {
+            for (int n = 0; n < 300; n++)
+                CheckCoins(*pview, n, mapExpected);
+        }
+    }
+
+    BOOST_CHECK(pview->Flush());
+    delete pview;
+    BOOST_CHECK(ptip->Flush());
+    BOOST_CHECK_EQUAL(ptip->GetDirtyCount(), 0U);
+    for (int n = 0; n < 300; n++) {
+        CheckCoins(*ptip, n, mapExpected);
+        CheckCoins(base, n, mapExpected);
+    }
+    delete ptip;
+}
+
+// Coins created and spent between two flushes never reach the base, and a
+// flush leaves the written coins cached
+BOOST_AUTO_TEST_CASE(coins_cache_fresh)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache tip(base);
+    uint256 txid1 = 1, txid2 = 2;
+
+    {
+        CCoinsViewCache view(tip, true);
+        view.SetNewCoins(txid1, RandomCoins(1));
+        view.SetNewCoins(txid2, RandomCoins(1));
+        BOOST_CHECK(view.Flush());
+    }
+    {
+        CCoinsViewCache view(tip, true);
+        CCoins &coins = view.GetCoins(txid1);
+        while (!coins.IsPruned())
+            coins.Spend(coins.vout.size() - 1);
+        BOOST_CHECK(view.Flush());
+    }
+    BOOST_CHECK_EQUAL(tip.GetDirtyCount(), 2U);
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 1U);
+    BOOST_CHECK(!base.HaveCoins(txid1));
+    BOOST_CHECK(base.HaveCoins(txid2));
+
+    // still cached, now clean: flushing again writes nothing
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 1U);
+    BOOST_CHECK_EQUAL(tip.GetDirtyCount(), 0U);
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 1U);
+
+    // spending coins the base has must be written
+    tip.GetCoins(txid2).Spend(0);
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(base.nWrites, 2U);
+}
+
+// Memory usage counts the outputs and scripts of the cached coins, and Trim
+// only evicts clean entries
+BOOST_AUTO_TEST_CASE(coins_cache_usage)
+{
+    CCoinsViewTest base;
+    CCoinsViewCache tip(base);
+    size_t nEmpty = tip.GetCacheUsage();
+
+    CCoins coins;
+    coins.vout.resize(2);
+    coins.vout[0].nValue = coins.vout[1].nValue = 1;
+    coins.vout[0].scriptPubKey = CScript() << vector<unsigned char>(1000, 0x51);
+    tip.SetCoins(1, coins);
+    size_t nOne = tip.GetCacheUsage();
+    BOOST_CHECK(nOne >= nEmpty + 2 * sizeof(CTxOut) + 1000);
+
+    // a change made through a modifiable reference is counted too
+    tip.GetCoins(1).vout[1].scriptPubKey = CScript() << vector<unsigned char>(5000, 0x51);
+    BOOST_CHECK(tip.GetCacheUsage() >= nOne + 5000);
+
+    for (int i = 2; i < 200; i++)
+        tip.SetCoins(i, coins);
+    size_t nFull = tip.GetCacheUsage();
+
+    // dirty entries stay
+    tip.Trim(0);
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 199U);
+    BOOST_CHECK_EQUAL(tip.GetCacheUsage(), nFull);
+
+    BOOST_CHECK(tip.Flush());
+    tip.Trim(nFull / 2);
+    BOOST_CHECK(tip.GetCacheUsage() <= nFull / 2);
+    BOOST_CHECK(tip.GetCacheSize() > 0);
+    BOOST_CHECK(tip.GetCacheSize() < 199U);
+
+    // evicted coins are fetched again from the base
+    for (int i = 1; i < 200; i++)
+        BOOST_CHECK(tip.HaveCoins(i));
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 199U);
+    tip.Trim(0);
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 0U);
+    BOOST_CHECK(tip.GetCacheUsage() < nFull / 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,74 @@
+#include <boost/test/unit_test.hpp>
+
+#include "prime.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(header_search_tests)
+
+// The nonce loop the multi-buffer search replaces
+static bool SearchProbablePrimeHeaderReference(CBlockHeader& block, unsigned int nNonceLimit)
+{
+    for (; block.nNonce < nNonceLimit; block.nNonce++)
+    {
+        uint256 hashBlockHeader = block.GetHeaderHash();
+        if (hashBlockHeader < hashBlockHeaderLimit)
+            continue;
+        if (ProbablePrimalityTestWithTrialDivision(CBigNum(hashBlockHeader), 1000))
+            return true;
+    }
+    return false;
+}
+
+static CBlockHeader RandomHeader()
+{
+    CBlockHeader block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nTime = GetRand(0xffffffff);
+    block.nBits = TargetFromInt(10);
+    block.nNonce = GetRand(0x10000);
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(header_search_first_nonce)
+{
+    GeneratePrimeTable();
+    for (int i = 0; i < 50; i++)
+    {
+        CBlockHeader block = RandomHeader();
+        CBlockHeader blockReference = block;
+        BOOST_CHECK(SearchProbablePrimeHeader(block, 0xffff0000));
+        BOOST_CHECK(SearchProbablePrimeHeaderReference(blockReference, 0xffff0000));
+        BOOST_CHECK_EQUAL(block.nNonce, blockReference.nNonce);
+        BOOST_CHECK(block.GetHeaderHash() >= hashBlockHeaderLimit);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(header_search_limit)
+{
+    GeneratePrimeTable();
+    for (int i = 0; i < 50; i++)
+    {
+        CBlockHeader block = RandomHeader();
+        CBlockHeader blockReference = block;
+        SearchProbablePrimeHeaderReference(blockReference, 0xffff0000);
+
+        // A limit at or just above the first good nonce, not aligned to lanes
+        unsigned int nLimit = blockReference.nNonce;
+        CBlockHeader blockLimit = block;
+        BOOST_CHECK(!SearchProbablePrimeHeader(blockLimit, nLimit));
+        BOOST_CHECK_EQUAL(blockLimit.nNonce, nLimit);
+        blockLimit = block;
+        BOOST_CHECK(SearchProbablePrimeHeader(blockLimit, nLimit + 1));
+        BOOST_CHECK_EQUAL(blockLimit.nNonce, nLimit);
+    }
+
+    // Search from the limit on finds nothing and leaves the nonce
+    CBlockHeader block = RandomHeader();
+    block.nNonce = 0xffff0005;
+    BOOST_CHECK(!SearchProbablePrimeHeader(block, 0xffff0000));
+    BOOST_CHECK_EQUAL(block.nNonce, 0xffff0005u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,301 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+#include "test/testchain.h"
+
+extern bool AcceptBlockHeader(CBlockHeader& header, CValidationState& state, CBlockIndex** ppindex);
+extern void CheckHeadersContext(const std::vector<CBlock>& vHeaders, std::vector<CBlockHeader>& vCheck);
+extern void InvalidHeaderFound(const uint256& hash, CNode* pfrom);
+extern void ScheduleBlockDownload(CNode* pto);
+extern bool ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
+
+BOOST_AUTO_TEST_SUITE(main_tests)
+
+// Header chain of nLength headers on top of pindexPrev
+static std::vector<CBlockIndex*> AcceptTestHeaders(CBlockIndex* pindexPrev, unsigned int nLength, unsigned int nExtraNonce)
+{
+    std::vector<CBlockIndex*> vIndex;
+    for (unsigned int i = 0; i < nLength; i++)
+    {
+        CBlock header = CreateTestBlock(pindexPrev, nExtraNonce);
+        CValidationState state;
+        BOOST_CHECK(AcceptBlockHeader(header, state, &pindexPrev));
+        vIndex.push_back(pindexPrev);
+    }
+    return vIndex;
+}
+
+// Pass the header integrity check again after a change, with the
+// proof-of-work check recorded as passed
+static void SolveTestHeader(CBlock& header)
+{
+    while (header.GetHeaderHash() < hashBlockHeaderLimit)
+        header.nNonce++;
+    pblocktree->WritePowCheck(header.GetHash(), PRIME_CHAIN_CUNNINGHAM1, header.nBits);
+}
+
+// Header on pindexPrev with a target other than the one required
+static CBlock CreateWrongTargetHeader(const CBlockIndex* pindexPrev)
+{
+    CBlock header = CreateTestBlock(pindexPrev, 0);
+    header.nBits++;
+    SolveTestHeader(header);
+    return header;
+}
+
+static bool HeaderFailed(CBlockIndex* pindex)
+{
+    return pindex->nStatus & BLOCK_FAILED_MASK;
+}
+
+// Headers are accepted after the contextual checks and the proof-of-work
+// check, the cheap checks alone picking those worth the latter
+BOOST_AUTO_TEST_CASE(main_header_accept)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexBase = pindexBest;
+    std::vector<CBlockIndex*> vIndex = AcceptTestHeaders(pindexBase, 2, 1);
+    BOOST_REQUIRE_EQUAL(vIndex.size(), 2U);
+    BOOST_CHECK(vIndex[1]->pprev == vIndex[0] && vIndex[1]->nHeight == pindexBase->nHeight + 2);
+    BOOST_CHECK(vIndex[1]->nChainWork > vIndex[0]->nChainWork);
+
+    // Known already
+    CBlock header = CreateTestBlock(pindexBase, 1);
+    CBlockIndex* pindex = NULL;
+    CValidationState state;
+    BOOST_CHECK(AcceptBlockHeader(header, state, &pindex) && pindex == vIndex[0]);
+
+    // Unknown previous block
+    header = CreateTestBlock(vIndex[1], 1);
+    header.hashPrevBlock = 1;
+    SolveTestHeader(header);
+    int nDoS = 0;
+    BOOST_CHECK(!AcceptBlockHeader(header, state, &pindex));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 10);
+
+    // Wrong target
+    header = CreateWrongTargetHeader(vIndex[1]);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptBlockHeader(header, state, &pindex));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+
+    // No prime chain
+    header = CreateTestBlock(vIndex[1], 5, false);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptBlockHeader(header, state, &pindex));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+
+    // A message with a known header, two new ones checked on top of each
+    // other and one with the wrong target: only the new ones up to the
+    // wrong one are worth a proof-of-work check
+    std::vector<CBlock> vHeaders;
+    vHeaders.push_back(CreateTestBlock(pindexBase, 1));
+    CBlock header3 = CreateTestBlock(vIndex[1], 1);
+    vHeaders.push_back(header3);
+    CBlockIndex index3(header3);
+    uint256 hash3 = header3.GetHash();
+    index3.phashBlock = &hash3;
+    index3.pprev = vIndex[1];
+    index3.nHeight = vIndex[1]->nHeight + 1;
+    CBlock header4 = CreateTestBlock(&index3, 1);
+    vHeaders.push_back(header4);
+    CBlockIndex index4(header4);
+    uint256 hash4 = header4.GetHash();
+    index4.phashBlock = &hash4;
+    index4.pprev = &index3;
+    index4.nHeight = index3.nHeight + 1;
+    vHeaders.push_back(CreateWrongTargetHeader(&index4));
+    vHeaders.push_back(CreateTestBlock(&index4, 2));
+    std::vector<CBlockHeader> vCheck;
+    CheckHeadersContext(vHeaders, vCheck);
+    BOOST_REQUIRE_EQUAL(vCheck.size(), 2U);
+    BOOST_CHECK(vCheck[0].GetHash() == hash3 && vCheck[1].GetHash() == hash4);
+
+    // Nothing new past the first unknown previous block
+    vHeaders.clear();
+    vHeaders.push_back(header3);
+    vHeaders.back().hashPrevBlock = 1;
+    SolveTestHeader(vHeaders.back());
+    vHeaders.push_back(header4);
+    vCheck.clear();
+    CheckHeadersContext(vHeaders, vCheck);
+    BOOST_CHECK(vCheck.empty());
+
+    InvalidHeaderFound(vIndex[0]->GetBlockHash(), NULL);
+}
+
+// An invalid block flags the headers descending from it, and only those
+BOOST_AUTO_TEST_CASE(main_header_invalid_chain)
+{
+    LOCK(cs_main);
+    std::vector<CBlockIndex*> vIndex = AcceptTestHeaders(pindexBest, 3, 2);
+    std::vector<CBlockIndex*> vSide = AcceptTestHeaders(vIndex[0], 2, 3);
+    BOOST_REQUIRE(vIndex.size() == 3 && vSide.size() == 2);
+
+    InvalidHeaderFound(vIndex[1]->GetBlockHash(), NULL);
+    BOOST_CHECK(!HeaderFailed(vIndex[0]));
+    BOOST_CHECK(HeaderFailed(vIndex[1]) && HeaderFailed(vIndex[2]));
+    BOOST_CHECK(!HeaderFailed(vSide[0]) && !HeaderFailed(vSide[1]));
+
+    CBlock header = CreateTestBlock(vIndex[2], 2);
+    CBlockIndex* pindex = NULL;
+    CValidationState state;
+    int nDoS = 0;
+    BOOST_CHECK(!AcceptBlockHeader(header, state, &pindex));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    header = CreateTestBlock(vIndex[1], 2);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptBlockHeader(header, state, &pindex));
+
+    // The side chain is still extended
+    BOOST_CHECK(AcceptTestHeaders(vSide[1], 1, 3).size() == 1);
+
+    InvalidHeaderFound(vIndex[0]->GetBlockHash(), NULL);
+    BOOST_CHECK(HeaderFailed(vSide[0]) && HeaderFailed(vSide[1]));
+}
+
+static CNode* CreateTestPeer(unsigned int i)
+{
+    CAddress addr(CService(CNetAddr(strprintf("10.0.0.%u", i).c_str()), GetDefaultPort()));
+    CNode* pnode = new CNode(INVALID_SOCKET, addr, "", false);
+    pnode->nVersion = PROTOCOL_VERSION;
+    pnode->fSuccessfullyConnected = true;
+    pnode->nStartingHeight = 1000000;
+    // a message queued ahead keeps the messages pushed from being sent,
+    // which would disconnect the peer for want of a socket
+    pnode->vSendMsg.push_back(CSerializeData(1));
+    return pnode;
+}
+
+// Blocks of the best header chain are asked from the peers, and asked from
+// another peer when one stalls or does not have them
+BOOST_AUTO_TEST_CASE(main_block_download)
+{
+    LOCK(cs_main);
+    std::vector<CBlockIndex*> vIndex = AcceptTestHeaders(pindexBest, 3, 4);
+    BOOST_REQUIRE_EQUAL(vIndex.size(), 3U);
+    CNode* pnode1 = CreateTestPeer(1);
+    CNode* pnode2 = CreateTestPeer(2);
+    CNode* pnode3 = CreateTestPeer(3);
+
+    ScheduleBlockDownload(pnode1);
+    BOOST_CHECK_EQUAL(pnode1->nBlocksInFlight, 3);
+    BOOST_CHECK_EQUAL(pnode1->vSendMsg.size(), 2U);
+    ScheduleBlockDownload(pnode1);
+    ScheduleBlockDownload(pnode2);
+    BOOST_CHECK_EQUAL(pnode1->nBlocksInFlight, 3);
+    BOOST_CHECK_EQUAL(pnode2->nBlocksInFlight, 0);
+    BOOST_CHECK_EQUAL(pnode2->vSendMsg.size(), 1U);
+
+    // Peer 1 stalls, its blocks go to peer 2 and it sits out a while
+    int64 nStalled = GetTime() + BLOCK_STALLING_TIMEOUT + 1;
+    SetMockTime(nStalled);
+    ScheduleBlockDownload(pnode2);
+    BOOST_CHECK_EQUAL(pnode1->nBlocksInFlight, 0);
+    BOOST_CHECK_EQUAL(pnode1->nBlocksStalledTime, nStalled);
+    BOOST_CHECK_EQUAL(pnode2->nBlocksInFlight, 3);
+    ScheduleBlockDownload(pnode1);
+    BOOST_CHECK_EQUAL(pnode1->nBlocksInFlight, 0);
+
+    // Peer 2 does not have the second block, peer 3 is asked for it; a
+    // notfound for blocks asked from another peer changes nothing
+    std::vector<CInv> vInv(1, CInv(MSG_BLOCK, vIndex[1]->GetBlockHash()));
+    CDataStream ssNotFound(SER_NETWORK, PROTOCOL_VERSION);
+    ssNotFound << vInv;
+    BOOST_CHECK(ProcessMessage(pnode3, "notfound", ssNotFound));
+    BOOST_CHECK_EQUAL(pnode2->nBlocksInFlight, 3);
+    ssNotFound << vInv;
+    BOOST_CHECK(ProcessMessage(pnode2, "notfound", ssNotFound));
+    BOOST_CHECK_EQUAL(pnode2->nBlocksInFlight, 2);
+    ScheduleBlockDownload(pnode3);
+    BOOST_CHECK_EQUAL(pnode3->nBlocksInFlight, 1);
+
+    // Requests to peers gone are dropped
+    pnode2->fDisconnect = true;
+    pnode3->fDisconnect = true;
+    ScheduleBlockDownload(pnode1);
+    BOOST_CHECK_EQUAL(pnode2->nBlocksInFlight, 0);
+    BOOST_CHECK_EQUAL(pnode3->nBlocksInFlight, 0);
+    BOOST_CHECK_EQUAL(pnode1->nBlocksInFlight, 0);
+
+    SetMockTime(0);
+    InvalidHeaderFound(vIndex[0]->GetBlockHash(), NULL);
+    delete pnode1;
+    delete pnode2;
+    delete pnode3;
+}
+
+// Chain of nLength headers on top of pindexPrev, not accepted; vIndex and
+// vHash hold their temporary index entries
+static std::vector<CBlock> CreateTestHeaders(const CBlockIndex* pindexPrev, unsigned int nLength, unsigned int nExtraNonce, bool fRecordPow, std::vector<CBlockIndex>& vIndex, std::vector<uint256>& vHash)
+{
+    std::vector<CBlock> vHeaders;
+    vIndex.resize(nLength);
+    vHash.resize(nLength);
+    for (unsigned int i = 0; i < nLength; i++)
+    {
+        vHeaders.push_back(CreateTestBlock(pindexPrev, nExtraNonce, fRecordPow));
+        vHash[i] = vHeaders[i].GetHash();
+        vIndex[i] = CBlockIndex(vHeaders[i]);
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = const_cast<CBlockIndex*>(pindexPrev);
+        vIndex[i].nHeight = pindexPrev->nHeight + 1;
+        pindexPrev = &vIndex[i];
+    }
+    return vHeaders;
+}
+
+// With -assumevalid, the headers leading to the assumed-valid block are
+// taken without a prime chain, the others have it checked once that block
+// links to ours; its ancestors' blocks only get the header integrity check
+BOOST_AUTO_TEST_CASE(main_header_assume_valid)
+{
+    LOCK(cs_main);
+    std::vector<CBlockIndex> vIndexTemp;
+    std::vector<uint256> vHashTemp;
+    std::vector<CBlock> vHeaders = CreateTestHeaders(pindexBest, 3, 6, false, vIndexTemp, vHashTemp);
+    hashAssumeValid = vHeaders[2].GetHash();
+
+    // Before the assumed-valid block, nothing tells the headers apart
+    std::vector<CBlockIndex*> vIndex(3, (CBlockIndex*)NULL);
+    CValidationState state;
+    BOOST_CHECK(AcceptBlockHeader(vHeaders[0], state, &vIndex[0]));
+    CBlock headerFork = CreateTestBlock(vIndex[0], 7, false);
+    CBlockIndex* pindexFork = NULL;
+    BOOST_CHECK(AcceptBlockHeader(headerFork, state, &pindexFork));
+    BOOST_REQUIRE(pindexFork);
+    BOOST_CHECK(!HeaderFailed(pindexFork));
+    BOOST_CHECK(AcceptBlockHeader(vHeaders[1], state, &vIndex[1]));
+
+    // The assumed-valid block trusts its ancestors, the fork fails
+    BOOST_CHECK(AcceptBlockHeader(vHeaders[2], state, &vIndex[2]));
+    BOOST_REQUIRE(vIndex[2]);
+    BOOST_CHECK(!HeaderFailed(vIndex[0]) && !HeaderFailed(vIndex[1]) && !HeaderFailed(vIndex[2]));
+    BOOST_CHECK(HeaderFailed(pindexFork));
+
+    // Past it the headers are checked
+    CBlock header = CreateTestBlock(vIndex[2], 6, false);
+    CBlockIndex* pindex = NULL;
+    int nDoS = 0;
+    BOOST_CHECK(!AcceptBlockHeader(header, state, &pindex));
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    header = CreateTestBlock(vIndex[2], 6);
+    state = CValidationState();
+    BOOST_CHECK(AcceptBlockHeader(header, state, &pindex));
+
+    // The block of an ancestor is taken without its prime chain
+    CBlock block = vHeaders[0];
+    BOOST_CHECK(ProcessBlock(state, NULL, &block));
+    BOOST_REQUIRE(mapBlockIndex.count(block.GetHash()));
+    unsigned int nChainType = 1, nChainLength = 1;
+    BOOST_CHECK(!GetBlockPrimeChain(mapBlockIndex[block.GetHash()], nChainType, nChainLength));
+    BOOST_CHECK(nChainType == 0 && nChainLength == 0);
+    BOOST_CHECK(!GetBlockPrimeChain(mapBlockIndex[block.GetHash()], nChainType, nChainLength, true));
+
+    hashAssumeValid = 0;
+    InvalidHeaderFound(vIndex[1]->GetBlockHash(), NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,92 @@
+#include <boost/test/unit_test.hpp>
+
+#include "init.h"
+#include "main.h"
+#include "minertemplate.h"
+#include "util.h"
+#include "wallet.h"
+#include "test/testchain.h"
+
+BOOST_AUTO_TEST_SUITE(minertemplate_tests)
+
+// A template is shared until the best chain moves on or transactions
+// arrived more than a while ago
+BOOST_AUTO_TEST_CASE(minertemplate_refresh)
+{
+    CMinerTemplateProducer producer(pwalletMain);
+    boost::shared_ptr<const CMinerBlockTemplate> ptemplate = producer.GetTemplate();
+    BOOST_REQUIRE(ptemplate);
+    BOOST_CHECK(ptemplate->pindexPrev == pindexBest);
+    BOOST_CHECK(ptemplate->blocktemplate.block.hashPrevBlock == pindexBest->GetBlockHash());
+    BOOST_CHECK(producer.GetTemplate() == ptemplate);
+
+    // New transactions wait a while
+    nTransactionsUpdated++;
+    BOOST_CHECK(producer.GetTemplate() == ptemplate);
+    SetMockTime(GetTime() + 11);
+    boost::shared_ptr<const CMinerBlockTemplate> ptemplateNew = producer.GetTemplate();
+    SetMockTime(0);
+    BOOST_REQUIRE(ptemplateNew);
+    BOOST_CHECK(ptemplateNew != ptemplate);
+    BOOST_CHECK_EQUAL(ptemplateNew->nGeneration, ptemplate->nGeneration + 1);
+    BOOST_CHECK_EQUAL(ptemplateNew->nTransactionsUpdated, nTransactionsUpdated);
+    ptemplate = ptemplateNew;
+
+    // A new best block does not
+    {
+        LOCK(cs_main);
+        CBlock block = CreateTestBlock(pindexBest, 8);
+        CValidationState state;
+        BOOST_CHECK(ProcessBlock(state, NULL, &block));
+        BOOST_CHECK(pindexBest->GetBlockHash() == block.GetHash());
+    }
+    ptemplateNew = producer.GetTemplate();
+    BOOST_REQUIRE(ptemplateNew);
+    BOOST_CHECK_EQUAL(ptemplateNew->nGeneration, ptemplate->nGeneration + 1);
+    BOOST_CHECK(ptemplateNew->pindexPrev == pindexBest);
+    BOOST_CHECK(ptemplateNew->blocktemplate.block.hashPrevBlock == pindexBest->GetBlockHash());
+}
+
+// The extranonce goes into the coinbase after the height, with the thread
+// number, and the merkle root follows the coinbase branch
+BOOST_AUTO_TEST_CASE(minertemplate_extranonce)
+{
+    CMinerTemplateProducer producer(pwalletMain);
+    boost::shared_ptr<const CMinerBlockTemplate> ptemplate = producer.GetTemplate();
+    BOOST_REQUIRE(ptemplate);
+
+    // Template with transactions past the coinbase, for a branch of some depth
+    CMinerBlockTemplate blocktemplate = *ptemplate;
+    CBlock& blockTemplate = blocktemplate.blocktemplate.block;
+    for (int i = 0; i < 4; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(i + 1, 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i * CENT;
+        blockTemplate.vtx.push_back(tx);
+    }
+    blockTemplate.hashMerkleRoot = blockTemplate.BuildMerkleTree();
+    blocktemplate.vCoinbaseBranch = blockTemplate.GetMerkleBranch(0);
+    BOOST_CHECK_EQUAL(blocktemplate.vCoinbaseBranch.size(), 3U);
+
+    unsigned int nHeight = blocktemplate.pindexPrev->nHeight + 1;
+    std::set<uint256> setRoots;
+    for (unsigned int nThread = 0; nThread < 2; nThread++)
+        for (unsigned int nExtraNonce = 1; nExtraNonce <= 2; nExtraNonce++)
+        {
+            CBlock block(blockTemplate);
+            SetTemplateExtraNonce(block, blocktemplate, nThread, nExtraNonce);
+            const CScript& scriptSig = block.vtx[0].vin[0].scriptSig;
+            CScript scriptPrefix = CScript() << nHeight << CBigNum(((uint64) nThread << 32) | nExtraNonce);
+            BOOST_CHECK(scriptSig.size() >= scriptPrefix.size() && std::equal(scriptPrefix.begin(), scriptPrefix.end(), scriptSig.begin()));
+            uint256 hashMerkleRoot = block.hashMerkleRoot;
+            BOOST_CHECK(hashMerkleRoot == block.BuildMerkleTree());
+            setRoots.insert(hashMerkleRoot);
+        }
+    BOOST_CHECK_EQUAL(setRoots.size(), 4U);
+    BOOST_CHECK(!setRoots.count(blockTemplate.hashMerkleRoot));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
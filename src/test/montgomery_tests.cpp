@@ -0,0 +1,85 @@
+#include <boost/test/unit_test.hpp>
+
+#include "montgomery.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(montgomery_tests)
+
+// Random odd number of exactly nBits bits
+static CBigNum RandomOdd(unsigned int nBits)
+{
+    CBigNum bn;
+    while ((unsigned int) BN_num_bits(&bn) < nBits)
+        bn = (bn << 256) + CBigNum(GetRandHash());
+    bn >>= BN_num_bits(&bn) - nBits;
+    BN_set_bit(&bn, nBits - 1);
+    BN_set_bit(&bn, 0);
+    return bn;
+}
+
+// Powers of two and products in Montgomery form must agree with BN_mod_exp
+template<unsigned int nLimbs>
+static void CheckModulus(unsigned int nBits)
+{
+    CBigNum bnTwo = 2;
+    CAutoBN_CTX pctx;
+    CBigNum bnN = RandomOdd(nBits);
+    CBigNum bnE = RandomOdd(nBits) >> 1;
+    mont_limb_t pN[nLimbs], pE[nLimbs], pr[nLimbs], pSquare[nLimbs], pProduct[nLimbs];
+    BOOST_CHECK(MontFromBigNum(bnN, pN, nLimbs));
+    BOOST_CHECK(MontFromBigNum(bnE, pE, nLimbs));
+
+    CMontgomeryModulus<nLimbs> mod;
+    mod.SetModulus(pN);
+    BOOST_CHECK_EQUAL(mod.nBits, nBits);
+    mod.PowerOfTwo(pr, pE, MontBitLength(pE, nLimbs));
+
+    // Squaring and general multiplication give the same result
+    mod.Square(pSquare, pr);
+    mod.Multiply(pProduct, pr, pr);
+    BOOST_CHECK(MontCompare(pSquare, pProduct, nLimbs) == 0);
+
+    CBigNum bnExpected, bnResult;
+    BN_mod_exp(&bnExpected, &bnTwo, &bnE, &bnN, pctx);
+    mod.Reduce(pr, pr);
+    MontToBigNum(pr, nLimbs, bnResult);
+    BOOST_CHECK(bnResult == bnExpected);
+
+    CBigNum bnExpectedSquare = (bnExpected * bnExpected) % bnN;
+    mod.Reduce(pSquare, pSquare);
+    MontToBigNum(pSquare, nLimbs, bnResult);
+    BOOST_CHECK(bnResult == bnExpectedSquare);
+}
+
+BOOST_AUTO_TEST_CASE(montgomery_power_of_two)
+{
+    for (int i = 0; i < 20; i++)
+    {
+        CheckModulus<256 / nMontLimbBits>(256);
+        CheckModulus<256 / nMontLimbBits>(200);
+        CheckModulus<384 / nMontLimbBits>(333);
+        CheckModulus<512 / nMontLimbBits>(512);
+        CheckModulus<nMontLimbsMax>(1999);
+        CheckModulus<nMontLimbsMax>(nMontBitsMax);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(montgomery_conversion)
+{
+    mont_limb_t pa[nMontLimbsMax];
+    CBigNum bn = RandomOdd(1000), bnResult;
+    BOOST_CHECK(MontFromBigNum(bn, pa, nMontLimbsMax));
+    MontToBigNum(pa, nMontLimbsMax, bnResult);
+    BOOST_CHECK(bnResult == bn);
+    BOOST_CHECK_EQUAL(MontBitLength(pa, nMontLimbsMax), 1000u);
+    BOOST_CHECK(!MontFromBigNum(bn, pa, 512 / nMontLimbBits));
+
+    // A chain number outgrowing the widest modulus takes one more limb
+    mont_limb_t pb[nMontLimbsMax + 1];
+    bn = RandomOdd(nMontBitsMax + 1);
+    BOOST_CHECK(MontFromBigNum(bn, pb, nMontLimbsMax + 1));
+    MontToBigNum(pb, nMontLimbsMax + 1, bnResult);
+    BOOST_CHECK(bnResult == bn);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
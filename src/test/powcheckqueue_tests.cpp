@@ -0,0 +1,124 @@
+#include <boost/test/unit_test.hpp>
+
+#include "powcheckqueue.h"
+#include "prime.h"
+
+BOOST_AUTO_TEST_SUITE(powcheckqueue_tests)
+
+static boost::mutex mutexChecks;
+static std::map<uint256, int> mapCheckCount;
+
+// Stand-in for the prime proof-of-work check: a nonce divisible by 3 fails,
+// and the checks of small nonces take longest so they complete out of order
+static bool CheckTestHeader(const CBlockHeader& header, unsigned int& nChainType, unsigned int& nChainLength)
+{
+    MilliSleep(2 * (8 - std::min(header.nNonce, 8u)));
+    {
+        boost::unique_lock<boost::mutex> lock(mutexChecks);
+        mapCheckCount[header.GetHash()]++;
+    }
+    nChainType = PRIME_CHAIN_CUNNINGHAM1;
+    nChainLength = header.nNonce;
+    return header.nNonce % 3 != 0;
+}
+
+static CBlockHeader TestHeader(unsigned int nNonce)
+{
+    CBlockHeader header;
+    header.nNonce = nNonce;
+    return header;
+}
+
+static int GetCheckCount(const CBlockHeader& header)
+{
+    boost::unique_lock<boost::mutex> lock(mutexChecks);
+    return mapCheckCount[header.GetHash()];
+}
+
+static void PowCheckWorker(CPowCheckQueue* pqueue)
+{
+    try {
+        pqueue->Thread();
+    }
+    catch (boost::thread_interrupted) {}
+}
+
+// Checks run ahead and out of order must come back to the caller in its
+// own order, each with the result of its own block
+BOOST_AUTO_TEST_CASE(powcheck_in_order)
+{
+    CPowCheckQueue queue(CheckTestHeader);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; i++)
+        threadGroup.create_thread(boost::bind(&PowCheckWorker, &queue));
+    while (queue.GetLookahead() < 12)
+        MilliSleep(1);
+
+    for (unsigned int n = 1; n <= 8; n++)
+        queue.Add(TestHeader(n));
+    for (unsigned int n = 1; n <= 8; n++)
+    {
+        unsigned int nChainType = 0, nChainLength = 0;
+        BOOST_CHECK_EQUAL(queue.Check(TestHeader(n), nChainType, nChainLength), n % 3 != 0);
+        BOOST_CHECK_EQUAL(nChainType, (unsigned int) PRIME_CHAIN_CUNNINGHAM1);
+        BOOST_CHECK_EQUAL(nChainLength, n);
+        BOOST_CHECK_EQUAL(GetCheckCount(TestHeader(n)), 1);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+// A block fails its check the same way whether it was checked ahead,
+// waited for or checked by the caller
+BOOST_AUTO_TEST_CASE(powcheck_rejection)
+{
+    unsigned int nChainType, nChainLength;
+    CPowCheckQueue queueIdle(CheckTestHeader);
+    queueIdle.Add(TestHeader(12)); // no workers, nothing queued
+    BOOST_CHECK(!queueIdle.Check(TestHeader(12), nChainType, nChainLength));
+    BOOST_CHECK(queueIdle.Check(TestHeader(13), nChainType, nChainLength));
+
+    CPowCheckQueue queue(CheckTestHeader);
+    boost::thread threadWorker(PowCheckWorker, &queue);
+    while (queue.GetLookahead() == 0)
+        MilliSleep(1);
+    queue.Add(TestHeader(15));
+    BOOST_CHECK(!queue.Wait(TestHeader(15).GetHash()));
+    BOOST_CHECK(!queue.Wait(TestHeader(15).GetHash()));
+    BOOST_CHECK(!queue.Check(TestHeader(15), nChainType, nChainLength));
+    queue.Add(TestHeader(18));
+    BOOST_CHECK(!queue.Check(TestHeader(18), nChainType, nChainLength));
+    queue.Add(TestHeader(19));
+    BOOST_CHECK(queue.Check(TestHeader(19), nChainType, nChainLength));
+
+    threadWorker.interrupt();
+    threadWorker.join();
+}
+
+// A block checked, taken and added again must keep its new check when the
+// entry of its first check is evicted
+BOOST_AUTO_TEST_CASE(powcheck_added_again)
+{
+    unsigned int nChainType, nChainLength;
+    CPowCheckQueue queue(CheckTestHeader, 4);
+    boost::thread threadWorker(PowCheckWorker, &queue);
+    while (queue.GetLookahead() == 0)
+        MilliSleep(1);
+
+    CBlockHeader header = TestHeader(20);
+    queue.Add(header);
+    BOOST_CHECK(queue.Check(header, nChainType, nChainLength));
+    queue.Add(header);
+    BOOST_CHECK(queue.Wait(header.GetHash()));
+    BOOST_CHECK_EQUAL(GetCheckCount(header), 2);
+    for (unsigned int n = 21; n <= 23; n++)
+        queue.Add(TestHeader(n)); // the last one evicts the first entry
+    BOOST_CHECK(queue.Check(header, nChainType, nChainLength));
+    BOOST_CHECK_EQUAL(GetCheckCount(header), 2);
+
+    threadWorker.interrupt();
+    threadWorker.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
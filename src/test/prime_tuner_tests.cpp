@@ -0,0 +1,139 @@
+#include <boost/test/unit_test.hpp>
+
+#include "prime.h"
+
+BOOST_AUTO_TEST_SUITE(prime_tuner_tests)
+
+// Expected chains per microsecond of a made-up miner, best at
+// sieve=2000000 weave=5000 primorial=19
+static double TunerTestRate(const CPrimeMinerProfile& profile)
+{
+    double dSieve = log(profile.nSieveSize / 2000000.0);
+    double dWeave = log(profile.nSieveWeave / 5000.0);
+    double dPrimorial = (profile.nPrimorialMultiplier - 19.0) / 10.0;
+    return exp(-dSieve * dSieve - dWeave * dWeave - dPrimorial * dPrimorial);
+}
+
+// Mine nTrials trials of the tuner's profiles
+static void TunerTestMine(CPrimeMinerTuner& tuner, unsigned int nTrials)
+{
+    static const int64 nRoundTime = 2000000;
+    for (unsigned int i = 0; i < nTrials * nTunerTrialRounds; i++)
+    {
+        CPrimeMinerProfile profile = tuner.GetProfile();
+        tuner.AddRound(profile, nRoundTime, TunerTestRate(profile) * nRoundTime);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(tuner_search)
+{
+    GeneratePrimeTable();
+    CPrimeMinerTuner tuner;
+    tuner.Start(CPrimeMinerProfile(), false, false, false);
+    TunerTestMine(tuner, 300);
+
+    CPrimeMinerProfile profile = tuner.GetBestProfile();
+    BOOST_CHECK(profile.nSieveSize > 2000000 * 4 / 5 && profile.nSieveSize < 2000000 * 5 / 4);
+    BOOST_CHECK(profile.nSieveSize % nSieveWordBits == 0);
+    BOOST_CHECK(profile.nSieveWeave > 5000 * 4 / 5 && profile.nSieveWeave < 5000 * 5 / 4);
+    BOOST_CHECK_EQUAL(profile.nPrimorialMultiplier, 19u);
+
+    // Rounds of an earlier profile are ignored
+    CPrimeMinerProfile profileTrial = tuner.GetProfile();
+    CPrimeMinerProfile profileOld;
+    profileOld.nSieveSize = nMinSieveSize;
+    for (unsigned int i = 0; i < 2 * nTunerTrialRounds; i++)
+        tuner.AddRound(profileOld, 2000000, 1.0e6);
+    BOOST_CHECK(tuner.GetProfile() == profileTrial);
+}
+
+BOOST_AUTO_TEST_CASE(tuner_fixed)
+{
+    GeneratePrimeTable();
+    CPrimeMinerTuner tuner;
+    CPrimeMinerProfile profileStart;
+    profileStart.nSieveSize = 500032;
+    profileStart.nPrimorialMultiplier = 13;
+    tuner.Start(profileStart, true, false, true);
+    for (unsigned int i = 0; i < 100; i++)
+    {
+        TunerTestMine(tuner, 1);
+        CPrimeMinerProfile profile = tuner.GetProfile();
+        BOOST_CHECK_EQUAL(profile.nSieveSize, profileStart.nSieveSize);
+        BOOST_CHECK_EQUAL(profile.nPrimorialMultiplier, profileStart.nPrimorialMultiplier);
+    }
+    BOOST_CHECK(tuner.GetBestProfile().nSieveWeave > 5000 * 4 / 5);
+
+    // Nothing left to search
+    tuner.Start(profileStart, true, true, true);
+    TunerTestMine(tuner, 10);
+    BOOST_CHECK(tuner.GetProfile() == profileStart);
+}
+
+BOOST_AUTO_TEST_CASE(tuner_persist)
+{
+    GeneratePrimeTable();
+    boost::filesystem::remove(GetDataDir() / "primeminer.dat");
+    CPrimeMinerTuner tuner;
+    tuner.Init(4);
+    BOOST_CHECK(tuner.GetProfile() == CPrimeMinerProfile());
+    TunerTestMine(tuner, 30);
+    BOOST_CHECK(tuner.GetBestProfile() != CPrimeMinerProfile());
+
+    // Resumes from the saved profile with as many threads
+    CPrimeMinerTuner tunerRestart;
+    tunerRestart.Init(4);
+    BOOST_CHECK(tunerRestart.GetProfile() == tuner.GetBestProfile());
+
+    // Options take precedence
+    mapArgs["-primorial"] = "24";
+    tunerRestart.Init(4);
+    BOOST_CHECK_EQUAL(tunerRestart.GetProfile().nPrimorialMultiplier, 23u);
+    BOOST_CHECK_EQUAL(tunerRestart.GetProfile().nSieveSize, tuner.GetBestProfile().nSieveSize);
+    mapArgs.erase("-primorial");
+
+    CPrimeMinerTuner tunerOther;
+    tunerOther.Init(8);
+    BOOST_CHECK(tunerOther.GetProfile() == CPrimeMinerProfile());
+    boost::filesystem::remove(GetDataDir() / "primeminer.dat");
+}
+
+BOOST_AUTO_TEST_CASE(miner_counters)
+{
+    // Chain lengths are counted by whole length, the longest ones together
+    const unsigned int pnTypes[5] = {PRIME_CHAIN_CUNNINGHAM1, PRIME_CHAIN_CUNNINGHAM2, PRIME_CHAIN_BI_TWIN, PRIME_CHAIN_CUNNINGHAM1, PRIME_CHAIN_CUNNINGHAM1};
+    const unsigned int pnLengths[5] = {TargetFromInt(5) + 12345, TargetFromInt(1), 0, TargetFromInt(40), TargetFromInt(5)};
+    CPrimeMinerCounters counters;
+    counters.AddTests(5, pnTypes, pnLengths);
+    counters.AddSieve(1000, 30, 250);
+    BOOST_CHECK_EQUAL(counters.nTests, 5u);
+    BOOST_CHECK_EQUAL(counters.pnChains[0][4], 2u);
+    BOOST_CHECK_EQUAL(counters.pnChains[1][0], 1u);
+    BOOST_CHECK_EQUAL(counters.pnChains[0][nMinerStatsChainLengthMax - 1], 1u);
+    for (unsigned int nLength = 0; nLength < nMinerStatsChainLengthMax; nLength++)
+        BOOST_CHECK_EQUAL(counters.pnChains[2][nLength], 0u);
+
+    // Threads are summed without losing their own counters
+    CPrimeMiningStats stats;
+    stats.Reset();
+    boost::shared_ptr<CPrimeMinerStats> pstatsSieve(new CPrimeMinerStats("sieve"));
+    boost::shared_ptr<CPrimeMinerStats> pstatsTester(new CPrimeMinerStats("tester"));
+    stats.Register(pstatsSieve);
+    stats.Register(pstatsTester);
+    pstatsSieve->Add(counters);
+    pstatsTester->Add(counters);
+    pstatsTester->Add(counters);
+    std::vector<std::pair<std::string, CPrimeMinerCounters> > vCounters;
+    BOOST_CHECK(stats.GetThreadCounters(vCounters) >= 0);
+    BOOST_CHECK_EQUAL(vCounters.size(), 2u);
+    BOOST_CHECK_EQUAL(vCounters[0].first, "sieve");
+    BOOST_CHECK_EQUAL(vCounters[1].second.nSieves, 2u);
+    BOOST_CHECK_EQUAL(vCounters[1].second.nSieveTime, 500u);
+    CPrimeMinerCounters total;
+    total += vCounters[0].second;
+    total += vCounters[1].second;
+    BOOST_CHECK_EQUAL(total.nCandidates, 90u);
+    BOOST_CHECK_EQUAL(total.pnChains[0][4], 6u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
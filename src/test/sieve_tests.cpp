@@ -0,0 +1,416 @@
+#include <boost/test/unit_test.hpp>
+
+#include "prime.h"
+
+extern std::vector<unsigned int> vPrimes;
+
+BOOST_AUTO_TEST_SUITE(sieve_tests)
+
+static const uint256 hashSieveTest("0xd1c7a1e0c0d1f2b4a3b5c7d9e1f3a5b7c9d1e3f5a7b9c1d3e5f7a9b1c3d5e7f9");
+
+// Segmented weaving of a batch of primes must give the same sieve as
+// weaving the primes one at a time
+BOOST_AUTO_TEST_CASE(sieve_weave_batch)
+{
+    GeneratePrimeTable();
+    CBigNum bnPrimorial;
+    Primorial(13, bnPrimorial);
+    unsigned int nBits = TargetFromInt(9);
+
+    CSieveOfEratosthenes sieveSingle(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    CSieveOfEratosthenes sieveBatch(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    for (unsigned int i = 0; i < 3000; i++)
+        BOOST_CHECK(sieveSingle.Weave());
+    BOOST_CHECK_EQUAL(sieveBatch.Weave(1000u), 1000u);
+    BOOST_CHECK_EQUAL(sieveBatch.Weave(2000u), 2000u);
+    BOOST_CHECK_EQUAL(sieveSingle.GetCandidateCount(), sieveBatch.GetCandidateCount());
+
+    unsigned int nMultiplierSingle, nTypeSingle, nMultiplierBatch, nTypeBatch;
+    while (sieveSingle.GetNextCandidateMultiplier(nMultiplierSingle, nTypeSingle))
+    {
+        BOOST_CHECK(sieveBatch.GetNextCandidateMultiplier(nMultiplierBatch, nTypeBatch));
+        BOOST_CHECK_EQUAL(nMultiplierSingle, nMultiplierBatch);
+        BOOST_CHECK_EQUAL(nTypeSingle, nTypeBatch);
+    }
+    BOOST_CHECK(!sieveBatch.GetNextCandidateMultiplier(nMultiplierBatch, nTypeBatch));
+}
+
+// A sieve woven with the replica of the prime table on a node must give the
+// same sieve as one woven with the prime table
+BOOST_AUTO_TEST_CASE(sieve_table_replica)
+{
+    GeneratePrimeTable();
+    CBigNum bnPrimorial;
+    Primorial(13, bnPrimorial);
+    unsigned int nBits = TargetFromInt(9);
+
+    CSieveOfEratosthenes sieveShared(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    SetPrimeTableNode(1);
+    BOOST_CHECK(GetPrimeTable().pPrimes != &vPrimes[0]);
+    BOOST_CHECK_EQUAL(GetPrimeTable().nPrimes, vPrimes.size());
+    CSieveOfEratosthenes sieveReplica(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    SetPrimeTableNode(-1);
+    BOOST_CHECK(GetPrimeTable().pPrimes == &vPrimes[0]);
+    BOOST_CHECK_EQUAL(sieveShared.Weave(5000u), 5000u);
+    BOOST_CHECK_EQUAL(sieveReplica.Weave(5000u), 5000u);
+    BOOST_CHECK_EQUAL(sieveShared.GetCandidateCount(), sieveReplica.GetCandidateCount());
+
+    unsigned int nMultiplierShared, nTypeShared, nMultiplierReplica, nTypeReplica;
+    while (sieveShared.GetNextCandidateMultiplier(nMultiplierShared, nTypeShared))
+    {
+        BOOST_CHECK(sieveReplica.GetNextCandidateMultiplier(nMultiplierReplica, nTypeReplica));
+        BOOST_CHECK_EQUAL(nMultiplierShared, nMultiplierReplica);
+        BOOST_CHECK_EQUAL(nTypeShared, nTypeReplica);
+    }
+    BOOST_CHECK(!sieveReplica.GetNextCandidateMultiplier(nMultiplierReplica, nTypeReplica));
+}
+
+// No number in a candidate chain may be divisible by a weaved prime
+BOOST_AUTO_TEST_CASE(sieve_candidates)
+{
+    GeneratePrimeTable();
+    CBigNum bnPrimorial;
+    Primorial(7, bnPrimorial);
+    unsigned int nBits = TargetFromInt(6);
+    unsigned int nChainLength = TargetGetLength(nBits);
+    CBigNum bnFixedFactor = bnPrimorial * CBigNum(hashSieveTest);
+
+    CSieveOfEratosthenes sieve(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    BOOST_CHECK_EQUAL(sieve.Weave(500u), 500u);
+    unsigned int nCandidates = sieve.GetCandidateCount();
+    BOOST_CHECK(nCandidates > 0 && nCandidates < nDefaultSieveSize);
+
+    unsigned int nMultiplier, nCandidateType;
+    unsigned int nListed = 0;
+    while (sieve.GetNextCandidateMultiplier(nMultiplier, nCandidateType))
+    {
+        nListed++;
+        if (nListed > 20)
+            continue;
+        CBigNum bnOrigin = bnFixedFactor * nMultiplier;
+        for (unsigned int nPrime = 2, nPrimeSeq = 0; nPrimeSeq < 500; nPrimeSeq++, PrimeTableGetNextPrime(nPrime))
+        {
+            if (bnFixedFactor % nPrime == 0)
+                continue;
+            CBigNum bnChain = bnOrigin;
+            for (unsigned int n = 0; n < nChainLength; n++)
+            {
+                if (nCandidateType == PRIME_CHAIN_CUNNINGHAM1 || (nCandidateType == PRIME_CHAIN_BI_TWIN && n < (nChainLength + 1) / 2))
+                    BOOST_CHECK((bnChain - 1) % nPrime != 0);
+                if (nCandidateType == PRIME_CHAIN_CUNNINGHAM2 || (nCandidateType == PRIME_CHAIN_BI_TWIN && n < nChainLength / 2))
+                    BOOST_CHECK((bnChain + 1) % nPrime != 0);
+                bnChain <<= 1;
+            }
+        }
+    }
+    // Multiplier 0 is counted but never listed as a candidate
+    BOOST_CHECK_EQUAL(nListed + 1, nCandidates);
+}
+
+// An extended sieve must list the candidates of the plain sieve first, then
+// deeper chains whose numbers have no weaved prime factor
+BOOST_AUTO_TEST_CASE(sieve_extensions)
+{
+    GeneratePrimeTable();
+    CBigNum bnPrimorial;
+    Primorial(11, bnPrimorial);
+    unsigned int nBits = TargetFromInt(5);
+    unsigned int nChainLength = TargetGetLength(nBits);
+    unsigned int nExtensions = 4;
+    CBigNum bnFixedFactor = bnPrimorial * CBigNum(hashSieveTest);
+
+    CSieveOfEratosthenes sieve(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    CSieveOfEratosthenes sieveExtended(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial, nExtensions);
+    BOOST_CHECK_EQUAL(sieve.Weave(1500u), 1500u);
+    BOOST_CHECK_EQUAL(sieveExtended.Weave(1500u), 1500u);
+    BOOST_CHECK_EQUAL(sieveExtended.GetExtensionCount(), nExtensions);
+    BOOST_CHECK_EQUAL(sieveExtended.GetCandidateCount(0), sieve.GetCandidateCount());
+
+    unsigned int nMultiplier, nCandidateType, nMultiplierExtended, nCandidateTypeExtended;
+    while (sieve.GetNextCandidateMultiplier(nMultiplier, nCandidateType))
+    {
+        BOOST_CHECK(sieveExtended.GetNextCandidateMultiplier(nMultiplierExtended, nCandidateTypeExtended));
+        BOOST_CHECK_EQUAL(nMultiplier, nMultiplierExtended);
+        BOOST_CHECK_EQUAL(nCandidateType, nCandidateTypeExtended);
+    }
+
+    std::vector<unsigned int> vListed(nExtensions + 1, 0);
+    vListed[0] = sieve.GetCandidateCount() - 1; // multiplier 0 is not listed
+    std::set<unsigned int> setMultipliers;
+    while (sieveExtended.GetNextCandidateMultiplier(nMultiplier, nCandidateType))
+    {
+        unsigned int nExtension = 0;
+        while ((nMultiplier >> nExtension) >= nDefaultSieveSize)
+            nExtension++;
+        BOOST_CHECK(nExtension > 0 && nExtension <= nExtensions);
+        BOOST_CHECK(setMultipliers.insert(nMultiplier).second);
+        vListed[nExtension]++;
+        if (vListed[nExtension] > 10)
+            continue;
+        CBigNum bnChain = bnFixedFactor * nMultiplier;
+        for (unsigned int n = 0; n < nChainLength; n++)
+        {
+            for (unsigned int nPrime = 13, nPrimeSeq = 5; nPrimeSeq < 1500; nPrimeSeq++, PrimeTableGetNextPrime(nPrime))
+            {
+                if (nCandidateType == PRIME_CHAIN_CUNNINGHAM1 || (nCandidateType == PRIME_CHAIN_BI_TWIN && 2 * n < nChainLength))
+                    BOOST_CHECK((bnChain - 1) % nPrime != 0);
+                if (nCandidateType == PRIME_CHAIN_CUNNINGHAM2 || (nCandidateType == PRIME_CHAIN_BI_TWIN && 2 * n + 1 < nChainLength))
+                    BOOST_CHECK((bnChain + 1) % nPrime != 0);
+            }
+            bnChain <<= 1;
+        }
+    }
+    for (unsigned int nExtension = 1; nExtension <= nExtensions; nExtension++)
+    {
+        BOOST_CHECK(vListed[nExtension] > 0);
+        BOOST_CHECK_EQUAL(vListed[nExtension], sieveExtended.GetCandidateCount(nExtension));
+    }
+}
+
+// Candidates taken in batches must come in the same order as one by one
+BOOST_AUTO_TEST_CASE(sieve_candidate_batches)
+{
+    GeneratePrimeTable();
+    CBigNum bnPrimorial;
+    Primorial(11, bnPrimorial);
+    unsigned int nBits = TargetFromInt(4);
+
+    for (unsigned int nExtensions = 0; nExtensions <= 2; nExtensions += 2)
+    {
+        CSieveOfEratosthenes sieveSingle(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial, nExtensions);
+        CSieveOfEratosthenes sieveBatch(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial, nExtensions);
+        sieveSingle.Weave(1000u);
+        sieveBatch.Weave(1000u);
+
+        std::vector<unsigned int> vMultipliers, vCandidateTypes;
+        unsigned int nMultiplier, nCandidateType;
+        while (sieveSingle.GetNextCandidateMultiplier(nMultiplier, nCandidateType))
+        {
+            vMultipliers.push_back(nMultiplier);
+            vCandidateTypes.push_back(nCandidateType);
+        }
+        BOOST_CHECK(vMultipliers.size() > 1000);
+
+        // Batch sizes across and within words, until the scan completes twice
+        for (unsigned int nRound = 0; nRound < 2; nRound++)
+        {
+            unsigned int pnMultipliers[100], pnCandidateTypes[100];
+            unsigned int nListed = 0, nBatch = 1, nCandidates;
+            do
+            {
+                nBatch = nBatch % 97 + 1;
+                nCandidates = sieveBatch.GetNextCandidates(pnMultipliers, pnCandidateTypes, nBatch);
+                BOOST_REQUIRE(nListed + nCandidates <= vMultipliers.size());
+                for (unsigned int i = 0; i < nCandidates; i++, nListed++)
+                {
+                    BOOST_CHECK_EQUAL(pnMultipliers[i], vMultipliers[nListed]);
+                    BOOST_CHECK_EQUAL(pnCandidateTypes[i], vCandidateTypes[nListed]);
+                }
+            } while (nCandidates == nBatch);
+            BOOST_CHECK_EQUAL(nListed, vMultipliers.size());
+        }
+    }
+}
+
+// Candidates tested side by side must get the chain lengths of the
+// one-by-one test
+BOOST_AUTO_TEST_CASE(sieve_batch_test)
+{
+    GeneratePrimeTable();
+    CBigNum bnPrimorial;
+    Primorial(31, bnPrimorial);
+    unsigned int nBits = TargetFromInt(4);
+    CBigNum bnFixedFactor = bnPrimorial * CBigNum(hashSieveTest);
+
+    CSieveOfEratosthenes sieve(nDefaultSieveSize, nBits, hashSieveTest, bnPrimorial);
+    BOOST_CHECK(sieve.Weave(2000u) > 0);
+    std::vector<unsigned int> vMultipliers, vCandidateTypes;
+    unsigned int nMultiplier, nCandidateType;
+    while (vMultipliers.size() < 301 && sieve.GetNextCandidateMultiplier(nMultiplier, nCandidateType))
+    {
+        vMultipliers.push_back(nMultiplier);
+        vCandidateTypes.push_back(nCandidateType);
+    }
+    BOOST_CHECK_EQUAL(vMultipliers.size(), 301u); // last lanes partly filled
+
+    // An odd fixed factor keeps the candidates out of the lanes, so the
+    // chains are derived from its words one by one
+    CBigNum pbnFixedFactor[2] = {bnFixedFactor, bnFixedFactor + 1};
+    for (unsigned int nCase = 0; nCase < 2; nCase++)
+    {
+        std::vector<unsigned int> vChainLengths(vMultipliers.size());
+        unsigned int nFound = ProbablePrimeChainTestBatch(CPrimeFixedFactor(pbnFixedFactor[nCase]), nBits, vMultipliers.size(), &vMultipliers[0], &vCandidateTypes[0], &vChainLengths[0]);
+        unsigned int nFoundExpected = 0, nPrimes = 0;
+        for (unsigned int i = 0; i < vMultipliers.size(); i++)
+        {
+            unsigned int nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin;
+            ProbablePrimeChainTest(pbnFixedFactor[nCase] * vMultipliers[i], nBits, false, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin);
+            unsigned int nExpected = nChainLengthCunningham1;
+            if (vCandidateTypes[i] == PRIME_CHAIN_CUNNINGHAM2)
+                nExpected = nChainLengthCunningham2;
+            else if (vCandidateTypes[i] == PRIME_CHAIN_BI_TWIN)
+                nExpected = (TargetGetLength(nChainLengthCunningham1) >= 2)? nChainLengthBiTwin : 0;
+            BOOST_CHECK_EQUAL(vChainLengths[i], nExpected);
+            if (nExpected >= nBits)
+                nFoundExpected++;
+            if (TargetGetLength(nExpected) >= 1)
+                nPrimes++;
+        }
+        BOOST_CHECK_EQUAL(nFound, nFoundExpected);
+        if (nCase == 0)
+            BOOST_CHECK(nPrimes > 0);
+    }
+}
+
+// Proof-of-work check as separate passes of chain tests with
+// Euler-Lagrange-Lifchitz tests and with Fermat tests only
+static bool CheckPrimeProofOfWorkSeparate(const CBigNum& bnOrigin, unsigned int nBits, const CBigNum& bnMultiplier, unsigned int& nChainLength)
+{
+    unsigned int nLength[3], nLengthFermat[3], nLengthExtended[3];
+    bool fPassed = ProbablePrimeChainTest(bnOrigin, nBits, false, nLength[0], nLength[1], nLength[2]);
+    nChainLength = std::max(nLength[0], std::max(nLength[1], nLength[2]));
+    if (!fPassed)
+        return false;
+    // Rejected by the Fermat double check without a chain length
+    bool fFermat = ProbablePrimeChainTest(bnOrigin, nBits, true, nLengthFermat[0], nLengthFermat[1], nLengthFermat[2]);
+    for (int i = 0; i < 3; i++)
+        fFermat = fFermat && (nLength[i] == nLengthFermat[i]);
+    if (!fFermat)
+    {
+        nChainLength = 0;
+        return false;
+    }
+    if (bnMultiplier % 2 == 0 && bnOrigin % 4 == 0 &&
+        ProbablePrimeChainTest(bnOrigin / 2, nBits, false, nLengthExtended[0], nLengthExtended[1], nLengthExtended[2]))
+        for (int i = 0; i < 3; i++)
+            if (nLengthExtended[i] > nChainLength)
+                return false;
+    return true;
+}
+
+// The single pass proof-of-work check must agree with separate passes of
+// chain tests, on accepted chains and on the lengths of rejected ones
+BOOST_AUTO_TEST_CASE(sieve_pow_check)
+{
+    GeneratePrimeTable();
+    unsigned int nTargetMinLengthSaved = nTargetMinLength;
+    nTargetMinLength = 2;
+    CBigNum bnPrimorial;
+    Primorial(13, bnPrimorial);
+    CSieveOfEratosthenes sieve(nDefaultSieveSize, TargetFromInt(4), hashSieveTest, bnPrimorial);
+    sieve.Weave(2000u);
+
+    unsigned int nMultiplier, nCandidateType;
+    unsigned int nCandidates = 0, nAccepted = 0;
+    while (sieve.GetNextCandidateMultiplier(nMultiplier, nCandidateType) && nCandidates++ < 300)
+    {
+        for (unsigned int nFactor = 1; nFactor <= 2; nFactor++)
+        {
+            CBigNum bnMultiplier = bnPrimorial * nMultiplier * nFactor;
+            CBigNum bnOrigin = CBigNum(hashSieveTest) * bnMultiplier;
+            for (unsigned int nLength = 2; nLength <= 3; nLength++)
+            {
+                unsigned int nBits = TargetFromInt(nLength);
+                unsigned int nChainType, nChainLength, nChainLengthSeparate;
+                bool fAccepted = CheckPrimeProofOfWork(hashSieveTest, nBits, bnMultiplier, nChainType, nChainLength);
+                BOOST_CHECK_EQUAL(fAccepted, CheckPrimeProofOfWorkSeparate(bnOrigin, nBits, bnMultiplier, nChainLengthSeparate));
+                BOOST_CHECK_EQUAL(nChainLength, nChainLengthSeparate);
+                if (fAccepted)
+                    nAccepted++;
+            }
+        }
+    }
+    BOOST_CHECK(nAccepted > 0);
+    nTargetMinLength = nTargetMinLengthSaved;
+}
+
+// A Fermat pseudoprime failing the Euler-Lagrange-Lifchitz test ends the
+// chain with the fractional length of the separate test, (n-1)/n
+BOOST_AUTO_TEST_CASE(sieve_pow_check_pseudoprime)
+{
+    // 2731 is prime, 5461 = 43 * 127 passes the Fermat test to base 2 only
+    CBigNum n = 2731;
+    unsigned int nLength, nLengthFermat, nLengthSeparate, nLengthFermatSeparate;
+    ProbableCunninghamChainTest(n, false, false, nLength, &nLengthFermat);
+    ProbableCunninghamChainTest(n, false, false, nLengthSeparate);
+    ProbableCunninghamChainTest(n, false, true, nLengthFermatSeparate);
+    BOOST_CHECK_EQUAL(nLength, nLengthSeparate);
+    BOOST_CHECK_EQUAL(nLengthFermat, nLengthFermatSeparate);
+    BOOST_CHECK_EQUAL(TargetGetLength(nLength), 1U);
+    BOOST_CHECK_EQUAL(TargetGetFractional(nLength), (unsigned int) ((5460ull << nFractionalBits) / 5461));
+    BOOST_CHECK(TargetGetLength(nLengthFermat) >= 2U);
+}
+
+// Candidates tested in a tester thread of a mining pipeline
+struct CPipelineTestResult
+{
+    unsigned int nBatches;
+    unsigned int nTests;
+    unsigned int nFound;
+    double dChainExpected;
+    CBlock blockFound;
+};
+
+static void PipelineTester(CPrimeMiningPipeline* ppipeline, CPipelineTestResult* presult)
+{
+    CPrimeCandidateBatch batch;
+    loop {
+        ppipeline->queue.Pop(batch);
+        if (batch.vMultipliers.empty())
+            break; // end of the round
+        CPrimeMinerCounters counters;
+        unsigned int nTests, nPrimesHit;
+        double dChainExpected;
+        CBlock block;
+        if (TestMiningCandidates(batch, counters, nTests, nPrimesHit, dChainExpected, block))
+        {
+            presult->nFound++;
+            presult->blockFound = block;
+        }
+        presult->nBatches++;
+        presult->nTests += nTests;
+        presult->dChainExpected += dChainExpected;
+    }
+}
+
+// A sieve round queued by a sieve thread must be tested by a tester thread,
+// which has no pminer of its own
+BOOST_AUTO_TEST_CASE(sieve_pipeline_round)
+{
+    GeneratePrimeTable();
+    unsigned int nTargetMinLengthSaved = nTargetMinLength;
+    nTargetMinLength = 2;
+    pminer.reset(new CPrimeMiner());
+
+    boost::shared_ptr<CPrimeSieveRound> pround(new CPrimeSieveRound());
+    pround->block.nBits = TargetFromInt(2);
+    pround->pindexPrev = pindexBest;
+    Primorial(pminer->nPrimorialMultiplier, pround->bnFixedMultiplier);
+
+    CPrimeMiningPipeline pipeline(1, 1);
+    CPipelineTestResult result = {0, 0, 0, 0, CBlock()};
+    boost::thread threadTester(PipelineTester, &pipeline, &result);
+    unsigned int nCandidateCount = 0;
+    int64 nWeaveTime = 0;
+    BOOST_CHECK(QueueMiningSieve(pipeline, pround, nCandidateCount, nWeaveTime));
+    CPrimeCandidateBatch batchEnd;
+    pipeline.queue.Push(batchEnd);
+    threadTester.join();
+
+    BOOST_CHECK(nCandidateCount > 0);
+    BOOST_CHECK(pround->dPrimeProbability > 0 && pround->dPrimeProbability < 1);
+    BOOST_CHECK_EQUAL(result.nBatches, (nCandidateCount + nPrimeCandidateBatchSize - 1) / nPrimeCandidateBatchSize);
+    BOOST_CHECK(result.nTests > 0 && result.nTests <= nCandidateCount);
+    BOOST_CHECK(result.dChainExpected > 0);
+    BOOST_CHECK(result.nFound > 0);
+    if (result.nFound > 0)
+    {
+        unsigned int nChainType, nChainLength;
+        BOOST_CHECK(CheckPrimeProofOfWork(result.blockFound.GetHeaderHash(), result.blockFound.nBits, result.blockFound.bnPrimeChainMultiplier, nChainType, nChainLength));
+    }
+
+    pminer.reset();
+    nTargetMinLength = nTargetMinLengthSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
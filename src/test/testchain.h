@@ -0,0 +1,39 @@
+#ifndef BITCOIN_TEST_TESTCHAIN_H
+#define BITCOIN_TEST_TESTCHAIN_H
+
+#include "main.h"
+#include "prime.h"
+#include "txdb.h"
+
+extern unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock);
+
+// Block on top of pindexPrev, a minute later, with only a coinbase told
+// apart by nExtraNonce. No prime chain is searched: the header only passes
+// the integrity checks, and with fRecordPow its proof-of-work check is
+// recorded in the block tree as passed, which the node takes instead of
+// the prime tests.
+static CBlock CreateTestBlock(const CBlockIndex* pindexPrev, unsigned int nExtraNonce, bool fRecordPow = true)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->nTime + 60;
+    CTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << (pindexPrev->nHeight + 1) << CBigNum(nExtraNonce);
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = COIN;
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(txCoinbase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nBits = GetNextWorkRequired(pindexPrev, &block);
+    block.bnPrimeChainMultiplier = 1;
+    while (block.GetHeaderHash() < hashBlockHeaderLimit)
+        block.nNonce++;
+    if (fRecordPow)
+        pblocktree->WritePowCheck(block.GetHash(), PRIME_CHAIN_CUNNINGHAM1, block.nBits);
+    return block;
+}
+
+#endif
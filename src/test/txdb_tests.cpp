@@ -0,0 +1,361 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "prime.h"
+#include "txdb.h"
+#include "test/testchain.h"
+
+extern bool ReplayInterruptedWrite();
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+// Verified proof-of-work records are kept by block hash and survive the
+// erasure of the block index for a reindex
+BOOST_AUTO_TEST_CASE(txdb_powcheck)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    uint256 hash1 = 1;
+    uint256 hash2 = 2;
+    unsigned int nChainType = 0;
+    unsigned int nChainLength = 0;
+    BOOST_CHECK(!blocktree.ReadPowCheck(hash1, nChainType, nChainLength));
+
+    BOOST_CHECK(blocktree.WritePowCheck(hash1, PRIME_CHAIN_CUNNINGHAM2, TargetFromInt(9) + 12345));
+    BOOST_CHECK(blocktree.WritePowCheck(hash2, PRIME_CHAIN_BI_TWIN, TargetFromInt(10)));
+    BOOST_CHECK(blocktree.ReadPowCheck(hash1, nChainType, nChainLength));
+    BOOST_CHECK_EQUAL(nChainType, (unsigned int) PRIME_CHAIN_CUNNINGHAM2);
+    BOOST_CHECK_EQUAL(nChainLength, TargetFromInt(9) + 12345);
+
+    BOOST_CHECK(blocktree.WriteLastBlockFile(3));
+    BOOST_CHECK(blocktree.WriteFlag("txindex", true));
+    BOOST_CHECK(blocktree.WriteReindexing(true));
+    BOOST_CHECK(blocktree.EraseBlockIndex());
+
+    int nFile = 0;
+    bool fValue = false;
+    BOOST_CHECK(!blocktree.ReadLastBlockFile(nFile));
+    BOOST_CHECK(!blocktree.ReadFlag("txindex", fValue));
+    BOOST_CHECK(blocktree.ReadReindexing(fValue) && !fValue);
+    BOOST_CHECK(blocktree.ReadPowCheck(hash2, nChainType, nChainLength));
+    BOOST_CHECK_EQUAL(nChainType, (unsigned int) PRIME_CHAIN_BI_TWIN);
+    BOOST_CHECK_EQUAL(nChainLength, TargetFromInt(10));
+}
+
+// Block index entries keep the prime chain multiplier in its serialized form,
+// inline or on the heap, and write it to disk the way a CBigNum would
+BOOST_AUTO_TEST_CASE(txdb_blockindex_multiplier)
+{
+    std::vector<CBigNum> vMultipliers;
+    vMultipliers.push_back(0);
+    vMultipliers.push_back(CBigNum((uint64) 532541) * (uint64)(2 * 3 * 5 * 7 * 11 * 13 * 17 * 19 * 23));
+    vMultipliers.push_back(CBigNum(1) << 175); // longest inline
+    vMultipliers.push_back(CBigNum(1) << 183);
+    vMultipliers.push_back((CBigNum(1) << 1744) - 1);
+    BOOST_FOREACH(const CBigNum& bn, vMultipliers)
+    {
+        CBlockHeader header;
+        header.bnPrimeChainMultiplier = bn;
+        CBlockIndex index(header);
+        BOOST_CHECK(index.GetPrimeChainMultiplier() == bn);
+
+        CBlockIndex indexCopy(index);
+        index = CBlockIndex();
+        BOOST_CHECK(indexCopy.GetPrimeChainMultiplier() == bn);
+        index = indexCopy;
+        BOOST_CHECK(index.GetPrimeChainMultiplier() == bn);
+
+        CDataStream ssCompact(SER_DISK, CLIENT_VERSION);
+        CDataStream ssBigNum(SER_DISK, CLIENT_VERSION);
+        ssCompact << index.primeChainMultiplier;
+        ssBigNum << bn;
+        BOOST_CHECK(ssCompact.str() == ssBigNum.str());
+        BOOST_CHECK_EQUAL(index.primeChainMultiplier.GetSerializeSize(), ssBigNum.size());
+
+        CCompactMultiplier multiplier;
+        ssBigNum >> multiplier;
+        BOOST_CHECK(multiplier.GetBigNum() == bn);
+    }
+
+    CDataStream ssTooLong(SER_DISK, CLIENT_VERSION);
+    ssTooLong << (CBigNum(1) << 2048);
+    CCompactMultiplier multiplier;
+    BOOST_CHECK_THROW(ssTooLong >> multiplier, std::ios_base::failure);
+}
+
+// Coins handed to the database read back at once, from memory while the
+// background write runs, and the best block moves with them
+BOOST_AUTO_TEST_CASE(txdb_coins_background_write)
+{
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewCache cache(db);
+    CCoins coins;
+    coins.vout.resize(3);
+    BOOST_FOREACH(CTxOut &out, coins.vout) {
+        out.nValue = 50 * CENT;
+        out.scriptPubKey = CScript() << OP_TRUE;
+    }
+    for (int i = 1; i <= 1000; i++)
+        cache.SetCoins(i, coins);
+    uint256 hashBlock = 77;
+    CBlockIndex index;
+    index.phashBlock = &hashBlock;
+    cache.SetBestBlock(&index);
+    BOOST_CHECK(cache.Flush());
+
+    CCoins coinsRead;
+    uint256 hashBest = 0;
+    BOOST_CHECK(db.GetCoins(500, coinsRead) && coinsRead == coins);
+    BOOST_CHECK(db.GetBestBlockHash(hashBest) && hashBest == hashBlock);
+
+    // spend one completely while the first write may still run
+    CCoins &coinsSpent = cache.GetCoins(500);
+    for (int n = 0; n < 3; n++)
+        coinsSpent.Spend(n);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!db.HaveCoins(500));
+    BOOST_CHECK(db.WaitForWrite());
+    BOOST_CHECK_EQUAL(cache.GetWriteUsage(), 0U);
+
+    uint256 hashFrom, hashTo;
+    BOOST_CHECK(!db.GetInterruptedWrite(hashFrom, hashTo));
+    BOOST_CHECK(!db.HaveCoins(500));
+    BOOST_CHECK(db.GetCoins(1000, coinsRead) && coinsRead == coins);
+    BOOST_CHECK(db.GetBestBlockHash(hashBest) && hashBest == hashBlock);
+}
+
+// Coin database counting the batches of its background writes, and failing
+// them after a number of batches
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    unsigned int nBatches;
+    int nBatchesLeft; // batches written before failing, negative for no failure
+
+    CCoinsViewDBTest(bool fMemory, bool fWipe, size_t nWriteBatchSizeIn) : CCoinsViewDB(1 << 20, fMemory, fWipe, nWriteBatchSizeIn), nBatches(0), nBatchesLeft(-1) {}
+
+    ~CCoinsViewDBTest()
+    {
+        // the writer thread calls back into this class
+        WaitForWrite();
+    }
+
+protected:
+    bool WriteCoinsBatch(CLevelDBBatch &batch)
+    {
+        if (nBatchesLeft == 0)
+            return false;
+        if (nBatchesLeft > 0)
+            nBatchesLeft--;
+        nBatches++;
+        return CCoinsViewDB::WriteCoinsBatch(batch);
+    }
+};
+
+static CCoins TestCoins(int i)
+{
+    CCoins coins;
+    coins.vout.resize(2);
+    BOOST_FOREACH(CTxOut &out, coins.vout) {
+        out.nValue = i * CENT;
+        out.scriptPubKey = CScript() << OP_TRUE;
+    }
+    return coins;
+}
+
+// A write larger than the batch size is split, and reads back whole
+BOOST_AUTO_TEST_CASE(txdb_coins_write_batches)
+{
+    CCoinsViewDBTest db(true, false, 1000);
+    CCoinsViewCache cache(db);
+    for (int i = 1; i <= 200; i++)
+        cache.SetCoins(i, TestCoins(i));
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.WaitForWrite());
+    BOOST_CHECK(db.nBatches > 5);
+
+    CCoins coinsRead;
+    for (int i = 1; i <= 200; i++)
+        BOOST_CHECK(db.GetCoins(i, coinsRead) && coinsRead == TestCoins(i));
+    uint256 hashFrom, hashTo;
+    BOOST_CHECK(!db.GetInterruptedWrite(hashFrom, hashTo));
+}
+
+// A write failing part way leaves 'F' behind, and the database refuses
+// further writes
+BOOST_AUTO_TEST_CASE(txdb_coins_write_failure)
+{
+    CCoinsViewDBTest db(true, false, 1);
+    CCoinsViewCache cache(db);
+    uint256 hashBlock1 = 31, hashBlock2 = 32;
+    CBlockIndex index1, index2;
+    index1.phashBlock = &hashBlock1;
+    index2.phashBlock = &hashBlock2;
+    cache.SetCoins(1, TestCoins(1));
+    cache.SetBestBlock(&index1);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(db.WaitForWrite());
+
+    for (int i = 2; i <= 10; i++)
+        cache.SetCoins(i, TestCoins(i));
+    cache.SetBestBlock(&index2);
+    db.nBatches = 0;
+    db.nBatchesLeft = 3;
+    BOOST_CHECK(cache.Flush()); // fails in the background
+    BOOST_CHECK(!db.WaitForWrite());
+    BOOST_CHECK_EQUAL(db.nBatches, 3U);
+
+    uint256 hashFrom, hashTo;
+    BOOST_CHECK(db.GetInterruptedWrite(hashFrom, hashTo));
+    BOOST_CHECK(hashFrom == hashBlock1 && hashTo == hashBlock2);
+    CCoinsMap mapCoins;
+    BOOST_CHECK(!db.BatchWrite(mapCoins, &index2));
+    cache.SetCoins(11, TestCoins(11));
+    BOOST_CHECK(!cache.Flush());
+    BOOST_CHECK_EQUAL(db.nBatches, 3U);
+}
+
+// Coinbases of the blocks up to pindex, the genesis block excepted
+static std::vector<std::pair<CTransaction, int> > GetChainCoinbases(CBlockIndex* pindex)
+{
+    std::vector<std::pair<CTransaction, int> > vCoinbases;
+    for (; pindex->pprev; pindex = pindex->pprev)
+    {
+        CBlock block;
+        BOOST_CHECK(block.ReadFromDisk(pindex));
+        vCoinbases.push_back(std::make_pair(block.vtx[0], pindex->nHeight));
+    }
+    return vCoinbases;
+}
+
+// Leave the coin database on disk half way through a write from the best
+// block pindexFrom to pindexTo, then finish it as startup does
+static void CheckInterruptedWrite(CBlockIndex* pindexFrom, CBlockIndex* pindexTo)
+{
+    typedef std::pair<CTransaction, int> CCoinbase;
+    std::vector<CCoinbase> vFrom = GetChainCoinbases(pindexFrom);
+    std::vector<CCoinbase> vTo = GetChainCoinbases(pindexTo);
+    {
+        CCoinsViewDBTest db(false, true, 1);
+        CCoinsViewCache cache(db);
+        BOOST_FOREACH(const CCoinbase& coinbase, vFrom)
+            cache.SetCoins(coinbase.first.GetHash(), CCoins(coinbase.first, coinbase.second));
+        cache.SetBestBlock(pindexFrom);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(db.WaitForWrite());
+
+        // The coinbases of the blocks left are spent, those of the blocks
+        // joined added; the write stops after the first batches
+        BOOST_FOREACH(const CCoinbase& coinbase, vFrom)
+        {
+            CCoins& coins = cache.GetCoins(coinbase.first.GetHash());
+            coins.Spend(0);
+        }
+        BOOST_FOREACH(const CCoinbase& coinbase, vTo)
+            cache.SetCoins(coinbase.first.GetHash(), CCoins(coinbase.first, coinbase.second));
+        cache.SetBestBlock(pindexTo);
+        db.nBatchesLeft = 2;
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(!db.WaitForWrite());
+    }
+
+    CCoinsViewDB db(1 << 20);
+    uint256 hashFrom, hashTo, hashBest;
+    BOOST_CHECK(db.GetInterruptedWrite(hashFrom, hashTo));
+    BOOST_CHECK(hashFrom == pindexFrom->GetBlockHash() && hashTo == pindexTo->GetBlockHash());
+    BOOST_CHECK(db.GetBestBlockHash(hashBest) && hashBest == hashFrom);
+
+    CCoinsViewCache* pcoinsTipSaved = pcoinsTip;
+    pcoinsTip = new CCoinsViewCache(db);
+    BOOST_CHECK(ReplayInterruptedWrite());
+    delete pcoinsTip;
+    pcoinsTip = pcoinsTipSaved;
+    BOOST_CHECK(db.WaitForWrite());
+
+    BOOST_CHECK(!db.GetInterruptedWrite(hashFrom, hashTo));
+    BOOST_CHECK(db.GetBestBlockHash(hashBest) && hashBest == pindexTo->GetBlockHash());
+    std::set<uint256> setTo;
+    CCoins coinsRead;
+    BOOST_FOREACH(const CCoinbase& coinbase, vTo)
+    {
+        setTo.insert(coinbase.first.GetHash());
+        BOOST_CHECK(db.GetCoins(coinbase.first.GetHash(), coinsRead) && coinsRead == CCoins(coinbase.first, coinbase.second));
+    }
+    BOOST_FOREACH(const CCoinbase& coinbase, vFrom)
+        if (!setTo.count(coinbase.first.GetHash()))
+            BOOST_CHECK(!db.HaveCoins(coinbase.first.GetHash()));
+}
+
+// An interrupted write of the coin database is finished at startup, from a
+// best block on the same branch or on a branch since left
+BOOST_AUTO_TEST_CASE(txdb_replay_interrupted_write)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexFork = pindexBest;
+    std::vector<CBlockIndex*> vBranch[2];
+    for (unsigned int nBranch = 0; nBranch < 2; nBranch++)
+    {
+        CBlockIndex* pindexPrev = pindexFork;
+        for (unsigned int i = 0; i < 2 + nBranch; i++)
+        {
+            CBlock block = CreateTestBlock(pindexPrev, nBranch);
+            CValidationState state;
+            BOOST_CHECK(ProcessBlock(state, NULL, &block));
+            BOOST_REQUIRE(mapBlockIndex.count(block.GetHash()));
+            pindexPrev = mapBlockIndex[block.GetHash()];
+            vBranch[nBranch].push_back(pindexPrev);
+        }
+    }
+    BOOST_REQUIRE(pindexBest == vBranch[1].back());
+
+    CheckInterruptedWrite(vBranch[1][0], vBranch[1][2]);
+    CheckInterruptedWrite(vBranch[0][1], vBranch[1][2]);
+}
+
+static void CheckBlockIndexReload(bool fCorruptSnapshot)
+{
+    uint256 hashBest = pindexBest->GetBlockHash();
+    uint256 nChainWork = pindexBest->nChainWork;
+    unsigned int nWorkTransition = pindexBest->nWorkTransition;
+    unsigned int nChainTx = pindexBest->nChainTx;
+    CBigNum bnMultiplier = pindexBest->GetPrimeChainMultiplier();
+    unsigned int nEntries = mapBlockIndex.size();
+    unsigned int nValid = setBlockIndexValid.size();
+
+    BOOST_CHECK(pcoinsTip->Flush());
+    BOOST_CHECK(WriteBlockIndexSnapshot());
+    boost::filesystem::path pathSnapshot = GetDataDir() / "blocks" / "indexsnapshot.dat";
+    BOOST_CHECK(boost::filesystem::exists(pathSnapshot));
+    if (fCorruptSnapshot)
+    {
+        FILE* file = fopen(pathSnapshot.string().c_str(), "r+b");
+        fseek(file, -1, SEEK_END);
+        int c = fgetc(file);
+        fseek(file, -1, SEEK_END);
+        fputc(c ^ 1, file);
+        fclose(file);
+    }
+
+    UnloadBlockIndex();
+    pcoinsTip->SetBestBlock(NULL);
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK(!boost::filesystem::exists(pathSnapshot));
+    BOOST_CHECK_EQUAL(mapBlockIndex.size(), nEntries);
+    BOOST_CHECK_EQUAL(setBlockIndexValid.size(), nValid);
+    BOOST_CHECK(pindexGenesisBlock != NULL);
+    BOOST_CHECK(pindexBest->GetBlockHash() == hashBest);
+    BOOST_CHECK(pindexBest->nChainWork == nChainWork);
+    BOOST_CHECK_EQUAL(pindexBest->nWorkTransition, nWorkTransition);
+    BOOST_CHECK_EQUAL(pindexBest->nChainTx, nChainTx);
+    BOOST_CHECK(pindexBest->GetPrimeChainMultiplier() == bnMultiplier);
+}
+
+// The block index comes back the same from a snapshot, and from LevelDB
+// when the snapshot is damaged
+BOOST_AUTO_TEST_CASE(txdb_blockindex_snapshot)
+{
+    LOCK(cs_main);
+    CheckBlockIndexReload(false);
+    CheckBlockIndexReload(true);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
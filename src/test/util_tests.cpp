@@ -302,4 +302,18 @@ BOOST_AUTO_TEST_CASE(util_TimingResistantEqual)
     BOOST_CHECK(!TimingResistantEqual(std::string("abc"), std::string("aba")));
 }
 
+BOOST_AUTO_TEST_CASE(util_ParseCpuList)
+{
+    std::vector<int> vCpus;
+    BOOST_CHECK(ParseCpuList("0-3,8, 10-11", vCpus));
+    int pExpected[] = {0, 1, 2, 3, 8, 10, 11};
+    BOOST_CHECK_EQUAL_COLLECTIONS(vCpus.begin(), vCpus.end(), pExpected, pExpected + 7);
+    BOOST_CHECK(ParseCpuList("5\n", vCpus));
+    BOOST_CHECK_EQUAL(vCpus.size(), 1u);
+    BOOST_CHECK(!ParseCpuList("", vCpus));
+    BOOST_CHECK(!ParseCpuList("3-1", vCpus));
+    BOOST_CHECK(!ParseCpuList("1-", vCpus));
+    BOOST_CHECK(!ParseCpuList("a", vCpus));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
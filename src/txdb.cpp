@@ -23,49 +23,192 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, size_t nWriteBatchSizeIn) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), nWriteBatchSize(nWriteBatchSizeIn), hashWriting(0), nWriteUsage(0), pthreadWriter(NULL), fWriteDone(false), fWriteFailed(false) {
+}
+
+CCoinsViewDB::~CCoinsViewDB() {
+    if (!WaitForWrite())
+        printf("ERROR: CCoinsViewDB : coins not written to disk were lost\n");
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) { 
+    FinishWrite(false);
+    const CCoinsCacheEntry *pentry = mapWriting.find(txid);
+    if (pentry != NULL) {
+        // not on disk yet
+        if (pentry->coins.IsPruned())
+            return false;
+        coins = pentry->coins;
+        return true;
+    }
     return db.Read(make_pair('c', txid), coins); 
 }
 
 bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
+    if (!WaitForWrite())
+        return false;
     CLevelDBBatch batch;
     BatchWriteCoins(batch, txid, coins);
     return db.WriteBatch(batch);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
+    FinishWrite(false);
+    const CCoinsCacheEntry *pentry = mapWriting.find(txid);
+    if (pentry != NULL)
+        return !pentry->coins.IsPruned();
     return db.Exists(make_pair('c', txid)); 
 }
 
 CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!GetBestBlockHash(hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
 }
 
+bool CCoinsViewDB::GetBestBlockHash(uint256 &hashBlock) {
+    FinishWrite(false);
+    if (hashWriting != 0) {
+        hashBlock = hashWriting;
+        return true;
+    }
+    return db.Read('B', hashBlock);
+}
+
+bool CCoinsViewDB::GetInterruptedWrite(uint256 &hashFrom, uint256 &hashTo) {
+    std::pair<uint256, uint256> blocks;
+    if (!db.Read('F', blocks))
+        return false;
+    hashFrom = blocks.first;
+    hashTo = blocks.second;
+    return true;
+}
+
 bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
+    if (!WaitForWrite())
+        return false;
     CLevelDBBatch batch;
     BatchWriteHashBestChain(batch, pindex->GetBlockHash()); 
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
+size_t CCoinsViewDB::GetWriteUsage() {
+    FinishWrite(false);
+    if (mapWriting.size() == 0)
+        return 0;
+    return nWriteUsage + mapWriting.DynamicMemoryUsage();
+}
 
-    CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+bool CCoinsViewDB::BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    // One write at a time: if the previous one is still going, wait for it
+    if (!WaitForWrite())
+        return false;
+
+    BOOST_FOREACH(const uint256 &txid, mapCoins.dirty()) {
+        const CCoinsCacheEntry *pentry = mapCoins.find(txid);
+        if (pentry == NULL || !pentry->IsDirty())
+            continue;
+        // coins created and spent again since the last flush were never written
+        if (pentry->IsFresh() && pentry->coins.IsPruned())
+            continue;
+        bool fInserted;
+        CCoinsCacheEntry *pcopy = mapWriting.insert(txid, fInserted);
+        if (!fInserted)
+            nWriteUsage -= GetCoinsMemoryUsage(pcopy->coins);
+        pcopy->coins = pentry->coins;
+        nWriteUsage += GetCoinsMemoryUsage(pcopy->coins);
+        mapWriting.MarkDirty(pcopy);
+    }
     if (pindex)
-        BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+        hashWriting = pindex->GetBlockHash();
+    else if (!db.Read('B', hashWriting))
+        hashWriting = 0;
 
-    return db.WriteBatch(batch);
+    {
+        LOCK(cs_writer);
+        fWriteDone = false;
+    }
+    pthreadWriter = new boost::thread(boost::bind(&CCoinsViewDB::ThreadWrite, this));
+    return true;
+}
+
+void CCoinsViewDB::ThreadWrite() {
+    RenameThread("primecoin-coinswr");
+    bool fOk = false;
+    try {
+        fOk = WriteChunked();
+    } catch (std::exception &e) {
+        PrintExceptionContinue(&e, "CCoinsViewDB::ThreadWrite()");
+    }
+    LOCK(cs_writer);
+    fWriteFailed = !fOk;
+    fWriteDone = true;
+}
+
+bool CCoinsViewDB::WriteChunked() {
+    int64 nStart = GetTimeMillis();
+    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapWriting.size());
+
+    uint256 hashFrom = 0;
+    db.Read('B', hashFrom);
+    CLevelDBBatch batch;
+    // Until the last batch is written the coins are partly at hashFrom and
+    // partly at hashWriting; GetInterruptedWrite tells startup so. Each
+    // batch is synced before the next one, so no coin reaches the disk
+    // before 'F' and a crash loses at most the batch being written.
+    batch.Write('F', make_pair(hashFrom, hashWriting));
+    unsigned int nBatches = 1;
+    BOOST_FOREACH(const uint256 &txid, mapWriting.dirty()) {
+        BatchWriteCoins(batch, txid, mapWriting.find(txid)->coins);
+        if (batch.SizeEstimate() >= nWriteBatchSize) {
+            if (!WriteCoinsBatch(batch))
+                return false;
+            batch.Clear();
+            nBatches++;
+        }
+    }
+    if (hashWriting != 0)
+        BatchWriteHashBestChain(batch, hashWriting);
+    batch.Erase('F');
+    if (!WriteCoinsBatch(batch))
+        return false;
+
+    printf("Committed %u changed transactions to coin database in %u batches (%"PRI64d"ms)\n",
+           (unsigned int)mapWriting.size(), nBatches, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewDB::WriteCoinsBatch(CLevelDBBatch &batch) {
+    return db.WriteBatch(batch, true);
+}
+
+// Collect the background write once it is done, or wait for it. If it
+// failed, its changes stay in mapWriting: they never reached the disk.
+bool CCoinsViewDB::FinishWrite(bool fWait) {
+    if (pthreadWriter == NULL)
+        return !fWriteFailed;
+    if (!fWait) {
+        LOCK(cs_writer);
+        if (!fWriteDone)
+            return true;
+    }
+    pthreadWriter->join();
+    delete pthreadWriter;
+    pthreadWriter = NULL;
+    if (fWriteFailed)
+        return false;
+    mapWriting.clear();
+    hashWriting = 0;
+    nWriteUsage = 0;
+    return true;
+}
+
+bool CCoinsViewDB::WaitForWrite() {
+    return FinishWrite(true);
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -115,6 +258,9 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    if (!WaitForWrite())
+        return false;
+
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
 
@@ -188,27 +334,92 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
+bool CBlockTreeDB::ReadPowCheck(const uint256 &hash, unsigned int &nChainType, unsigned int &nChainLength) {
+    std::pair<unsigned int, unsigned int> check;
+    if (!Read(make_pair('p', hash), check))
+        return false;
+    nChainType = check.first;
+    nChainLength = check.second;
+    return true;
+}
+
+bool CBlockTreeDB::WritePowCheck(const uint256 &hash, unsigned int nChainType, unsigned int nChainLength) {
+    return Write(make_pair('p', hash), make_pair(nChainType, nChainLength));
+}
+
+// Erase everything but the verified proof-of-work records, which stay
+// valid for the blocks found again by a reindex
+bool CBlockTreeDB::EraseBlockIndex()
+{
+    leveldb::Iterator *pcursor = NewIterator();
+    pcursor->SeekToFirst();
+
+    CLevelDBBatch batch;
+    unsigned int nBatch = 0;
+    while (pcursor->Valid()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 'p') {
+            batch.EraseRaw(slKey);
+            if (++nBatch >= 10000) {
+                if (!WriteBatch(batch)) {
+                    delete pcursor;
+                    return error("EraseBlockIndex() : write failed");
+                }
+                batch = CLevelDBBatch();
+                nBatch = 0;
+            }
+        }
+        pcursor->Next();
+    }
+    delete pcursor;
+    return WriteBatch(batch, true);
+}
+
+// Load the index entries of the blocks whose hash starts with a byte in
+// [nBegin, nEnd). Deserialization and the header checks run in parallel
+// with the other ranges; the block index is not shared yet, so the threads
+// only need cs to exclude each other when inserting into it. The block's own
+// work goes into nChainWork, LoadBlockIndexDB sums it up along the chain.
+bool CBlockTreeDB::LoadBlockIndexRange(unsigned int nBegin, unsigned int nEnd, CCriticalSection& cs)
 {
     leveldb::Iterator *pcursor = NewIterator();
 
+    uint256 hashBegin = 0;
+    *hashBegin.begin() = nBegin;
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
+    ssKeySet << make_pair('b', hashBegin);
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
+    bool fRet = true;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
+            uint256 hash;
             ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
+            if (chType != 'b')
+                break;
+            ssKey >> hash;
+            if (*hash.begin() >= nEnd)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+
+            CBlockHeader header(diskindex.GetBlockHeader());
+            header.hashPrevBlock = diskindex.hashPrev;
+            if (!CheckBlockHeaderIntegrity(header.GetHeaderHash(), header.nBits, header.bnPrimeChainMultiplier)) {
+                fRet = error("%s: CheckBlockHeaderIntegrity failed: %s", __func__, diskindex.GetBlockHash().ToString().c_str());
+                break;
+            }
+            uint256 nBlockWork = diskindex.GetBlockWork().getuint256();
+
+            {
+                LOCK(cs);
 
                 // Construct block index object
                 CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
@@ -225,31 +436,59 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nTime          = diskindex.nTime;
                 pindexNew->nBits          = diskindex.nBits;
                 pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->bnPrimeChainMultiplier = diskindex.bnPrimeChainMultiplier;
+                pindexNew->primeChainMultiplier = diskindex.primeChainMultiplier;
                 pindexNew->nStatus        = diskindex.nStatus;
                 pindexNew->nTx            = diskindex.nTx;
+                pindexNew->nChainWork     = nBlockWork;
 
-                CBlockHeader header(pindexNew->GetBlockHeader());
-                if (!CheckBlockHeaderIntegrity(header.GetHeaderHash(), pindexNew->nBits, pindexNew->bnPrimeChainMultiplier))
-                    return error("%s: CheckBlockHeaderIntegrity failed: %s", __func__, pindexNew->ToString().c_str());
-                
                 // Watch for genesis block
                 if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
                     pindexGenesisBlock = pindexNew;
 
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+                if (!pindexNew->CheckIndex()) {
+                    fRet = error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+                    break;
+                }
             }
+
+            pcursor->Next();
         } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            fRet = error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            break;
         }
     }
     delete pcursor;
 
+    return fRet;
+}
+
+static void ThreadLoadBlockIndexRange(CBlockTreeDB* pblocktree, unsigned int nBegin, unsigned int nEnd, CCriticalSection* pcs, int* pnRet)
+{
+    *pnRet = pblocktree->LoadBlockIndexRange(nBegin, nEnd, *pcs);
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    // Load mapBlockIndex, the 'b' keyspace split by the first byte of the
+    // block hash over a thread per core
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), 16));
+    CCriticalSection cs;
+    std::vector<int> vRet(nThreads, 0);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadLoadBlockIndexRange, this, 256 * i / nThreads, 256 * (i + 1) / nThreads, &cs, &vRet[i]));
+    try {
+        threadGroup.join_all();
+    } catch (boost::thread_interrupted) {
+        // Shutdown requested, the threads use this frame
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        throw;
+    }
+
+    BOOST_FOREACH(int nRet, vRet)
+        if (!nRet)
+            return false;
     return true;
 }
 
@@ -10,21 +10,60 @@
 #include "main.h"
 #include "leveldb.h"
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+// Background writes of the coin database are split into batches of about
+// this many bytes, so LevelDB never has to hold all of a large flush at once
+static const size_t COINS_WRITE_BATCH_SIZE = 16 << 20;
+
+/** CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ *  BatchWrite returns once it has copied the changes. A background thread
+ *  writes them in batches of limited size, while reads are answered from
+ *  the copy. Every batch is synced before the next one is written. 'B'
+ *  only moves to the new best block with the last batch; from the first
+ *  one on, 'F' records the blocks between which the coins are, so that an
+ *  interrupted write can be finished at startup.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDB db;
+    size_t nWriteBatchSize;
+
+    // Changes being written by pthreadWriter, the block they lead to and
+    // the memory they take
+    CCoinsMap mapWriting;
+    uint256 hashWriting;
+    size_t nWriteUsage;
+    boost::thread *pthreadWriter;
+
+    CCriticalSection cs_writer;
+    bool fWriteDone;
+    bool fWriteFailed;
+
+    void ThreadWrite();
+    bool WriteChunked();
+    bool FinishWrite(bool fWait);
+    // Write and sync one batch of a background write
+    virtual bool WriteCoinsBatch(CLevelDBBatch &batch);
+
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, size_t nWriteBatchSizeIn = COINS_WRITE_BATCH_SIZE);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins);
     bool SetCoins(const uint256 &txid, const CCoins &coins);
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
+    bool GetBestBlockHash(uint256 &hashBlock);
+    bool GetInterruptedWrite(uint256 &hashFrom, uint256 &hashTo);
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    size_t GetWriteUsage();
+    bool BatchWrite(const CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+
+    // Wait until all changes passed to BatchWrite are on disk.
+    // Returns false if writing them failed.
+    bool WaitForWrite();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -49,7 +88,13 @@ public:
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool LoadBlockIndexRange(unsigned int nBegin, unsigned int nEnd, CCriticalSection& cs);
     bool LoadBlockIndexGuts();
+    bool EraseBlockIndex();
+
+    // primecoin: verified prime proof-of-work by block hash
+    bool ReadPowCheck(const uint256 &hash, unsigned int &nChainType, unsigned int &nChainLength);
+    bool WritePowCheck(const uint256 &hash, unsigned int nChainType, unsigned int nChainLength);
 
     // ppcoin sync checkpoint related data
     bool ReadSyncCheckpoint(uint256& hashCheckpoint);
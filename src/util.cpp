@@ -21,6 +21,9 @@
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
+#include <boost/algorithm/string/classification.hpp> // for is_any_of()
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
 
 // Work around clang compilation problem in Boost 1.46:
 // /usr/include/boost/program_options/detail/config_file.hpp:163:17: error: call to function 'to_internal' that is neither visible in the template definition nor found by argument-dependent lookup
@@ -65,6 +68,7 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <sched.h>
 #endif
 
 using namespace std;
@@ -1501,3 +1505,102 @@ bool NewThread(void(*pfn)(void*), void* parg)
     }
     return true;
 }
+
+bool ParseCpuList(const std::string& str, std::vector<int>& vCpus)
+{
+    vCpus.clear();
+    std::vector<std::string> vRanges;
+    boost::split(vRanges, str, boost::is_any_of(","));
+    BOOST_FOREACH(std::string strRange, vRanges)
+    {
+        boost::trim(strRange);
+        if (strRange.empty())
+            continue;
+        size_t nDash = strRange.find('-');
+        std::string strFirst = strRange.substr(0, nDash);
+        std::string strLast = (nDash == std::string::npos)? strFirst : strRange.substr(nDash + 1);
+        if (strFirst.empty() || strLast.empty() ||
+            strFirst.find_first_not_of("0123456789") != std::string::npos ||
+            strLast.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        int nFirst = atoi(strFirst);
+        int nLast = atoi(strLast);
+        if (nLast < nFirst || nLast > 65535)
+            return false;
+        for (int nCpu = nFirst; nCpu <= nLast; nCpu++)
+            vCpus.push_back(nCpu);
+    }
+    return !vCpus.empty();
+}
+
+#ifdef __linux__
+// Read a CPU list file of /sys, such as /sys/devices/system/node/node0/cpulist
+static bool ReadSysCpuList(const boost::filesystem::path& path, std::vector<int>& vCpus)
+{
+    boost::filesystem::ifstream file(path);
+    std::string str;
+    if (!file.good() || !std::getline(file, str))
+        return false;
+    return ParseCpuList(str, vCpus);
+}
+#endif
+
+void GetCpuTopology(std::vector<std::vector<int> >& vNodeCpus)
+{
+    vNodeCpus.clear();
+#ifdef __linux__
+    // CPUs this process is allowed to run on
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    bool fMask = (sched_getaffinity(0, sizeof(mask), &mask) == 0);
+
+    // CPUs of each NUMA node, or all online CPUs without NUMA support
+    std::vector<std::vector<int> > vNodes;
+    for (int nNode = 0; ; nNode++)
+    {
+        std::vector<int> vCpus;
+        if (!ReadSysCpuList(strprintf("/sys/devices/system/node/node%d/cpulist", nNode), vCpus))
+            break;
+        vNodes.push_back(vCpus);
+    }
+    if (vNodes.empty())
+    {
+        std::vector<int> vCpus;
+        if (ReadSysCpuList("/sys/devices/system/cpu/online", vCpus))
+            vNodes.push_back(vCpus);
+    }
+
+    // Order the CPUs of a node by core, one hardware thread of every core first
+    BOOST_FOREACH(const std::vector<int>& vCpus, vNodes)
+    {
+        std::vector<int> vFirst, vSiblings;
+        BOOST_FOREACH(int nCpu, vCpus)
+        {
+            if (fMask && (nCpu >= CPU_SETSIZE || !CPU_ISSET(nCpu, &mask)))
+                continue;
+            std::vector<int> vCore;
+            if (ReadSysCpuList(strprintf("/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", nCpu), vCore) && vCore[0] != nCpu)
+                vSiblings.push_back(nCpu);
+            else
+                vFirst.push_back(nCpu);
+        }
+        vFirst.insert(vFirst.end(), vSiblings.begin(), vSiblings.end());
+        vNodeCpus.push_back(vFirst);
+    }
+#endif
+}
+
+bool SetThreadAffinity(int nCpu)
+{
+#ifdef __linux__
+    if (nCpu < 0 || nCpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(nCpu, &mask);
+    return (sched_setaffinity(0, sizeof(mask), &mask) == 0);
+#else
+    (void)nCpu;
+    return false;
+#endif
+}
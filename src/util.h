@@ -547,6 +547,12 @@ inline void ExitThread(size_t nExitCode)
 #endif
 
 void RenameThread(const char* name);
+/** Parse a CPU list such as 0-3,8,10-11 */
+bool ParseCpuList(const std::string& str, std::vector<int>& vCpus);
+/** CPUs the process may run on for each NUMA node, one hardware thread of every core first. Empty if unknown */
+void GetCpuTopology(std::vector<std::vector<int> >& vNodeCpus);
+/** Pin the calling thread to a CPU */
+bool SetThreadAffinity(int nCpu);
 
 inline uint32_t ByteReverse(uint32_t value)
 {